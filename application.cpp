@@ -170,6 +170,16 @@ queue_family_indices find_queue_families(
   VkPhysicalDevice device,
   VkSurfaceKHR surface
 );
+// Returns every extension a given device supports.
+vector<VkExtensionProperties> get_device_extensions(VkPhysicalDevice device);
+// Returns true if the extension is in the list.
+bool has_extension(
+  const vector<VkExtensionProperties>& extensions,
+  const char* name
+);
+// Returns the shared queue for a VkQueue, making it if it's the first
+// time we've seen the queue.
+shared_queue* get_shared_queue(application* app, VkQueue queue);
 
 application::application() {
   window = NULL;
@@ -212,6 +222,90 @@ void init_vulkan(application* app) {
   create_surface(app);
   pick_physical_device(app);
   create_logical_device(app);
+  create_swap_chain(
+    app->physical_device,
+    app->device,
+    app->surface,
+    app->queue_families.graphics_family.value(),
+    app->queue_families.present_family.value(),
+    true,
+    WINDOW_W,
+    WINDOW_H,
+    &(app->swapchain)
+  );
+
+  create_memory_allocator(
+    app->physical_device,
+    app->device,
+    app->capabilities.buffer_device_address,
+    {
+      app->queue_families.graphics_family.value(),
+      app->queue_families.present_family.value(),
+      app->queue_families.transfer_family.value()
+    },
+    &(app->allocator)
+  );
+  create_defragmenter(
+    app->device,
+    &(app->allocator),
+    app->transfer_submit,
+    app->queue_families.transfer_family.value(),
+    MAX_FRAMES_IN_FLIGHT,
+    &(app->defrag)
+  );
+  create_memory_budget_tracker(
+    app->physical_device,
+    app->capabilities.memory_budget,
+    &(app->memory_budget)
+  );
+  // The first numbers, so whatever is made below can be sized against
+  // the budget.
+  update_memory_budget(&(app->memory_budget), &(app->allocator));
+  create_gpu_profiler(
+    app->physical_device,
+    app->device,
+    app->queue_families.graphics_family.value(),
+    &(app->profiler)
+  );
+  create_frame_arenas(MAX_FRAMES_IN_FLIGHT, &(app->arenas));
+  register_arena_thread(&(app->arenas));
+  create_submission_thread(
+    app->graphics_submit,
+    app->present_submit,
+    app->shared_queues,
+    app->num_shared_queues,
+    SUBMISSION_QUEUE_DEPTH,
+    &(app->submission)
+  );
+  create_command_cache(
+    app->device,
+    app->queue_families.graphics_family.value(),
+    MAX_FRAMES_IN_FLIGHT,
+    &(app->commands)
+  );
+  create_shader_library(app->device, &(app->shaders));
+  create_layout_cache(app->device, &(app->layouts));
+  create_pipeline_manager(
+    app->physical_device,
+    app->device,
+    app->capabilities.graphics_pipeline_library,
+    &(app->pipelines)
+  );
+  create_per_draw_binder(
+    app->physical_device,
+    app->device,
+    &(app->allocator),
+    &(app->memory_budget),
+    &(app->layouts),
+    app->capabilities.push_descriptor,
+    MAX_FRAMES_IN_FLIGHT,
+    &(app->per_draw)
+  );
+  set_fallback_shaders(
+    &(app->pipelines),
+    get_shader_module(&(app->shaders), "fallback.vert"),
+    get_shader_module(&(app->shaders), "fallback.frag")
+  );
 }
 
 bool check_validation_layer_support() {
@@ -275,7 +369,10 @@ void create_vulkan_instance(application* app) {
   app_info.applicationVersion = VK_MAKE_VERSION(1, 0, 0);
   app_info.pEngineName = "No Engine";
   app_info.engineVersion = VK_MAKE_VERSION(1, 0, 0);
-  app_info.apiVersion = VK_API_VERSION_1_0;
+  // We need 1.1 for vkGetPhysicalDeviceFeatures2, which is how we ask
+  // about features that come from extensions, and 1.2 for buffer device
+  // addresses. Devices that only have 1.1 still work, just without them.
+  app_info.apiVersion = VK_API_VERSION_1_2;
 
   //
   // Next we specify the parameters of our instance.
@@ -362,6 +459,8 @@ void create_vulkan_instance(application* app) {
 vector<const char*> get_required_extensions() {
   uint32_t glfw_extension_count;
   const char** glfw_extensions;
+  uint32_t num_supported_extensions;
+  vector<VkExtensionProperties> supported_extensions;
   vector<const char*> result;
 
   //
@@ -386,6 +485,27 @@ vector<const char*> get_required_extensions() {
     result.push_back(VK_EXT_DEBUG_UTILS_EXTENSION_NAME);
   }
 
+  //
+  // Last, the optional ones: everything else is required, so these are
+  // only asked for if the instance has them.
+  //
+
+  num_supported_extensions = 0;
+  vkEnumerateInstanceExtensionProperties(NULL, &num_supported_extensions, NULL);
+  supported_extensions.resize(num_supported_extensions);
+  vkEnumerateInstanceExtensionProperties(
+    NULL,
+    &num_supported_extensions,
+    supported_extensions.data()
+  );
+
+  // Adds the HDR color spaces to the surface formats. Without it every
+  // surface only offers sRGB, and the swap chain is SDR (see
+  // swap_chain.h).
+  if (has_extension(supported_extensions, VK_EXT_SWAPCHAIN_COLOR_SPACE_EXTENSION_NAME)) {
+    result.push_back(VK_EXT_SWAPCHAIN_COLOR_SPACE_EXTENSION_NAME);
+  }
+
   return result;
 }
 
@@ -458,7 +578,9 @@ bool is_device_suitable(VkPhysicalDevice device, VkSurfaceKHR surface) {
 
   indices = find_queue_families(device, surface);
 
-  return is_complete(indices);
+  // Presenting to the surface at all needs a swap chain.
+  return is_complete(indices) &&
+         has_extension(get_device_extensions(device), VK_KHR_SWAPCHAIN_EXTENSION_NAME);
 }
 
 queue_family_indices find_queue_families(
@@ -518,6 +640,39 @@ queue_family_indices find_queue_families(
     i++;
   }
 
+  //
+  // Last, look for a family that only does transfers. These usually map
+  // to the GPU's copy engines, so copies on them run alongside rendering
+  // instead of taking turns with it. Without one, transfers go on the
+  // graphics family, which can do them too.
+  //
+
+  for (i = 0; i < num_queue_families; i++) {
+    if ((queue_families[i].queueFlags & VK_QUEUE_TRANSFER_BIT) &&
+        !(queue_families[i].queueFlags & (VK_QUEUE_GRAPHICS_BIT | VK_QUEUE_COMPUTE_BIT))) {
+      indices.transfer_family = i;
+      break;
+    }
+  }
+
+  if (!indices.transfer_family.has_value()) {
+    indices.transfer_family = indices.graphics_family;
+  }
+
+  // Sparse binding is optional. The graphics family is best, since then
+  // binds and the copies that fill the pages in share a queue.
+  if (indices.graphics_family.has_value() &&
+      (queue_families[indices.graphics_family.value()].queueFlags & VK_QUEUE_SPARSE_BINDING_BIT)) {
+    indices.sparse_family = indices.graphics_family;
+  } else {
+    for (i = 0; i < num_queue_families; i++) {
+      if (queue_families[i].queueFlags & VK_QUEUE_SPARSE_BINDING_BIT) {
+        indices.sparse_family = i;
+        break;
+      }
+    }
+  }
+
   return indices;
 }
 
@@ -572,6 +727,16 @@ void create_logical_device(application* app) {
   set<uint32_t> unique_queue_familes;
   float queue_priority;
   VkPhysicalDeviceFeatures device_features;
+  vector<VkExtensionProperties> supported_extensions;
+  vector<const char*> device_extensions;
+  void* feature_chain;
+  VkPhysicalDeviceFeatures2 supported_features;
+  VkPhysicalDeviceProperties2 supported_properties;
+  VkPhysicalDeviceGraphicsPipelineLibraryFeaturesEXT gpl_features;
+  VkPhysicalDeviceGraphicsPipelineLibraryPropertiesEXT gpl_properties;
+  VkPhysicalDeviceVulkan12Features vulkan12_features;
+  VkPhysicalDeviceVulkan12Features vulkan12_enabled;
+  VkPhysicalDeviceSynchronization2Features sync2_features;
   VkDeviceCreateInfo device_create_info;
   VkResult result;
 
@@ -589,9 +754,14 @@ void create_logical_device(application* app) {
 
   unique_queue_familes = {
     indices.graphics_family.value(),
-    indices.present_family.value()
+    indices.present_family.value(),
+    indices.transfer_family.value()
   };
 
+  if (indices.sparse_family.has_value()) {
+    unique_queue_familes.insert(indices.sparse_family.value());
+  }
+
   // We must give a priority value to the queue even if we only
   // have one. So in our case, we give it the largest priority
   // possible.
@@ -603,7 +773,7 @@ void create_logical_device(application* app) {
     // We know this will work because if we got to this point that means
     // we know from choosing the physical device we found a physical
     // device to suit our needs.
-    queue_create_info.queueFamilyIndex = indices.graphics_family.value();
+    queue_create_info.queueFamilyIndex = queue_family;
     // Vulkan will already limit the # of queues for each queue family
     // and you really don't need more than one anyways. You can create
     // your command buffers on multiple threads and then submit them
@@ -622,12 +792,142 @@ void create_logical_device(application* app) {
   // anything special. So we just initialize this to empty.
   device_features = {};
 
+  //
+  // Next, look for the optional features we know how to use. Features
+  // that come from extensions are described by structs that get chained
+  // together through their pNext pointers. To ask if they're supported,
+  // we hand vkGetPhysicalDeviceFeatures2 a chain and it fills it in. To
+  // turn them on, we hand vkCreateDevice a chain with the ones we want.
+  //
+
+  app->capabilities = {};
+  supported_extensions = get_device_extensions(app->physical_device);
+  feature_chain = NULL;
+
+  gpl_properties = {};
+  gpl_properties.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_GRAPHICS_PIPELINE_LIBRARY_PROPERTIES_EXT;
+
+  // Only ask about graphics pipeline libraries if the device has the
+  // extension, since a driver without it needn't know the structs.
+  supported_properties = {};
+  supported_properties.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2;
+  if (has_extension(supported_extensions, VK_EXT_GRAPHICS_PIPELINE_LIBRARY_EXTENSION_NAME)) {
+    supported_properties.pNext = &gpl_properties;
+  }
+  vkGetPhysicalDeviceProperties2(app->physical_device, &supported_properties);
+
+  supported_features = {};
+  supported_features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+
+  // The Vulkan 1.2 features all live in one struct, which the device
+  // only knows about if it supports 1.2.
+  vulkan12_features = {};
+  vulkan12_features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES;
+  if (supported_properties.properties.apiVersion >= VK_API_VERSION_1_2) {
+    vulkan12_features.pNext = supported_features.pNext;
+    supported_features.pNext = &vulkan12_features;
+  }
+
+  // Likewise for graphics pipeline libraries...
+  gpl_features = {};
+  gpl_features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_GRAPHICS_PIPELINE_LIBRARY_FEATURES_EXT;
+  if (has_extension(supported_extensions, VK_EXT_GRAPHICS_PIPELINE_LIBRARY_EXTENSION_NAME)) {
+    gpl_features.pNext = supported_features.pNext;
+    supported_features.pNext = &gpl_features;
+  }
+
+  // ...and synchronization2.
+  sync2_features = {};
+  sync2_features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_SYNCHRONIZATION_2_FEATURES;
+  if (has_extension(supported_extensions, VK_KHR_SYNCHRONIZATION_2_EXTENSION_NAME)) {
+    sync2_features.pNext = supported_features.pNext;
+    supported_features.pNext = &sync2_features;
+  }
+  vkGetPhysicalDeviceFeatures2(app->physical_device, &supported_features);
+
+  vulkan12_enabled = {};
+  vulkan12_enabled.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES;
+
+  // The one extension we can't do without; is_device_suitable checked
+  // for it.
+  device_extensions.push_back(VK_KHR_SWAPCHAIN_EXTENSION_NAME);
+
+  // Graphics pipeline libraries are only worth it if linking them is
+  // fast; otherwise we are better off with the fallback pipelines.
+  if (has_extension(supported_extensions, VK_KHR_PIPELINE_LIBRARY_EXTENSION_NAME) &&
+      has_extension(supported_extensions, VK_EXT_GRAPHICS_PIPELINE_LIBRARY_EXTENSION_NAME) &&
+      gpl_features.graphicsPipelineLibrary &&
+      gpl_properties.graphicsPipelineLibraryFastLinking) {
+    device_extensions.push_back(VK_KHR_PIPELINE_LIBRARY_EXTENSION_NAME);
+    device_extensions.push_back(VK_EXT_GRAPHICS_PIPELINE_LIBRARY_EXTENSION_NAME);
+
+    gpl_features = {};
+    gpl_features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_GRAPHICS_PIPELINE_LIBRARY_FEATURES_EXT;
+    gpl_features.graphicsPipelineLibrary = VK_TRUE;
+    gpl_features.pNext = feature_chain;
+    feature_chain = &gpl_features;
+
+    app->capabilities.graphics_pipeline_library = true;
+  }
+
+  // Push descriptors need no feature struct, just the extension.
+  if (has_extension(supported_extensions, VK_KHR_PUSH_DESCRIPTOR_EXTENSION_NAME)) {
+    device_extensions.push_back(VK_KHR_PUSH_DESCRIPTOR_EXTENSION_NAME);
+    app->capabilities.push_descriptor = true;
+  }
+
+  // Like push descriptors, the memory budget is just an extension. It
+  // only adds a struct to vkGetPhysicalDeviceMemoryProperties2.
+  if (has_extension(supported_extensions, VK_EXT_MEMORY_BUDGET_EXTENSION_NAME)) {
+    device_extensions.push_back(VK_EXT_MEMORY_BUDGET_EXTENSION_NAME);
+    app->capabilities.memory_budget = true;
+  }
+
+  // Lets shaders read buffers through 64 bit GPU addresses instead of
+  // descriptors.
+  if (vulkan12_features.bufferDeviceAddress) {
+    vulkan12_enabled.bufferDeviceAddress = VK_TRUE;
+    app->capabilities.buffer_device_address = true;
+  }
+
+  // Sparse residency lets a huge texture have memory only for the pages
+  // we're using (see virtual_texture.h).
+  if (indices.sparse_family.has_value() &&
+      supported_features.features.sparseBinding &&
+      supported_features.features.sparseResidencyImage2D) {
+    device_features.sparseBinding = VK_TRUE;
+    device_features.sparseResidencyImage2D = VK_TRUE;
+    app->capabilities.sparse_residency = true;
+  }
+
+  // Lets every submission on a queue go out in one vkQueueSubmit2 (see
+  // shared_queue.h), and barriers say exactly which stages they wait on.
+  if (has_extension(supported_extensions, VK_KHR_SYNCHRONIZATION_2_EXTENSION_NAME) &&
+      sync2_features.synchronization2) {
+    device_extensions.push_back(VK_KHR_SYNCHRONIZATION_2_EXTENSION_NAME);
+
+    sync2_features = {};
+    sync2_features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_SYNCHRONIZATION_2_FEATURES;
+    sync2_features.synchronization2 = VK_TRUE;
+    sync2_features.pNext = feature_chain;
+    feature_chain = &sync2_features;
+
+    app->capabilities.synchronization2 = true;
+  }
+
+  if (supported_properties.properties.apiVersion >= VK_API_VERSION_1_2) {
+    vulkan12_enabled.pNext = feature_chain;
+    feature_chain = &vulkan12_enabled;
+  }
+
   device_create_info = {};
   device_create_info.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO;
+  device_create_info.pNext = feature_chain;
   device_create_info.pQueueCreateInfos = queue_create_infos.data();
   device_create_info.queueCreateInfoCount = (uint32_t)queue_create_infos.size();
   device_create_info.pEnabledFeatures = &device_features;
-  device_create_info.enabledExtensionCount = 0;
+  device_create_info.enabledExtensionCount = (uint32_t)device_extensions.size();
+  device_create_info.ppEnabledExtensionNames = device_extensions.data();
 
   // Just like with the VkInstanceCreateInfo, we need to enable validation
   // layers for the device.
@@ -666,15 +966,182 @@ void create_logical_device(application* app) {
     0,
     &(app->present_queue)
   );
+
+  vkGetDeviceQueue(
+    app->device,
+    indices.transfer_family.value(),
+    0,
+    &(app->transfer_queue)
+  );
+
+  if (app->capabilities.sparse_residency) {
+    vkGetDeviceQueue(
+      app->device,
+      indices.sparse_family.value(),
+      0,
+      &(app->sparse_queue)
+    );
+  }
+
+  app->queue_families = indices;
+
+  //
+  // Wrap them, so threads can submit to them safely.
+  //
+
+  app->num_shared_queues = 0;
+  app->graphics_submit = get_shared_queue(app, app->graphics_queue);
+  app->present_submit = get_shared_queue(app, app->present_queue);
+  app->transfer_submit = get_shared_queue(app, app->transfer_queue);
+  app->sparse_submit = NULL;
+
+  if (app->capabilities.sparse_residency) {
+    app->sparse_submit = get_shared_queue(app, app->sparse_queue);
+  }
+
+  link_shared_queues(app->shared_queues, app->num_shared_queues);
+}
+
+shared_queue* get_shared_queue(application* app, VkQueue queue) {
+  shared_queue* shared;
+
+  for (uint32_t i = 0; i < app->num_shared_queues; i++) {
+    if (app->shared_queues[i].queue == queue) {
+      return &(app->shared_queues[i]);
+    }
+  }
+
+  shared = &(app->shared_queues[app->num_shared_queues]);
+  app->num_shared_queues++;
+
+  create_shared_queue(app->device, queue, app->capabilities.synchronization2, shared);
+
+  return shared;
+}
+
+vector<VkExtensionProperties> get_device_extensions(VkPhysicalDevice device) {
+  uint32_t num_extensions;
+  vector<VkExtensionProperties> extensions;
+
+  num_extensions = 0;
+  vkEnumerateDeviceExtensionProperties(device, NULL, &num_extensions, NULL);
+
+  extensions.resize(num_extensions);
+  vkEnumerateDeviceExtensionProperties(
+    device,
+    NULL,
+    &num_extensions,
+    extensions.data()
+  );
+
+  return extensions;
+}
+
+bool has_extension(
+  const vector<VkExtensionProperties>& extensions,
+  const char* name
+) {
+  for (const VkExtensionProperties& extension : extensions) {
+    if (strcmp(extension.extensionName, name) == 0) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+void rebuild_swap_chain(application* app) {
+  int width;
+  int height;
+
+  // A minimized window has no size to build for, so wait until it's back.
+  glfwGetFramebufferSize(app->window, &width, &height);
+  while ((width == 0 || height == 0) && !glfwWindowShouldClose(app->window)) {
+    glfwWaitEvents();
+    glfwGetFramebufferSize(app->window, &width, &height);
+  }
+
+  // Nothing may still be using the old images, so every queued frame has
+  // to be out and finished on the GPU.
+  wait_submission_idle(&(app->submission));
+
+  for (uint32_t i = 0; i < app->num_shared_queues; i++) {
+    wait_shared_queue_idle(&(app->shared_queues[i]));
+  }
+
+  recreate_swap_chain(&(app->swapchain), (uint32_t)width, (uint32_t)height);
 }
 
 void application_main_loop(application* app) {
+  uint32_t frame_index = 0;
+  uint64_t num_submissions;
+  uint64_t num_submit_calls;
+  uint64_t queue_submissions;
+  uint64_t queue_submit_calls;
+
   while (!glfwWindowShouldClose(app->window)) {
     glfwPollEvents();
+
+    begin_arena_frame(&(app->arenas), frame_index);
+    publish_arena_stats(&(app->arenas), &(app->profiler));
+    publish_command_cache_stats(&(app->commands), &(app->profiler));
+
+    // No defragment_step: the only long lived buffer, the per draw ring,
+    // is rewritten by the CPU every frame, and a move would lose those
+    // writes. With nothing setting on_relocate a step can't move
+    // anything, so it waits until something movable exists.
+    update_memory_budget(&(app->memory_budget), &(app->allocator));
+    publish_memory_stats(&(app->memory_budget), &(app->profiler));
+
+    // There are no recorded frames yet, so have the submission thread
+    // send off whatever the frame's work submitted.
+    queue_flush(&(app->submission));
+
+    // Nothing presents yet, but once frames do, a present that finds the
+    // swap chain out of date (or no longer the best fit) lands here.
+    if (take_present_result(&(app->submission)) != VK_SUCCESS) {
+      rebuild_swap_chain(app);
+    }
+
+    num_submissions = 0;
+    num_submit_calls = 0;
+
+    for (uint32_t i = 0; i < app->num_shared_queues; i++) {
+      take_queue_stats(&(app->shared_queues[i]), &queue_submissions, &queue_submit_calls);
+
+      num_submissions += queue_submissions;
+      num_submit_calls += queue_submit_calls;
+    }
+
+    set_profiler_counter(&(app->profiler), "queue_submissions", (double)num_submissions);
+    set_profiler_counter(&(app->profiler), "queue_submit_calls", (double)num_submit_calls);
+
+    frame_index = (frame_index + 1) % MAX_FRAMES_IN_FLIGHT;
   }
 }
 
 void application_cleanup(application* app) {
+  // Before anything the queued frames might use is destroyed.
+  destroy_submission_thread(&(app->submission));
+
+  // The thread has handed everything to the queues, but the GPU may still
+  // be running it.
+  for (uint32_t i = 0; i < app->num_shared_queues; i++) {
+    wait_shared_queue_idle(&(app->shared_queues[i]));
+  }
+
+  destroy_command_cache(&(app->commands));
+
+  destroy_per_draw_binder(&(app->per_draw));
+  destroy_pipeline_manager(&(app->pipelines));
+  destroy_layout_cache(&(app->layouts));
+  destroy_shader_library(&(app->shaders));
+  destroy_frame_arenas(&(app->arenas));
+  destroy_gpu_profiler(app->device, &(app->profiler));
+  destroy_defragmenter(&(app->defrag));
+  destroy_memory_allocator(&(app->allocator));
+  destroy_swap_chain(&(app->swapchain));
+
   vkDestroyDevice(app->device, NULL);
 
   if (enable_validation_layers) {
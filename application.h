@@ -9,8 +9,28 @@
 #include <cstdlib>
 #include <optional>
 
+#include "pipeline_manager.h"
+#include "memory_allocator.h"
+#include "layout_cache.h"
+#include "shader_library.h"
+#include "per_draw.h"
+#include "memory_budget.h"
+#include "defragmenter.h"
+#include "gpu_profiler.h"
+#include "frame_arena.h"
+#include "shared_queue.h"
+#include "submission_thread.h"
+#include "static_commands.h"
+#include "swap_chain.h"
+
 const uint32_t WINDOW_W = 800;
 const uint32_t WINDOW_H = 600;
+// How many frames the CPU may get ahead of the GPU. Anything with per
+// frame data (like the per draw ring) keeps this many copies of it.
+const uint32_t MAX_FRAMES_IN_FLIGHT = 2;
+// How many recorded frames can wait on the submission thread. More rides
+// out uneven frames, fewer keeps input latency down.
+const uint32_t SUBMISSION_QUEUE_DEPTH = 1;
 
 // When looking for a suitable physical device, we need to look
 // for one that supports the types of commands we want to submit.
@@ -26,6 +46,35 @@ struct queue_family_indices {
   // the individual device may not. Thus, for a device to be viable,
   // we need to know that it supports it.
   std::optional<uint32_t> present_family;
+  // A family for copies, ideally one that does nothing else. Falls back
+  // to the graphics family, so it's always set if that is.
+  std::optional<uint32_t> transfer_family;
+  // A family that can bind memory to sparse resources, if there is one.
+  std::optional<uint32_t> sparse_family;
+};
+
+// Optional device features. create_logical_device turns each one on if
+// the physical device supports it, and records here whether it did, so
+// the rest of the renderer can pick a fast path or fall back.
+struct device_capabilities {
+  // VK_EXT_graphics_pipeline_library, with fast linking. Lets us build
+  // pipelines out of separately compiled pieces.
+  bool graphics_pipeline_library;
+  // VK_KHR_push_descriptor. Lets us write descriptors straight into the
+  // command buffer instead of allocating sets.
+  bool push_descriptor;
+  // bufferDeviceAddress from Vulkan 1.2. Gives every buffer allocation a
+  // GPU address shaders can use as a pointer.
+  bool buffer_device_address;
+  // VK_EXT_memory_budget. Tells us how much of each memory heap we can use
+  // before the driver starts moving things to system memory.
+  bool memory_budget;
+  // sparseBinding and sparseResidencyImage2D, with a queue that can bind.
+  // Lets textures be bigger than the memory they use.
+  bool sparse_residency;
+  // VK_KHR_synchronization2. 64 bit stage and access masks, barriers that
+  // carry their own stages, and vkQueueSubmit2.
+  bool synchronization2;
 };
 
 struct application {
@@ -58,6 +107,54 @@ struct application {
   VkQueue graphics_queue;
   // A command queue for presenting images to the surface.
   VkQueue present_queue;
+  // A command queue for copies that shouldn't hold up rendering.
+  VkQueue transfer_queue;
+  // A command queue for binding memory to sparse images. Only set with
+  // capabilities.sparse_residency.
+  VkQueue sparse_queue;
+  // The families the queues above came from.
+  queue_family_indices queue_families;
+  // Every submission goes through these, one for each distinct queue
+  // above, since several of them can be the same VkQueue.
+  shared_queue shared_queues[4];
+  uint32_t num_shared_queues;
+  // Which of shared_queues each of the queues above is. sparse_submit is
+  // NULL without capabilities.sparse_residency.
+  shared_queue* graphics_submit;
+  shared_queue* present_submit;
+  shared_queue* transfer_submit;
+  shared_queue* sparse_submit;
+  // Which optional features the logical device was created with.
+  device_capabilities capabilities;
+  // The images we present to the surface, in the best format it offers,
+  // HDR if it can.
+  swap_chain swapchain;
+  // Hands out device memory in pieces of big blocks.
+  memory_allocator allocator;
+  // Compacts the allocator's blocks a few allocations at a time. Not
+  // stepped yet: nothing the application allocates sets on_relocate.
+  defragmenter defrag;
+  // Watches the heaps' budgets, and frees memory when one gets close.
+  memory_budget_tracker memory_budget;
+  // GPU timings and counters, memory use among them.
+  gpu_profiler profiler;
+  // Per thread, per frame scratch memory for everything the CPU throws
+  // away by the end of a frame.
+  frame_arenas arenas;
+  // Submits and presents recorded frames, so the main thread never
+  // waits on vkQueuePresentKHR.
+  submission_thread submission;
+  // Command buffers recorded once and reused until what they draw
+  // changes.
+  command_cache commands;
+  // Every shader module, created from the shaders embedded in the binary.
+  shader_library shaders;
+  // Deduplicates the descriptor set and pipeline layouts.
+  layout_cache layouts;
+  // Gets small per draw data to the shaders the cheapest way we can.
+  per_draw_binder per_draw;
+  // Creates, deduplicates and caches every graphics pipeline we use.
+  pipeline_manager pipelines;
 };
 
 //
@@ -75,6 +172,10 @@ void create_surface(application* app);
 void pick_physical_device(application* app);
 void create_logical_device(application* app);
 
+// Rebuilds the swap chain at the window's current size, after presenting
+// found it out of date or suboptimal. Waits for everything queued first.
+void rebuild_swap_chain(application* app);
+
 void application_main_loop(application* app);
 
 void application_cleanup(application* app);
@@ -0,0 +1,418 @@
+#include "barrier_batch.h"
+
+#include <stdexcept>
+
+using namespace std;
+
+// The access bits that write memory.
+const VkAccessFlags2 WRITE_ACCESS =
+  VK_ACCESS_2_SHADER_WRITE_BIT |
+  VK_ACCESS_2_COLOR_ATTACHMENT_WRITE_BIT |
+  VK_ACCESS_2_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT |
+  VK_ACCESS_2_TRANSFER_WRITE_BIT |
+  VK_ACCESS_2_HOST_WRITE_BIT |
+  VK_ACCESS_2_MEMORY_WRITE_BIT |
+  VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT;
+
+// The stage and access bits that only exist in synchronization2 live
+// above the first 32.
+const uint64_t SYNC2_ONLY_BITS = ~(uint64_t)0xffffffff;
+
+void create_barrier_batch(VkDevice device, bool synchronization2, barrier_batch* batch) {
+  batch->synchronization2 = synchronization2;
+  batch->cmd_pipeline_barrier2 = NULL;
+  batch->images.clear();
+  batch->buffers.clear();
+  batch->image_barriers.clear();
+  batch->buffer_barriers.clear();
+  batch->image_states_before.clear();
+  batch->buffer_states_before.clear();
+  batch->num_requests = 0;
+  batch->num_dropped = 0;
+  batch->num_merged = 0;
+  batch->num_barrier_calls = 0;
+
+  if (synchronization2) {
+    batch->cmd_pipeline_barrier2 = (PFN_vkCmdPipelineBarrier2KHR)vkGetDeviceProcAddr(
+      device,
+      "vkCmdPipelineBarrier2KHR"
+    );
+
+    if (batch->cmd_pipeline_barrier2 == NULL) {
+      throw runtime_error("failed to load vkCmdPipelineBarrier2KHR!");
+    }
+  }
+}
+
+static resource_state initial_state(VkImageLayout layout) {
+  resource_state state{};
+
+  state.layout = layout;
+  state.pending = -1;
+
+  return state;
+}
+
+void track_image(
+  barrier_batch* batch,
+  VkImage image,
+  const VkImageSubresourceRange& range,
+  VkImageLayout layout
+) {
+  batch->images[image] = { initial_state(layout), range };
+}
+
+void track_buffer(barrier_batch* batch, VkBuffer buffer) {
+  batch->buffers[buffer] = initial_state(VK_IMAGE_LAYOUT_UNDEFINED);
+}
+
+void untrack_image(barrier_batch* batch, VkImage image) {
+  if (batch->images.at(image).state.pending >= 0) {
+    throw runtime_error("image untracked with a barrier waiting to be flushed!");
+  }
+
+  batch->images.erase(image);
+}
+
+void untrack_buffer(barrier_batch* batch, VkBuffer buffer) {
+  if (batch->buffers.at(buffer).pending >= 0) {
+    throw runtime_error("buffer untracked with a barrier waiting to be flushed!");
+  }
+
+  batch->buffers.erase(buffer);
+}
+
+// Whether one barrier since the last write covered both stages and access.
+static bool already_seen(
+  const resource_state* state,
+  VkPipelineStageFlags2 stages,
+  VkAccessFlags2 access
+) {
+  for (uint32_t i = 0; i < state->num_seen; i++) {
+    if ((stages & ~state->seen[i].stages) == 0 && (access & ~state->seen[i].access) == 0) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+// Remembers a barrier's scope, forgetting the oldest if there's no room.
+static void add_seen(resource_state* state, VkPipelineStageFlags2 stages, VkAccessFlags2 access) {
+  if (state->num_seen == MAX_SEEN_SCOPES) {
+    for (uint32_t i = 1; i < MAX_SEEN_SCOPES; i++) {
+      state->seen[i - 1] = state->seen[i];
+    }
+
+    state->num_seen--;
+  }
+
+  state->seen[state->num_seen] = { stages, access };
+  state->num_seen++;
+}
+
+// Works out the barrier needed before the resource is used by stages with
+// access in layout, and moves state to after that use. Returns false if
+// no barrier is needed.
+static bool plan_barrier(
+  resource_state* state,
+  VkPipelineStageFlags2 stages,
+  VkAccessFlags2 access,
+  VkImageLayout layout,
+  VkPipelineStageFlags2* src_stages,
+  VkAccessFlags2* src_access
+) {
+  VkAccessFlags2 writes;
+  bool layout_change;
+
+  writes = access & WRITE_ACCESS;
+  layout_change = layout != state->layout;
+
+  if (writes == 0 && !layout_change) {
+    // Nothing has written since we started tracking, or an earlier
+    // barrier already made the write visible to this use.
+    if (state->write_stages == 0 || already_seen(state, stages, access)) {
+      state->read_stages |= stages;
+      state->read_access |= access;
+      return false;
+    }
+
+    *src_stages = state->write_stages;
+    *src_access = state->write_access;
+
+    state->read_stages |= stages;
+    state->read_access |= access;
+    add_seen(state, stages, access);
+    return true;
+  }
+
+  // Writes, including layout changes. If anything read since the last
+  // write, that read waited on the write already, so waiting on the read
+  // is enough and the write needs no flushing again.
+  if (state->read_stages != 0) {
+    *src_stages = state->read_stages;
+    *src_access = 0;
+  } else {
+    *src_stages = state->write_stages;
+    *src_access = state->write_access;
+  }
+
+  state->layout = layout;
+  state->write_stages = stages;
+  state->write_access = writes;
+
+  if (writes == 0) {
+    // Only the layout changed. The barrier makes that visible to these
+    // stages, so they count as having read it.
+    state->read_stages = stages;
+    state->read_access = access;
+    state->num_seen = 0;
+    add_seen(state, stages, access);
+  } else {
+    state->read_stages = 0;
+    state->read_access = 0;
+    state->num_seen = 0;
+  }
+
+  // Writing a buffer nothing has touched yet needs no barrier at all.
+  // Images always need one the first time, for the layout.
+  return *src_stages != 0 || layout_change;
+}
+
+void use_image(
+  barrier_batch* batch,
+  VkImage image,
+  VkPipelineStageFlags2 stages,
+  VkAccessFlags2 access,
+  VkImageLayout layout
+) {
+  tracked_image* tracked;
+  VkImageMemoryBarrier2* barrier;
+  VkImageMemoryBarrier2 new_barrier{};
+  resource_state before;
+  int32_t pending;
+
+  tracked = &(batch->images.at(image));
+  batch->num_requests++;
+
+  // Already used once in this batch: both uses are in the same upcoming
+  // work, so plan one barrier for both from the state before either.
+  if (tracked->state.pending >= 0) {
+    barrier = &(batch->image_barriers[tracked->state.pending]);
+
+    if (barrier->newLayout != layout) {
+      throw runtime_error("image used in two layouts in one barrier batch!");
+    }
+
+    pending = tracked->state.pending;
+    tracked->state = batch->image_states_before[pending];
+    barrier->dstStageMask |= stages;
+    barrier->dstAccessMask |= access;
+    plan_barrier(&(tracked->state), barrier->dstStageMask, barrier->dstAccessMask, layout,
+                 &(barrier->srcStageMask), &(barrier->srcAccessMask));
+    tracked->state.pending = pending;
+
+    batch->num_merged++;
+    return;
+  }
+
+  before = tracked->state;
+  new_barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER_2;
+  new_barrier.oldLayout = tracked->state.layout;
+
+  if (!plan_barrier(&(tracked->state), stages, access, layout,
+                    &(new_barrier.srcStageMask), &(new_barrier.srcAccessMask))) {
+    batch->num_dropped++;
+    return;
+  }
+
+  new_barrier.dstStageMask = stages;
+  new_barrier.dstAccessMask = access;
+  new_barrier.newLayout = layout;
+  new_barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+  new_barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+  new_barrier.image = image;
+  new_barrier.subresourceRange = tracked->range;
+
+  tracked->state.pending = (int32_t)batch->image_barriers.size();
+  batch->image_barriers.push_back(new_barrier);
+  batch->image_states_before.push_back(before);
+}
+
+void use_buffer(
+  barrier_batch* batch,
+  VkBuffer buffer,
+  VkPipelineStageFlags2 stages,
+  VkAccessFlags2 access
+) {
+  resource_state* state;
+  VkBufferMemoryBarrier2* barrier;
+  VkBufferMemoryBarrier2 new_barrier{};
+  resource_state before;
+  int32_t pending;
+
+  state = &(batch->buffers.at(buffer));
+  batch->num_requests++;
+
+  // Same as for images, without the layout.
+  if (state->pending >= 0) {
+    pending = state->pending;
+    barrier = &(batch->buffer_barriers[pending]);
+
+    *state = batch->buffer_states_before[pending];
+    barrier->dstStageMask |= stages;
+    barrier->dstAccessMask |= access;
+    plan_barrier(state, barrier->dstStageMask, barrier->dstAccessMask, VK_IMAGE_LAYOUT_UNDEFINED,
+                 &(barrier->srcStageMask), &(barrier->srcAccessMask));
+    state->pending = pending;
+
+    batch->num_merged++;
+    return;
+  }
+
+  before = *state;
+  new_barrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER_2;
+
+  if (!plan_barrier(state, stages, access, VK_IMAGE_LAYOUT_UNDEFINED,
+                    &(new_barrier.srcStageMask), &(new_barrier.srcAccessMask))) {
+    batch->num_dropped++;
+    return;
+  }
+
+  new_barrier.dstStageMask = stages;
+  new_barrier.dstAccessMask = access;
+  new_barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+  new_barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+  new_barrier.buffer = buffer;
+  new_barrier.offset = 0;
+  new_barrier.size = VK_WHOLE_SIZE;
+
+  state->pending = (int32_t)batch->buffer_barriers.size();
+  batch->buffer_barriers.push_back(new_barrier);
+  batch->buffer_states_before.push_back(before);
+}
+
+// Vulkan 1.0 stages. The new stages are finer grained versions of old
+// ones, but not all map cleanly, so they fall back to ALL_COMMANDS.
+static VkPipelineStageFlags legacy_stages(VkPipelineStageFlags2 stages) {
+  if (stages & SYNC2_ONLY_BITS) {
+    return VK_PIPELINE_STAGE_ALL_COMMANDS_BIT;
+  }
+
+  return (VkPipelineStageFlags)stages;
+}
+
+static VkAccessFlags legacy_access(VkAccessFlags2 access) {
+  VkAccessFlags result;
+
+  result = (VkAccessFlags)(access & ~SYNC2_ONLY_BITS);
+
+  if (access & (VK_ACCESS_2_SHADER_SAMPLED_READ_BIT | VK_ACCESS_2_SHADER_STORAGE_READ_BIT)) {
+    result |= VK_ACCESS_SHADER_READ_BIT;
+  }
+
+  if (access & VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT) {
+    result |= VK_ACCESS_SHADER_WRITE_BIT;
+  }
+
+  return result;
+}
+
+static void flush_legacy_barriers(barrier_batch* batch, VkCommandBuffer cmd) {
+  vector<VkImageMemoryBarrier> image_barriers(batch->image_barriers.size());
+  vector<VkBufferMemoryBarrier> buffer_barriers(batch->buffer_barriers.size());
+  VkPipelineStageFlags src_stages;
+  VkPipelineStageFlags dst_stages;
+
+  src_stages = 0;
+  dst_stages = 0;
+
+  for (size_t i = 0; i < batch->image_barriers.size(); i++) {
+    const VkImageMemoryBarrier2& barrier = batch->image_barriers[i];
+
+    image_barriers[i] = {};
+    image_barriers[i].sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+    image_barriers[i].srcAccessMask = legacy_access(barrier.srcAccessMask);
+    image_barriers[i].dstAccessMask = legacy_access(barrier.dstAccessMask);
+    image_barriers[i].oldLayout = barrier.oldLayout;
+    image_barriers[i].newLayout = barrier.newLayout;
+    image_barriers[i].srcQueueFamilyIndex = barrier.srcQueueFamilyIndex;
+    image_barriers[i].dstQueueFamilyIndex = barrier.dstQueueFamilyIndex;
+    image_barriers[i].image = barrier.image;
+    image_barriers[i].subresourceRange = barrier.subresourceRange;
+
+    src_stages |= legacy_stages(barrier.srcStageMask);
+    dst_stages |= legacy_stages(barrier.dstStageMask);
+  }
+
+  for (size_t i = 0; i < batch->buffer_barriers.size(); i++) {
+    const VkBufferMemoryBarrier2& barrier = batch->buffer_barriers[i];
+
+    buffer_barriers[i] = {};
+    buffer_barriers[i].sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+    buffer_barriers[i].srcAccessMask = legacy_access(barrier.srcAccessMask);
+    buffer_barriers[i].dstAccessMask = legacy_access(barrier.dstAccessMask);
+    buffer_barriers[i].srcQueueFamilyIndex = barrier.srcQueueFamilyIndex;
+    buffer_barriers[i].dstQueueFamilyIndex = barrier.dstQueueFamilyIndex;
+    buffer_barriers[i].buffer = barrier.buffer;
+    buffer_barriers[i].offset = barrier.offset;
+    buffer_barriers[i].size = barrier.size;
+
+    src_stages |= legacy_stages(barrier.srcStageMask);
+    dst_stages |= legacy_stages(barrier.dstStageMask);
+  }
+
+  // Vulkan 1.0 has no "no stage".
+  if (src_stages == 0) {
+    src_stages = VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT;
+  }
+
+  if (dst_stages == 0) {
+    dst_stages = VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT;
+  }
+
+  vkCmdPipelineBarrier(
+    cmd,
+    src_stages,
+    dst_stages,
+    0,
+    0, NULL,
+    (uint32_t)buffer_barriers.size(), buffer_barriers.data(),
+    (uint32_t)image_barriers.size(), image_barriers.data()
+  );
+}
+
+void flush_barriers(barrier_batch* batch, VkCommandBuffer cmd) {
+  VkDependencyInfo dependency_info{};
+
+  if (batch->image_barriers.empty() && batch->buffer_barriers.empty()) {
+    return;
+  }
+
+  if (batch->synchronization2) {
+    dependency_info.sType = VK_STRUCTURE_TYPE_DEPENDENCY_INFO;
+    dependency_info.imageMemoryBarrierCount = (uint32_t)batch->image_barriers.size();
+    dependency_info.pImageMemoryBarriers = batch->image_barriers.data();
+    dependency_info.bufferMemoryBarrierCount = (uint32_t)batch->buffer_barriers.size();
+    dependency_info.pBufferMemoryBarriers = batch->buffer_barriers.data();
+
+    batch->cmd_pipeline_barrier2(cmd, &dependency_info);
+  } else {
+    flush_legacy_barriers(batch, cmd);
+  }
+
+  batch->num_barrier_calls++;
+
+  for (const VkImageMemoryBarrier2& barrier : batch->image_barriers) {
+    batch->images.at(barrier.image).state.pending = -1;
+  }
+
+  for (const VkBufferMemoryBarrier2& barrier : batch->buffer_barriers) {
+    batch->buffers.at(barrier.buffer).pending = -1;
+  }
+
+  batch->image_barriers.clear();
+  batch->buffer_barriers.clear();
+  batch->image_states_before.clear();
+  batch->buffer_states_before.clear();
+}
@@ -0,0 +1,147 @@
+#ifndef BARRIER_BATCH_H
+#define BARRIER_BATCH_H
+
+#define GLFW_INCLUDE_VULKAN
+
+#include <GLFW/glfw3.h>
+#include <cstdint>
+#include <vector>
+#include <unordered_map>
+
+//
+// Every pipeline barrier makes the GPU wait: the stages after it can't
+// start until the stages before it are done. Barriers that wait on
+// ALL_COMMANDS, or that come one at a time, or that aren't needed at all,
+// leave the GPU idle for nothing.
+//
+// A barrier batch remembers how each resource was last used, so code only
+// has to say how it's about to use one ("sampled in the fragment shader,
+// in SHADER_READ_ONLY_OPTIMAL"). The batch works out the smallest barrier
+// that makes that safe:
+//
+//   - Reading after a write waits on just the stages that wrote, and
+//     makes just those writes visible to just the stages that read.
+//   - Reading again needs nothing, if one earlier barrier already made
+//     the write visible to all of the stages for all of the accesses.
+//   - Writing after reads only has to wait for the reads to finish; the
+//     memory needs no flushing.
+//   - Changing layout always needs a barrier, since it's a write too.
+//
+// The barriers for several resources collect in the batch until the next
+// flush, which records all of them with one vkCmdPipelineBarrier2. With
+// synchronization2 each barrier keeps its own stages. Without it, they go
+// through vkCmdPipelineBarrier, which takes one set of stages for all of
+// them, so the batch ORs them together.
+//
+// State is tracked per whole image and whole buffer, and belongs to the
+// command buffers recorded through the batch in submission order. A batch
+// isn't thread safe; each recording thread should have its own, for the
+// resources only it uses.
+//
+
+// How many barriers since the last write a resource remembers. Forgetting
+// one only costs a barrier that wasn't needed.
+const uint32_t MAX_SEEN_SCOPES = 4;
+
+// The stages and accesses one barrier made a write visible to.
+struct seen_scope {
+  VkPipelineStageFlags2 stages;
+  VkAccessFlags2 access;
+};
+
+// The state a resource was left in by its last use.
+struct resource_state {
+  VkImageLayout layout;
+
+  // The last write, which later reads must wait on.
+  VkPipelineStageFlags2 write_stages;
+  VkAccessFlags2 write_access;
+
+  // The stages and accesses that have read since the last write, and so
+  // have already waited on it. The next write waits on them.
+  VkPipelineStageFlags2 read_stages;
+  VkAccessFlags2 read_access;
+
+  // The barriers since the last write, oldest first. A read can skip its
+  // barrier only if one of them covered both its stages and its access:
+  // the unions above can't say that, since one barrier may have made the
+  // write visible to a vertex shader's uniform reads and another to a
+  // fragment shader's sampling, which says nothing about the fragment
+  // shader's uniform reads.
+  seen_scope seen[MAX_SEEN_SCOPES];
+  uint32_t num_seen;
+
+  // Where this resource's barrier is in the batch, or -1 if it has none.
+  int32_t pending;
+};
+
+struct tracked_image {
+  resource_state state;
+  VkImageSubresourceRange range;
+};
+
+struct barrier_batch {
+  bool synchronization2;
+  PFN_vkCmdPipelineBarrier2KHR cmd_pipeline_barrier2;
+
+  std::unordered_map<VkImage, tracked_image> images;
+  std::unordered_map<VkBuffer, resource_state> buffers;
+
+  // The barriers waiting for the next flush, and the state each resource
+  // was in before them, in case another use has to be folded in.
+  std::vector<VkImageMemoryBarrier2> image_barriers;
+  std::vector<VkBufferMemoryBarrier2> buffer_barriers;
+  std::vector<resource_state> image_states_before;
+  std::vector<resource_state> buffer_states_before;
+
+  // Reset by whoever reads them. num_dropped counts the requests that
+  // needed no barrier, num_merged the ones folded into a barrier already
+  // in the batch.
+  uint32_t num_requests;
+  uint32_t num_dropped;
+  uint32_t num_merged;
+  uint32_t num_barrier_calls;
+};
+
+//
+// BARRIER BATCH ROUTINES
+//
+
+// synchronization2 says whether VK_KHR_synchronization2 was enabled on
+// the device.
+void create_barrier_batch(VkDevice device, bool synchronization2, barrier_batch* batch);
+
+// Starts tracking an image, in the given layout with nothing in flight.
+// range covers what the barriers apply to, usually the whole image.
+void track_image(
+  barrier_batch* batch,
+  VkImage image,
+  const VkImageSubresourceRange& range,
+  VkImageLayout layout
+);
+void track_buffer(barrier_batch* batch, VkBuffer buffer);
+// Forgets a resource, for when it's destroyed.
+void untrack_image(barrier_batch* batch, VkImage image);
+void untrack_buffer(barrier_batch* batch, VkBuffer buffer);
+
+// Says the image is about to be used by stages, with access, in layout.
+// Adds a barrier to the batch if one is needed. A resource can only be
+// given one layout per flush.
+void use_image(
+  barrier_batch* batch,
+  VkImage image,
+  VkPipelineStageFlags2 stages,
+  VkAccessFlags2 access,
+  VkImageLayout layout
+);
+void use_buffer(
+  barrier_batch* batch,
+  VkBuffer buffer,
+  VkPipelineStageFlags2 stages,
+  VkAccessFlags2 access
+);
+
+// Records every barrier in the batch into cmd, in one call.
+void flush_barriers(barrier_batch* batch, VkCommandBuffer cmd);
+
+#endif
@@ -3,4 +3,13 @@
 # use -DNDEBUG if you want release
 
 rm *.out
-g++ -std=c++17 -O2  main.cpp application.cpp -lglfw -lvulkan -ldl -lpthread -lX11 -lXxf86vm -lXi
+
+# Compiles the shaders and embeds them into generated/embedded_shaders.h.
+python3 embed_shaders.py || exit 1
+
+g++ -std=c++17 -O2  main.cpp application.cpp mesh_lod.cpp pipeline_manager.cpp shader_permutation.cpp spirv_reflect.cpp layout_cache.cpp shader_library.cpp per_draw.cpp memory_allocator.cpp memory_budget.cpp gpu_profiler.cpp defragmenter.cpp virtual_texture.cpp dynamic_upload.cpp frame_arena.cpp submission_thread.cpp shared_queue.cpp barrier_batch.cpp static_commands.cpp sprite_batch.cpp text_renderer.cpp shadow_cascades.cpp post_process.cpp swap_chain.cpp msaa_target.cpp -lglfw -lvulkan -ldl -lpthread -lX11 -lXxf86vm -lXi
+
+# The headless benchmark and capture replayer don't need a window, so they
+# only link Vulkan.
+g++ -std=c++17 -O2 -DNDEBUG vulkan_benchmark.cpp headless.cpp gpu_profiler.cpp command_capture.cpp memory_allocator.cpp memory_budget.cpp dynamic_upload.cpp shader_library.cpp spirv_reflect.cpp layout_cache.cpp pipeline_manager.cpp barrier_batch.cpp sprite_batch.cpp -o benchmark.out -lvulkan -ldl -lpthread
+g++ -std=c++17 -O2 -DNDEBUG vulkan_replay.cpp headless.cpp command_capture.cpp -o replay.out -lvulkan -ldl -lpthread
@@ -0,0 +1,1135 @@
+#include "command_capture.h"
+#include "hash.h"
+
+#include <stdexcept>
+#include <fstream>
+#include <cstring>
+
+using namespace std;
+
+// "VCAP" when read as little endian bytes.
+const uint32_t CAPTURE_FILE_MAGIC = 0x50414356;
+
+//
+// Every op in the stream is written as:
+//
+// uint32_t opcode
+// uint32_t payload_size
+// uint8_t payload[payload_size]
+//
+// The size lets a reader skip over ops it doesn't understand. Payloads are
+// plain little endian values, written field by field (Vulkan structs
+// included) so that no pointers, handles or padding ever end up in the
+// file.
+//
+
+template <typename T>
+static void put(command_capture* capture, const T& value) {
+  const uint8_t* bytes;
+
+  bytes = (const uint8_t*)&value;
+  capture->stream.insert(capture->stream.end(), bytes, bytes + sizeof(T));
+}
+
+static size_t begin_op(command_capture* capture, capture_opcode opcode) {
+  size_t size_position;
+
+  put(capture, (uint32_t)opcode);
+
+  size_position = capture->stream.size();
+  put(capture, (uint32_t)0);
+
+  return size_position;
+}
+
+static void end_op(command_capture* capture, size_t size_position) {
+  uint32_t payload_size;
+
+  payload_size = (uint32_t)(capture->stream.size() - size_position - sizeof(uint32_t));
+  memcpy(&capture->stream[size_position], &payload_size, sizeof(uint32_t));
+}
+
+static void put_offset(command_capture* capture, const VkOffset3D& offset) {
+  put(capture, offset.x);
+  put(capture, offset.y);
+  put(capture, offset.z);
+}
+
+static void put_extent(command_capture* capture, const VkExtent3D& extent) {
+  put(capture, extent.width);
+  put(capture, extent.height);
+  put(capture, extent.depth);
+}
+
+static void put_subresource_layers(command_capture* capture, const VkImageSubresourceLayers& layers) {
+  put(capture, (uint32_t)layers.aspectMask);
+  put(capture, layers.mipLevel);
+  put(capture, layers.baseArrayLayer);
+  put(capture, layers.layerCount);
+}
+
+static void put_subresource_range(command_capture* capture, const VkImageSubresourceRange& range) {
+  put(capture, (uint32_t)range.aspectMask);
+  put(capture, range.baseMipLevel);
+  put(capture, range.levelCount);
+  put(capture, range.baseArrayLayer);
+  put(capture, range.layerCount);
+}
+
+// The bits of whichever member was set, so floats and ints both survive.
+static void put_clear_color(command_capture* capture, const VkClearColorValue& color) {
+  for (uint32_t i = 0; i < 4; i++) {
+    put(capture, color.uint32[i]);
+  }
+}
+
+static void put_buffer_copy(command_capture* capture, const VkBufferCopy& region) {
+  put(capture, (uint64_t)region.srcOffset);
+  put(capture, (uint64_t)region.dstOffset);
+  put(capture, (uint64_t)region.size);
+}
+
+static void put_buffer_image_copy(command_capture* capture, const VkBufferImageCopy& region) {
+  put(capture, (uint64_t)region.bufferOffset);
+  put(capture, region.bufferRowLength);
+  put(capture, region.bufferImageHeight);
+  put_subresource_layers(capture, region.imageSubresource);
+  put_offset(capture, region.imageOffset);
+  put_extent(capture, region.imageExtent);
+}
+
+static void put_image_blit(command_capture* capture, const VkImageBlit& region) {
+  put_subresource_layers(capture, region.srcSubresource);
+  put_offset(capture, region.srcOffsets[0]);
+  put_offset(capture, region.srcOffsets[1]);
+  put_subresource_layers(capture, region.dstSubresource);
+  put_offset(capture, region.dstOffsets[0]);
+  put_offset(capture, region.dstOffsets[1]);
+}
+
+static uint32_t buffer_id(const command_capture* capture, VkBuffer buffer) {
+  auto it = capture->buffer_ids.find(buffer);
+
+  if (it == capture->buffer_ids.end()) {
+    throw runtime_error("buffer was not registered with the capture!");
+  }
+
+  return it->second;
+}
+
+static uint32_t image_id(const command_capture* capture, VkImage image) {
+  auto it = capture->image_ids.find(image);
+
+  if (it == capture->image_ids.end()) {
+    throw runtime_error("image was not registered with the capture!");
+  }
+
+  return it->second;
+}
+
+// Called whenever the GPU is about to read a buffer. If the CPU wrote it
+// and its contents changed since we last saved them, save them again.
+static void note_buffer_read(command_capture* capture, VkBuffer buffer) {
+  uint32_t id;
+  captured_buffer* captured;
+  uint64_t hash;
+  size_t op;
+
+  id = buffer_id(capture, buffer);
+  captured = &capture->buffers[id];
+
+  if (captured->host_data == NULL) {
+    return;
+  }
+
+  hash = HASH_SEED;
+  hash_bytes(&hash, captured->host_data, captured->size);
+
+  if (captured->contents_captured && captured->contents_hash == hash) {
+    return;
+  }
+
+  op = begin_op(capture, CAPTURE_OP_BUFFER_CONTENTS);
+  put(capture, id);
+  put(capture, (uint64_t)captured->size);
+  capture->stream.insert(
+    capture->stream.end(),
+    captured->host_data,
+    captured->host_data + captured->size
+  );
+  end_op(capture, op);
+
+  captured->contents_hash = hash;
+  captured->contents_captured = true;
+}
+
+void init_command_capture(command_capture* capture) {
+  capture->stream.clear();
+  capture->buffer_ids.clear();
+  capture->image_ids.clear();
+  capture->buffers.clear();
+  capture->num_images = 0;
+  capture->num_frames = 0;
+
+  put(capture, CAPTURE_FILE_MAGIC);
+  put(capture, CAPTURE_FILE_VERSION);
+}
+
+void capture_buffer(
+  command_capture* capture,
+  VkBuffer buffer,
+  const VkBufferCreateInfo& create_info,
+  const void* host_data
+) {
+  captured_buffer captured{};
+  uint32_t id;
+  size_t op;
+
+  id = (uint32_t)capture->buffers.size();
+
+  captured.size = create_info.size;
+  captured.host_data = (const uint8_t*)host_data;
+  capture->buffers.push_back(captured);
+  capture->buffer_ids[buffer] = id;
+
+  op = begin_op(capture, CAPTURE_OP_CREATE_BUFFER);
+  put(capture, id);
+  put(capture, (uint64_t)create_info.size);
+  put(capture, (uint32_t)create_info.usage);
+  put(capture, (uint32_t)(host_data != NULL));
+  end_op(capture, op);
+}
+
+void capture_image(
+  command_capture* capture,
+  VkImage image,
+  const VkImageCreateInfo& create_info
+) {
+  uint32_t id;
+  size_t op;
+
+  id = capture->num_images++;
+  capture->image_ids[image] = id;
+
+  op = begin_op(capture, CAPTURE_OP_CREATE_IMAGE);
+  put(capture, id);
+  put(capture, (uint32_t)create_info.flags);
+  put(capture, (uint32_t)create_info.imageType);
+  put(capture, (uint32_t)create_info.format);
+  put_extent(capture, create_info.extent);
+  put(capture, create_info.mipLevels);
+  put(capture, create_info.arrayLayers);
+  put(capture, (uint32_t)create_info.samples);
+  put(capture, (uint32_t)create_info.tiling);
+  put(capture, (uint32_t)create_info.usage);
+  end_op(capture, op);
+}
+
+void capture_cmd_pipeline_barrier(
+  command_capture* capture,
+  VkCommandBuffer cmd,
+  VkPipelineStageFlags src_stage,
+  VkPipelineStageFlags dst_stage,
+  uint32_t num_buffer_barriers,
+  const VkBufferMemoryBarrier* buffer_barriers,
+  uint32_t num_image_barriers,
+  const VkImageMemoryBarrier* image_barriers
+) {
+  size_t op;
+
+  vkCmdPipelineBarrier(
+    cmd,
+    src_stage,
+    dst_stage,
+    0,
+    0, NULL,
+    num_buffer_barriers, buffer_barriers,
+    num_image_barriers, image_barriers
+  );
+
+  if (capture == NULL) {
+    return;
+  }
+
+  // Queue family ownership transfers aren't captured: the replayer only
+  // has one queue.
+  op = begin_op(capture, CAPTURE_OP_PIPELINE_BARRIER);
+  put(capture, (uint32_t)src_stage);
+  put(capture, (uint32_t)dst_stage);
+
+  put(capture, num_buffer_barriers);
+  for (uint32_t i = 0; i < num_buffer_barriers; i++) {
+    put(capture, (uint32_t)buffer_barriers[i].srcAccessMask);
+    put(capture, (uint32_t)buffer_barriers[i].dstAccessMask);
+    put(capture, buffer_id(capture, buffer_barriers[i].buffer));
+    put(capture, (uint64_t)buffer_barriers[i].offset);
+    put(capture, (uint64_t)buffer_barriers[i].size);
+  }
+
+  put(capture, num_image_barriers);
+  for (uint32_t i = 0; i < num_image_barriers; i++) {
+    put(capture, (uint32_t)image_barriers[i].srcAccessMask);
+    put(capture, (uint32_t)image_barriers[i].dstAccessMask);
+    put(capture, (uint32_t)image_barriers[i].oldLayout);
+    put(capture, (uint32_t)image_barriers[i].newLayout);
+    put(capture, image_id(capture, image_barriers[i].image));
+    put_subresource_range(capture, image_barriers[i].subresourceRange);
+  }
+
+  end_op(capture, op);
+}
+
+void capture_cmd_clear_color_image(
+  command_capture* capture,
+  VkCommandBuffer cmd,
+  VkImage image,
+  VkImageLayout layout,
+  const VkClearColorValue* color,
+  uint32_t num_ranges,
+  const VkImageSubresourceRange* ranges
+) {
+  size_t op;
+
+  vkCmdClearColorImage(cmd, image, layout, color, num_ranges, ranges);
+
+  if (capture == NULL) {
+    return;
+  }
+
+  op = begin_op(capture, CAPTURE_OP_CLEAR_COLOR_IMAGE);
+  put(capture, image_id(capture, image));
+  put(capture, (uint32_t)layout);
+  put_clear_color(capture, *color);
+  put(capture, num_ranges);
+  for (uint32_t i = 0; i < num_ranges; i++) {
+    put_subresource_range(capture, ranges[i]);
+  }
+  end_op(capture, op);
+}
+
+void capture_cmd_fill_buffer(
+  command_capture* capture,
+  VkCommandBuffer cmd,
+  VkBuffer buffer,
+  VkDeviceSize offset,
+  VkDeviceSize size,
+  uint32_t data
+) {
+  size_t op;
+
+  vkCmdFillBuffer(cmd, buffer, offset, size, data);
+
+  if (capture == NULL) {
+    return;
+  }
+
+  op = begin_op(capture, CAPTURE_OP_FILL_BUFFER);
+  put(capture, buffer_id(capture, buffer));
+  put(capture, (uint64_t)offset);
+  put(capture, (uint64_t)size);
+  put(capture, data);
+  end_op(capture, op);
+}
+
+void capture_cmd_copy_buffer(
+  command_capture* capture,
+  VkCommandBuffer cmd,
+  VkBuffer src,
+  VkBuffer dst,
+  uint32_t num_regions,
+  const VkBufferCopy* regions
+) {
+  size_t op;
+
+  vkCmdCopyBuffer(cmd, src, dst, num_regions, regions);
+
+  if (capture == NULL) {
+    return;
+  }
+
+  note_buffer_read(capture, src);
+
+  op = begin_op(capture, CAPTURE_OP_COPY_BUFFER);
+  put(capture, buffer_id(capture, src));
+  put(capture, buffer_id(capture, dst));
+  put(capture, num_regions);
+  for (uint32_t i = 0; i < num_regions; i++) {
+    put_buffer_copy(capture, regions[i]);
+  }
+  end_op(capture, op);
+}
+
+void capture_cmd_copy_buffer_to_image(
+  command_capture* capture,
+  VkCommandBuffer cmd,
+  VkBuffer src,
+  VkImage dst,
+  VkImageLayout dst_layout,
+  uint32_t num_regions,
+  const VkBufferImageCopy* regions
+) {
+  size_t op;
+
+  vkCmdCopyBufferToImage(cmd, src, dst, dst_layout, num_regions, regions);
+
+  if (capture == NULL) {
+    return;
+  }
+
+  note_buffer_read(capture, src);
+
+  op = begin_op(capture, CAPTURE_OP_COPY_BUFFER_TO_IMAGE);
+  put(capture, buffer_id(capture, src));
+  put(capture, image_id(capture, dst));
+  put(capture, (uint32_t)dst_layout);
+  put(capture, num_regions);
+  for (uint32_t i = 0; i < num_regions; i++) {
+    put_buffer_image_copy(capture, regions[i]);
+  }
+  end_op(capture, op);
+}
+
+void capture_cmd_copy_image_to_buffer(
+  command_capture* capture,
+  VkCommandBuffer cmd,
+  VkImage src,
+  VkImageLayout src_layout,
+  VkBuffer dst,
+  uint32_t num_regions,
+  const VkBufferImageCopy* regions
+) {
+  size_t op;
+
+  vkCmdCopyImageToBuffer(cmd, src, src_layout, dst, num_regions, regions);
+
+  if (capture == NULL) {
+    return;
+  }
+
+  op = begin_op(capture, CAPTURE_OP_COPY_IMAGE_TO_BUFFER);
+  put(capture, image_id(capture, src));
+  put(capture, (uint32_t)src_layout);
+  put(capture, buffer_id(capture, dst));
+  put(capture, num_regions);
+  for (uint32_t i = 0; i < num_regions; i++) {
+    put_buffer_image_copy(capture, regions[i]);
+  }
+  end_op(capture, op);
+}
+
+void capture_cmd_blit_image(
+  command_capture* capture,
+  VkCommandBuffer cmd,
+  VkImage src,
+  VkImageLayout src_layout,
+  VkImage dst,
+  VkImageLayout dst_layout,
+  uint32_t num_regions,
+  const VkImageBlit* regions,
+  VkFilter filter
+) {
+  size_t op;
+
+  vkCmdBlitImage(cmd, src, src_layout, dst, dst_layout, num_regions, regions, filter);
+
+  if (capture == NULL) {
+    return;
+  }
+
+  op = begin_op(capture, CAPTURE_OP_BLIT_IMAGE);
+  put(capture, image_id(capture, src));
+  put(capture, (uint32_t)src_layout);
+  put(capture, image_id(capture, dst));
+  put(capture, (uint32_t)dst_layout);
+  put(capture, (uint32_t)filter);
+  put(capture, num_regions);
+  for (uint32_t i = 0; i < num_regions; i++) {
+    put_image_blit(capture, regions[i]);
+  }
+  end_op(capture, op);
+}
+
+void capture_submit(command_capture* capture) {
+  size_t op;
+
+  if (capture == NULL) {
+    return;
+  }
+
+  op = begin_op(capture, CAPTURE_OP_SUBMIT);
+  end_op(capture, op);
+
+  capture->num_frames++;
+}
+
+void write_command_capture(const string& path, const command_capture* capture) {
+  ofstream file;
+
+  file.open(path, ios::binary);
+
+  if (!file.is_open()) {
+    throw runtime_error("failed to open capture file for writing!");
+  }
+
+  file.write((const char*)capture->stream.data(), capture->stream.size());
+
+  if (!file.good()) {
+    throw runtime_error("failed to write capture file!");
+  }
+}
+
+//
+// REPLAY
+//
+
+struct capture_reader {
+  const vector<uint8_t>* data;
+  size_t position;
+  // The end of the op we are currently reading.
+  size_t end;
+};
+
+template <typename T>
+static T get(capture_reader* reader) {
+  T value;
+
+  if (reader->position + sizeof(T) > reader->end) {
+    throw runtime_error("capture file is truncated!");
+  }
+
+  memcpy(&value, &(*reader->data)[reader->position], sizeof(T));
+  reader->position += sizeof(T);
+
+  return value;
+}
+
+// The readers for the Vulkan structs, field by field in the same order the
+// capture wrote them.
+static VkOffset3D get_offset(capture_reader* reader) {
+  VkOffset3D offset;
+
+  offset.x = get<int32_t>(reader);
+  offset.y = get<int32_t>(reader);
+  offset.z = get<int32_t>(reader);
+
+  return offset;
+}
+
+static VkExtent3D get_extent(capture_reader* reader) {
+  VkExtent3D extent;
+
+  extent.width = get<uint32_t>(reader);
+  extent.height = get<uint32_t>(reader);
+  extent.depth = get<uint32_t>(reader);
+
+  return extent;
+}
+
+static VkImageSubresourceLayers get_subresource_layers(capture_reader* reader) {
+  VkImageSubresourceLayers layers;
+
+  layers.aspectMask = get<uint32_t>(reader);
+  layers.mipLevel = get<uint32_t>(reader);
+  layers.baseArrayLayer = get<uint32_t>(reader);
+  layers.layerCount = get<uint32_t>(reader);
+
+  return layers;
+}
+
+static VkImageSubresourceRange get_subresource_range(capture_reader* reader) {
+  VkImageSubresourceRange range;
+
+  range.aspectMask = get<uint32_t>(reader);
+  range.baseMipLevel = get<uint32_t>(reader);
+  range.levelCount = get<uint32_t>(reader);
+  range.baseArrayLayer = get<uint32_t>(reader);
+  range.layerCount = get<uint32_t>(reader);
+
+  return range;
+}
+
+static VkClearColorValue get_clear_color(capture_reader* reader) {
+  VkClearColorValue color;
+
+  for (uint32_t i = 0; i < 4; i++) {
+    color.uint32[i] = get<uint32_t>(reader);
+  }
+
+  return color;
+}
+
+static VkBufferCopy get_buffer_copy(capture_reader* reader) {
+  VkBufferCopy region;
+
+  region.srcOffset = get<uint64_t>(reader);
+  region.dstOffset = get<uint64_t>(reader);
+  region.size = get<uint64_t>(reader);
+
+  return region;
+}
+
+static VkBufferImageCopy get_buffer_image_copy(capture_reader* reader) {
+  VkBufferImageCopy region;
+
+  region.bufferOffset = get<uint64_t>(reader);
+  region.bufferRowLength = get<uint32_t>(reader);
+  region.bufferImageHeight = get<uint32_t>(reader);
+  region.imageSubresource = get_subresource_layers(reader);
+  region.imageOffset = get_offset(reader);
+  region.imageExtent = get_extent(reader);
+
+  return region;
+}
+
+static VkImageBlit get_image_blit(capture_reader* reader) {
+  VkImageBlit region;
+
+  region.srcSubresource = get_subresource_layers(reader);
+  region.srcOffsets[0] = get_offset(reader);
+  region.srcOffsets[1] = get_offset(reader);
+  region.dstSubresource = get_subresource_layers(reader);
+  region.dstOffsets[0] = get_offset(reader);
+  region.dstOffsets[1] = get_offset(reader);
+
+  return region;
+}
+
+// A count followed by that many structs, each read with get_one.
+template <typename T>
+static vector<T> get_array(capture_reader* reader, T (*get_one)(capture_reader*)) {
+  uint32_t count;
+  vector<T> values;
+
+  count = get<uint32_t>(reader);
+
+  for (uint32_t i = 0; i < count; i++) {
+    values.push_back(get_one(reader));
+  }
+
+  return values;
+}
+
+static VkBuffer replay_buffer(const capture_replay* replay, uint32_t id) {
+  if (id >= replay->buffers.size() || replay->buffers[id] == VK_NULL_HANDLE) {
+    throw runtime_error("capture uses a buffer it never created!");
+  }
+
+  return replay->buffers[id];
+}
+
+static VkImage replay_image(const capture_replay* replay, uint32_t id) {
+  if (id >= replay->images.size() || replay->images[id] == VK_NULL_HANDLE) {
+    throw runtime_error("capture uses an image it never created!");
+  }
+
+  return replay->images[id];
+}
+
+static void replay_create_buffer(
+  headless_context* ctx,
+  capture_replay* replay,
+  capture_reader* reader
+) {
+  uint32_t id;
+  VkBufferCreateInfo create_info{};
+  bool host_visible;
+  VkMemoryRequirements requirements;
+  VkMemoryAllocateInfo allocate_info{};
+  VkMemoryPropertyFlags properties;
+
+  id = get<uint32_t>(reader);
+
+  create_info.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+  create_info.size = get<uint64_t>(reader);
+  create_info.usage = get<uint32_t>(reader);
+  create_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+  host_visible = get<uint32_t>(reader) != 0;
+
+  if (id >= replay->buffers.size()) {
+    replay->buffers.resize(id + 1, VK_NULL_HANDLE);
+    replay->buffer_memory.resize(id + 1, VK_NULL_HANDLE);
+    replay->buffer_mapped.resize(id + 1, NULL);
+  }
+
+  if (vkCreateBuffer(ctx->device, &create_info, NULL, &replay->buffers[id]) != VK_SUCCESS) {
+    throw runtime_error("failed to create replay buffer!");
+  }
+
+  vkGetBufferMemoryRequirements(ctx->device, replay->buffers[id], &requirements);
+
+  properties = host_visible
+    ? VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT
+    : VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT;
+
+  allocate_info.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+  allocate_info.allocationSize = requirements.size;
+  allocate_info.memoryTypeIndex = find_memory_type(
+    ctx->physical_device,
+    requirements.memoryTypeBits,
+    properties
+  );
+
+  if (vkAllocateMemory(ctx->device, &allocate_info, NULL, &replay->buffer_memory[id]) != VK_SUCCESS) {
+    throw runtime_error("failed to allocate replay buffer memory!");
+  }
+
+  vkBindBufferMemory(ctx->device, replay->buffers[id], replay->buffer_memory[id], 0);
+
+  if (host_visible) {
+    vkMapMemory(
+      ctx->device,
+      replay->buffer_memory[id],
+      0,
+      create_info.size,
+      0,
+      (void**)&replay->buffer_mapped[id]
+    );
+  }
+}
+
+static void replay_create_image(
+  headless_context* ctx,
+  capture_replay* replay,
+  capture_reader* reader
+) {
+  uint32_t id;
+  VkImageCreateInfo create_info{};
+  VkMemoryRequirements requirements;
+  VkMemoryAllocateInfo allocate_info{};
+
+  id = get<uint32_t>(reader);
+
+  create_info.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+  create_info.flags = get<uint32_t>(reader);
+  create_info.imageType = (VkImageType)get<uint32_t>(reader);
+  create_info.format = (VkFormat)get<uint32_t>(reader);
+  create_info.extent = get_extent(reader);
+  create_info.mipLevels = get<uint32_t>(reader);
+  create_info.arrayLayers = get<uint32_t>(reader);
+  create_info.samples = (VkSampleCountFlagBits)get<uint32_t>(reader);
+  create_info.tiling = (VkImageTiling)get<uint32_t>(reader);
+  create_info.usage = get<uint32_t>(reader);
+  create_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+  create_info.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+
+  if (id >= replay->images.size()) {
+    replay->images.resize(id + 1, VK_NULL_HANDLE);
+    replay->image_memory.resize(id + 1, VK_NULL_HANDLE);
+  }
+
+  if (vkCreateImage(ctx->device, &create_info, NULL, &replay->images[id]) != VK_SUCCESS) {
+    throw runtime_error("failed to create replay image!");
+  }
+
+  vkGetImageMemoryRequirements(ctx->device, replay->images[id], &requirements);
+
+  allocate_info.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+  allocate_info.allocationSize = requirements.size;
+  allocate_info.memoryTypeIndex = find_memory_type(
+    ctx->physical_device,
+    requirements.memoryTypeBits,
+    VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT
+  );
+
+  if (vkAllocateMemory(ctx->device, &allocate_info, NULL, &replay->image_memory[id]) != VK_SUCCESS) {
+    throw runtime_error("failed to allocate replay image memory!");
+  }
+
+  vkBindImageMemory(ctx->device, replay->images[id], replay->image_memory[id], 0);
+}
+
+static void replay_pipeline_barrier(
+  const capture_replay* replay,
+  capture_reader* reader,
+  VkCommandBuffer cmd
+) {
+  VkPipelineStageFlags src_stage;
+  VkPipelineStageFlags dst_stage;
+  uint32_t count;
+  vector<VkBufferMemoryBarrier> buffer_barriers;
+  vector<VkImageMemoryBarrier> image_barriers;
+
+  src_stage = get<uint32_t>(reader);
+  dst_stage = get<uint32_t>(reader);
+
+  count = get<uint32_t>(reader);
+  buffer_barriers.resize(count);
+  for (VkBufferMemoryBarrier& barrier : buffer_barriers) {
+    barrier = {};
+    barrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+    barrier.srcAccessMask = get<uint32_t>(reader);
+    barrier.dstAccessMask = get<uint32_t>(reader);
+    barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.buffer = replay_buffer(replay, get<uint32_t>(reader));
+    barrier.offset = get<uint64_t>(reader);
+    barrier.size = get<uint64_t>(reader);
+  }
+
+  count = get<uint32_t>(reader);
+  image_barriers.resize(count);
+  for (VkImageMemoryBarrier& barrier : image_barriers) {
+    barrier = {};
+    barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+    barrier.srcAccessMask = get<uint32_t>(reader);
+    barrier.dstAccessMask = get<uint32_t>(reader);
+    barrier.oldLayout = (VkImageLayout)get<uint32_t>(reader);
+    barrier.newLayout = (VkImageLayout)get<uint32_t>(reader);
+    barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.image = replay_image(replay, get<uint32_t>(reader));
+    barrier.subresourceRange = get_subresource_range(reader);
+  }
+
+  vkCmdPipelineBarrier(
+    cmd,
+    src_stage,
+    dst_stage,
+    0,
+    0, NULL,
+    (uint32_t)buffer_barriers.size(), buffer_barriers.data(),
+    (uint32_t)image_barriers.size(), image_barriers.data()
+  );
+}
+
+// Records a single command op into cmd.
+static void replay_command(
+  const capture_replay* replay,
+  capture_opcode opcode,
+  capture_reader* reader,
+  VkCommandBuffer cmd
+) {
+  VkBuffer buffer;
+  VkBuffer dst_buffer;
+  VkImage image;
+  VkImage dst_image;
+  VkImageLayout layout;
+  VkImageLayout dst_layout;
+  VkClearColorValue color;
+  VkDeviceSize offset;
+  VkDeviceSize size;
+  VkFilter filter;
+  uint32_t data;
+
+  switch (opcode) {
+    case CAPTURE_OP_PIPELINE_BARRIER:
+      replay_pipeline_barrier(replay, reader, cmd);
+      break;
+
+    case CAPTURE_OP_CLEAR_COLOR_IMAGE: {
+      image = replay_image(replay, get<uint32_t>(reader));
+      layout = (VkImageLayout)get<uint32_t>(reader);
+      color = get_clear_color(reader);
+      vector<VkImageSubresourceRange> ranges = get_array(reader, get_subresource_range);
+
+      vkCmdClearColorImage(cmd, image, layout, &color, (uint32_t)ranges.size(), ranges.data());
+      break;
+    }
+
+    case CAPTURE_OP_FILL_BUFFER:
+      buffer = replay_buffer(replay, get<uint32_t>(reader));
+      offset = get<uint64_t>(reader);
+      size = get<uint64_t>(reader);
+      data = get<uint32_t>(reader);
+
+      vkCmdFillBuffer(cmd, buffer, offset, size, data);
+      break;
+
+    case CAPTURE_OP_COPY_BUFFER: {
+      buffer = replay_buffer(replay, get<uint32_t>(reader));
+      dst_buffer = replay_buffer(replay, get<uint32_t>(reader));
+      vector<VkBufferCopy> regions = get_array(reader, get_buffer_copy);
+
+      vkCmdCopyBuffer(cmd, buffer, dst_buffer, (uint32_t)regions.size(), regions.data());
+      break;
+    }
+
+    case CAPTURE_OP_COPY_BUFFER_TO_IMAGE: {
+      buffer = replay_buffer(replay, get<uint32_t>(reader));
+      image = replay_image(replay, get<uint32_t>(reader));
+      layout = (VkImageLayout)get<uint32_t>(reader);
+      vector<VkBufferImageCopy> regions = get_array(reader, get_buffer_image_copy);
+
+      vkCmdCopyBufferToImage(cmd, buffer, image, layout, (uint32_t)regions.size(), regions.data());
+      break;
+    }
+
+    case CAPTURE_OP_COPY_IMAGE_TO_BUFFER: {
+      image = replay_image(replay, get<uint32_t>(reader));
+      layout = (VkImageLayout)get<uint32_t>(reader);
+      buffer = replay_buffer(replay, get<uint32_t>(reader));
+      vector<VkBufferImageCopy> regions = get_array(reader, get_buffer_image_copy);
+
+      vkCmdCopyImageToBuffer(cmd, image, layout, buffer, (uint32_t)regions.size(), regions.data());
+      break;
+    }
+
+    case CAPTURE_OP_BLIT_IMAGE: {
+      image = replay_image(replay, get<uint32_t>(reader));
+      layout = (VkImageLayout)get<uint32_t>(reader);
+      dst_image = replay_image(replay, get<uint32_t>(reader));
+      dst_layout = (VkImageLayout)get<uint32_t>(reader);
+      filter = (VkFilter)get<uint32_t>(reader);
+      vector<VkImageBlit> regions = get_array(reader, get_image_blit);
+
+      vkCmdBlitImage(
+        cmd,
+        image,
+        layout,
+        dst_image,
+        dst_layout,
+        (uint32_t)regions.size(),
+        regions.data(),
+        filter
+      );
+      break;
+    }
+
+    default:
+      // An op from a newer version of the capture layer. Skip it.
+      break;
+  }
+}
+
+void prepare_capture_replay(
+  headless_context* ctx,
+  const string& path,
+  capture_replay* replay
+) {
+  ifstream file;
+  capture_reader reader;
+  capture_opcode opcode;
+  uint32_t payload_size;
+  replay_frame frame;
+  bool recording;
+  replay_upload upload;
+  VkCommandBufferAllocateInfo alloc_info{};
+  VkCommandBufferBeginInfo begin_info{};
+  VkMemoryBarrier frame_barrier{};
+  VkFenceCreateInfo fence_info{};
+
+  //
+  // First, read the whole file into memory. Buffer contents are uploaded
+  // straight out of it when frames are replayed.
+  //
+
+  file.open(path, ios::binary | ios::ate);
+
+  if (!file.is_open()) {
+    throw runtime_error("failed to open capture file!");
+  }
+
+  replay->data.resize((size_t)file.tellg());
+  file.seekg(0);
+  file.read((char*)replay->data.data(), replay->data.size());
+
+  reader.data = &replay->data;
+  reader.position = 0;
+  reader.end = replay->data.size();
+
+  if (get<uint32_t>(&reader) != CAPTURE_FILE_MAGIC) {
+    throw runtime_error("file is not a capture!");
+  }
+
+  if (get<uint32_t>(&reader) != CAPTURE_FILE_VERSION) {
+    throw runtime_error("capture was made by a different version of the capture layer!");
+  }
+
+  alloc_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+  alloc_info.commandPool = ctx->command_pool;
+  alloc_info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+  alloc_info.commandBufferCount = 1;
+
+  // The same command buffers get submitted over and over, so they are
+  // recorded without the one time submit flag. A capture with fewer frames
+  // than we keep in flight resubmits a command buffer that's still pending,
+  // hence simultaneous use.
+  begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+  begin_info.flags = VK_COMMAND_BUFFER_USAGE_SIMULTANEOUS_USE_BIT;
+
+  // The captured app waited for each frame before starting the next, so
+  // its commands assume the previous frame is done with every resource.
+  // Replayed frames overlap on the queue, so each one starts with a full
+  // barrier against the work before it instead.
+  frame_barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+  frame_barrier.srcAccessMask = VK_ACCESS_MEMORY_WRITE_BIT;
+  frame_barrier.dstAccessMask = VK_ACCESS_MEMORY_READ_BIT | VK_ACCESS_MEMORY_WRITE_BIT;
+
+  //
+  // Now walk the ops. Resources are created as we meet them, and every
+  // command between two submits is recorded into one command buffer.
+  //
+
+  recording = false;
+
+  while (reader.position < replay->data.size()) {
+    reader.end = replay->data.size();
+    opcode = (capture_opcode)get<uint32_t>(&reader);
+    payload_size = get<uint32_t>(&reader);
+    reader.end = reader.position + payload_size;
+
+    if (reader.end > replay->data.size()) {
+      throw runtime_error("capture file is truncated!");
+    }
+
+    switch (opcode) {
+      case CAPTURE_OP_CREATE_BUFFER:
+        replay_create_buffer(ctx, replay, &reader);
+        break;
+
+      case CAPTURE_OP_CREATE_IMAGE:
+        replay_create_image(ctx, replay, &reader);
+        break;
+
+      case CAPTURE_OP_BUFFER_CONTENTS:
+        upload.buffer = get<uint32_t>(&reader);
+        upload.size = (size_t)get<uint64_t>(&reader);
+        upload.data_offset = reader.position;
+
+        if (upload.buffer >= replay->buffer_mapped.size() ||
+            replay->buffer_mapped[upload.buffer] == NULL ||
+            upload.data_offset + upload.size > reader.end) {
+          throw runtime_error("capture has contents for a buffer the CPU can't write!");
+        }
+
+        frame.uploads.push_back(upload);
+        break;
+
+      case CAPTURE_OP_SUBMIT:
+        // An empty submit has nothing to replay. Any uploads it had
+        // carry over to the next frame.
+        if (recording) {
+          vkEndCommandBuffer(frame.cmd);
+          replay->frames.push_back(frame);
+
+          frame = replay_frame();
+          recording = false;
+        }
+        break;
+
+      default:
+        if (!recording) {
+          if (vkAllocateCommandBuffers(ctx->device, &alloc_info, &frame.cmd) != VK_SUCCESS) {
+            throw runtime_error("failed to allocate replay command buffer!");
+          }
+
+          vkBeginCommandBuffer(frame.cmd, &begin_info);
+          vkCmdPipelineBarrier(
+            frame.cmd,
+            VK_PIPELINE_STAGE_ALL_COMMANDS_BIT,
+            VK_PIPELINE_STAGE_ALL_COMMANDS_BIT,
+            0,
+            1,
+            &frame_barrier,
+            0,
+            NULL,
+            0,
+            NULL
+          );
+          recording = true;
+        }
+
+        replay_command(replay, opcode, &reader, frame.cmd);
+        break;
+    }
+
+    reader.position = reader.end;
+  }
+
+  // A capture cut off mid frame still replays what it has.
+  if (recording) {
+    vkEndCommandBuffer(frame.cmd);
+    replay->frames.push_back(frame);
+  }
+
+  fence_info.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+
+  for (uint32_t i = 0; i < REPLAY_FRAMES_IN_FLIGHT; i++) {
+    if (vkCreateFence(ctx->device, &fence_info, NULL, &replay->fences[i]) != VK_SUCCESS) {
+      throw runtime_error("failed to create replay fence!");
+    }
+
+    replay->pending[i] = false;
+  }
+
+  replay->num_submitted = 0;
+}
+
+static void wait_replay_fence(headless_context* ctx, capture_replay* replay, uint32_t slot) {
+  if (!replay->pending[slot]) {
+    return;
+  }
+
+  vkWaitForFences(ctx->device, 1, &replay->fences[slot], VK_TRUE, UINT64_MAX);
+  vkResetFences(ctx->device, 1, &replay->fences[slot]);
+  replay->pending[slot] = false;
+}
+
+void finish_capture_replay(headless_context* ctx, capture_replay* replay) {
+  for (uint32_t i = 0; i < REPLAY_FRAMES_IN_FLIGHT; i++) {
+    wait_replay_fence(ctx, replay, i);
+  }
+}
+
+void run_replay_frame(
+  headless_context* ctx,
+  capture_replay* replay,
+  uint32_t frame
+) {
+  const replay_frame* next;
+  uint32_t slot;
+  VkSubmitInfo submit_info{};
+
+  next = &replay->frames[frame];
+  slot = (uint32_t)(replay->num_submitted % REPLAY_FRAMES_IN_FLIGHT);
+
+  // The host buffers are shared by every frame, so they can only be
+  // overwritten once nothing in flight reads them. Frames without uploads
+  // just need their fence back.
+  if (next->uploads.empty()) {
+    wait_replay_fence(ctx, replay, slot);
+  } else {
+    finish_capture_replay(ctx, replay);
+  }
+
+  for (const replay_upload& upload : next->uploads) {
+    memcpy(
+      replay->buffer_mapped[upload.buffer],
+      &replay->data[upload.data_offset],
+      upload.size
+    );
+  }
+
+  submit_info.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+  submit_info.commandBufferCount = 1;
+  submit_info.pCommandBuffers = &next->cmd;
+
+  if (vkQueueSubmit(ctx->queue, 1, &submit_info, replay->fences[slot]) != VK_SUCCESS) {
+    throw runtime_error("failed to submit replay frame!");
+  }
+
+  replay->pending[slot] = true;
+  replay->num_submitted++;
+}
+
+void destroy_capture_replay(headless_context* ctx, capture_replay* replay) {
+  vkDeviceWaitIdle(ctx->device);
+
+  for (uint32_t i = 0; i < REPLAY_FRAMES_IN_FLIGHT; i++) {
+    vkDestroyFence(ctx->device, replay->fences[i], NULL);
+  }
+
+  for (const replay_frame& frame : replay->frames) {
+    vkFreeCommandBuffers(ctx->device, ctx->command_pool, 1, &frame.cmd);
+  }
+
+  for (size_t i = 0; i < replay->buffers.size(); i++) {
+    vkDestroyBuffer(ctx->device, replay->buffers[i], NULL);
+    vkFreeMemory(ctx->device, replay->buffer_memory[i], NULL);
+  }
+
+  for (size_t i = 0; i < replay->images.size(); i++) {
+    vkDestroyImage(ctx->device, replay->images[i], NULL);
+    vkFreeMemory(ctx->device, replay->image_memory[i], NULL);
+  }
+}
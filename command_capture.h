@@ -0,0 +1,219 @@
+#ifndef COMMAND_CAPTURE_H
+#define COMMAND_CAPTURE_H
+
+#define GLFW_INCLUDE_VULKAN
+
+#include <GLFW/glfw3.h>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+#include "headless.h"
+
+//
+// A capture is a recording of the commands a renderer submitted, plus
+// everything needed to run them again: how each buffer and image was
+// created, and the contents of host written buffers the first time (and
+// every time after they change) the GPU reads them.
+//
+// Handles mean nothing outside the process that made them, so the capture
+// refers to resources by small integer ids. The replayer creates fresh
+// resources on whatever device it runs on and maps the ids back. That is
+// what lets a capture made on a desktop GPU be replayed on lavapipe.
+//
+// Recording works by calling the capture_cmd_* wrappers instead of the
+// vkCmd* functions. Each wrapper forwards to Vulkan and, if capture isn't
+// NULL, appends the command to the stream. So code can use the wrappers
+// all the time and only pay for capturing when it's turned on.
+//
+
+const uint32_t CAPTURE_FILE_VERSION = 1;
+
+enum capture_opcode : uint32_t {
+  CAPTURE_OP_CREATE_BUFFER = 1,
+  CAPTURE_OP_CREATE_IMAGE,
+  CAPTURE_OP_BUFFER_CONTENTS,
+  CAPTURE_OP_PIPELINE_BARRIER,
+  CAPTURE_OP_CLEAR_COLOR_IMAGE,
+  CAPTURE_OP_FILL_BUFFER,
+  CAPTURE_OP_COPY_BUFFER,
+  CAPTURE_OP_COPY_BUFFER_TO_IMAGE,
+  CAPTURE_OP_COPY_IMAGE_TO_BUFFER,
+  CAPTURE_OP_BLIT_IMAGE,
+  // Ends the current frame. Everything since the last submit is one
+  // command buffer.
+  CAPTURE_OP_SUBMIT,
+};
+
+struct captured_buffer {
+  VkDeviceSize size;
+  // Where the CPU writes the buffer's contents, or NULL if the buffer is
+  // only ever written by the GPU.
+  const uint8_t* host_data;
+  // Hash of the contents we last wrote to the stream, so unchanged
+  // contents aren't written again.
+  uint64_t contents_hash;
+  bool contents_captured;
+};
+
+struct command_capture {
+  std::vector<uint8_t> stream;
+  std::unordered_map<VkBuffer, uint32_t> buffer_ids;
+  std::unordered_map<VkImage, uint32_t> image_ids;
+  std::vector<captured_buffer> buffers;
+  uint32_t num_images;
+  uint32_t num_frames;
+};
+
+// How many replayed frames may be queued on the GPU at once. The CPU
+// records nothing during replay, so two is enough to keep the queue fed.
+const uint32_t REPLAY_FRAMES_IN_FLIGHT = 2;
+
+// The resources and pre-recorded command buffers for replaying a capture.
+struct replay_upload {
+  uint32_t buffer;
+  // Offset of the contents in the capture data.
+  size_t data_offset;
+  size_t size;
+};
+
+struct replay_frame {
+  VkCommandBuffer cmd;
+  // Host writes that have to land before the frame is submitted.
+  std::vector<replay_upload> uploads;
+};
+
+struct capture_replay {
+  std::vector<uint8_t> data;
+  std::vector<VkBuffer> buffers;
+  std::vector<VkDeviceMemory> buffer_memory;
+  std::vector<uint8_t*> buffer_mapped;
+  std::vector<VkImage> images;
+  std::vector<VkDeviceMemory> image_memory;
+  std::vector<replay_frame> frames;
+  // One fence per frame in flight, used round robin. pending says whether
+  // a fence's submit hasn't been waited on yet.
+  VkFence fences[REPLAY_FRAMES_IN_FLIGHT];
+  bool pending[REPLAY_FRAMES_IN_FLIGHT];
+  uint64_t num_submitted;
+};
+
+//
+// CAPTURE ROUTINES
+//
+
+void init_command_capture(command_capture* capture);
+
+// Resources must be registered before a wrapper uses them. host_data is
+// the persistently mapped pointer for host visible buffers, or NULL.
+void capture_buffer(
+  command_capture* capture,
+  VkBuffer buffer,
+  const VkBufferCreateInfo& create_info,
+  const void* host_data
+);
+void capture_image(
+  command_capture* capture,
+  VkImage image,
+  const VkImageCreateInfo& create_info
+);
+
+void capture_cmd_pipeline_barrier(
+  command_capture* capture,
+  VkCommandBuffer cmd,
+  VkPipelineStageFlags src_stage,
+  VkPipelineStageFlags dst_stage,
+  uint32_t num_buffer_barriers,
+  const VkBufferMemoryBarrier* buffer_barriers,
+  uint32_t num_image_barriers,
+  const VkImageMemoryBarrier* image_barriers
+);
+void capture_cmd_clear_color_image(
+  command_capture* capture,
+  VkCommandBuffer cmd,
+  VkImage image,
+  VkImageLayout layout,
+  const VkClearColorValue* color,
+  uint32_t num_ranges,
+  const VkImageSubresourceRange* ranges
+);
+void capture_cmd_fill_buffer(
+  command_capture* capture,
+  VkCommandBuffer cmd,
+  VkBuffer buffer,
+  VkDeviceSize offset,
+  VkDeviceSize size,
+  uint32_t data
+);
+void capture_cmd_copy_buffer(
+  command_capture* capture,
+  VkCommandBuffer cmd,
+  VkBuffer src,
+  VkBuffer dst,
+  uint32_t num_regions,
+  const VkBufferCopy* regions
+);
+void capture_cmd_copy_buffer_to_image(
+  command_capture* capture,
+  VkCommandBuffer cmd,
+  VkBuffer src,
+  VkImage dst,
+  VkImageLayout dst_layout,
+  uint32_t num_regions,
+  const VkBufferImageCopy* regions
+);
+void capture_cmd_copy_image_to_buffer(
+  command_capture* capture,
+  VkCommandBuffer cmd,
+  VkImage src,
+  VkImageLayout src_layout,
+  VkBuffer dst,
+  uint32_t num_regions,
+  const VkBufferImageCopy* regions
+);
+void capture_cmd_blit_image(
+  command_capture* capture,
+  VkCommandBuffer cmd,
+  VkImage src,
+  VkImageLayout src_layout,
+  VkImage dst,
+  VkImageLayout dst_layout,
+  uint32_t num_regions,
+  const VkImageBlit* regions,
+  VkFilter filter
+);
+
+// Marks the end of a frame. Call it when the recorded command buffer is
+// submitted.
+void capture_submit(command_capture* capture);
+
+void write_command_capture(const std::string& path, const command_capture* capture);
+
+//
+// REPLAY ROUTINES
+//
+
+// Loads a capture, creates its resources on ctx's device and records one
+// command buffer per frame.
+void prepare_capture_replay(
+  headless_context* ctx,
+  const std::string& path,
+  capture_replay* replay
+);
+
+// Uploads the frame's host data and submits it without waiting for it.
+// Up to REPLAY_FRAMES_IN_FLIGHT frames can be queued at once; a frame with
+// uploads first waits for all of them, since they may read the buffers.
+void run_replay_frame(
+  headless_context* ctx,
+  capture_replay* replay,
+  uint32_t frame
+);
+
+// Waits for every submitted frame to finish, e.g. before stopping a timer.
+void finish_capture_replay(headless_context* ctx, capture_replay* replay);
+
+void destroy_capture_replay(headless_context* ctx, capture_replay* replay);
+
+#endif
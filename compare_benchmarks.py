@@ -0,0 +1,84 @@
+#!/usr/bin/env python3
+
+# Compares two results files written by benchmark.out and flags any scene
+# that got slower, or whose golden image check failed.
+#
+# Usage: compare_benchmarks.py baseline.json current.json [--threshold 0.05]
+#
+# Exits with 1 if anything regressed, so it can gate a CI job.
+
+import argparse
+import json
+import statistics
+import sys
+
+
+def median(values):
+    # A scene without timestamps reports negative GPU times.
+    values = [v for v in values if v >= 0]
+    return statistics.median(values) if values else None
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument("baseline")
+    parser.add_argument("current")
+    parser.add_argument(
+        "--threshold",
+        type=float,
+        default=0.05,
+        help="fractional slowdown of the median that counts as a regression",
+    )
+    args = parser.parse_args()
+
+    with open(args.baseline) as f:
+        baseline = json.load(f)
+    with open(args.current) as f:
+        current = json.load(f)
+
+    if baseline["device"] != current["device"]:
+        print("warning: comparing %s against %s"
+              % (baseline["device"], current["device"]))
+
+    baseline_scenes = {s["name"]: s for s in baseline["scenes"]}
+    regressed = False
+
+    print("%-16s %8s %10s %10s %8s" % ("scene", "timer", "baseline", "current", "change"))
+
+    for scene in current["scenes"]:
+        name = scene["name"]
+
+        if scene["golden"] == "fail":
+            print("%-16s golden image mismatch (max difference %d)"
+                  % (name, scene["max_difference"]))
+            regressed = True
+        elif scene["golden"] == "missing":
+            print("%-16s no golden image to check against" % name)
+            regressed = True
+
+        if name not in baseline_scenes:
+            print("%-16s new scene, nothing to compare against" % name)
+            continue
+
+        for timer in ("cpu_ms", "gpu_ms"):
+            old = median(baseline_scenes[name][timer])
+            new = median(scene[timer])
+
+            if old is None or new is None or old == 0:
+                continue
+
+            change = (new - old) / old
+            flag = ""
+
+            if change > args.threshold:
+                flag = "  REGRESSION"
+                regressed = True
+
+            print("%-16s %8s %10.3f %10.3f %+7.1f%%%s"
+                  % (name, timer, old, new, change * 100, flag))
+
+    return 1 if regressed else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,249 @@
+#include "defragmenter.h"
+
+#include <stdexcept>
+#include <algorithm>
+#include <map>
+
+using namespace std;
+
+void create_defragmenter(
+  VkDevice device,
+  memory_allocator* allocator,
+  shared_queue* transfer_queue,
+  uint32_t transfer_family,
+  uint32_t frames_in_flight,
+  defragmenter* defrag
+) {
+  VkCommandPoolCreateInfo pool_info{};
+  VkCommandBufferAllocateInfo alloc_info{};
+  VkFenceCreateInfo fence_info{};
+
+  defrag->device = device;
+  defrag->allocator = allocator;
+  defrag->transfer_queue = transfer_queue;
+  defrag->frames_in_flight = frames_in_flight;
+  defrag->frame = 0;
+  defrag->submitted = false;
+  defrag->moves.clear();
+  defrag->retired.clear();
+
+  // The command buffer is rerecorded every step.
+  pool_info.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+  pool_info.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
+  pool_info.queueFamilyIndex = transfer_family;
+
+  if (vkCreateCommandPool(device, &pool_info, NULL, &(defrag->command_pool)) != VK_SUCCESS) {
+    throw runtime_error("failed to create defragmenter command pool!");
+  }
+
+  alloc_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+  alloc_info.commandPool = defrag->command_pool;
+  alloc_info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+  alloc_info.commandBufferCount = 1;
+
+  if (vkAllocateCommandBuffers(device, &alloc_info, &(defrag->cmd)) != VK_SUCCESS) {
+    throw runtime_error("failed to allocate defragmenter command buffer!");
+  }
+
+  fence_info.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+
+  if (vkCreateFence(device, &fence_info, NULL, &(defrag->fence)) != VK_SUCCESS) {
+    throw runtime_error("failed to create defragmenter fence!");
+  }
+}
+
+// Switches every finished move over to its new place. The copies must be
+// done.
+static void finish_moves(defragmenter* defrag) {
+  for (defrag_move& move : defrag->moves) {
+    if (move.cancelled) {
+      // Nobody wants the data anymore, and the copy is done with both.
+      free_allocation(defrag->allocator, move.source);
+      free_allocation(defrag->allocator, move.target);
+      continue;
+    }
+
+    // Afterwards, the target holds the old space, which frames recorded
+    // before the callback may still be reading.
+    swap_allocation_placement(defrag->allocator, move.source, move.target);
+    move.source->on_relocate(move.source, move.source->relocation_user_data);
+
+    defrag->retired.push_back({ move.target, defrag->frame + defrag->frames_in_flight });
+  }
+
+  defrag->moves.clear();
+}
+
+static void free_retired(defragmenter* defrag) {
+  size_t i;
+
+  i = 0;
+  while (i < defrag->retired.size()) {
+    if (defrag->retired[i].free_frame <= defrag->frame) {
+      free_allocation(defrag->allocator, defrag->retired[i].allocation);
+      defrag->retired.erase(defrag->retired.begin() + i);
+    } else {
+      i++;
+    }
+  }
+}
+
+// Picks the allocations to move this step, emptiest blocks first. The
+// blocks they're in go in avoid, so nothing gets moved into them.
+static void choose_moves(
+  defragmenter* defrag,
+  vector<gpu_allocation*>* sources,
+  vector<memory_block*>* avoid
+) {
+  memory_allocator* allocator;
+  map<uint32_t, vector<memory_block*>> sparse;
+  VkDeviceSize bytes;
+
+  allocator = defrag->allocator;
+  lock_guard<mutex> lock(allocator->mutex);
+
+  // By memory type, since an allocation can only move to a block of its
+  // own type.
+  for (memory_block* block : allocator->blocks) {
+    if (block->kind == ALLOCATION_BUFFER &&
+        !block->dedicated &&
+        block->used < block->size * DEFRAG_SPARSE_THRESHOLD) {
+      sparse[block->memory_type].push_back(block);
+    }
+  }
+
+  // The fullest sparse block of each type is left alone to take what the
+  // others of its type give up. Otherwise two half empty blocks could
+  // trade allocations forever.
+  for (auto& [memory_type, blocks] : sparse) {
+    if (blocks.size() < 2) {
+      continue;
+    }
+
+    sort(blocks.begin(), blocks.end(), [](const memory_block* a, const memory_block* b) {
+      return a->used < b->used;
+    });
+    blocks.pop_back();
+
+    avoid->insert(avoid->end(), blocks.begin(), blocks.end());
+  }
+
+  sort(avoid->begin(), avoid->end(), [](const memory_block* a, const memory_block* b) {
+    return a->used < b->used;
+  });
+  bytes = 0;
+
+  for (memory_block* block : *avoid) {
+    for (gpu_allocation* allocation : block->allocations) {
+      if (sources->size() == DEFRAG_MAX_MOVES_PER_FRAME ||
+          bytes + allocation->size > DEFRAG_MAX_BYTES_PER_FRAME) {
+        return;
+      }
+
+      if (allocation->on_relocate != NULL) {
+        sources->push_back(allocation);
+        bytes += allocation->size;
+      }
+    }
+  }
+}
+
+static void start_moves(defragmenter* defrag) {
+  vector<gpu_allocation*> sources;
+  vector<memory_block*> avoid;
+  gpu_allocation* target;
+  VkCommandBufferBeginInfo begin_info{};
+  VkBufferCopy region{};
+  queue_submission submission{};
+
+  choose_moves(defrag, &sources, &avoid);
+
+  for (gpu_allocation* source : sources) {
+    target = allocate_relocation_target(defrag->allocator, source, avoid);
+
+    // Everything else is full. Maybe next frame.
+    if (target == NULL) {
+      break;
+    }
+
+    defrag->moves.push_back({ source, target, false });
+  }
+
+  if (defrag->moves.empty()) {
+    return;
+  }
+
+  vkResetCommandBuffer(defrag->cmd, 0);
+
+  begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+  begin_info.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+  vkBeginCommandBuffer(defrag->cmd, &begin_info);
+
+  for (const defrag_move& move : defrag->moves) {
+    region.srcOffset = move.source->offset;
+    region.dstOffset = move.target->offset;
+    region.size = move.source->size;
+
+    vkCmdCopyBuffer(defrag->cmd, move.source->buffer, move.target->buffer, 1, &region);
+  }
+
+  vkEndCommandBuffer(defrag->cmd);
+
+  submission.command_buffers[0] = defrag->cmd;
+  submission.num_command_buffers = 1;
+  submission.fence = defrag->fence;
+
+  vkResetFences(defrag->device, 1, &(defrag->fence));
+
+  submit_to_queue(defrag->transfer_queue, submission);
+
+  defrag->submitted = true;
+}
+
+void defragment_step(defragmenter* defrag) {
+  defrag->frame++;
+
+  // Never wait on the copies; if they aren't done, try next frame.
+  if (defrag->submitted) {
+    if (vkGetFenceStatus(defrag->device, defrag->fence) != VK_SUCCESS) {
+      free_retired(defrag);
+      return;
+    }
+
+    defrag->submitted = false;
+    finish_moves(defrag);
+  }
+
+  free_retired(defrag);
+  start_moves(defrag);
+}
+
+void free_movable_allocation(defragmenter* defrag, gpu_allocation* allocation) {
+  for (defrag_move& move : defrag->moves) {
+    if (move.source == allocation) {
+      move.cancelled = true;
+      return;
+    }
+  }
+
+  free_allocation(defrag->allocator, allocation);
+}
+
+void destroy_defragmenter(defragmenter* defrag) {
+  if (defrag->submitted) {
+    // The copies may not have been flushed yet.
+    flush_queue(defrag->transfer_queue);
+    vkWaitForFences(defrag->device, 1, &(defrag->fence), VK_TRUE, UINT64_MAX);
+    defrag->submitted = false;
+  }
+
+  // Nothing is in flight anymore, so there's no reason to hold on to old
+  // space. Moves that were copied are still finished, since the owners
+  // may have kept the allocations.
+  finish_moves(defrag);
+  defrag->frame += defrag->frames_in_flight;
+  free_retired(defrag);
+
+  vkDestroyFence(defrag->device, defrag->fence, NULL);
+  vkDestroyCommandPool(defrag->device, defrag->command_pool, NULL);
+}
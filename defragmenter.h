@@ -0,0 +1,93 @@
+#ifndef DEFRAGMENTER_H
+#define DEFRAGMENTER_H
+
+#define GLFW_INCLUDE_VULKAN
+
+#include <GLFW/glfw3.h>
+#include <cstdint>
+#include <vector>
+
+#include "memory_allocator.h"
+#include "shared_queue.h"
+
+//
+// As allocations come and go, blocks end up with a few live allocations
+// scattered among holes. Every block still holds its full 64 MiB, so in a
+// long session the heap fills up with mostly empty blocks until new
+// allocations fail, or the driver starts spilling them to system memory.
+//
+// The defragmenter fixes this a little at a time. Each frame it picks a
+// few allocations in the emptiest blocks and copies them into free space
+// in fuller ones, on the transfer queue so the copies don't hold up
+// rendering. Once a copy is done, the allocation is switched over and its
+// owner's relocation callback is called to patch anything that points at
+// it. The old space is freed once no frame in flight can still be using
+// it, and a block that's left with nothing in it goes back to the driver.
+//
+// Only buffer allocations with a relocation callback (see
+// gpu_allocation::on_relocate) are moved. Images would have to be
+// recreated and have their layouts tracked, so they stay put.
+//
+
+// Blocks less full than this are emptied out.
+const double DEFRAG_SPARSE_THRESHOLD = 0.5;
+// The most we move in one frame, so a step never costs much.
+const uint32_t DEFRAG_MAX_MOVES_PER_FRAME = 16;
+const VkDeviceSize DEFRAG_MAX_BYTES_PER_FRAME = 8 * 1024 * 1024;
+
+struct defrag_move {
+  // The allocation being moved, and the space it's being moved into.
+  gpu_allocation* source;
+  gpu_allocation* target;
+  // Set if the source was freed while the copy was in flight.
+  bool cancelled;
+};
+
+// Space that may still be in use by a frame in flight.
+struct retired_allocation {
+  gpu_allocation* allocation;
+  uint64_t free_frame;
+};
+
+struct defragmenter {
+  VkDevice device;
+  memory_allocator* allocator;
+  // The copies are flushed along with everything else on the queue.
+  shared_queue* transfer_queue;
+  uint32_t frames_in_flight;
+  uint64_t frame;
+
+  VkCommandPool command_pool;
+  VkCommandBuffer cmd;
+  // Signaled when the last step's copies are done.
+  VkFence fence;
+  bool submitted;
+
+  // The moves the last step submitted.
+  std::vector<defrag_move> moves;
+  std::vector<retired_allocation> retired;
+};
+
+// transfer_family is the family transfer_queue belongs to. The allocator
+// must have been created with it as one of its queue families.
+void create_defragmenter(
+  VkDevice device,
+  memory_allocator* allocator,
+  shared_queue* transfer_queue,
+  uint32_t transfer_family,
+  uint32_t frames_in_flight,
+  defragmenter* defrag
+);
+// Waits for the copies in flight and frees everything still held.
+void destroy_defragmenter(defragmenter* defrag);
+
+// Call once a frame, before recording it. Finishes the moves whose copies
+// are done (calling their relocation callbacks), frees old space and
+// starts the next batch of moves.
+void defragment_step(defragmenter* defrag);
+
+// Frees an allocation that the defragmenter might be moving. Movable
+// allocations must be freed with this instead of free_allocation.
+void free_movable_allocation(defragmenter* defrag, gpu_allocation* allocation);
+
+#endif
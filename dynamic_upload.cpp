@@ -0,0 +1,185 @@
+#include "dynamic_upload.h"
+
+#include <stdexcept>
+
+using namespace std;
+
+bool find_direct_upload_heap(const memory_allocator* allocator, uint32_t* heap) {
+  const VkPhysicalDeviceMemoryProperties* memory;
+
+  memory = &allocator->memory_properties;
+
+  for (uint32_t i = 0; i < memory->memoryTypeCount; i++) {
+    if ((allocator->buffer_type_bits & (1 << i)) &&
+        (memory->memoryTypes[i].propertyFlags & DIRECT_UPLOAD_PROPERTIES) == DIRECT_UPLOAD_PROPERTIES) {
+      *heap = memory->memoryTypes[i].heapIndex;
+      return true;
+    }
+  }
+
+  return false;
+}
+
+upload_path choose_upload_path(
+  const memory_allocator* allocator,
+  const memory_budget_tracker* budget,
+  VkDeviceSize size
+) {
+  uint32_t heap_index;
+  const heap_budget* heap;
+  VkDeviceSize heap_budget_bytes;
+
+  if (!find_direct_upload_heap(allocator, &heap_index)) {
+    return UPLOAD_STAGED;
+  }
+
+  heap = &budget->heaps[heap_index];
+
+  // Before the first update_memory_budget, all we know is the heap size.
+  heap_budget_bytes = heap->budget;
+  if (heap_budget_bytes == 0) {
+    heap_budget_bytes = (VkDeviceSize)(heap->size * MEMORY_FALLBACK_BUDGET);
+  }
+
+  // A 256 MiB BAR window would fill up with a few of these, so anything
+  // too big for what's left goes through staging.
+  if (heap->usage + size > heap_budget_bytes * MEMORY_PRESSURE_THRESHOLD) {
+    return UPLOAD_STAGED;
+  }
+
+  return UPLOAD_DIRECT;
+}
+
+static VkDeviceSize dynamic_frame_size(const memory_allocator* allocator, VkDeviceSize size) {
+  return (size + allocator->buffer_alignment - 1) /
+    allocator->buffer_alignment * allocator->buffer_alignment;
+}
+
+void create_dynamic_buffer(
+  memory_allocator* allocator,
+  const memory_budget_tracker* budget,
+  VkDeviceSize size,
+  uint32_t frames_in_flight,
+  memory_category category,
+  dynamic_buffer* buffer
+) {
+  upload_path path;
+
+  path = choose_upload_path(
+    allocator,
+    budget,
+    dynamic_frame_size(allocator, size) * frames_in_flight
+  );
+
+  create_dynamic_buffer_on_path(allocator, size, frames_in_flight, path, category, buffer);
+}
+
+void create_dynamic_buffer_on_path(
+  memory_allocator* allocator,
+  VkDeviceSize size,
+  uint32_t frames_in_flight,
+  upload_path path,
+  memory_category category,
+  dynamic_buffer* buffer
+) {
+  *buffer = {};
+  buffer->allocator = allocator;
+  buffer->frames_in_flight = frames_in_flight;
+  buffer->frame_size = dynamic_frame_size(allocator, size);
+  buffer->path = path;
+
+  if (buffer->path == UPLOAD_DIRECT) {
+    // The heap can look like it has room and still refuse a new block
+    // (the BAR window is small and others use it too), so be ready to
+    // stage after all.
+    try {
+      buffer->device = allocate_buffer(
+        allocator,
+        buffer->frame_size * frames_in_flight,
+        DIRECT_UPLOAD_PROPERTIES,
+        category
+      );
+    } catch (const runtime_error&) {
+      buffer->path = UPLOAD_STAGED;
+    }
+  }
+
+  if (buffer->path == UPLOAD_STAGED) {
+    buffer->device = allocate_buffer(
+      allocator,
+      buffer->frame_size * frames_in_flight,
+      VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+      category
+    );
+    buffer->staging = allocate_buffer(
+      allocator,
+      buffer->frame_size * frames_in_flight,
+      VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+      MEMORY_STAGING
+    );
+  }
+}
+
+void destroy_dynamic_buffer(dynamic_buffer* buffer) {
+  if (buffer->staging != NULL) {
+    free_allocation(buffer->allocator, buffer->staging);
+  }
+
+  free_allocation(buffer->allocator, buffer->device);
+}
+
+uint8_t* begin_dynamic_buffer_frame(dynamic_buffer* buffer, uint32_t frame_index) {
+  buffer->frame_index = frame_index % buffer->frames_in_flight;
+
+  if (buffer->path == UPLOAD_DIRECT) {
+    return buffer->device->mapped + dynamic_buffer_offset(buffer) - buffer->device->offset;
+  }
+
+  return buffer->staging->mapped + buffer->frame_index * buffer->frame_size;
+}
+
+void flush_dynamic_buffer(
+  dynamic_buffer* buffer,
+  VkCommandBuffer cmd,
+  VkDeviceSize size,
+  VkPipelineStageFlags dst_stage,
+  VkAccessFlags dst_access
+) {
+  VkBufferCopy region{};
+  VkBufferMemoryBarrier barrier{};
+
+  // Coherent memory, and vkQueueSubmit makes host writes visible to the
+  // device, so there's nothing to do.
+  if (buffer->path == UPLOAD_DIRECT || size == 0) {
+    return;
+  }
+
+  region.srcOffset = buffer->staging->offset + buffer->frame_index * buffer->frame_size;
+  region.dstOffset = dynamic_buffer_offset(buffer);
+  region.size = size;
+
+  vkCmdCopyBuffer(cmd, buffer->staging->buffer, buffer->device->buffer, 1, &region);
+
+  barrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+  barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+  barrier.dstAccessMask = dst_access;
+  barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+  barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+  barrier.buffer = buffer->device->buffer;
+  barrier.offset = region.dstOffset;
+  barrier.size = size;
+
+  vkCmdPipelineBarrier(
+    cmd,
+    VK_PIPELINE_STAGE_TRANSFER_BIT,
+    dst_stage,
+    0,
+    0, NULL,
+    1, &barrier,
+    0, NULL
+  );
+}
+
+VkDeviceSize dynamic_buffer_offset(const dynamic_buffer* buffer) {
+  return buffer->device->offset + buffer->frame_index * buffer->frame_size;
+}
@@ -0,0 +1,111 @@
+#ifndef DYNAMIC_UPLOAD_H
+#define DYNAMIC_UPLOAD_H
+
+#define GLFW_INCLUDE_VULKAN
+
+#include <GLFW/glfw3.h>
+#include <cstdint>
+
+#include "memory_allocator.h"
+#include "memory_budget.h"
+
+//
+// Data the CPU rewrites every frame (per draw data, particles, skinning
+// matrices...) normally takes two trips: the CPU writes it into host
+// visible memory, then a copy moves it into device local memory where the
+// GPU can read it quickly.
+//
+// With resizable BAR, some memory is both device local and host visible,
+// so the CPU can write straight into VRAM and the copy goes away. Without
+// it, most GPUs still expose a 256 MiB window of VRAM that way, which is
+// fine for small buffers as long as we don't fill it. Either way, the
+// memory has to be shared with everything else in the heap, so we only
+// use it while the heap's budget has room, and stage otherwise.
+//
+// CPU writes to this memory go over the bus, uncached and write combined.
+// Write it sequentially and never read it back.
+//
+
+const VkMemoryPropertyFlags DIRECT_UPLOAD_PROPERTIES =
+  VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT |
+  VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+  VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+
+enum upload_path {
+  // The CPU writes straight into device local memory.
+  UPLOAD_DIRECT,
+  // The CPU writes into host memory and a copy moves it to the device.
+  UPLOAD_STAGED,
+};
+
+struct dynamic_buffer {
+  memory_allocator* allocator;
+  upload_path path;
+  VkDeviceSize frame_size;
+  uint32_t frames_in_flight;
+  uint32_t frame_index;
+
+  // Where the GPU reads from, one frame_size slice per frame in flight so
+  // a frame never overwrites data an earlier one is still reading. Host
+  // visible on the direct path.
+  gpu_allocation* device;
+  // The staged path only: where the CPU writes, sliced the same way.
+  gpu_allocation* staging;
+};
+
+// Returns true and the heap if the device has memory with
+// DIRECT_UPLOAD_PROPERTIES.
+bool find_direct_upload_heap(const memory_allocator* allocator, uint32_t* heap);
+
+// Picks the path for size bytes of new per frame data: direct if the
+// device has the memory and its heap would stay under
+// MEMORY_PRESSURE_THRESHOLD of its budget with the data in it.
+upload_path choose_upload_path(
+  const memory_allocator* allocator,
+  const memory_budget_tracker* budget,
+  VkDeviceSize size
+);
+
+// size is per frame. Falls back to staging if the direct memory can't be
+// allocated.
+void create_dynamic_buffer(
+  memory_allocator* allocator,
+  const memory_budget_tracker* budget,
+  VkDeviceSize size,
+  uint32_t frames_in_flight,
+  memory_category category,
+  dynamic_buffer* buffer
+);
+// Like create_dynamic_buffer, but on path whatever choose_upload_path
+// would say, for comparing the two. UPLOAD_DIRECT still falls back to
+// staging if the memory can't be allocated, so check buffer->path.
+void create_dynamic_buffer_on_path(
+  memory_allocator* allocator,
+  VkDeviceSize size,
+  uint32_t frames_in_flight,
+  upload_path path,
+  memory_category category,
+  dynamic_buffer* buffer
+);
+void destroy_dynamic_buffer(dynamic_buffer* buffer);
+
+// Returns where to write this frame's data. Call once the frame's fence
+// says the GPU is done with the last frame that used this index.
+uint8_t* begin_dynamic_buffer_frame(dynamic_buffer* buffer, uint32_t frame_index);
+
+// Makes the first size bytes written this frame visible to the GPU at
+// dst_stage and dst_access. On the staged path that records a copy, so
+// it must be outside of a render pass, before anything reads the data.
+void flush_dynamic_buffer(
+  dynamic_buffer* buffer,
+  VkCommandBuffer cmd,
+  VkDeviceSize size,
+  VkPipelineStageFlags dst_stage,
+  VkAccessFlags dst_access
+);
+
+// Where this frame's data is for the GPU: a range of the device
+// allocation's buffer, starting at this offset.
+VkDeviceSize dynamic_buffer_offset(const dynamic_buffer* buffer);
+
+#endif
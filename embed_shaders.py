@@ -0,0 +1,131 @@
+#!/usr/bin/env python3
+
+# Compiles every shader in shaders/ with glslc and writes the SPIR-V into
+# a C++ header as constant arrays, along with a registry of them by name.
+# shader_library.cpp includes the header, so shaders are part of the
+# binary and loading them needs no file access at all. Other files, like
+# the .glsl files shaders #include, are left to glslc.
+#
+# Usage: embed_shaders.py [--shader-dir shaders] [--output generated/embedded_shaders.h]
+#
+# Run by build.sh before compiling. The header is only rewritten when its
+# contents change, so unchanged shaders don't cause a rebuild.
+
+import argparse
+import os
+import re
+import subprocess
+import sys
+import tempfile
+
+SHADER_EXTENSIONS = (".vert", ".frag", ".comp", ".geom", ".tesc", ".tese")
+
+# Words per line in the generated arrays.
+WORDS_PER_LINE = 8
+
+
+def compile_shader(glslc, path):
+    with tempfile.TemporaryDirectory() as temp_dir:
+        output = os.path.join(temp_dir, "shader.spv")
+        try:
+            result = subprocess.run([glslc, "-O", path, "-o", output])
+        except FileNotFoundError:
+            sys.exit("%s not found, it comes with the Vulkan SDK (or pass --glslc)" % glslc)
+
+        if result.returncode != 0:
+            sys.exit("failed to compile %s" % path)
+
+        with open(output, "rb") as f:
+            return f.read()
+
+
+def array_name(shader_name):
+    return "SHADER_" + re.sub(r"[^0-9a-zA-Z]", "_", shader_name).upper()
+
+
+def generate_header(shaders):
+    lines = [
+        "// Generated by embed_shaders.py. Do not edit, and don't include it",
+        "// anywhere but shader_library.cpp.",
+        "",
+        "#ifndef EMBEDDED_SHADERS_H",
+        "#define EMBEDDED_SHADERS_H",
+        "",
+        "#include \"../shader_library.h\"",
+        "",
+    ]
+
+    for name, code in shaders:
+        words = [int.from_bytes(code[i:i + 4], "little") for i in range(0, len(code), 4)]
+
+        lines.append("// %s" % name)
+        lines.append("alignas(16) constexpr uint32_t %s[] = {" % array_name(name))
+
+        for i in range(0, len(words), WORDS_PER_LINE):
+            chunk = words[i:i + WORDS_PER_LINE]
+            lines.append("  " + " ".join("0x%08x," % word for word in chunk))
+
+        lines.append("};")
+        lines.append("")
+
+    lines.append("constexpr embedded_shader EMBEDDED_SHADERS[] = {")
+
+    for name, code in shaders:
+        lines.append("  { \"%s\", %s, sizeof(%s) }," % (name, array_name(name), array_name(name)))
+
+    # An array can't be empty, so an empty registry gets a terminator.
+    if not shaders:
+        lines.append("  { nullptr, nullptr, 0 },")
+
+    lines.append("};")
+    lines.append("")
+    lines.append("constexpr size_t NUM_EMBEDDED_SHADERS = %d;" % len(shaders))
+    lines.append("")
+    lines.append("#endif")
+    lines.append("")
+
+    return "\n".join(lines)
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument("--shader-dir", default="shaders")
+    parser.add_argument("--output", default="generated/embedded_shaders.h")
+    parser.add_argument("--glslc", default="glslc")
+    args = parser.parse_args()
+
+    shaders = []
+
+    for file_name in sorted(os.listdir(args.shader_dir)):
+        path = os.path.join(args.shader_dir, file_name)
+
+        if file_name.endswith(SHADER_EXTENSIONS):
+            code = compile_shader(args.glslc, path)
+        elif file_name.endswith(".spv"):
+            # Already compiled elsewhere. Registered without the .spv.
+            with open(path, "rb") as f:
+                code = f.read()
+            file_name = file_name[:-len(".spv")]
+        else:
+            continue
+
+        if len(code) % 4 != 0:
+            sys.exit("%s is not valid SPIR-V" % path)
+
+        shaders.append((file_name, code))
+
+    header = generate_header(shaders)
+
+    if os.path.exists(args.output):
+        with open(args.output) as f:
+            if f.read() == header:
+                return
+
+    os.makedirs(os.path.dirname(args.output) or ".", exist_ok=True)
+
+    with open(args.output, "w") as f:
+        f.write(header)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,129 @@
+#include "frame_arena.h"
+
+#include <stdexcept>
+#include <algorithm>
+
+using namespace std;
+
+// Handed out to each frame_arenas, starting at 1 so 0 means none.
+static atomic<uint64_t> next_arenas_id(1);
+
+// The arenas the calling thread last registered with, and its index into
+// them.
+static thread_local uint64_t arena_thread_owner = 0;
+static thread_local uint32_t arena_thread = 0;
+
+void create_frame_arenas(uint32_t frames_in_flight, frame_arenas* arenas) {
+  if (frames_in_flight > MAX_ARENA_FRAMES) {
+    throw runtime_error("too many frames in flight for the frame arenas!");
+  }
+
+  arenas->id = next_arenas_id.fetch_add(1);
+  arenas->frames_in_flight = frames_in_flight;
+  arenas->frame_index = 0;
+  arenas->switching_frames = false;
+  arenas->num_threads = 0;
+  arenas->last_stats = {};
+  arenas->high_water = 0;
+
+  // The memory comes when a thread registers, so threads that never do
+  // cost nothing.
+  for (uint32_t frame = 0; frame < MAX_ARENA_FRAMES; frame++) {
+    for (uint32_t thread = 0; thread < MAX_ARENA_THREADS; thread++) {
+      arenas->arenas[frame][thread] = {};
+    }
+  }
+}
+
+void destroy_frame_arenas(frame_arenas* arenas) {
+  for (uint32_t frame = 0; frame < arenas->frames_in_flight; frame++) {
+    for (uint32_t thread = 0; thread < MAX_ARENA_THREADS; thread++) {
+      delete[] arenas->arenas[frame][thread].memory;
+    }
+  }
+}
+
+void register_arena_thread(frame_arenas* arenas) {
+  uint32_t index;
+
+  if (arena_thread_owner == arenas->id) {
+    return;
+  }
+
+  index = arenas->num_threads.fetch_add(1);
+
+  if (index >= MAX_ARENA_THREADS) {
+    throw runtime_error("too many threads for the frame arenas!");
+  }
+
+  // The only time the arenas touch the heap. Nothing else looks at the
+  // thread's memory until it allocates, after this returns.
+  for (uint32_t frame = 0; frame < arenas->frames_in_flight; frame++) {
+    arenas->arenas[frame][index].memory = new uint8_t[FRAME_ARENA_SIZE];
+  }
+
+  arena_thread_owner = arenas->id;
+  arena_thread = index;
+}
+
+void begin_arena_frame(frame_arenas* arenas, uint32_t frame_index) {
+  arena_frame_stats stats{};
+  frame_arena* arena;
+  uint32_t num_threads;
+
+  arenas->switching_frames.store(true, memory_order_relaxed);
+  arenas->frame_index = frame_index % arenas->frames_in_flight;
+  num_threads = min(arenas->num_threads.load(), MAX_ARENA_THREADS);
+
+  for (uint32_t thread = 0; thread < num_threads; thread++) {
+    arena = &arenas->arenas[arenas->frame_index][thread];
+
+    stats.num_allocations += arena->num_allocations;
+    stats.bytes += arena->head;
+    stats.max_thread_bytes = max(stats.max_thread_bytes, arena->head);
+
+    arena->head = 0;
+    arena->num_allocations = 0;
+  }
+
+  arenas->last_stats = stats;
+  arenas->high_water = max(arenas->high_water, stats.max_thread_bytes);
+  arenas->switching_frames.store(false, memory_order_relaxed);
+}
+
+void* frame_alloc(frame_arenas* arenas, size_t size, size_t alignment) {
+  frame_arena* arena;
+  uintptr_t base;
+  size_t offset;
+
+  if (arena_thread_owner != arenas->id) {
+    throw runtime_error("thread allocated from the frame arenas without registering!");
+  }
+
+  if (arenas->switching_frames.load(memory_order_relaxed)) {
+    throw runtime_error("frame_alloc ran during begin_arena_frame!");
+  }
+
+  arena = &arenas->arenas[arenas->frame_index][arena_thread];
+  // It's the address that has to be aligned, and the arena itself only
+  // comes aligned for the fundamental types.
+  base = (uintptr_t)arena->memory;
+  offset = (base + arena->head + alignment - 1) / alignment * alignment - base;
+
+  // Falling back to malloc would hide the problem, so make it loud.
+  if (offset + size > FRAME_ARENA_SIZE) {
+    throw runtime_error("frame arena is full, raise FRAME_ARENA_SIZE!");
+  }
+
+  arena->head = offset + size;
+  arena->num_allocations++;
+
+  return arena->memory + offset;
+}
+
+void publish_arena_stats(const frame_arenas* arenas, gpu_profiler* profiler) {
+  set_profiler_counter(profiler, "arena_allocations", arenas->last_stats.num_allocations);
+  set_profiler_counter(profiler, "arena_kb", arenas->last_stats.bytes / 1024.0);
+  set_profiler_counter(profiler, "arena_max_thread_kb", arenas->last_stats.max_thread_bytes / 1024.0);
+  set_profiler_counter(profiler, "arena_high_water_kb", arenas->high_water / 1024.0);
+}
@@ -0,0 +1,118 @@
+#ifndef FRAME_ARENA_H
+#define FRAME_ARENA_H
+
+#include <cstdint>
+#include <cstddef>
+#include <atomic>
+#include <new>
+#include <type_traits>
+
+#include "gpu_profiler.h"
+
+//
+// Most of what the CPU allocates in a frame (draw lists, sort keys, per
+// draw data on its way to the GPU...) is dead by the end of it. Getting
+// it from malloc means a lock, a search for a free block and a free for
+// every piece, and the lock is shared by every thread, so the more
+// threads we have the more they wait on each other.
+//
+// A frame arena is one big block, allocated once per thread, that hands
+// out memory by bumping a pointer, and is emptied all at once when its
+// frame comes around again. Each thread gets its own arenas, so
+// allocating takes no locks, and only a relaxed atomic load to catch
+// misuse. There is one set of arenas per frame in flight, since data
+// handed to the GPU or another thread must stay put until that frame is
+// done.
+//
+// That only works because switching frames never overlaps allocating:
+// begin_arena_frame empties every thread's arena, so no thread may be in
+// frame_alloc while it runs. The frame's jobs have to be joined before
+// the next frame begins, which a frame loop does anyway.
+//
+// Nothing in an arena is ever destructed, so only trivially destructible
+// types belong in one.
+//
+
+// How much each thread can allocate per frame.
+const size_t FRAME_ARENA_SIZE = 4 * 1024 * 1024;
+// How many threads can have arenas, and the most frames in flight.
+const uint32_t MAX_ARENA_THREADS = 16;
+const uint32_t MAX_ARENA_FRAMES = 4;
+
+struct frame_arena {
+  uint8_t* memory;
+  size_t head;
+
+  // Reset with the arena.
+  uint32_t num_allocations;
+};
+
+struct arena_frame_stats {
+  uint32_t num_allocations;
+  size_t bytes;
+  // The fullest any one thread's arena got.
+  size_t max_thread_bytes;
+};
+
+struct frame_arenas {
+  // Tells this set of arenas from any other, past or present, since
+  // threads remember which they registered with.
+  uint64_t id;
+  uint32_t frames_in_flight;
+  uint32_t frame_index;
+  // Set while begin_arena_frame runs, so frame_alloc can throw rather
+  // than race with it.
+  std::atomic<bool> switching_frames;
+  frame_arena arenas[MAX_ARENA_FRAMES][MAX_ARENA_THREADS];
+  std::atomic<uint32_t> num_threads;
+
+  // The totals for the last frame that used frame_index, taken just
+  // before its arenas were reset.
+  arena_frame_stats last_stats;
+  // The fullest any arena has ever been.
+  size_t high_water;
+};
+
+//
+// FRAME ARENA ROUTINES
+//
+
+// Sets up the arenas, without memory; each thread's comes when it
+// registers. A thread can only allocate from the last frame_arenas it
+// registered with, since it remembers its arena index in a thread local.
+void create_frame_arenas(uint32_t frames_in_flight, frame_arenas* arenas);
+void destroy_frame_arenas(frame_arenas* arenas);
+
+// Every thread that allocates from the arenas has to call this once
+// first, and it allocates the thread's arenas, one per frame in flight.
+// Throws if there are already MAX_ARENA_THREADS.
+void register_arena_thread(frame_arenas* arenas);
+
+// Call at the start of every frame, on one thread, once nothing uses the
+// memory from the last frame with this index. Empties its arenas. No
+// thread may be in frame_alloc while it runs.
+void begin_arena_frame(frame_arenas* arenas, uint32_t frame_index);
+
+// Returns size bytes from the calling thread's arena for this frame.
+// Throws if the arena is full, if the thread hasn't registered with these
+// arenas, or if it catches begin_arena_frame running.
+void* frame_alloc(frame_arenas* arenas, size_t size, size_t alignment);
+
+// Returns count default constructed Ts from the calling thread's arena.
+template<typename T>
+T* frame_new(frame_arenas* arenas, size_t count) {
+  static_assert(std::is_trivially_destructible<T>::value, "arena memory is never destructed");
+
+  T* result = (T*)frame_alloc(arenas, sizeof(T) * count, alignof(T));
+
+  for (size_t i = 0; i < count; i++) {
+    new (&result[i]) T();
+  }
+
+  return result;
+}
+
+// Sets profiler counters with last_stats.
+void publish_arena_stats(const frame_arenas* arenas, gpu_profiler* profiler);
+
+#endif
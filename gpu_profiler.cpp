@@ -0,0 +1,174 @@
+#include "gpu_profiler.h"
+
+#include <stdexcept>
+#include <vector>
+#include <cstring>
+
+using namespace std;
+
+void create_gpu_profiler(
+  VkPhysicalDevice physical_device,
+  VkDevice device,
+  uint32_t queue_family,
+  gpu_profiler* profiler
+) {
+  VkPhysicalDeviceProperties properties;
+  uint32_t num_queue_families;
+  vector<VkQueueFamilyProperties> queue_families;
+  uint32_t valid_bits;
+  VkQueryPoolCreateInfo create_info{};
+  VkResult result;
+
+  vkGetPhysicalDeviceProperties(physical_device, &properties);
+
+  vkGetPhysicalDeviceQueueFamilyProperties(physical_device, &num_queue_families, NULL);
+  queue_families.resize(num_queue_families);
+  vkGetPhysicalDeviceQueueFamilyProperties(
+    physical_device,
+    &num_queue_families,
+    queue_families.data()
+  );
+
+  // A queue family with zero valid bits can't do timestamps at all.
+  valid_bits = queue_families[queue_family].timestampValidBits;
+  if (valid_bits == 0) {
+    throw runtime_error("queue family does not support timestamps!");
+  }
+
+  profiler->timestamp_period = properties.limits.timestampPeriod;
+  profiler->timestamp_mask = valid_bits >= 64 ? ~0ULL : (1ULL << valid_bits) - 1;
+  profiler->num_scopes = 0;
+  profiler->num_counters = 0;
+
+  // Every scope needs two queries: one for the start and one for the end.
+  create_info.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+  create_info.queryType = VK_QUERY_TYPE_TIMESTAMP;
+  create_info.queryCount = MAX_PROFILER_SCOPES * 2;
+
+  result = vkCreateQueryPool(device, &create_info, NULL, &(profiler->query_pool));
+
+  if (result != VK_SUCCESS) {
+    throw runtime_error("failed to create profiler query pool!");
+  }
+}
+
+void destroy_gpu_profiler(VkDevice device, gpu_profiler* profiler) {
+  vkDestroyQueryPool(device, profiler->query_pool, NULL);
+}
+
+void reset_gpu_profiler(VkCommandBuffer cmd, gpu_profiler* profiler) {
+  vkCmdResetQueryPool(cmd, profiler->query_pool, 0, MAX_PROFILER_SCOPES * 2);
+  profiler->num_scopes = 0;
+}
+
+uint32_t begin_profiler_scope(
+  VkCommandBuffer cmd,
+  gpu_profiler* profiler,
+  const char* name
+) {
+  uint32_t scope;
+
+  if (profiler->num_scopes == MAX_PROFILER_SCOPES) {
+    throw runtime_error("too many profiler scopes in one frame!");
+  }
+
+  scope = profiler->num_scopes++;
+  profiler->scope_names[scope] = name;
+
+  // TOP_OF_PIPE means "as soon as the GPU gets to this command", so the
+  // timestamp doesn't wait for earlier work to finish.
+  vkCmdWriteTimestamp(
+    cmd,
+    VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+    profiler->query_pool,
+    scope * 2
+  );
+
+  return scope;
+}
+
+void end_profiler_scope(
+  VkCommandBuffer cmd,
+  gpu_profiler* profiler,
+  uint32_t scope
+) {
+  // BOTTOM_OF_PIPE waits until everything before it has finished.
+  vkCmdWriteTimestamp(
+    cmd,
+    VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
+    profiler->query_pool,
+    scope * 2 + 1
+  );
+}
+
+void read_profiler_results(VkDevice device, gpu_profiler* profiler) {
+  uint64_t timestamps[MAX_PROFILER_SCOPES * 2];
+  uint64_t ticks;
+  VkResult result;
+
+  if (profiler->num_scopes == 0) {
+    return;
+  }
+
+  result = vkGetQueryPoolResults(
+    device,
+    profiler->query_pool,
+    0,
+    profiler->num_scopes * 2,
+    sizeof(timestamps),
+    timestamps,
+    sizeof(uint64_t),
+    VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WAIT_BIT
+  );
+
+  if (result != VK_SUCCESS) {
+    throw runtime_error("failed to read profiler timestamps!");
+  }
+
+  for (uint32_t i = 0; i < profiler->num_scopes; i++) {
+    ticks = (timestamps[i * 2 + 1] - timestamps[i * 2]) & profiler->timestamp_mask;
+    profiler->scope_ms[i] = (double)ticks * profiler->timestamp_period / 1000000.0;
+  }
+}
+
+double profiler_scope_ms(const gpu_profiler* profiler, const char* name) {
+  for (uint32_t i = 0; i < profiler->num_scopes; i++) {
+    if (strcmp(profiler->scope_names[i], name) == 0) {
+      return profiler->scope_ms[i];
+    }
+  }
+
+  return -1.0;
+}
+
+void set_profiler_counter(gpu_profiler* profiler, const char* name, double value) {
+  uint32_t counter;
+
+  for (counter = 0; counter < profiler->num_counters; counter++) {
+    if (strncmp(profiler->counter_names[counter], name, MAX_COUNTER_NAME - 1) == 0) {
+      break;
+    }
+  }
+
+  if (counter == profiler->num_counters) {
+    if (counter == MAX_PROFILER_COUNTERS) {
+      return;
+    }
+
+    strncpy(profiler->counter_names[counter], name, MAX_COUNTER_NAME - 1);
+    profiler->counter_names[counter][MAX_COUNTER_NAME - 1] = '\0';
+    profiler->num_counters++;
+  }
+
+  profiler->counter_values[counter] = value;
+}
+
+double profiler_counter(const gpu_profiler* profiler, const char* name) {
+  for (uint32_t i = 0; i < profiler->num_counters; i++) {
+    if (strncmp(profiler->counter_names[i], name, MAX_COUNTER_NAME - 1) == 0) {
+      return profiler->counter_values[i];
+    }
+  }
+
+  return -1.0;
+}
@@ -0,0 +1,90 @@
+#ifndef GPU_PROFILER_H
+#define GPU_PROFILER_H
+
+#define GLFW_INCLUDE_VULKAN
+
+#include <GLFW/glfw3.h>
+#include <cstdint>
+
+//
+// The GPU runs our commands asynchronously, so timing it from the CPU
+// only tells us how long we waited, not how long the work took. Instead,
+// we ask the GPU itself to write timestamps into a query pool at the start
+// and end of each scope we care about, and read them back once the frame
+// is done.
+//
+// The profiler also keeps named counters, for stats that aren't timings
+// (memory use, draw counts...), so everything shows up in one place.
+//
+
+const uint32_t MAX_PROFILER_SCOPES = 64;
+const uint32_t MAX_PROFILER_COUNTERS = 64;
+const uint32_t MAX_COUNTER_NAME = 48;
+
+struct gpu_profiler {
+  VkQueryPool query_pool;
+  // Nanoseconds per timestamp tick. This comes from the device limits.
+  float timestamp_period;
+  // Timestamps only have this many meaningful bits; the rest are garbage.
+  uint64_t timestamp_mask;
+
+  uint32_t num_scopes;
+  const char* scope_names[MAX_PROFILER_SCOPES];
+  // Filled in by read_profiler_results.
+  double scope_ms[MAX_PROFILER_SCOPES];
+
+  // Counters keep their value until set again.
+  uint32_t num_counters;
+  char counter_names[MAX_PROFILER_COUNTERS][MAX_COUNTER_NAME];
+  double counter_values[MAX_PROFILER_COUNTERS];
+};
+
+//
+// GPU PROFILER ROUTINES
+//
+
+// queue_family is the family the profiled command buffers are submitted
+// to, since the number of valid timestamp bits is per queue family.
+void create_gpu_profiler(
+  VkPhysicalDevice physical_device,
+  VkDevice device,
+  uint32_t queue_family,
+  gpu_profiler* profiler
+);
+void destroy_gpu_profiler(VkDevice device, gpu_profiler* profiler);
+
+// Must be recorded at the start of every profiled frame, outside of any
+// render pass.
+void reset_gpu_profiler(VkCommandBuffer cmd, gpu_profiler* profiler);
+
+// Returns a handle to pass to end_profiler_scope. name must outlive the
+// frame (a string literal is ideal).
+uint32_t begin_profiler_scope(
+  VkCommandBuffer cmd,
+  gpu_profiler* profiler,
+  const char* name
+);
+void end_profiler_scope(
+  VkCommandBuffer cmd,
+  gpu_profiler* profiler,
+  uint32_t scope
+);
+
+// Waits for the timestamps of the last frame and converts them into
+// scope_ms. Only call this once the frame's command buffer is done.
+void read_profiler_results(VkDevice device, gpu_profiler* profiler);
+
+// Returns the time of the named scope from the last frame, or a negative
+// number if there was no such scope.
+double profiler_scope_ms(const gpu_profiler* profiler, const char* name);
+
+// Sets the named counter, adding it if it's new. Names longer than
+// MAX_COUNTER_NAME are cut short. Once the profiler has
+// MAX_PROFILER_COUNTERS counters, new ones are ignored.
+void set_profiler_counter(gpu_profiler* profiler, const char* name, double value);
+
+// Returns the value of the named counter, or a negative number if there
+// is no such counter.
+double profiler_counter(const gpu_profiler* profiler, const char* name);
+
+#endif
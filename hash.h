@@ -0,0 +1,37 @@
+#ifndef HASH_H
+#define HASH_H
+
+#include <cstdint>
+#include <cstddef>
+
+// The starting value of an FNV-1a hash.
+const uint64_t HASH_SEED = 0xcbf29ce484222325ULL;
+
+// Mixes a value into an FNV-1a hash. Hash structs field by field instead
+// of all at once, since structs have padding with garbage in it.
+template <typename T>
+inline void hash_value(uint64_t* hash, const T& value) {
+  const uint8_t* bytes;
+
+  bytes = (const uint8_t*)&value;
+
+  for (size_t i = 0; i < sizeof(T); i++) {
+    *hash ^= bytes[i];
+    *hash *= 0x100000001b3ULL;
+  }
+}
+
+// Mixes size bytes of data into an FNV-1a hash, for data that's just
+// bytes, like a buffer's contents.
+inline void hash_bytes(uint64_t* hash, const void* data, size_t size) {
+  const uint8_t* bytes;
+
+  bytes = (const uint8_t*)data;
+
+  for (size_t i = 0; i < size; i++) {
+    *hash ^= bytes[i];
+    *hash *= 0x100000001b3ULL;
+  }
+}
+
+#endif
@@ -0,0 +1,156 @@
+#include "headless.h"
+
+#include <stdexcept>
+#include <vector>
+#include <iostream>
+
+using namespace std;
+
+uint32_t find_memory_type(
+  VkPhysicalDevice physical_device,
+  uint32_t type_bits,
+  VkMemoryPropertyFlags properties
+) {
+  VkPhysicalDeviceMemoryProperties memory_properties;
+
+  vkGetPhysicalDeviceMemoryProperties(physical_device, &memory_properties);
+
+  for (uint32_t i = 0; i < memory_properties.memoryTypeCount; i++) {
+    if ((type_bits & (1 << i)) &&
+        (memory_properties.memoryTypes[i].propertyFlags & properties) == properties) {
+      return i;
+    }
+  }
+
+  throw runtime_error("failed to find suitable memory type!");
+}
+
+static void create_instance(const char* app_name, headless_context* ctx) {
+  VkApplicationInfo app_info{};
+  VkInstanceCreateInfo create_info{};
+
+  app_info.sType = VK_STRUCTURE_TYPE_APPLICATION_INFO;
+  app_info.pApplicationName = app_name;
+  app_info.applicationVersion = VK_MAKE_VERSION(1, 0, 0);
+  app_info.pEngineName = "No Engine";
+  app_info.engineVersion = VK_MAKE_VERSION(1, 0, 0);
+  app_info.apiVersion = VK_API_VERSION_1_0;
+
+  // We never present anything, so unlike the application we don't need
+  // any window system extensions. We also leave validation layers off so
+  // they don't show up in the timings.
+  create_info.sType = VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO;
+  create_info.pApplicationInfo = &app_info;
+
+  if (vkCreateInstance(&create_info, NULL, &(ctx->instance)) != VK_SUCCESS) {
+    throw runtime_error("failed to create Vulkan instance!");
+  }
+}
+
+static void pick_device(headless_context* ctx, bool allow_gpu) {
+  uint32_t device_count;
+  vector<VkPhysicalDevice> devices;
+  VkPhysicalDeviceProperties properties;
+  uint32_t num_queue_families;
+  vector<VkQueueFamilyProperties> queue_families;
+
+  device_count = 0;
+  vkEnumeratePhysicalDevices(ctx->instance, &device_count, NULL);
+  devices.resize(device_count);
+  vkEnumeratePhysicalDevices(ctx->instance, &device_count, devices.data());
+
+  //
+  // Numbers from a software rasterizer are only comparable to other
+  // numbers from that same rasterizer, so by default we insist on a CPU
+  // device.
+  //
+
+  ctx->physical_device = VK_NULL_HANDLE;
+
+  for (const VkPhysicalDevice& device : devices) {
+    vkGetPhysicalDeviceProperties(device, &properties);
+
+    if (!allow_gpu && properties.deviceType != VK_PHYSICAL_DEVICE_TYPE_CPU) {
+      continue;
+    }
+
+    vkGetPhysicalDeviceQueueFamilyProperties(device, &num_queue_families, NULL);
+    queue_families.resize(num_queue_families);
+    vkGetPhysicalDeviceQueueFamilyProperties(
+      device,
+      &num_queue_families,
+      queue_families.data()
+    );
+
+    // Blits need a graphics queue, and the profiler needs timestamps.
+    for (uint32_t i = 0; i < num_queue_families; i++) {
+      if ((queue_families[i].queueFlags & VK_QUEUE_GRAPHICS_BIT) &&
+          queue_families[i].timestampValidBits > 0) {
+        ctx->physical_device = device;
+        ctx->queue_family = i;
+        break;
+      }
+    }
+
+    if (ctx->physical_device != VK_NULL_HANDLE) {
+      cout << "Running on: " << properties.deviceName << endl;
+      return;
+    }
+  }
+
+  throw runtime_error(
+    allow_gpu ? "failed to find a usable device!"
+              : "failed to find a software device! (use --gpu for hardware)"
+  );
+}
+
+static void create_device(headless_context* ctx) {
+  VkDeviceQueueCreateInfo queue_create_info{};
+  VkDeviceCreateInfo device_create_info{};
+  VkPhysicalDeviceFeatures device_features{};
+  float queue_priority;
+
+  queue_priority = 1.0f;
+
+  queue_create_info.sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO;
+  queue_create_info.queueFamilyIndex = ctx->queue_family;
+  queue_create_info.queueCount = 1;
+  queue_create_info.pQueuePriorities = &queue_priority;
+
+  device_create_info.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO;
+  device_create_info.pQueueCreateInfos = &queue_create_info;
+  device_create_info.queueCreateInfoCount = 1;
+  device_create_info.pEnabledFeatures = &device_features;
+
+  if (vkCreateDevice(ctx->physical_device, &device_create_info, NULL, &(ctx->device)) != VK_SUCCESS) {
+    throw runtime_error("failed to create logical device!");
+  }
+
+  vkGetDeviceQueue(ctx->device, ctx->queue_family, 0, &(ctx->queue));
+}
+
+void create_headless_context(
+  const char* app_name,
+  bool allow_gpu,
+  headless_context* ctx
+) {
+  VkCommandPoolCreateInfo pool_info{};
+
+  create_instance(app_name, ctx);
+  pick_device(ctx, allow_gpu);
+  create_device(ctx);
+
+  pool_info.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+  pool_info.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
+  pool_info.queueFamilyIndex = ctx->queue_family;
+
+  if (vkCreateCommandPool(ctx->device, &pool_info, NULL, &(ctx->command_pool)) != VK_SUCCESS) {
+    throw runtime_error("failed to create command pool!");
+  }
+}
+
+void destroy_headless_context(headless_context* ctx) {
+  vkDestroyCommandPool(ctx->device, ctx->command_pool, NULL);
+  vkDestroyDevice(ctx->device, NULL);
+  vkDestroyInstance(ctx->instance, NULL);
+}
@@ -0,0 +1,47 @@
+#ifndef HEADLESS_H
+#define HEADLESS_H
+
+#define GLFW_INCLUDE_VULKAN
+
+#include <GLFW/glfw3.h>
+#include <cstdint>
+
+//
+// The bare minimum needed to run Vulkan commands without a window: an
+// instance, a device with one graphics queue, and a command pool for it.
+// The benchmark and the capture replayer both run this way, so they can
+// run on machines with no display (or no GPU, using a software ICD).
+//
+
+struct headless_context {
+  VkInstance instance;
+  VkPhysicalDevice physical_device;
+  VkDevice device;
+  uint32_t queue_family;
+  VkQueue queue;
+  VkCommandPool command_pool;
+};
+
+//
+// HEADLESS CONTEXT ROUTINES
+//
+
+// Picks the first device with a graphics queue that supports timestamps.
+// Unless allow_gpu is true, only CPU (software) devices are considered, so
+// that numbers from different machines are comparable.
+void create_headless_context(
+  const char* app_name,
+  bool allow_gpu,
+  headless_context* ctx
+);
+void destroy_headless_context(headless_context* ctx);
+
+// Returns the index of a memory type allowed by type_bits that has all of
+// the requested properties.
+uint32_t find_memory_type(
+  VkPhysicalDevice physical_device,
+  uint32_t type_bits,
+  VkMemoryPropertyFlags properties
+);
+
+#endif
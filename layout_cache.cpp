@@ -0,0 +1,278 @@
+#include "layout_cache.h"
+#include "hash.h"
+
+#include <stdexcept>
+#include <algorithm>
+
+using namespace std;
+
+static uint64_t hash_set_layout(
+  const vector<VkDescriptorSetLayoutBinding>& bindings,
+  VkDescriptorSetLayoutCreateFlags flags
+) {
+  uint64_t hash;
+
+  hash = HASH_SEED;
+  hash_value(&hash, flags);
+
+  for (const VkDescriptorSetLayoutBinding& binding : bindings) {
+    hash_value(&hash, binding.binding);
+    hash_value(&hash, binding.descriptorType);
+    hash_value(&hash, binding.descriptorCount);
+    hash_value(&hash, binding.stageFlags);
+  }
+
+  return hash;
+}
+
+static bool set_layouts_equal(
+  const vector<VkDescriptorSetLayoutBinding>& a,
+  const vector<VkDescriptorSetLayoutBinding>& b
+) {
+  if (a.size() != b.size()) {
+    return false;
+  }
+
+  for (size_t i = 0; i < a.size(); i++) {
+    if (a[i].binding != b[i].binding ||
+        a[i].descriptorType != b[i].descriptorType ||
+        a[i].descriptorCount != b[i].descriptorCount ||
+        a[i].stageFlags != b[i].stageFlags) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+static uint64_t hash_pipeline_layout(
+  const vector<VkDescriptorSetLayout>& set_layouts,
+  const VkPushConstantRange& push_constants
+) {
+  uint64_t hash;
+
+  hash = HASH_SEED;
+
+  // Set layouts come from the cache, so equal layouts are the same
+  // handle and we can hash the handles.
+  for (VkDescriptorSetLayout set_layout : set_layouts) {
+    hash_value(&hash, set_layout);
+  }
+
+  hash_value(&hash, push_constants.stageFlags);
+  hash_value(&hash, push_constants.offset);
+  hash_value(&hash, push_constants.size);
+
+  return hash;
+}
+
+void create_layout_cache(VkDevice device, layout_cache* cache) {
+  cache->device = device;
+}
+
+void destroy_layout_cache(layout_cache* cache) {
+  // Pipeline layouts first, since they refer to the set layouts.
+  for (auto& bucket : cache->pipeline_layouts) {
+    for (pipeline_layout_entry* entry : bucket.second) {
+      vkDestroyPipelineLayout(cache->device, entry->layout, NULL);
+      delete entry;
+    }
+  }
+
+  for (auto& bucket : cache->set_layouts) {
+    for (set_layout_entry* entry : bucket.second) {
+      vkDestroyDescriptorSetLayout(cache->device, entry->layout, NULL);
+      delete entry;
+    }
+  }
+
+  cache->pipeline_layouts.clear();
+  cache->set_layouts.clear();
+}
+
+static VkDescriptorSetLayout find_set_layout(
+  layout_cache* cache,
+  const VkDescriptorSetLayoutBinding* bindings,
+  uint32_t num_bindings,
+  VkDescriptorSetLayoutCreateFlags flags
+) {
+  lock_guard<mutex> lock(cache->mutex);
+  vector<VkDescriptorSetLayoutBinding> sorted;
+  vector<set_layout_entry*>* bucket;
+  set_layout_entry* entry;
+  VkDescriptorSetLayoutCreateInfo create_info{};
+  VkResult result;
+
+  // The order bindings are listed in doesn't matter to Vulkan, so sort
+  // them to make the same layout always hash the same.
+  sorted.assign(bindings, bindings + num_bindings);
+  sort(
+    sorted.begin(),
+    sorted.end(),
+    [](const VkDescriptorSetLayoutBinding& a, const VkDescriptorSetLayoutBinding& b) {
+      return a.binding < b.binding;
+    }
+  );
+
+  for (const VkDescriptorSetLayoutBinding& binding : sorted) {
+    if (binding.pImmutableSamplers != NULL) {
+      throw runtime_error("the layout cache doesn't support immutable samplers!");
+    }
+  }
+
+  bucket = &cache->set_layouts[hash_set_layout(sorted, flags)];
+
+  for (set_layout_entry* existing : *bucket) {
+    if (existing->flags == flags && set_layouts_equal(existing->bindings, sorted)) {
+      return existing->layout;
+    }
+  }
+
+  create_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+  create_info.flags = flags;
+  create_info.bindingCount = (uint32_t)sorted.size();
+  create_info.pBindings = sorted.data();
+
+  entry = new set_layout_entry;
+  entry->bindings = sorted;
+  entry->flags = flags;
+
+  result = vkCreateDescriptorSetLayout(cache->device, &create_info, NULL, &(entry->layout));
+
+  if (result != VK_SUCCESS) {
+    delete entry;
+    throw runtime_error("failed to create descriptor set layout!");
+  }
+
+  bucket->push_back(entry);
+
+  return entry->layout;
+}
+
+VkDescriptorSetLayout get_descriptor_set_layout(
+  layout_cache* cache,
+  const VkDescriptorSetLayoutBinding* bindings,
+  uint32_t num_bindings
+) {
+  return find_set_layout(cache, bindings, num_bindings, 0);
+}
+
+VkDescriptorSetLayout get_push_descriptor_set_layout(
+  layout_cache* cache,
+  const VkDescriptorSetLayoutBinding* bindings,
+  uint32_t num_bindings
+) {
+  return find_set_layout(
+    cache,
+    bindings,
+    num_bindings,
+    VK_DESCRIPTOR_SET_LAYOUT_CREATE_PUSH_DESCRIPTOR_BIT_KHR
+  );
+}
+
+VkPipelineLayout get_pipeline_layout(
+  layout_cache* cache,
+  const VkDescriptorSetLayout* set_layouts,
+  uint32_t num_set_layouts,
+  const VkPushConstantRange* push_constants
+) {
+  lock_guard<mutex> lock(cache->mutex);
+  vector<VkDescriptorSetLayout> layouts;
+  VkPushConstantRange range{};
+  vector<pipeline_layout_entry*>* bucket;
+  pipeline_layout_entry* entry;
+  VkPipelineLayoutCreateInfo create_info{};
+  VkResult result;
+
+  layouts.assign(set_layouts, set_layouts + num_set_layouts);
+
+  if (push_constants != NULL) {
+    range = *push_constants;
+  }
+
+  bucket = &cache->pipeline_layouts[hash_pipeline_layout(layouts, range)];
+
+  for (pipeline_layout_entry* existing : *bucket) {
+    if (existing->set_layouts == layouts &&
+        existing->push_constants.stageFlags == range.stageFlags &&
+        existing->push_constants.offset == range.offset &&
+        existing->push_constants.size == range.size) {
+      return existing->layout;
+    }
+  }
+
+  create_info.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+  create_info.setLayoutCount = num_set_layouts;
+  create_info.pSetLayouts = layouts.data();
+  create_info.pushConstantRangeCount = range.size > 0 ? 1 : 0;
+  create_info.pPushConstantRanges = &range;
+
+  entry = new pipeline_layout_entry;
+  entry->set_layouts = layouts;
+  entry->push_constants = range;
+
+  result = vkCreatePipelineLayout(cache->device, &create_info, NULL, &(entry->layout));
+
+  if (result != VK_SUCCESS) {
+    delete entry;
+    throw runtime_error("failed to create pipeline layout!");
+  }
+
+  bucket->push_back(entry);
+
+  return entry->layout;
+}
+
+reflected_layout get_reflected_layout(
+  layout_cache* cache,
+  const shader_reflection& reflection
+) {
+  reflected_layout result{};
+  uint32_t num_sets;
+  vector<VkDescriptorSetLayoutBinding> bindings;
+  VkDescriptorSetLayoutBinding binding{};
+
+  num_sets = 0;
+
+  for (const reflected_binding& reflected : reflection.bindings) {
+    num_sets = max(num_sets, reflected.set + 1);
+  }
+
+  // Vulkan wants a layout for every set up to the highest one used, even
+  // if the shaders skip some.
+  for (uint32_t set = 0; set < num_sets; set++) {
+    bindings.clear();
+
+    for (const reflected_binding& reflected : reflection.bindings) {
+      if (reflected.set != set) {
+        continue;
+      }
+
+      binding.binding = reflected.binding;
+      binding.descriptorType = reflected.type;
+      binding.descriptorCount = reflected.count;
+      binding.stageFlags = reflected.stages;
+      binding.pImmutableSamplers = NULL;
+      bindings.push_back(binding);
+    }
+
+    result.set_layouts.push_back(
+      get_descriptor_set_layout(cache, bindings.data(), (uint32_t)bindings.size())
+    );
+  }
+
+  if (reflection.push_constant_size > 0) {
+    result.push_constants.stageFlags = reflection.stage;
+    result.push_constants.offset = reflection.push_constant_offset;
+    result.push_constants.size = reflection.push_constant_size;
+  }
+
+  result.layout = get_pipeline_layout(
+    cache,
+    result.set_layouts.data(),
+    (uint32_t)result.set_layouts.size(),
+    result.push_constants.size > 0 ? &result.push_constants : NULL
+  );
+
+  return result;
+}
@@ -0,0 +1,98 @@
+#ifndef LAYOUT_CACHE_H
+#define LAYOUT_CACHE_H
+
+#define GLFW_INCLUDE_VULKAN
+
+#include <GLFW/glfw3.h>
+#include <cstdint>
+#include <vector>
+#include <unordered_map>
+#include <mutex>
+
+#include "spirv_reflect.h"
+
+//
+// Most pipelines use the same few descriptor set layouts (per frame data,
+// per material textures, etc.), but each shader would otherwise get its
+// own copy, and every copy means another pipeline layout and a less
+// compatible set of bindings. Pipelines whose layouts are the same object
+// can also share descriptor sets without rebinding them.
+//
+// So layouts come from this cache, which hashes the layout description
+// and hands back the existing VkDescriptorSetLayout or VkPipelineLayout if
+// an identical one was made before. Everything lives until the cache is
+// destroyed.
+//
+
+struct set_layout_entry {
+  // Sorted by binding number.
+  std::vector<VkDescriptorSetLayoutBinding> bindings;
+  // 0, or PUSH_DESCRIPTOR for a push descriptor layout.
+  VkDescriptorSetLayoutCreateFlags flags;
+  VkDescriptorSetLayout layout;
+};
+
+struct pipeline_layout_entry {
+  std::vector<VkDescriptorSetLayout> set_layouts;
+  // A size of 0 means no push constants.
+  VkPushConstantRange push_constants;
+  VkPipelineLayout layout;
+};
+
+struct layout_cache {
+  VkDevice device;
+
+  // Guards everything below.
+  std::mutex mutex;
+  std::unordered_map<uint64_t, std::vector<set_layout_entry*>> set_layouts;
+  std::unordered_map<uint64_t, std::vector<pipeline_layout_entry*>> pipeline_layouts;
+};
+
+// A pipeline layout made from reflection, along with the pieces it was
+// made from, which are needed to allocate descriptor sets and push
+// constants for it.
+struct reflected_layout {
+  VkPipelineLayout layout;
+  // Indexed by set number. Sets the shaders skip get an empty layout.
+  std::vector<VkDescriptorSetLayout> set_layouts;
+  VkPushConstantRange push_constants;
+};
+
+void create_layout_cache(VkDevice device, layout_cache* cache);
+// Destroys every layout the cache made. Only call it once no pipeline
+// made with them is in use.
+void destroy_layout_cache(layout_cache* cache);
+
+// Immutable samplers aren't supported, so pImmutableSamplers must be NULL.
+VkDescriptorSetLayout get_descriptor_set_layout(
+  layout_cache* cache,
+  const VkDescriptorSetLayoutBinding* bindings,
+  uint32_t num_bindings
+);
+
+// The same, for a set whose descriptors are pushed with
+// vkCmdPushDescriptorSetKHR instead of allocated. Only for devices made
+// with VK_KHR_push_descriptor. It's never the same layout as a normal one
+// with the same bindings.
+VkDescriptorSetLayout get_push_descriptor_set_layout(
+  layout_cache* cache,
+  const VkDescriptorSetLayoutBinding* bindings,
+  uint32_t num_bindings
+);
+
+// push_constants may be NULL if there are none.
+VkPipelineLayout get_pipeline_layout(
+  layout_cache* cache,
+  const VkDescriptorSetLayout* set_layouts,
+  uint32_t num_set_layouts,
+  const VkPushConstantRange* push_constants
+);
+
+// Makes (or finds) the layout for the merged reflection of every stage of
+// a pipeline (see merge_reflections).
+reflected_layout get_reflected_layout(
+  layout_cache* cache,
+  const shader_reflection& reflection
+);
+
+#endif
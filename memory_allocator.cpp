@@ -0,0 +1,602 @@
+#include "memory_allocator.h"
+
+#include <stdexcept>
+#include <algorithm>
+
+using namespace std;
+
+const uint32_t NO_MEMORY_TYPE = ~0u;
+
+// Block buffers are made with every usage we might want, so any buffer
+// allocation can go in any buffer block.
+const VkBufferUsageFlags BLOCK_BUFFER_USAGE =
+  VK_BUFFER_USAGE_TRANSFER_SRC_BIT |
+  VK_BUFFER_USAGE_TRANSFER_DST_BIT |
+  VK_BUFFER_USAGE_UNIFORM_TEXEL_BUFFER_BIT |
+  VK_BUFFER_USAGE_STORAGE_TEXEL_BUFFER_BIT |
+  VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT |
+  VK_BUFFER_USAGE_STORAGE_BUFFER_BIT |
+  VK_BUFFER_USAGE_INDEX_BUFFER_BIT |
+  VK_BUFFER_USAGE_VERTEX_BUFFER_BIT |
+  VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT;
+
+static VkDeviceSize align_up(VkDeviceSize value, VkDeviceSize alignment) {
+  return (value + alignment - 1) / alignment * alignment;
+}
+
+// Returns the first memory type allowed by type_bits that has all of the
+// properties, or NO_MEMORY_TYPE.
+static uint32_t choose_memory_type(
+  const memory_allocator* allocator,
+  uint32_t type_bits,
+  VkMemoryPropertyFlags properties
+) {
+  const VkPhysicalDeviceMemoryProperties* memory;
+
+  memory = &allocator->memory_properties;
+
+  for (uint32_t i = 0; i < memory->memoryTypeCount; i++) {
+    if ((type_bits & (1 << i)) &&
+        (memory->memoryTypes[i].propertyFlags & properties) == properties) {
+      return i;
+    }
+  }
+
+  return NO_MEMORY_TYPE;
+}
+
+static uint32_t block_heap(const memory_allocator* allocator, const memory_block* block) {
+  return allocator->memory_properties.memoryTypes[block->memory_type].heapIndex;
+}
+
+static VkBuffer create_block_buffer(memory_allocator* allocator, VkDeviceSize size) {
+  VkBufferCreateInfo create_info{};
+  VkBuffer buffer;
+
+  create_info.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+  create_info.size = size;
+  create_info.usage = BLOCK_BUFFER_USAGE;
+  create_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+
+  // The defragmenter copies blocks on the transfer queue, which may be a
+  // different family from the one that uses them. Concurrent sharing saves
+  // us from transferring ownership back and forth for every move.
+  if (allocator->queue_families.size() > 1) {
+    create_info.sharingMode = VK_SHARING_MODE_CONCURRENT;
+    create_info.queueFamilyIndexCount = (uint32_t)allocator->queue_families.size();
+    create_info.pQueueFamilyIndices = allocator->queue_families.data();
+  }
+
+  if (allocator->buffer_device_address) {
+    create_info.usage |= VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT;
+  }
+
+  if (vkCreateBuffer(allocator->device, &create_info, NULL, &buffer) != VK_SUCCESS) {
+    throw runtime_error("failed to create block buffer!");
+  }
+
+  return buffer;
+}
+
+static memory_block* create_block(
+  memory_allocator* allocator,
+  allocation_kind kind,
+  VkDeviceSize size,
+  uint32_t memory_type,
+  bool dedicated
+) {
+  memory_block* block;
+  VkMemoryAllocateInfo allocate_info{};
+  VkMemoryAllocateFlagsInfo flags_info{};
+  VkBufferDeviceAddressInfo address_info{};
+  VkMemoryRequirements requirements;
+
+  block = new memory_block{};
+  block->size = size;
+  block->memory_type = memory_type;
+  block->kind = kind;
+  block->dedicated = dedicated;
+
+  allocate_info.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+  allocate_info.allocationSize = size;
+  allocate_info.memoryTypeIndex = memory_type;
+
+  if (kind == ALLOCATION_BUFFER) {
+    block->buffer = create_block_buffer(allocator, size);
+
+    // A buffer may need a little more memory than its size.
+    vkGetBufferMemoryRequirements(allocator->device, block->buffer, &requirements);
+    allocate_info.allocationSize = requirements.size;
+
+    // Memory that buffers with device addresses are bound to has to be
+    // allocated with the flag saying so.
+    if (allocator->buffer_device_address) {
+      flags_info.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_FLAGS_INFO;
+      flags_info.flags = VK_MEMORY_ALLOCATE_DEVICE_ADDRESS_BIT;
+      allocate_info.pNext = &flags_info;
+    }
+  }
+
+  if (vkAllocateMemory(allocator->device, &allocate_info, NULL, &(block->memory)) != VK_SUCCESS) {
+    if (block->buffer != VK_NULL_HANDLE) {
+      vkDestroyBuffer(allocator->device, block->buffer, NULL);
+    }
+
+    delete block;
+    return NULL;
+  }
+
+  if (kind == ALLOCATION_BUFFER) {
+    vkBindBufferMemory(allocator->device, block->buffer, block->memory, 0);
+
+    if (allocator->buffer_device_address) {
+      address_info.sType = VK_STRUCTURE_TYPE_BUFFER_DEVICE_ADDRESS_INFO;
+      address_info.buffer = block->buffer;
+      block->address = vkGetBufferDeviceAddress(allocator->device, &address_info);
+    }
+  }
+
+  if (allocator->memory_properties.memoryTypes[memory_type].propertyFlags &
+      VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) {
+    vkMapMemory(allocator->device, block->memory, 0, VK_WHOLE_SIZE, 0, (void**)&(block->mapped));
+  }
+
+  block->free_ranges.push_back({ 0, size });
+  allocator->blocks.push_back(block);
+  allocator->stats.heap_block_bytes[block_heap(allocator, block)] += size;
+
+  return block;
+}
+
+static void destroy_block(memory_allocator* allocator, memory_block* block) {
+  allocator->stats.heap_block_bytes[block_heap(allocator, block)] -= block->size;
+
+  if (block->mapped != NULL) {
+    vkUnmapMemory(allocator->device, block->memory);
+  }
+
+  if (block->buffer != VK_NULL_HANDLE) {
+    vkDestroyBuffer(allocator->device, block->buffer, NULL);
+  }
+
+  vkFreeMemory(allocator->device, block->memory, NULL);
+
+  allocator->blocks.erase(find(allocator->blocks.begin(), allocator->blocks.end(), block));
+  delete block;
+}
+
+// First fit. Returns false if no free range is big enough.
+static bool allocate_from_block(
+  memory_block* block,
+  VkDeviceSize size,
+  VkDeviceSize alignment,
+  VkDeviceSize* offset
+) {
+  memory_range range;
+  VkDeviceSize aligned;
+
+  for (size_t i = 0; i < block->free_ranges.size(); i++) {
+    range = block->free_ranges[i];
+    aligned = align_up(range.offset, alignment);
+
+    if (aligned + size > range.offset + range.size) {
+      continue;
+    }
+
+    //
+    // Cut the allocation out of the range, leaving whatever is left on
+    // either side of it free.
+    //
+
+    block->free_ranges.erase(block->free_ranges.begin() + i);
+
+    if (aligned + size < range.offset + range.size) {
+      block->free_ranges.insert(
+        block->free_ranges.begin() + i,
+        { aligned + size, range.offset + range.size - (aligned + size) }
+      );
+    }
+
+    if (aligned > range.offset) {
+      block->free_ranges.insert(
+        block->free_ranges.begin() + i,
+        { range.offset, aligned - range.offset }
+      );
+    }
+
+    *offset = aligned;
+    return true;
+  }
+
+  return false;
+}
+
+static void free_from_block(memory_block* block, VkDeviceSize offset, VkDeviceSize size) {
+  size_t i;
+  memory_range* previous;
+  memory_range* next;
+
+  i = 0;
+  while (i < block->free_ranges.size() && block->free_ranges[i].offset < offset) {
+    i++;
+  }
+
+  block->free_ranges.insert(block->free_ranges.begin() + i, { offset, size });
+
+  // Merge with the neighbors so the block doesn't end up as lots of
+  // small ranges that could have been one big one.
+  if (i + 1 < block->free_ranges.size()) {
+    next = &block->free_ranges[i + 1];
+
+    if (offset + size == next->offset) {
+      block->free_ranges[i].size += next->size;
+      block->free_ranges.erase(block->free_ranges.begin() + i + 1);
+    }
+  }
+
+  if (i > 0) {
+    previous = &block->free_ranges[i - 1];
+
+    if (previous->offset + previous->size == offset) {
+      previous->size += block->free_ranges[i].size;
+      block->free_ranges.erase(block->free_ranges.begin() + i);
+    }
+  }
+}
+
+// Points the allocation's block, offset, buffer, address and mapped
+// pointer at the given place.
+static void place_allocation(gpu_allocation* allocation, memory_block* block, VkDeviceSize offset) {
+  allocation->block = block;
+  allocation->offset = offset;
+  allocation->mapped = block->mapped != NULL ? block->mapped + offset : NULL;
+
+  if (block->kind == ALLOCATION_BUFFER) {
+    allocation->buffer = block->buffer;
+    allocation->address = block->address != 0 ? block->address + offset : 0;
+  }
+}
+
+// Wraps a range already taken out of the block in a new allocation. The
+// mutex must be held.
+static gpu_allocation* make_allocation(
+  memory_allocator* allocator,
+  memory_block* block,
+  VkDeviceSize offset,
+  VkDeviceSize size,
+  memory_category category
+) {
+  gpu_allocation* allocation;
+
+  allocation = new gpu_allocation{};
+  allocation->size = size;
+  allocation->category = category;
+  place_allocation(allocation, block, offset);
+
+  block->allocations.push_back(allocation);
+  block->used += size;
+  allocator->stats.heap_category_bytes[block_heap(allocator, block)][category] += size;
+
+  return allocation;
+}
+
+// Finds room in an existing block, or makes a new one. The mutex must be
+// held.
+static gpu_allocation* allocate(
+  memory_allocator* allocator,
+  allocation_kind kind,
+  VkDeviceSize size,
+  VkDeviceSize alignment,
+  uint32_t memory_type,
+  memory_category category
+) {
+  memory_block* block;
+  VkDeviceSize offset;
+  bool dedicated;
+
+  block = NULL;
+  offset = 0;
+  dedicated = size > DEDICATED_ALLOCATION_SIZE;
+
+  if (!dedicated) {
+    for (memory_block* existing : allocator->blocks) {
+      if (existing->kind == kind &&
+          existing->memory_type == memory_type &&
+          !existing->dedicated &&
+          allocate_from_block(existing, size, alignment, &offset)) {
+        block = existing;
+        break;
+      }
+    }
+  }
+
+  if (block == NULL) {
+    block = create_block(
+      allocator,
+      kind,
+      dedicated ? size : MEMORY_BLOCK_SIZE,
+      memory_type,
+      dedicated
+    );
+
+    if (block == NULL) {
+      return NULL;
+    }
+
+    allocate_from_block(block, size, alignment, &offset);
+  }
+
+  return make_allocation(allocator, block, offset, size, category);
+}
+
+void create_memory_allocator(
+  VkPhysicalDevice physical_device,
+  VkDevice device,
+  bool buffer_device_address,
+  const std::vector<uint32_t>& queue_families,
+  memory_allocator* allocator
+) {
+  VkPhysicalDeviceProperties properties;
+  VkBuffer probe;
+  VkMemoryRequirements requirements;
+
+  allocator->physical_device = physical_device;
+  allocator->device = device;
+  allocator->buffer_device_address = buffer_device_address;
+  allocator->stats = {};
+
+  allocator->queue_families.clear();
+  for (uint32_t family : queue_families) {
+    if (find(allocator->queue_families.begin(), allocator->queue_families.end(), family) ==
+        allocator->queue_families.end()) {
+      allocator->queue_families.push_back(family);
+    }
+  }
+
+  vkGetPhysicalDeviceMemoryProperties(physical_device, &(allocator->memory_properties));
+  vkGetPhysicalDeviceProperties(physical_device, &properties);
+
+  //
+  // Every block buffer is made the same way, so one small buffer tells us
+  // the alignment and memory types all of them will need.
+  //
+
+  probe = create_block_buffer(allocator, 1);
+  vkGetBufferMemoryRequirements(device, probe, &requirements);
+  vkDestroyBuffer(device, probe, NULL);
+
+  allocator->buffer_type_bits = requirements.memoryTypeBits;
+  allocator->buffer_alignment = max({
+    requirements.alignment,
+    properties.limits.minUniformBufferOffsetAlignment,
+    properties.limits.minStorageBufferOffsetAlignment,
+    properties.limits.minTexelBufferOffsetAlignment,
+  });
+}
+
+void destroy_memory_allocator(memory_allocator* allocator) {
+  while (!allocator->blocks.empty()) {
+    destroy_block(allocator, allocator->blocks.back());
+  }
+}
+
+gpu_allocation* allocate_buffer(
+  memory_allocator* allocator,
+  VkDeviceSize size,
+  VkMemoryPropertyFlags properties,
+  memory_category category
+) {
+  lock_guard<mutex> lock(allocator->mutex);
+  uint32_t memory_type;
+  gpu_allocation* allocation;
+
+  memory_type = choose_memory_type(allocator, allocator->buffer_type_bits, properties);
+
+  if (memory_type == NO_MEMORY_TYPE) {
+    throw runtime_error("no memory type for buffer allocation!");
+  }
+
+  // Rounding the size up keeps the next allocation's start aligned
+  // without wasting a gap in front of it.
+  size = align_up(size, allocator->buffer_alignment);
+
+  allocation = allocate(
+    allocator,
+    ALLOCATION_BUFFER,
+    size,
+    allocator->buffer_alignment,
+    memory_type,
+    category
+  );
+
+  if (allocation == NULL) {
+    throw runtime_error("failed to allocate buffer memory!");
+  }
+
+  return allocation;
+}
+
+// Finds memory that meets the requirements. The mutex must be held.
+static gpu_allocation* allocate_for_requirements(
+  memory_allocator* allocator,
+  const VkMemoryRequirements& requirements,
+  VkMemoryPropertyFlags properties,
+  memory_category category
+) {
+  uint32_t memory_type;
+  gpu_allocation* allocation;
+
+  memory_type = choose_memory_type(allocator, requirements.memoryTypeBits, properties);
+
+  if (memory_type == NO_MEMORY_TYPE) {
+    throw runtime_error("no memory type for image allocation!");
+  }
+
+  allocation = allocate(
+    allocator,
+    ALLOCATION_IMAGE,
+    requirements.size,
+    requirements.alignment,
+    memory_type,
+    category
+  );
+
+  if (allocation == NULL) {
+    throw runtime_error("failed to allocate image memory!");
+  }
+
+  return allocation;
+}
+
+gpu_allocation* allocate_image(
+  memory_allocator* allocator,
+  VkImage image,
+  VkMemoryPropertyFlags properties,
+  memory_category category
+) {
+  lock_guard<mutex> lock(allocator->mutex);
+  VkMemoryRequirements requirements;
+  gpu_allocation* allocation;
+
+  vkGetImageMemoryRequirements(allocator->device, image, &requirements);
+
+  allocation = allocate_for_requirements(allocator, requirements, properties, category);
+  allocation->image = image;
+  vkBindImageMemory(allocator->device, image, allocation->block->memory, allocation->offset);
+
+  return allocation;
+}
+
+gpu_allocation* allocate_transient_image(
+  memory_allocator* allocator,
+  VkImage image,
+  memory_category category,
+  bool* lazily_allocated
+) {
+  lock_guard<mutex> lock(allocator->mutex);
+  VkMemoryRequirements requirements;
+  VkMemoryPropertyFlags properties;
+  gpu_allocation* allocation;
+
+  vkGetImageMemoryRequirements(allocator->device, image, &requirements);
+
+  // Blocks are per memory type, so lazily allocated blocks only ever hold
+  // transient attachments, which is all that memory may be bound to.
+  properties = VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT | VK_MEMORY_PROPERTY_LAZILY_ALLOCATED_BIT;
+  *lazily_allocated = true;
+
+  if (choose_memory_type(allocator, requirements.memoryTypeBits, properties) == NO_MEMORY_TYPE) {
+    properties = VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT;
+    *lazily_allocated = false;
+  }
+
+  allocation = allocate_for_requirements(allocator, requirements, properties, category);
+  allocation->image = image;
+  vkBindImageMemory(allocator->device, image, allocation->block->memory, allocation->offset);
+
+  return allocation;
+}
+
+gpu_allocation* allocate_image_memory(
+  memory_allocator* allocator,
+  const VkMemoryRequirements& requirements,
+  VkMemoryPropertyFlags properties,
+  memory_category category
+) {
+  lock_guard<mutex> lock(allocator->mutex);
+
+  return allocate_for_requirements(allocator, requirements, properties, category);
+}
+
+// Returns true if there is an empty block other than this one with the
+// same kind and memory type. The mutex must be held.
+static bool has_spare_block(const memory_allocator* allocator, const memory_block* block) {
+  for (const memory_block* other : allocator->blocks) {
+    if (other != block &&
+        other->kind == block->kind &&
+        other->memory_type == block->memory_type &&
+        !other->dedicated &&
+        other->allocations.empty()) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+void free_allocation(memory_allocator* allocator, gpu_allocation* allocation) {
+  lock_guard<mutex> lock(allocator->mutex);
+  memory_block* block;
+
+  block = allocation->block;
+
+  allocator->stats.heap_category_bytes[block_heap(allocator, block)][allocation->category] -=
+    allocation->size;
+  free_from_block(block, allocation->offset, allocation->size);
+  block->used -= allocation->size;
+  block->allocations.erase(find(block->allocations.begin(), block->allocations.end(), allocation));
+
+  delete allocation;
+
+  // Keep one empty block of each kind and memory type around. Otherwise a
+  // pattern like freeing and reallocating the last buffer in a block every
+  // frame goes to the driver for a whole block each time. Dedicated blocks
+  // fit only the allocation they were made for, so they always go.
+  if (block->allocations.empty() &&
+      (block->dedicated || has_spare_block(allocator, block))) {
+    destroy_block(allocator, block);
+  }
+}
+
+memory_allocator_stats get_allocator_stats(memory_allocator* allocator) {
+  lock_guard<mutex> lock(allocator->mutex);
+
+  return allocator->stats;
+}
+
+gpu_allocation* allocate_relocation_target(
+  memory_allocator* allocator,
+  const gpu_allocation* source,
+  const std::vector<memory_block*>& avoid
+) {
+  lock_guard<mutex> lock(allocator->mutex);
+  VkDeviceSize offset;
+
+  for (memory_block* block : allocator->blocks) {
+    if (block->kind != source->block->kind ||
+        block->memory_type != source->block->memory_type ||
+        block->dedicated ||
+        find(avoid.begin(), avoid.end(), block) != avoid.end()) {
+      continue;
+    }
+
+    if (allocate_from_block(block, source->size, allocator->buffer_alignment, &offset)) {
+      return make_allocation(allocator, block, offset, source->size, source->category);
+    }
+  }
+
+  return NULL;
+}
+
+void swap_allocation_placement(memory_allocator* allocator, gpu_allocation* a, gpu_allocation* b) {
+  lock_guard<mutex> lock(allocator->mutex);
+  memory_block* a_block;
+  VkDeviceSize a_offset;
+
+  if (a->size != b->size || a->category != b->category) {
+    throw runtime_error("can only swap allocations of the same size and category!");
+  }
+
+  // Each block's list has to follow its allocation to the other block.
+  // When both are in the same block the list already holds both, and the
+  // two replaces would turn it into two copies of a.
+  if (a->block != b->block) {
+    replace(a->block->allocations.begin(), a->block->allocations.end(), a, b);
+    replace(b->block->allocations.begin(), b->block->allocations.end(), b, a);
+  }
+
+  a_block = a->block;
+  a_offset = a->offset;
+  place_allocation(a, b->block, b->offset);
+  place_allocation(b, a_block, a_offset);
+}
@@ -0,0 +1,227 @@
+#ifndef MEMORY_ALLOCATOR_H
+#define MEMORY_ALLOCATOR_H
+
+#define GLFW_INCLUDE_VULKAN
+
+#include <GLFW/glfw3.h>
+#include <cstdint>
+#include <vector>
+#include <mutex>
+
+//
+// Vulkan only allows a few thousand VkDeviceMemory allocations at once
+// (maxMemoryAllocationCount, often 4096), and each one is slow to make.
+// So instead of one per buffer or image, we allocate big blocks and hand
+// out pieces of them.
+//
+// Buffer blocks go one step further: each block has a single VkBuffer
+// covering all of it, usable for anything, and a buffer allocation is
+// just a range of that buffer. That means fewer buffer objects to bind,
+// and with bufferDeviceAddress every allocation has a GPU virtual address
+// (the block's address plus its offset) that shaders can read through
+// like a pointer:
+//
+//   layout(buffer_reference, std430) readonly buffer vertices {
+//     vec4 positions[];
+//   };
+//   layout(push_constant) uniform draw { vertices verts; };
+//
+// Images can't share memory with buffers in a simple way (see
+// bufferImageGranularity), so they get blocks of their own.
+//
+
+// The size of a normal block. Allocations bigger than
+// DEDICATED_ALLOCATION_SIZE get a block of their own instead.
+const VkDeviceSize MEMORY_BLOCK_SIZE = 64 * 1024 * 1024;
+const VkDeviceSize DEDICATED_ALLOCATION_SIZE = MEMORY_BLOCK_SIZE / 2;
+
+// What an allocation is for. Only used for bookkeeping, so we can tell
+// where the memory went and what to evict when it runs low.
+enum memory_category {
+  MEMORY_TEXTURES,
+  MEMORY_MESHES,
+  MEMORY_RENDER_TARGETS,
+  MEMORY_STAGING,
+  MEMORY_OTHER,
+  NUM_MEMORY_CATEGORIES,
+};
+
+enum allocation_kind {
+  ALLOCATION_BUFFER,
+  ALLOCATION_IMAGE,
+};
+
+struct memory_range {
+  VkDeviceSize offset;
+  VkDeviceSize size;
+};
+
+struct gpu_allocation;
+
+// Called after the defragmenter moves an allocation, once the data is at
+// its new place. Anything that refers to the allocation by its buffer,
+// offset or address (descriptors, addresses stored in other buffers) has
+// to be pointed at the new one before the next frame is recorded.
+typedef void (*relocation_callback)(gpu_allocation* allocation, void* user_data);
+
+struct memory_block {
+  VkDeviceMemory memory;
+  VkDeviceSize size;
+  uint32_t memory_type;
+  allocation_kind kind;
+  // True if the block belongs to a single big allocation.
+  bool dedicated;
+
+  // Buffer blocks only. The buffer covers the whole block, and address
+  // is its device address (0 without bufferDeviceAddress).
+  VkBuffer buffer;
+  VkDeviceAddress address;
+
+  // The whole block, mapped for its lifetime. NULL if it isn't host
+  // visible.
+  uint8_t* mapped;
+
+  // Sorted by offset, with neighbors merged.
+  std::vector<memory_range> free_ranges;
+  std::vector<gpu_allocation*> allocations;
+  // The total size of the allocations.
+  VkDeviceSize used;
+};
+
+// Allocations are handed out as pointers that stay valid until freed, so
+// other code can hold on to them.
+struct gpu_allocation {
+  memory_block* block;
+  // Where the allocation is in the block's memory.
+  VkDeviceSize offset;
+  VkDeviceSize size;
+  memory_category category;
+
+  // Buffer allocations: bind buffer at offset. address is the device
+  // address of the start of the allocation.
+  VkBuffer buffer;
+  VkDeviceAddress address;
+  // Image allocations: the image bound to this memory.
+  VkImage image;
+
+  // NULL unless the memory is host visible.
+  uint8_t* mapped;
+
+  // Buffer allocations with a callback may be moved by the defragmenter
+  // (see defragmenter.h). Only set it on allocations the GPU just reads,
+  // since writes made during a move would be lost.
+  relocation_callback on_relocate;
+  void* relocation_user_data;
+};
+
+struct memory_allocator_stats {
+  // What we've allocated from the driver in each heap, in blocks.
+  VkDeviceSize heap_block_bytes[VK_MAX_MEMORY_HEAPS];
+  // How much of that is handed out, by category.
+  VkDeviceSize heap_category_bytes[VK_MAX_MEMORY_HEAPS][NUM_MEMORY_CATEGORIES];
+};
+
+struct memory_allocator {
+  VkPhysicalDevice physical_device;
+  VkDevice device;
+  VkPhysicalDeviceMemoryProperties memory_properties;
+  // True if the device was created with bufferDeviceAddress.
+  bool buffer_device_address;
+
+  // Every buffer allocation is aligned to this, which satisfies uniform,
+  // storage and texel buffer offsets alike.
+  VkDeviceSize buffer_alignment;
+  // The memory types a block buffer can live in.
+  uint32_t buffer_type_bits;
+  // The queue families block buffers are shared between.
+  std::vector<uint32_t> queue_families;
+
+  // Guards everything below.
+  std::mutex mutex;
+  std::vector<memory_block*> blocks;
+  memory_allocator_stats stats;
+};
+
+// buffer_device_address should only be true if the device was created
+// with the bufferDeviceAddress feature. queue_families are the families
+// that use buffer allocations; repeats are fine.
+void create_memory_allocator(
+  VkPhysicalDevice physical_device,
+  VkDevice device,
+  bool buffer_device_address,
+  const std::vector<uint32_t>& queue_families,
+  memory_allocator* allocator
+);
+// Frees every block. Every allocation must already be freed, and nothing
+// may be using them.
+void destroy_memory_allocator(memory_allocator* allocator);
+
+// Returns a range of a buffer in memory with at least the given
+// properties. Throws if there is no such memory, or it's full.
+gpu_allocation* allocate_buffer(
+  memory_allocator* allocator,
+  VkDeviceSize size,
+  VkMemoryPropertyFlags properties,
+  memory_category category
+);
+
+// Finds memory for the image and binds it.
+gpu_allocation* allocate_image(
+  memory_allocator* allocator,
+  VkImage image,
+  VkMemoryPropertyFlags properties,
+  memory_category category
+);
+
+// For attachments created with VK_IMAGE_USAGE_TRANSIENT_ATTACHMENT_BIT,
+// which are never loaded or stored. Prefers lazily allocated memory,
+// which tile based GPUs only back if an attachment actually has to leave
+// the tile (so usually never), and falls back to device local memory
+// elsewhere. Sets lazily_allocated to which it got, and binds the image.
+gpu_allocation* allocate_transient_image(
+  memory_allocator* allocator,
+  VkImage image,
+  memory_category category,
+  bool* lazily_allocated
+);
+
+// Finds image memory that meets the requirements, without binding it to
+// anything. For binding pieces of sparse images (see virtual_texture.h).
+gpu_allocation* allocate_image_memory(
+  memory_allocator* allocator,
+  const VkMemoryRequirements& requirements,
+  VkMemoryPropertyFlags properties,
+  memory_category category
+);
+
+// The allocation must not be in use by the GPU. Blocks left empty are
+// returned to the driver, except for one spare block of each kind and
+// memory type, which is kept to save the next allocation a trip to the
+// driver.
+void free_allocation(memory_allocator* allocator, gpu_allocation* allocation);
+
+//
+// DEFRAGMENTATION ROUTINES
+//
+// Used by the defragmenter to move an allocation: it gets a target, copies
+// the data over, then swaps the two so the original allocation object
+// (which other code holds on to) ends up at the new place, and the target
+// object at the old one, ready to be freed.
+//
+
+// Returns a new allocation the same size, category and memory type as the
+// source, in an existing block that isn't in avoid. Returns NULL if none
+// of them have room; no new blocks are made.
+gpu_allocation* allocate_relocation_target(
+  memory_allocator* allocator,
+  const gpu_allocation* source,
+  const std::vector<memory_block*>& avoid
+);
+
+// Exchanges where the two allocations are. They may be in the same block.
+void swap_allocation_placement(memory_allocator* allocator, gpu_allocation* a, gpu_allocation* b);
+
+// Returns a copy of the allocator's stats, taken under its lock.
+memory_allocator_stats get_allocator_stats(memory_allocator* allocator);
+
+#endif
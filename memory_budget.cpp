@@ -0,0 +1,162 @@
+#include "memory_budget.h"
+
+#include <cstdio>
+#include <algorithm>
+
+using namespace std;
+
+// The order we evict in: what's cheapest to bring back first.
+const memory_category EVICTION_ORDER[] = {
+  MEMORY_STAGING,
+  MEMORY_TEXTURES,
+  MEMORY_MESHES,
+  MEMORY_OTHER,
+};
+
+const char* const CATEGORY_NAMES[NUM_MEMORY_CATEGORIES] = {
+  "textures",
+  "meshes",
+  "render_targets",
+  "staging",
+  "other",
+};
+
+const double BYTES_PER_MB = 1024.0 * 1024.0;
+
+void create_memory_budget_tracker(
+  VkPhysicalDevice physical_device,
+  bool has_budget_extension,
+  memory_budget_tracker* tracker
+) {
+  VkPhysicalDeviceMemoryProperties properties;
+
+  tracker->physical_device = physical_device;
+  tracker->has_budget_extension = has_budget_extension;
+  tracker->handlers.clear();
+
+  vkGetPhysicalDeviceMemoryProperties(physical_device, &properties);
+
+  tracker->num_heaps = properties.memoryHeapCount;
+
+  for (uint32_t i = 0; i < tracker->num_heaps; i++) {
+    tracker->heaps[i] = {};
+    tracker->heaps[i].size = properties.memoryHeaps[i].size;
+    tracker->heaps[i].device_local =
+      (properties.memoryHeaps[i].flags & VK_MEMORY_HEAP_DEVICE_LOCAL_BIT) != 0;
+  }
+}
+
+void add_eviction_handler(
+  memory_budget_tracker* tracker,
+  memory_category category,
+  eviction_callback callback,
+  void* user_data
+) {
+  tracker->handlers.push_back({ category, callback, user_data });
+}
+
+void remove_eviction_handler(
+  memory_budget_tracker* tracker,
+  eviction_callback callback,
+  void* user_data
+) {
+  tracker->handlers.erase(
+    remove_if(tracker->handlers.begin(), tracker->handlers.end(), [&](const eviction_handler& handler) {
+      return handler.callback == callback && handler.user_data == user_data;
+    }),
+    tracker->handlers.end()
+  );
+}
+
+// Asks the handlers to bring the heap's usage down to the eviction target.
+static void evict_from_heap(memory_budget_tracker* tracker, uint32_t heap_index) {
+  const heap_budget* heap;
+  VkDeviceSize wanted;
+  VkDeviceSize freed;
+
+  heap = &tracker->heaps[heap_index];
+  wanted = heap->usage - (VkDeviceSize)(heap->budget * MEMORY_EVICTION_TARGET);
+
+  // What the handlers say they freed only decides when to stop asking.
+  // It isn't taken off the usage: most of it is only freed frames later,
+  // and freed allocations may leave their blocks allocated, so the next
+  // update's numbers are the only ones to trust.
+  for (memory_category category : EVICTION_ORDER) {
+    for (const eviction_handler& handler : tracker->handlers) {
+      if (wanted == 0) {
+        return;
+      }
+
+      if (handler.category != category || heap->category_bytes[category] == 0) {
+        continue;
+      }
+
+      freed = handler.callback(heap_index, wanted, handler.user_data);
+      wanted -= freed < wanted ? freed : wanted;
+    }
+  }
+}
+
+void update_memory_budget(memory_budget_tracker* tracker, memory_allocator* allocator) {
+  VkPhysicalDeviceMemoryBudgetPropertiesEXT budget_properties{};
+  VkPhysicalDeviceMemoryProperties2 properties{};
+  memory_allocator_stats stats;
+  heap_budget* heap;
+
+  stats = get_allocator_stats(allocator);
+
+  if (tracker->has_budget_extension) {
+    budget_properties.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MEMORY_BUDGET_PROPERTIES_EXT;
+
+    properties.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MEMORY_PROPERTIES_2;
+    properties.pNext = &budget_properties;
+
+    vkGetPhysicalDeviceMemoryProperties2(tracker->physical_device, &properties);
+  }
+
+  for (uint32_t i = 0; i < tracker->num_heaps; i++) {
+    heap = &tracker->heaps[i];
+    heap->allocated = stats.heap_block_bytes[i];
+
+    for (uint32_t category = 0; category < NUM_MEMORY_CATEGORIES; category++) {
+      heap->category_bytes[category] = stats.heap_category_bytes[i][category];
+    }
+
+    if (tracker->has_budget_extension) {
+      heap->budget = budget_properties.heapBudget[i];
+      heap->usage = budget_properties.heapUsage[i];
+    } else {
+      heap->budget = (VkDeviceSize)(heap->size * MEMORY_FALLBACK_BUDGET);
+      heap->usage = heap->allocated;
+    }
+  }
+
+  for (uint32_t i = 0; i < tracker->num_heaps; i++) {
+    heap = &tracker->heaps[i];
+
+    if (heap->usage > heap->budget * MEMORY_PRESSURE_THRESHOLD) {
+      evict_from_heap(tracker, i);
+    }
+  }
+}
+
+void publish_memory_stats(const memory_budget_tracker* tracker, gpu_profiler* profiler) {
+  const heap_budget* heap;
+  char name[MAX_COUNTER_NAME];
+
+  for (uint32_t i = 0; i < tracker->num_heaps; i++) {
+    heap = &tracker->heaps[i];
+
+    snprintf(name, sizeof(name), "heap%u_budget_mb", i);
+    set_profiler_counter(profiler, name, heap->budget / BYTES_PER_MB);
+    snprintf(name, sizeof(name), "heap%u_usage_mb", i);
+    set_profiler_counter(profiler, name, heap->usage / BYTES_PER_MB);
+    snprintf(name, sizeof(name), "heap%u_allocated_mb", i);
+    set_profiler_counter(profiler, name, heap->allocated / BYTES_PER_MB);
+
+    for (uint32_t category = 0; category < NUM_MEMORY_CATEGORIES; category++) {
+      snprintf(name, sizeof(name), "heap%u_%s_mb", i, CATEGORY_NAMES[category]);
+      set_profiler_counter(profiler, name, heap->category_bytes[category] / BYTES_PER_MB);
+    }
+  }
+}
@@ -0,0 +1,106 @@
+#ifndef MEMORY_BUDGET_H
+#define MEMORY_BUDGET_H
+
+#define GLFW_INCLUDE_VULKAN
+
+#include <GLFW/glfw3.h>
+#include <cstdint>
+#include <vector>
+
+#include "memory_allocator.h"
+#include "gpu_profiler.h"
+
+//
+// A heap's size is not how much of it we can use. Other programs (and the
+// desktop compositor) share it, and when a device local heap is
+// oversubscribed the driver doesn't fail our allocations; it quietly moves
+// some of them to system memory, where every access goes over the bus.
+// Nothing errors, the frame rate just drops.
+//
+// VK_EXT_memory_budget tells us how much of each heap the OS is willing to
+// give us right now (the budget) and how much we're using (the usage). We
+// check it every frame, and when a heap gets close to its budget we ask
+// whoever owns the memory to give some back before the driver decides for
+// us. Without the extension we have to guess, so the budget is taken to be
+// a fraction of the heap and the usage is whatever our allocator holds.
+//
+
+// When usage passes this fraction of the budget, we start evicting...
+const double MEMORY_PRESSURE_THRESHOLD = 0.9;
+// ...until it's back under this one.
+const double MEMORY_EVICTION_TARGET = 0.8;
+// The budget we assume for a heap without VK_EXT_memory_budget.
+const double MEMORY_FALLBACK_BUDGET = 0.8;
+
+// Asked to free about bytes_wanted of the heap's memory (more or less is
+// fine). Returns how much it actually freed.
+typedef VkDeviceSize (*eviction_callback)(
+  uint32_t heap,
+  VkDeviceSize bytes_wanted,
+  void* user_data
+);
+
+struct eviction_handler {
+  // The category of memory the callback can free.
+  memory_category category;
+  eviction_callback callback;
+  void* user_data;
+};
+
+struct heap_budget {
+  VkDeviceSize size;
+  bool device_local;
+  // What the OS lets us use and what we (the whole process) use, in bytes.
+  VkDeviceSize budget;
+  VkDeviceSize usage;
+  // What our allocator has in this heap, in blocks and by category.
+  VkDeviceSize allocated;
+  VkDeviceSize category_bytes[NUM_MEMORY_CATEGORIES];
+};
+
+struct memory_budget_tracker {
+  VkPhysicalDevice physical_device;
+  // True if the device was created with VK_EXT_memory_budget.
+  bool has_budget_extension;
+
+  uint32_t num_heaps;
+  heap_budget heaps[VK_MAX_MEMORY_HEAPS];
+
+  std::vector<eviction_handler> handlers;
+};
+
+// has_budget_extension should only be true if the device was created with
+// VK_EXT_memory_budget.
+void create_memory_budget_tracker(
+  VkPhysicalDevice physical_device,
+  bool has_budget_extension,
+  memory_budget_tracker* tracker
+);
+
+// Handlers are asked in category order: staging first, then textures,
+// meshes and everything else. Render targets are never evicted, since the
+// frame can't be drawn without them.
+void add_eviction_handler(
+  memory_budget_tracker* tracker,
+  memory_category category,
+  eviction_callback callback,
+  void* user_data
+);
+// For when whatever the handler frees is destroyed.
+void remove_eviction_handler(
+  memory_budget_tracker* tracker,
+  eviction_callback callback,
+  void* user_data
+);
+
+// Call once a frame. Refreshes the budgets, and evicts from any heap that
+// is over MEMORY_PRESSURE_THRESHOLD of its budget. Handlers may free their
+// memory later (once the GPU is done with it) or not as much as they
+// said, so the usage isn't corrected until the next call measures it.
+void update_memory_budget(memory_budget_tracker* tracker, memory_allocator* allocator);
+
+// Sets profiler counters with the usage, budget and categories of every
+// heap, in megabytes.
+void publish_memory_stats(const memory_budget_tracker* tracker, gpu_profiler* profiler);
+
+#endif
@@ -0,0 +1,709 @@
+#include "mesh_lod.h"
+
+#include <stdexcept>
+#include <vector>
+#include <queue>
+#include <unordered_map>
+#include <algorithm>
+#include <fstream>
+#include <cmath>
+#include <cfloat>
+
+using namespace std;
+
+// "MLOD" when read as little endian bytes.
+const uint32_t MESH_FILE_MAGIC = 0x444f4c4d;
+
+// Boundary edges (edges used by only one triangle) get an extra plane
+// perpendicular to their triangle. This is how strongly that plane is
+// weighted. Without it the simplifier happily eats away at the open
+// edges of a mesh since moving along them costs nothing.
+const double BOUNDARY_WEIGHT = 10.0;
+
+//
+// A quadric is a symmetric 4x4 matrix, so we only store the upper
+// triangle: aa ab ac ad bb bc bd cc cd dd. weight is the total weight of
+// the planes summed into it, which turns the sum into an average.
+//
+
+struct quadric {
+  double a[10];
+  double weight;
+};
+
+// A candidate collapse of the edge from -> to. The versions let us throw
+// out candidates that went stale because one of the vertices changed
+// since the candidate was pushed.
+struct edge_collapse {
+  double cost;
+  uint32_t from;
+  uint32_t to;
+  uint32_t from_version;
+  uint32_t to_version;
+};
+
+struct edge_collapse_greater {
+  bool operator()(const edge_collapse& x, const edge_collapse& y) const {
+    return x.cost > y.cost;
+  }
+};
+
+typedef priority_queue<
+  edge_collapse,
+  vector<edge_collapse>,
+  edge_collapse_greater
+> collapse_queue;
+
+struct vec3 {
+  double x;
+  double y;
+  double z;
+};
+
+// Makes sure every index refers to a whole vertex, so nothing after this
+// reads past the end of the vertex buffer.
+static void check_indices(
+  const vector<uint32_t>& indices,
+  size_t num_vertices,
+  const char* message
+) {
+  for (uint32_t index : indices) {
+    if (index >= num_vertices) {
+      throw runtime_error(message);
+    }
+  }
+}
+
+static void check_mesh(const mesh_data& mesh) {
+  // The first three floats of a vertex are its position.
+  if (mesh.vertex_stride < 3 ||
+      mesh.vertices.size() % mesh.vertex_stride != 0 ||
+      mesh.indices.size() % 3 != 0) {
+    throw runtime_error("mesh to simplify is malformed!");
+  }
+
+  check_indices(
+    mesh.indices,
+    mesh.vertices.size() / mesh.vertex_stride,
+    "mesh to simplify has an index past its last vertex!"
+  );
+}
+
+static vec3 vertex_position(const mesh_data& mesh, uint32_t v) {
+  const float* p;
+
+  p = &mesh.vertices[(size_t)v * mesh.vertex_stride];
+
+  return { p[0], p[1], p[2] };
+}
+
+static vec3 sub(vec3 a, vec3 b) {
+  return { a.x - b.x, a.y - b.y, a.z - b.z };
+}
+
+static vec3 cross(vec3 a, vec3 b) {
+  return {
+    a.y * b.z - a.z * b.y,
+    a.z * b.x - a.x * b.z,
+    a.x * b.y - a.y * b.x
+  };
+}
+
+static double dot(vec3 a, vec3 b) {
+  return a.x * b.x + a.y * b.y + a.z * b.z;
+}
+
+static double length(vec3 a) {
+  return sqrt(dot(a, a));
+}
+
+// Adds the quadric of the plane n.p + d = 0 (n must be unit length)
+// to q, scaled by weight.
+static void add_plane(quadric* q, vec3 n, double d, double weight) {
+  q->a[0] += weight * n.x * n.x;
+  q->a[1] += weight * n.x * n.y;
+  q->a[2] += weight * n.x * n.z;
+  q->a[3] += weight * n.x * d;
+  q->a[4] += weight * n.y * n.y;
+  q->a[5] += weight * n.y * n.z;
+  q->a[6] += weight * n.y * d;
+  q->a[7] += weight * n.z * n.z;
+  q->a[8] += weight * n.z * d;
+  q->a[9] += weight * d * d;
+  q->weight += weight;
+}
+
+static void add_quadric(quadric* dst, const quadric& src) {
+  for (uint32_t i = 0; i < 10; i++) {
+    dst->a[i] += src.a[i];
+  }
+
+  dst->weight += src.weight;
+}
+
+// Evaluates v^T (q0 + q1) v with v = (p, 1), which is the weighted sum of
+// squared distances from p to every plane that went into the two quadrics,
+// and divides it by the total weight. The result is a mean squared
+// distance, so it doesn't grow just because a vertex has absorbed a lot of
+// planes, and its square root is in model units.
+static double collapse_cost(const quadric& q0, const quadric& q1, vec3 p) {
+  double a[10];
+  double weight;
+  double cost;
+
+  for (uint32_t i = 0; i < 10; i++) {
+    a[i] = q0.a[i] + q1.a[i];
+  }
+
+  cost = a[0] * p.x * p.x + 2 * a[1] * p.x * p.y + 2 * a[2] * p.x * p.z +
+         2 * a[3] * p.x + a[4] * p.y * p.y + 2 * a[5] * p.y * p.z +
+         2 * a[6] * p.y + a[7] * p.z * p.z + 2 * a[8] * p.z + a[9];
+
+  // Vertices only used by degenerate triangles have no planes at all.
+  weight = q0.weight + q1.weight;
+
+  if (weight == 0.0) {
+    return 0.0;
+  }
+
+  // Rounding can push a perfect collapse slightly below zero.
+  return max(cost / weight, 0.0);
+}
+
+static uint64_t edge_key(uint32_t a, uint32_t b) {
+  if (a > b) {
+    swap(a, b);
+  }
+
+  return ((uint64_t)a << 32) | b;
+}
+
+// Returns true if collapsing from -> to would flip the facing of any
+// triangle that survives the collapse.
+static bool collapse_flips_triangle(
+  const mesh_data& mesh,
+  const vector<uint32_t>& triangles,
+  const vector<bool>& removed,
+  const vector<uint32_t>& from_triangles,
+  uint32_t from,
+  uint32_t to
+) {
+  const uint32_t* tri;
+  vec3 p[3];
+  vec3 before;
+  vec3 after;
+  uint32_t i;
+
+  for (uint32_t t : from_triangles) {
+    tri = &triangles[(size_t)t * 3];
+
+    if (removed[t] || tri[0] == to || tri[1] == to || tri[2] == to) {
+      continue;
+    }
+
+    for (i = 0; i < 3; i++) {
+      p[i] = vertex_position(mesh, tri[i]);
+    }
+
+    before = cross(sub(p[1], p[0]), sub(p[2], p[0]));
+
+    for (i = 0; i < 3; i++) {
+      if (tri[i] == from) {
+        p[i] = vertex_position(mesh, to);
+      }
+    }
+
+    after = cross(sub(p[1], p[0]), sub(p[2], p[0]));
+
+    if (dot(before, after) <= 0.0) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+static void push_collapse(
+  collapse_queue* queue,
+  const mesh_data& mesh,
+  const vector<quadric>& quadrics,
+  const vector<uint32_t>& versions,
+  uint32_t from,
+  uint32_t to
+) {
+  edge_collapse collapse;
+
+  collapse.cost = collapse_cost(
+    quadrics[from],
+    quadrics[to],
+    vertex_position(mesh, to)
+  );
+  collapse.from = from;
+  collapse.to = to;
+  collapse.from_version = versions[from];
+  collapse.to_version = versions[to];
+
+  queue->push(collapse);
+}
+
+vector<uint32_t> simplify_mesh(
+  const mesh_data& mesh,
+  uint32_t target_index_count,
+  float max_error,
+  float* result_error
+) {
+  size_t num_vertices;
+  size_t num_triangles;
+  vector<uint32_t> triangles;
+  vector<bool> removed;
+  vector<quadric> quadrics;
+  vector<vector<uint32_t>> vertex_triangles;
+  vector<uint32_t> versions;
+  unordered_map<uint64_t, uint32_t> edge_uses;
+  collapse_queue queue;
+  edge_collapse collapse;
+  size_t live_index_count;
+  double max_cost;
+  double worst_cost;
+  vector<uint32_t> result;
+  const uint32_t* tri;
+  vec3 p[3];
+  vec3 normal;
+  vec3 edge_normal;
+  double normal_length;
+  double edge_length;
+  bool shares_triangle;
+  uint32_t i;
+
+  check_mesh(mesh);
+
+  num_vertices = mesh.vertices.size() / mesh.vertex_stride;
+  num_triangles = mesh.indices.size() / 3;
+
+  triangles = mesh.indices;
+  removed.assign(num_triangles, false);
+  quadrics.assign(num_vertices, quadric{});
+  vertex_triangles.resize(num_vertices);
+  versions.assign(num_vertices, 0);
+
+  //
+  // First, build the quadric for every vertex from the planes of the
+  // triangles around it, and remember which triangles use which vertex.
+  //
+
+  for (size_t t = 0; t < num_triangles; t++) {
+    tri = &triangles[t * 3];
+
+    for (i = 0; i < 3; i++) {
+      p[i] = vertex_position(mesh, tri[i]);
+      vertex_triangles[tri[i]].push_back((uint32_t)t);
+      edge_uses[edge_key(tri[i], tri[(i + 1) % 3])]++;
+    }
+
+    normal = cross(sub(p[1], p[0]), sub(p[2], p[0]));
+    normal_length = length(normal);
+
+    // Degenerate triangles don't describe a plane.
+    if (normal_length == 0.0) {
+      continue;
+    }
+
+    normal = { normal.x / normal_length, normal.y / normal_length, normal.z / normal_length };
+
+    for (i = 0; i < 3; i++) {
+      add_plane(&quadrics[tri[i]], normal, -dot(normal, p[0]), 1.0);
+    }
+  }
+
+  //
+  // Next, pin down the boundary edges with a plane that contains the edge
+  // and is perpendicular to the triangle.
+  //
+
+  for (size_t t = 0; t < num_triangles; t++) {
+    tri = &triangles[t * 3];
+
+    for (i = 0; i < 3; i++) {
+      p[i] = vertex_position(mesh, tri[i]);
+    }
+
+    normal = cross(sub(p[1], p[0]), sub(p[2], p[0]));
+
+    for (i = 0; i < 3; i++) {
+      if (edge_uses[edge_key(tri[i], tri[(i + 1) % 3])] != 1) {
+        continue;
+      }
+
+      edge_normal = cross(sub(p[(i + 1) % 3], p[i]), normal);
+      edge_length = length(edge_normal);
+
+      if (edge_length == 0.0) {
+        continue;
+      }
+
+      edge_normal = { edge_normal.x / edge_length, edge_normal.y / edge_length, edge_normal.z / edge_length };
+
+      add_plane(&quadrics[tri[i]], edge_normal, -dot(edge_normal, p[i]), BOUNDARY_WEIGHT);
+      add_plane(&quadrics[tri[(i + 1) % 3]], edge_normal, -dot(edge_normal, p[i]), BOUNDARY_WEIGHT);
+    }
+  }
+
+  //
+  // Now seed the queue with both directions of every edge. We only ever
+  // collapse a vertex onto one of its neighbours (rather than solving for
+  // the optimal point) so that the other vertex attributes stay valid and
+  // every LOD can share one vertex buffer.
+  //
+
+  for (size_t t = 0; t < num_triangles; t++) {
+    tri = &triangles[t * 3];
+
+    for (i = 0; i < 3; i++) {
+      push_collapse(&queue, mesh, quadrics, versions, tri[i], tri[(i + 1) % 3]);
+      push_collapse(&queue, mesh, quadrics, versions, tri[(i + 1) % 3], tri[i]);
+    }
+  }
+
+  //
+  // Finally, collapse the cheapest edge until we are under budget.
+  //
+
+  live_index_count = triangles.size();
+  max_cost = (double)max_error * (double)max_error;
+  worst_cost = 0.0;
+
+  while (live_index_count > target_index_count && !queue.empty()) {
+    collapse = queue.top();
+    queue.pop();
+
+    // One of the two vertices changed since this was pushed.
+    if (versions[collapse.from] != collapse.from_version ||
+        versions[collapse.to] != collapse.to_version) {
+      continue;
+    }
+
+    // The queue is sorted by cost, so nothing after this is any cheaper.
+    if (collapse.cost > max_cost) {
+      break;
+    }
+
+    // The edge may have disappeared along with the last triangle using it.
+    shares_triangle = false;
+    for (uint32_t t : vertex_triangles[collapse.from]) {
+      tri = &triangles[(size_t)t * 3];
+
+      if (!removed[t] &&
+          (tri[0] == collapse.to || tri[1] == collapse.to || tri[2] == collapse.to)) {
+        shares_triangle = true;
+        break;
+      }
+    }
+
+    if (!shares_triangle) {
+      continue;
+    }
+
+    if (collapse_flips_triangle(
+          mesh,
+          triangles,
+          removed,
+          vertex_triangles[collapse.from],
+          collapse.from,
+          collapse.to)) {
+      continue;
+    }
+
+    // Triangles using both vertices become degenerate and are removed.
+    // The rest are moved over onto the vertex we collapse to.
+    for (uint32_t t : vertex_triangles[collapse.from]) {
+      if (removed[t]) {
+        continue;
+      }
+
+      for (i = 0; i < 3; i++) {
+        if (triangles[(size_t)t * 3 + i] == collapse.to) {
+          break;
+        }
+      }
+
+      if (i < 3) {
+        removed[t] = true;
+        live_index_count -= 3;
+        continue;
+      }
+
+      for (i = 0; i < 3; i++) {
+        if (triangles[(size_t)t * 3 + i] == collapse.from) {
+          triangles[(size_t)t * 3 + i] = collapse.to;
+        }
+      }
+
+      vertex_triangles[collapse.to].push_back(t);
+    }
+
+    vertex_triangles[collapse.from].clear();
+    add_quadric(&quadrics[collapse.to], quadrics[collapse.from]);
+    versions[collapse.from]++;
+    versions[collapse.to]++;
+    worst_cost = max(worst_cost, collapse.cost);
+
+    // Every edge touching the surviving vertex now has a new cost.
+    for (uint32_t t : vertex_triangles[collapse.to]) {
+      if (removed[t]) {
+        continue;
+      }
+
+      for (i = 0; i < 3; i++) {
+        uint32_t other = triangles[(size_t)t * 3 + i];
+
+        if (other != collapse.to) {
+          push_collapse(&queue, mesh, quadrics, versions, collapse.to, other);
+          push_collapse(&queue, mesh, quadrics, versions, other, collapse.to);
+        }
+      }
+    }
+  }
+
+  for (size_t t = 0; t < num_triangles; t++) {
+    if (!removed[t]) {
+      result.insert(result.end(), &triangles[t * 3], &triangles[t * 3] + 3);
+    }
+  }
+
+  if (result_error != NULL) {
+    *result_error = (float)sqrt(worst_cost);
+  }
+
+  return result;
+}
+
+mesh_lod_chain generate_lod_chain(const mesh_data& mesh, uint32_t lod_count) {
+  mesh_lod_chain chain;
+  mesh_lod lod;
+  vector<uint32_t> simplified;
+  uint32_t target_index_count;
+  float error;
+  float radius_sq;
+  const float* p;
+
+  check_mesh(mesh);
+
+  chain.vertices = mesh.vertices;
+  chain.vertex_stride = mesh.vertex_stride;
+  chain.indices = mesh.indices;
+
+  lod.index_offset = 0;
+  lod.index_count = (uint32_t)mesh.indices.size();
+  lod.error = 0.0f;
+  chain.lods.push_back(lod);
+
+  //
+  // Every LOD is simplified from the original mesh rather than from the
+  // previous LOD. It costs a bit more time in the converter, but the error
+  // we store is then measured against the real surface.
+  //
+
+  for (uint32_t i = 1; i < lod_count; i++) {
+    target_index_count = (chain.lods.back().index_count / 2) / 3 * 3;
+
+    if (target_index_count == 0) {
+      break;
+    }
+
+    simplified = simplify_mesh(mesh, target_index_count, FLT_MAX, &error);
+
+    // If we couldn't get meaningfully below the previous LOD, any further
+    // LODs would just be copies of it.
+    if (simplified.size() > chain.lods.back().index_count * 0.85f) {
+      break;
+    }
+
+    lod.index_offset = (uint32_t)chain.indices.size();
+    lod.index_count = (uint32_t)simplified.size();
+    // Keep errors increasing down the chain, since select_lod relies on it.
+    lod.error = max(error, chain.lods.back().error);
+
+    chain.indices.insert(chain.indices.end(), simplified.begin(), simplified.end());
+    chain.lods.push_back(lod);
+  }
+
+  radius_sq = 0.0f;
+  for (size_t v = 0; v < mesh.vertices.size(); v += mesh.vertex_stride) {
+    p = &mesh.vertices[v];
+    radius_sq = max(radius_sq, p[0] * p[0] + p[1] * p[1] + p[2] * p[2]);
+  }
+
+  chain.bounding_radius = sqrt(radius_sq);
+
+  return chain;
+}
+
+//
+// The binary mesh file is laid out as:
+//
+// uint32_t magic, version, vertex_stride, vertex_count, index_count, lod_count
+// float bounding_radius
+// float vertices[vertex_count * vertex_stride]
+// uint32_t indices[index_count]
+// mesh_lod lods[lod_count]
+//
+// Everything is little endian, which is every platform we care about.
+//
+
+void write_mesh_lod_chain(const string& path, const mesh_lod_chain& chain) {
+  ofstream file;
+  uint32_t header[6];
+
+  file.open(path, ios::binary);
+
+  if (!file.is_open()) {
+    throw runtime_error("failed to open mesh file for writing!");
+  }
+
+  header[0] = MESH_FILE_MAGIC;
+  header[1] = MESH_FILE_VERSION;
+  header[2] = chain.vertex_stride;
+  header[3] = (uint32_t)(chain.vertices.size() / chain.vertex_stride);
+  header[4] = (uint32_t)chain.indices.size();
+  header[5] = (uint32_t)chain.lods.size();
+
+  file.write((const char*)header, sizeof(header));
+  file.write((const char*)&chain.bounding_radius, sizeof(float));
+  file.write((const char*)chain.vertices.data(), chain.vertices.size() * sizeof(float));
+  file.write((const char*)chain.indices.data(), chain.indices.size() * sizeof(uint32_t));
+  file.write((const char*)chain.lods.data(), chain.lods.size() * sizeof(mesh_lod));
+
+  if (!file.good()) {
+    throw runtime_error("failed to write mesh file!");
+  }
+}
+
+mesh_lod_chain read_mesh_lod_chain(const string& path) {
+  ifstream file;
+  uint64_t file_size;
+  uint64_t expected_size;
+  uint32_t header[6];
+  mesh_lod_chain chain;
+
+  file.open(path, ios::binary | ios::ate);
+
+  if (!file.is_open()) {
+    throw runtime_error("failed to open mesh file!");
+  }
+
+  file_size = (uint64_t)file.tellg();
+  file.seekg(0);
+
+  file.read((char*)header, sizeof(header));
+
+  if (!file.good() || header[0] != MESH_FILE_MAGIC) {
+    throw runtime_error("file is not a mesh file!");
+  }
+
+  if (header[1] != MESH_FILE_VERSION) {
+    throw runtime_error("mesh file was written by a different version of the converter!");
+  }
+
+  if (header[2] < 3) {
+    throw runtime_error("mesh file has vertices too small to hold a position!");
+  }
+
+  // Check the counts against the size before allocating anything, so a
+  // corrupt header can't ask for gigabytes. 64 bits can't overflow here.
+  expected_size = sizeof(header) + sizeof(float) +
+                  (uint64_t)header[3] * header[2] * sizeof(float) +
+                  (uint64_t)header[4] * sizeof(uint32_t) +
+                  (uint64_t)header[5] * sizeof(mesh_lod);
+
+  if (expected_size != file_size) {
+    throw runtime_error("mesh file size doesn't match its header!");
+  }
+
+  chain.vertex_stride = header[2];
+  chain.vertices.resize((size_t)header[3] * header[2]);
+  chain.indices.resize(header[4]);
+  chain.lods.resize(header[5]);
+
+  file.read((char*)&chain.bounding_radius, sizeof(float));
+  file.read((char*)chain.vertices.data(), chain.vertices.size() * sizeof(float));
+  file.read((char*)chain.indices.data(), chain.indices.size() * sizeof(uint32_t));
+  file.read((char*)chain.lods.data(), chain.lods.size() * sizeof(mesh_lod));
+
+  if (!file.good()) {
+    throw runtime_error("mesh file is truncated!");
+  }
+
+  check_indices(chain.indices, header[3], "mesh file has an index past its last vertex!");
+
+  for (const mesh_lod& lod : chain.lods) {
+    if ((uint64_t)lod.index_offset + lod.index_count > chain.indices.size() ||
+        lod.index_count % 3 != 0) {
+      throw runtime_error("mesh file has a LOD outside its indices!");
+    }
+  }
+
+  return chain;
+}
+
+float lod_projection_scale(float fov_y, float viewport_height) {
+  return viewport_height / (2.0f * tan(fov_y * 0.5f));
+}
+
+float projected_screen_size(
+  float world_size,
+  float distance,
+  float projection_scale
+) {
+  return world_size * projection_scale / distance;
+}
+
+uint32_t select_lod(
+  const mesh_lod_chain& chain,
+  lod_selection* state,
+  float distance,
+  float object_scale,
+  float projection_scale,
+  float threshold_pixels
+) {
+  uint32_t lod;
+  float limit;
+  float error_pixels;
+
+  // The camera is inside (or right on top of) the object.
+  if (distance <= chain.bounding_radius * object_scale) {
+    state->current_lod = 0;
+    return 0;
+  }
+
+  //
+  // Errors increase down the chain, so walk it until the projected
+  // error gets too big. LODs coarser than the one we are using now must
+  // clear a stricter limit, so an object has to move a fair bit further
+  // away before it switches back and forth.
+  //
+
+  lod = 0;
+  for (uint32_t i = 1; i < chain.lods.size(); i++) {
+    limit = threshold_pixels;
+
+    if (i > state->current_lod) {
+      limit *= 1.0f - LOD_HYSTERESIS;
+    }
+
+    error_pixels = projected_screen_size(
+      chain.lods[i].error * object_scale,
+      distance,
+      projection_scale
+    );
+
+    if (error_pixels > limit) {
+      break;
+    }
+
+    lod = i;
+  }
+
+  state->current_lod = lod;
+
+  return lod;
+}
@@ -0,0 +1,140 @@
+#ifndef MESH_LOD_H
+#define MESH_LOD_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+//
+// Level of detail (LOD) is the idea that an object far away from the
+// camera covers only a handful of pixels, so drawing all of its triangles
+// is wasted work. Instead, we keep a chain of progressively simpler
+// versions of the mesh and pick one based on how big the object is on
+// screen.
+//
+// The simplified meshes are made with quadric error metrics (Garland and
+// Heckbert, 1997). Every vertex gets a 4x4 matrix (the quadric) that
+// measures the squared distance from a point to the planes of the triangles
+// around it. We then repeatedly collapse the edge whose collapse moves the
+// surface the least, until we hit the triangle budget for that LOD.
+//
+// The quadric sum grows with the number of planes a vertex has absorbed,
+// so it isn't a distance by itself. Every quadric also tracks the total
+// weight of its planes, and the error we report is the square root of the
+// sum divided by that weight: the weighted RMS distance (in model units)
+// from the collapsed vertex to the original planes around it. That is what
+// max_error and the per-LOD error are measured in.
+//
+
+// Bumped whenever the layout of the binary mesh file changes.
+const uint32_t MESH_FILE_VERSION = 1;
+
+// The number of LODs we generate by default, including the original mesh.
+const uint32_t MAX_MESH_LODS = 5;
+
+// When moving to a coarser LOD, the projected error must be this fraction
+// below the threshold. Without this, an object sitting right on the
+// threshold flickers between two LODs every frame ("popping").
+const float LOD_HYSTERESIS = 0.25f;
+
+// A triangle mesh as it comes out of the asset converter. Vertices are
+// interleaved floats, vertex_stride floats each, and the first three floats
+// of every vertex are always its position. Any other attributes (normals,
+// texture coordinates, etc.) ride along untouched.
+struct mesh_data {
+  std::vector<float> vertices;
+  std::vector<uint32_t> indices;
+  uint32_t vertex_stride;
+};
+
+// One entry in the LOD chain. All LODs share the same vertex buffer, so
+// a LOD is just a range of the index buffer.
+struct mesh_lod {
+  uint32_t index_offset;
+  uint32_t index_count;
+  // The largest weighted RMS distance (in model units) of any collapse
+  // that made this LOD, i.e. roughly how far the simplified surface moved
+  // away from the original. This is what we project to the screen at
+  // runtime to decide if the LOD is good enough.
+  float error;
+};
+
+struct mesh_lod_chain {
+  std::vector<float> vertices;
+  uint32_t vertex_stride;
+  // The indices of every LOD, one after the other. lods[0] is always
+  // the full detail mesh.
+  std::vector<uint32_t> indices;
+  std::vector<mesh_lod> lods;
+  // Radius of a sphere around the origin that encloses every vertex.
+  float bounding_radius;
+};
+
+// Per-object state needed to apply hysteresis when picking a LOD.
+struct lod_selection {
+  uint32_t current_lod;
+};
+
+//
+// MESH SIMPLIFICATION ROUTINES
+//
+
+// Simplifies the mesh until it has at most target_index_count indices, or
+// until no edge can be collapsed without moving the surface further than
+// max_error. Returns the new index buffer, which refers to the original
+// vertices. If result_error is not NULL, it receives the error of the
+// simplified mesh. Throws if the mesh is malformed (a stride too small to
+// hold a position, a partial vertex or triangle, or an index past the last
+// vertex).
+std::vector<uint32_t> simplify_mesh(
+  const mesh_data& mesh,
+  uint32_t target_index_count,
+  float max_error,
+  float* result_error
+);
+
+// Builds a chain of up to lod_count LODs, each with roughly half the
+// triangles of the one before it. Stops early once simplification no
+// longer makes meaningful progress.
+mesh_lod_chain generate_lod_chain(const mesh_data& mesh, uint32_t lod_count);
+
+//
+// MESH FILE ROUTINES
+//
+
+void write_mesh_lod_chain(const std::string& path, const mesh_lod_chain& chain);
+// Throws if the file is not a mesh file, or if its counts don't match its
+// size or its indices and LODs point outside the data.
+mesh_lod_chain read_mesh_lod_chain(const std::string& path);
+
+//
+// LOD SELECTION ROUTINES
+//
+
+// Returns the projection scale used to turn a size in world units at some
+// distance into a size in pixels, given the vertical field of view (in
+// radians) and the height of the viewport in pixels.
+float lod_projection_scale(float fov_y, float viewport_height);
+
+// Returns the size in pixels of a sphere with the given radius at the given
+// distance from the camera.
+float projected_screen_size(
+  float radius,
+  float distance,
+  float projection_scale
+);
+
+// Picks the coarsest LOD whose error projects to less than
+// threshold_pixels, given the distance from the camera and the uniform
+// scale of the object. Updates (and uses) state for hysteresis. Intended
+// to be called from the culling pass once per visible object.
+uint32_t select_lod(
+  const mesh_lod_chain& chain,
+  lod_selection* state,
+  float distance,
+  float object_scale,
+  float projection_scale,
+  float threshold_pixels
+);
+
+#endif
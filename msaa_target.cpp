@@ -0,0 +1,332 @@
+#include "msaa_target.h"
+
+#include <stdexcept>
+
+using namespace std;
+
+// The attachments, in framebuffer order. The resolve attachment is only
+// there with more than one sample; with one, the target is the color.
+enum msaa_attachment {
+  MSAA_COLOR,
+  MSAA_DEPTH,
+  MSAA_RESOLVE,
+};
+
+// The most samples no more than wanted that the device supports for both
+// color and depth attachments.
+static VkSampleCountFlagBits choose_samples(VkPhysicalDevice physical_device, uint32_t wanted) {
+  VkPhysicalDeviceProperties properties;
+  VkSampleCountFlags supported;
+
+  vkGetPhysicalDeviceProperties(physical_device, &properties);
+
+  supported = properties.limits.framebufferColorSampleCounts &
+              properties.limits.framebufferDepthSampleCounts;
+
+  for (uint32_t samples = VK_SAMPLE_COUNT_64_BIT; samples > VK_SAMPLE_COUNT_1_BIT; samples >>= 1) {
+    if (samples <= wanted && (supported & samples)) {
+      return (VkSampleCountFlagBits)samples;
+    }
+  }
+
+  return VK_SAMPLE_COUNT_1_BIT;
+}
+
+static bool has_stencil(VkFormat format) {
+  return format == VK_FORMAT_D24_UNORM_S8_UINT || format == VK_FORMAT_D32_SFLOAT_S8_UINT;
+}
+
+static void create_render_pass(msaa_target* msaa) {
+  VkAttachmentDescription attachments[3]{};
+  VkAttachmentReference color_ref{};
+  VkAttachmentReference depth_ref{};
+  VkAttachmentReference resolve_ref{};
+  VkSubpassDescription subpass{};
+  VkSubpassDependency dependencies[2]{};
+  VkRenderPassCreateInfo render_pass_info{};
+  bool resolve;
+  const VkPipelineStageFlags attachment_stages =
+    VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT |
+    VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT |
+    VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT;
+  const VkAccessFlags attachment_writes =
+    VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+
+  resolve = msaa->samples != VK_SAMPLE_COUNT_1_BIT;
+
+  // Cleared on chip and thrown away, never loaded or stored. Without a
+  // resolve this is the target itself, so it's kept.
+  attachments[MSAA_COLOR].format = msaa->color_format;
+  attachments[MSAA_COLOR].samples = msaa->samples;
+  attachments[MSAA_COLOR].loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
+  attachments[MSAA_COLOR].storeOp = resolve ? VK_ATTACHMENT_STORE_OP_DONT_CARE : VK_ATTACHMENT_STORE_OP_STORE;
+  attachments[MSAA_COLOR].stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+  attachments[MSAA_COLOR].stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+  attachments[MSAA_COLOR].initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+  attachments[MSAA_COLOR].finalLayout =
+    resolve ? VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL : VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+
+  attachments[MSAA_DEPTH].format = msaa->depth_format;
+  attachments[MSAA_DEPTH].samples = msaa->samples;
+  attachments[MSAA_DEPTH].loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
+  attachments[MSAA_DEPTH].storeOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+  attachments[MSAA_DEPTH].stencilLoadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
+  attachments[MSAA_DEPTH].stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+  attachments[MSAA_DEPTH].initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+  attachments[MSAA_DEPTH].finalLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+
+  // Written whole by the resolve, so what was there can go.
+  attachments[MSAA_RESOLVE].format = msaa->color_format;
+  attachments[MSAA_RESOLVE].samples = VK_SAMPLE_COUNT_1_BIT;
+  attachments[MSAA_RESOLVE].loadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+  attachments[MSAA_RESOLVE].storeOp = VK_ATTACHMENT_STORE_OP_STORE;
+  attachments[MSAA_RESOLVE].stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+  attachments[MSAA_RESOLVE].stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+  attachments[MSAA_RESOLVE].initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+  attachments[MSAA_RESOLVE].finalLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+
+  color_ref.attachment = MSAA_COLOR;
+  color_ref.layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+  depth_ref.attachment = MSAA_DEPTH;
+  depth_ref.layout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+  resolve_ref.attachment = MSAA_RESOLVE;
+  resolve_ref.layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+
+  subpass.pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS;
+  subpass.colorAttachmentCount = 1;
+  subpass.pColorAttachments = &color_ref;
+  subpass.pResolveAttachments = resolve ? &resolve_ref : NULL;
+  subpass.pDepthStencilAttachment = &depth_ref;
+
+  // Last frame's pass has to be done with the attachments, and whoever
+  // sampled the target done reading it, before we draw over them.
+  dependencies[0].srcSubpass = VK_SUBPASS_EXTERNAL;
+  dependencies[0].dstSubpass = 0;
+  dependencies[0].srcStageMask =
+    attachment_stages | VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT;
+  dependencies[0].dstStageMask = attachment_stages;
+  dependencies[0].srcAccessMask = attachment_writes;
+  dependencies[0].dstAccessMask = attachment_writes | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT;
+
+  // The resolve happens in the color attachment output stage.
+  dependencies[1].srcSubpass = 0;
+  dependencies[1].dstSubpass = VK_SUBPASS_EXTERNAL;
+  dependencies[1].srcStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+  dependencies[1].dstStageMask = VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT;
+  dependencies[1].srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+  dependencies[1].dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+
+  render_pass_info.sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO;
+  render_pass_info.attachmentCount = resolve ? 3 : 2;
+  render_pass_info.pAttachments = attachments;
+  render_pass_info.subpassCount = 1;
+  render_pass_info.pSubpasses = &subpass;
+  render_pass_info.dependencyCount = 2;
+  render_pass_info.pDependencies = dependencies;
+
+  if (vkCreateRenderPass(msaa->device, &render_pass_info, NULL, &(msaa->render_pass)) != VK_SUCCESS) {
+    throw runtime_error("failed to create MSAA render pass!");
+  }
+}
+
+void create_msaa_target(
+  VkPhysicalDevice physical_device,
+  VkDevice device,
+  memory_allocator* allocator,
+  uint32_t samples,
+  VkFormat color_format,
+  VkFormat depth_format,
+  msaa_target* msaa
+) {
+  msaa->device = device;
+  msaa->allocator = allocator;
+  msaa->samples = choose_samples(physical_device, samples);
+  msaa->color_format = color_format;
+  msaa->depth_format = depth_format;
+  msaa->width = 0;
+  msaa->height = 0;
+  msaa->color = NULL;
+  msaa->depth = NULL;
+  msaa->lazily_allocated = false;
+  msaa->framebuffer = VK_NULL_HANDLE;
+
+  create_render_pass(msaa);
+}
+
+static void destroy_attachments(msaa_target* msaa) {
+  if (msaa->framebuffer != VK_NULL_HANDLE) {
+    vkDestroyFramebuffer(msaa->device, msaa->framebuffer, NULL);
+    msaa->framebuffer = VK_NULL_HANDLE;
+  }
+
+  if (msaa->color != NULL) {
+    vkDestroyImageView(msaa->device, msaa->color_view, NULL);
+    vkDestroyImage(msaa->device, msaa->color->image, NULL);
+    free_allocation(msaa->allocator, msaa->color);
+    msaa->color = NULL;
+  }
+
+  if (msaa->depth != NULL) {
+    vkDestroyImageView(msaa->device, msaa->depth_view, NULL);
+    vkDestroyImage(msaa->device, msaa->depth->image, NULL);
+    free_allocation(msaa->allocator, msaa->depth);
+    msaa->depth = NULL;
+  }
+}
+
+void destroy_msaa_target(msaa_target* msaa) {
+  destroy_attachments(msaa);
+  vkDestroyRenderPass(msaa->device, msaa->render_pass, NULL);
+}
+
+//
+// ATTACHMENTS
+//
+
+// A multisampled image that only ever lives in the render pass.
+static gpu_allocation* create_transient_attachment(
+  msaa_target* msaa,
+  VkFormat format,
+  VkImageUsageFlags usage,
+  VkImageAspectFlags aspect,
+  VkImageView* view
+) {
+  VkImageCreateInfo image_info{};
+  VkImageViewCreateInfo view_info{};
+  VkImage image;
+  gpu_allocation* allocation;
+  bool lazily_allocated;
+
+  image_info.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+  image_info.imageType = VK_IMAGE_TYPE_2D;
+  image_info.format = format;
+  image_info.extent = { msaa->width, msaa->height, 1 };
+  image_info.mipLevels = 1;
+  image_info.arrayLayers = 1;
+  image_info.samples = msaa->samples;
+  image_info.tiling = VK_IMAGE_TILING_OPTIMAL;
+  image_info.usage = usage | VK_IMAGE_USAGE_TRANSIENT_ATTACHMENT_BIT;
+  image_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+  image_info.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+
+  if (vkCreateImage(msaa->device, &image_info, NULL, &image) != VK_SUCCESS) {
+    throw runtime_error("failed to create MSAA attachment!");
+  }
+
+  allocation = allocate_transient_image(
+    msaa->allocator,
+    image,
+    MEMORY_RENDER_TARGETS,
+    &lazily_allocated
+  );
+  msaa->lazily_allocated = msaa->lazily_allocated && lazily_allocated;
+
+  view_info.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+  view_info.image = image;
+  view_info.viewType = VK_IMAGE_VIEW_TYPE_2D;
+  view_info.format = format;
+  view_info.subresourceRange.aspectMask = aspect;
+  view_info.subresourceRange.levelCount = 1;
+  view_info.subresourceRange.layerCount = 1;
+
+  if (vkCreateImageView(msaa->device, &view_info, NULL, view) != VK_SUCCESS) {
+    throw runtime_error("failed to create MSAA attachment view!");
+  }
+
+  return allocation;
+}
+
+void set_msaa_target(msaa_target* msaa, VkImageView target, uint32_t width, uint32_t height) {
+  VkFramebufferCreateInfo framebuffer_info{};
+  VkImageView views[3];
+  VkImageAspectFlags depth_aspect;
+
+  // Only the target changed, so the attachments can stay, but the
+  // framebuffer can't.
+  if (width != msaa->width || height != msaa->height || msaa->depth == NULL) {
+    destroy_attachments(msaa);
+
+    msaa->width = width;
+    msaa->height = height;
+    msaa->lazily_allocated = true;
+
+    if (msaa->samples != VK_SAMPLE_COUNT_1_BIT) {
+      msaa->color = create_transient_attachment(
+        msaa,
+        msaa->color_format,
+        VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT,
+        VK_IMAGE_ASPECT_COLOR_BIT,
+        &(msaa->color_view)
+      );
+    }
+
+    depth_aspect = VK_IMAGE_ASPECT_DEPTH_BIT;
+    if (has_stencil(msaa->depth_format)) {
+      depth_aspect |= VK_IMAGE_ASPECT_STENCIL_BIT;
+    }
+
+    msaa->depth = create_transient_attachment(
+      msaa,
+      msaa->depth_format,
+      VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT,
+      depth_aspect,
+      &(msaa->depth_view)
+    );
+  } else {
+    vkDestroyFramebuffer(msaa->device, msaa->framebuffer, NULL);
+    msaa->framebuffer = VK_NULL_HANDLE;
+  }
+
+  views[MSAA_COLOR] = msaa->color != NULL ? msaa->color_view : target;
+  views[MSAA_DEPTH] = msaa->depth_view;
+  views[MSAA_RESOLVE] = target;
+
+  framebuffer_info.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
+  framebuffer_info.renderPass = msaa->render_pass;
+  framebuffer_info.attachmentCount = msaa->color != NULL ? 3 : 2;
+  framebuffer_info.pAttachments = views;
+  framebuffer_info.width = width;
+  framebuffer_info.height = height;
+  framebuffer_info.layers = 1;
+
+  if (vkCreateFramebuffer(msaa->device, &framebuffer_info, NULL, &(msaa->framebuffer)) != VK_SUCCESS) {
+    throw runtime_error("failed to create MSAA framebuffer!");
+  }
+}
+
+//
+// RENDERING
+//
+
+void begin_msaa_pass(msaa_target* msaa, VkCommandBuffer cmd, const float clear_color[4]) {
+  VkRenderPassBeginInfo begin_info{};
+  VkClearValue clears[3]{};
+  VkViewport viewport{};
+  VkRect2D scissor{};
+
+  if (msaa->framebuffer == VK_NULL_HANDLE) {
+    throw runtime_error("MSAA pass has no target!");
+  }
+
+  for (uint32_t i = 0; i < 4; i++) {
+    clears[MSAA_COLOR].color.float32[i] = clear_color[i];
+  }
+  clears[MSAA_DEPTH].depthStencil.depth = 1.0f;
+
+  begin_info.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
+  begin_info.renderPass = msaa->render_pass;
+  begin_info.framebuffer = msaa->framebuffer;
+  begin_info.renderArea.extent = { msaa->width, msaa->height };
+  begin_info.clearValueCount = 2;
+  begin_info.pClearValues = clears;
+
+  vkCmdBeginRenderPass(cmd, &begin_info, VK_SUBPASS_CONTENTS_INLINE);
+
+  viewport.width = (float)msaa->width;
+  viewport.height = (float)msaa->height;
+  viewport.maxDepth = 1.0f;
+  scissor.extent = { msaa->width, msaa->height };
+
+  vkCmdSetViewport(cmd, 0, 1, &viewport);
+  vkCmdSetScissor(cmd, 0, 1, &scissor);
+}
@@ -0,0 +1,95 @@
+#ifndef MSAA_TARGET_H
+#define MSAA_TARGET_H
+
+#define GLFW_INCLUDE_VULKAN
+
+#include <GLFW/glfw3.h>
+#include <cstdint>
+
+#include "memory_allocator.h"
+
+//
+// Multisampled rendering, arranged so the samples never reach memory.
+//
+// With MSAA every pixel has several color and depth samples, so a 4x
+// target is four times the size of the picture, and writing it out and
+// reading it back to resolve is four times the bandwidth. A tile based
+// GPU (most mobile and embedded ones) keeps the samples for one tile of
+// the screen on chip while it draws, and only writes to memory what the
+// render pass says to store. So the render pass here:
+//
+//   - clears the multisampled color and depth, rather than loading them,
+//   - resolves the color into the single sample target at the end of the
+//     subpass (pResolveAttachments), which a tiler does on chip,
+//   - and doesn't store either multisampled attachment.
+//
+// Nothing ever reads or writes the multisampled images in memory, so
+// they're created transient, in lazily allocated memory where there is
+// some (see allocate_transient_image): on a tiler, they never get any
+// memory at all. Desktop GPUs have no such memory and do the resolve as a
+// step of its own, but still skip storing the samples.
+//
+// The depth isn't resolved, so nothing can read it after the pass. With
+// one sample there's nothing to resolve, and the pass draws straight into
+// the target, with only the depth transient.
+//
+// Pipelines for the pass need samples set to msaa_target::samples and
+// render_pass to msaa_target::render_pass in their graphics state.
+//
+
+struct msaa_target {
+  VkDevice device;
+  memory_allocator* allocator;
+
+  // What was asked for, brought down to what the device can do with both
+  // color and depth.
+  VkSampleCountFlagBits samples;
+  VkFormat color_format;
+  VkFormat depth_format;
+  // Leaves the target in SHADER_READ_ONLY_OPTIMAL, for fragment or
+  // compute shaders to sample (like post_process.h's hdr).
+  VkRenderPass render_pass;
+
+  // Set by set_msaa_target. color is NULL with one sample.
+  uint32_t width;
+  uint32_t height;
+  gpu_allocation* color;
+  VkImageView color_view;
+  gpu_allocation* depth;
+  VkImageView depth_view;
+  // True if the transient images got lazily allocated memory.
+  bool lazily_allocated;
+  VkFramebuffer framebuffer;
+};
+
+//
+// MSAA TARGET ROUTINES
+//
+
+// samples is the most wanted, as a VkSampleCountFlagBits; 1 turns MSAA
+// off. Changing it means a new render pass and new pipelines, so it's
+// fixed for the msaa_target's life.
+void create_msaa_target(
+  VkPhysicalDevice physical_device,
+  VkDevice device,
+  memory_allocator* allocator,
+  uint32_t samples,
+  VkFormat color_format,
+  VkFormat depth_format,
+  msaa_target* msaa
+);
+// Nothing the pass recorded may still be in flight.
+void destroy_msaa_target(msaa_target* msaa);
+
+// Points the pass at the single sample image it resolves into, of
+// color_format with color attachment and sampled usage, and makes the
+// transient images for its size. Call again when it changes, once
+// nothing the pass recorded is in flight.
+void set_msaa_target(msaa_target* msaa, VkImageView target, uint32_t width, uint32_t height);
+
+// Begins the render pass, clearing to clear_color and a depth of 1, and
+// sets the viewport and scissor to the whole target. End it with
+// vkCmdEndRenderPass; after that the target is ready to sample.
+void begin_msaa_pass(msaa_target* msaa, VkCommandBuffer cmd, const float clear_color[4]);
+
+#endif
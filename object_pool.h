@@ -0,0 +1,107 @@
+#ifndef OBJECT_POOL_H
+#define OBJECT_POOL_H
+
+#include <cstdint>
+#include <cstddef>
+#include <new>
+#include <vector>
+#include <stdexcept>
+
+//
+// For objects that outlive a frame but come and go often (in flight
+// uploads, jobs, queued submissions...), a pool keeps a fixed number of
+// slots allocated up front and a list of the free ones. Getting and
+// returning an object is popping and pushing that list, with no malloc.
+//
+// A pool isn't thread safe. Give each thread its own, or hand objects
+// back to their owner through a queue (see work_queue.h).
+//
+
+template<typename T>
+struct object_pool {
+  // Raw storage, so slots aren't constructed until they're used.
+  struct alignas(T) slot {
+    uint8_t bytes[sizeof(T)];
+  };
+
+  std::vector<slot> slots;
+  // The free slots, used as a stack so recently freed (and still cached)
+  // slots are reused first.
+  std::vector<uint32_t> free_slots;
+
+  uint32_t num_live;
+  uint32_t high_water;
+  // Reset by whoever reads them, usually once a frame.
+  uint32_t num_acquired;
+  uint32_t num_failed;
+};
+
+//
+// OBJECT POOL ROUTINES
+//
+
+template<typename T>
+void create_object_pool(uint32_t capacity, object_pool<T>* pool) {
+  pool->slots.resize(capacity);
+  pool->free_slots.resize(capacity);
+
+  for (uint32_t i = 0; i < capacity; i++) {
+    pool->free_slots[i] = capacity - 1 - i;
+  }
+
+  pool->num_live = 0;
+  pool->high_water = 0;
+  pool->num_acquired = 0;
+  pool->num_failed = 0;
+}
+
+// Every object must have been released.
+template<typename T>
+void destroy_object_pool(object_pool<T>* pool) {
+  if (pool->num_live != 0) {
+    throw std::runtime_error("object pool destroyed with live objects!");
+  }
+
+  pool->slots.clear();
+  pool->free_slots.clear();
+}
+
+// Returns a default constructed object, or NULL if the pool is empty.
+template<typename T>
+T* acquire_object(object_pool<T>* pool) {
+  uint32_t index;
+
+  if (pool->free_slots.empty()) {
+    pool->num_failed++;
+    return NULL;
+  }
+
+  index = pool->free_slots.back();
+  pool->free_slots.pop_back();
+
+  pool->num_live++;
+  pool->num_acquired++;
+  if (pool->num_live > pool->high_water) {
+    pool->high_water = pool->num_live;
+  }
+
+  return new (pool->slots[index].bytes) T();
+}
+
+// Destructs the object and returns its slot to the pool.
+template<typename T>
+void release_object(object_pool<T>* pool, T* object) {
+  uint32_t index;
+
+  index = (uint32_t)((typename object_pool<T>::slot*)object - pool->slots.data());
+
+  if (index >= pool->slots.size()) {
+    throw std::runtime_error("object released to the wrong pool!");
+  }
+
+  object->~T();
+  pool->free_slots.push_back(index);
+  pool->num_live--;
+}
+
+#endif
@@ -0,0 +1,235 @@
+#include "per_draw.h"
+
+#include <stdexcept>
+#include <cstring>
+#include <algorithm>
+
+using namespace std;
+
+// Every device supports uniform blocks at least this big
+// (maxUniformBufferRange), and per draw data has no business being bigger,
+// so the binder never uses more than this even if the device allows it.
+const uint32_t PER_DRAW_MAX_UNIFORM_SIZE = 16384;
+
+static VkDeviceSize align_up(VkDeviceSize value, VkDeviceSize alignment) {
+  return (value + alignment - 1) / alignment * alignment;
+}
+
+static void create_ring(per_draw_binder* binder, const memory_budget_tracker* budget) {
+  VkDeviceSize size;
+
+  // Each frame gets an aligned slice. The extra uniform block's worth at
+  // the end is because a dynamic uniform descriptor always covers a fixed
+  // range past its offset, even if the draw uses less.
+  binder->frame_ring_size = PER_DRAW_RING_SIZE / binder->frames_in_flight;
+  binder->frame_ring_size -= binder->frame_ring_size % binder->uniform_alignment;
+
+  size = binder->frame_ring_size * binder->frames_in_flight + binder->max_uniform_range;
+
+  // Draws are recorded as the data is written, so there's no point to
+  // copy it at. Without device local host visible memory, the shaders
+  // read it from host memory instead, which is still better than a
+  // descriptor set per draw. HOST_COHERENT means we don't have to flush
+  // or invalidate by hand.
+  if (choose_upload_path(binder->allocator, budget, size) == UPLOAD_DIRECT) {
+    try {
+      binder->ring = allocate_buffer(binder->allocator, size, DIRECT_UPLOAD_PROPERTIES, MEMORY_OTHER);
+      return;
+    } catch (const runtime_error&) {
+    }
+  }
+
+  binder->ring = allocate_buffer(
+    binder->allocator,
+    size,
+    VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+    MEMORY_OTHER
+  );
+}
+
+static void create_dynamic_descriptor_set(per_draw_binder* binder) {
+  VkDescriptorPoolSize pool_size{};
+  VkDescriptorPoolCreateInfo pool_info{};
+  VkDescriptorSetAllocateInfo alloc_info{};
+  VkDescriptorBufferInfo buffer_info{};
+  VkWriteDescriptorSet write{};
+
+  pool_size.type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
+  pool_size.descriptorCount = 1;
+
+  pool_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+  pool_info.maxSets = 1;
+  pool_info.poolSizeCount = 1;
+  pool_info.pPoolSizes = &pool_size;
+
+  if (vkCreateDescriptorPool(binder->device, &pool_info, NULL, &(binder->descriptor_pool)) != VK_SUCCESS) {
+    throw runtime_error("failed to create per draw descriptor pool!");
+  }
+
+  alloc_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+  alloc_info.descriptorPool = binder->descriptor_pool;
+  alloc_info.descriptorSetCount = 1;
+  alloc_info.pSetLayouts = &(binder->set_layout);
+
+  if (vkAllocateDescriptorSets(binder->device, &alloc_info, &(binder->descriptor_set)) != VK_SUCCESS) {
+    throw runtime_error("failed to allocate per draw descriptor set!");
+  }
+
+  // Written once. Each draw just passes a different dynamic offset.
+  buffer_info.buffer = binder->ring->buffer;
+  buffer_info.offset = binder->ring->offset;
+  buffer_info.range = binder->max_uniform_range;
+
+  write.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+  write.dstSet = binder->descriptor_set;
+  write.dstBinding = 0;
+  write.descriptorCount = 1;
+  write.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
+  write.pBufferInfo = &buffer_info;
+
+  vkUpdateDescriptorSets(binder->device, 1, &write, 0, NULL);
+}
+
+void create_per_draw_binder(
+  VkPhysicalDevice physical_device,
+  VkDevice device,
+  memory_allocator* allocator,
+  const memory_budget_tracker* budget,
+  layout_cache* layouts,
+  bool push_descriptor,
+  uint32_t frames_in_flight,
+  per_draw_binder* binder
+) {
+  VkPhysicalDeviceProperties properties;
+  VkDescriptorSetLayoutBinding binding{};
+
+  *binder = {};
+  binder->device = device;
+  binder->allocator = allocator;
+  binder->frames_in_flight = frames_in_flight;
+
+  vkGetPhysicalDeviceProperties(physical_device, &properties);
+  binder->max_push_constants_size = properties.limits.maxPushConstantsSize;
+  binder->max_uniform_range = min(properties.limits.maxUniformBufferRange, PER_DRAW_MAX_UNIFORM_SIZE);
+  binder->uniform_alignment = properties.limits.minUniformBufferOffsetAlignment;
+
+  // Extension commands aren't exported by the loader, so we have to ask
+  // the device for them.
+  if (push_descriptor) {
+    binder->cmd_push_descriptor_set = (PFN_vkCmdPushDescriptorSetKHR)vkGetDeviceProcAddr(
+      device,
+      "vkCmdPushDescriptorSetKHR"
+    );
+  }
+
+  binding.binding = 0;
+  binding.descriptorCount = 1;
+  binding.stageFlags = VK_SHADER_STAGE_ALL_GRAPHICS;
+
+  if (binder->cmd_push_descriptor_set != NULL) {
+    binding.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+    binder->set_layout = get_push_descriptor_set_layout(layouts, &binding, 1);
+  } else {
+    binding.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
+    binder->set_layout = get_descriptor_set_layout(layouts, &binding, 1);
+  }
+
+  create_ring(binder, budget);
+
+  if (binder->cmd_push_descriptor_set == NULL) {
+    create_dynamic_descriptor_set(binder);
+  }
+
+  begin_per_draw_frame(binder, 0);
+}
+
+void destroy_per_draw_binder(per_draw_binder* binder) {
+  if (binder->descriptor_pool != VK_NULL_HANDLE) {
+    vkDestroyDescriptorPool(binder->device, binder->descriptor_pool, NULL);
+  }
+
+  // The set layout belongs to the layout cache.
+  free_allocation(binder->allocator, binder->ring);
+}
+
+void begin_per_draw_frame(per_draw_binder* binder, uint32_t frame_index) {
+  binder->frame_start = (frame_index % binder->frames_in_flight) * binder->frame_ring_size;
+  binder->ring_head = binder->frame_start;
+}
+
+per_draw_path choose_per_draw_path(const per_draw_binder* binder, uint32_t size) {
+  if (size <= binder->max_push_constants_size) {
+    return PER_DRAW_PUSH_CONSTANTS;
+  }
+
+  if (size > binder->max_uniform_range) {
+    throw runtime_error("per draw data is too big for a uniform block!");
+  }
+
+  return binder->cmd_push_descriptor_set != NULL ?
+    PER_DRAW_PUSH_DESCRIPTOR :
+    PER_DRAW_DYNAMIC_UNIFORM;
+}
+
+void bind_per_draw_data(
+  per_draw_binder* binder,
+  VkCommandBuffer cmd,
+  VkPipelineLayout layout,
+  uint32_t set,
+  VkShaderStageFlags stages,
+  const void* data,
+  uint32_t size
+) {
+  per_draw_path path;
+  VkDeviceSize offset;
+  VkDescriptorBufferInfo buffer_info{};
+  VkWriteDescriptorSet write{};
+  uint32_t dynamic_offset;
+
+  path = choose_per_draw_path(binder, size);
+
+  if (path == PER_DRAW_PUSH_CONSTANTS) {
+    vkCmdPushConstants(cmd, layout, stages, 0, size, data);
+    return;
+  }
+
+  //
+  // Both of the other paths read from the ring.
+  //
+
+  offset = align_up(binder->ring_head, binder->uniform_alignment);
+
+  if (offset + size > binder->frame_start + binder->frame_ring_size) {
+    throw runtime_error("per draw ring is full!");
+  }
+
+  memcpy(binder->ring->mapped + offset, data, size);
+  binder->ring_head = offset + size;
+
+  if (path == PER_DRAW_PUSH_DESCRIPTOR) {
+    buffer_info.buffer = binder->ring->buffer;
+    buffer_info.offset = binder->ring->offset + offset;
+    buffer_info.range = size;
+
+    write.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+    write.dstBinding = 0;
+    write.descriptorCount = 1;
+    write.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+    write.pBufferInfo = &buffer_info;
+
+    binder->cmd_push_descriptor_set(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, layout, set, 1, &write);
+  } else {
+    dynamic_offset = (uint32_t)offset;
+
+    vkCmdBindDescriptorSets(
+      cmd,
+      VK_PIPELINE_BIND_POINT_GRAPHICS,
+      layout,
+      set,
+      1,
+      &(binder->descriptor_set),
+      1,
+      &dynamic_offset
+    );
+  }
+}
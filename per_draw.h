@@ -0,0 +1,121 @@
+#ifndef PER_DRAW_H
+#define PER_DRAW_H
+
+#define GLFW_INCLUDE_VULKAN
+
+#include <GLFW/glfw3.h>
+#include <cstdint>
+#include <vector>
+
+#include "memory_allocator.h"
+#include "memory_budget.h"
+#include "dynamic_upload.h"
+#include "layout_cache.h"
+
+//
+// Per draw data (a transform, a material index, a tint color...) is small
+// and changes every draw. The textbook way to get it to the shader is to
+// allocate a descriptor set per draw, write a uniform buffer descriptor
+// into it and bind it, which is a lot of CPU work for a few bytes.
+//
+// The binder picks the cheapest way the device has, based on the size of
+// the data:
+// 1. Push constants. The data goes straight into the command buffer. Every
+//    device has at least 128 bytes of them (maxPushConstantsSize), which is
+//    plenty for most per draw data.
+// 2. Push descriptors (VK_KHR_push_descriptor). The data is written into a
+//    per frame uniform ring buffer, and the descriptor pointing at it goes
+//    straight into the command buffer, with no descriptor set to allocate.
+// 3. Otherwise, one descriptor set made up front with a dynamic uniform
+//    buffer pointing at the ring, bound with the draw's offset.
+//
+// Paths 2 and 3 show up the same in the shader: a uniform block in the
+// binder's set at binding 0. Shaders that support both that and push
+// constants declare both blocks and choose with a specialization constant
+// (see shader_permutation.h) with the id PER_DRAW_PATH_CONSTANT_ID, set to
+// the per_draw_path the binder picked. The unused path compiles away.
+//
+
+const uint32_t PER_DRAW_PATH_CONSTANT_ID = 100;
+
+// The size of the uniform ring, shared by every frame in flight.
+const VkDeviceSize PER_DRAW_RING_SIZE = 4 * 1024 * 1024;
+
+enum per_draw_path : uint32_t {
+  PER_DRAW_PUSH_CONSTANTS,
+  PER_DRAW_PUSH_DESCRIPTOR,
+  PER_DRAW_DYNAMIC_UNIFORM,
+};
+
+struct per_draw_binder {
+  VkDevice device;
+
+  // From the device limits. max_uniform_range is the biggest per draw
+  // uniform block, and also how much of the ring a dynamic uniform
+  // descriptor covers.
+  uint32_t max_push_constants_size;
+  uint32_t max_uniform_range;
+  VkDeviceSize uniform_alignment;
+
+  // NULL if the device doesn't support push descriptors.
+  PFN_vkCmdPushDescriptorSetKHR cmd_push_descriptor_set;
+
+  // The layout of the set holding the per draw uniform block. Pipelines
+  // that read per draw data from a uniform block need it in their layout.
+  VkDescriptorSetLayout set_layout;
+  // Only used without push descriptors.
+  VkDescriptorPool descriptor_pool;
+  VkDescriptorSet descriptor_set;
+
+  // Host visible and coherent, mapped for the binder's lifetime, and
+  // device local too if the budget allows (see dynamic_upload.h). Split
+  // evenly between the frames in flight, so a frame never overwrites data
+  // the GPU may still be reading for an earlier one. Offsets below are
+  // from the start of the ring, not of its buffer.
+  memory_allocator* allocator;
+  gpu_allocation* ring;
+  VkDeviceSize frame_ring_size;
+  uint32_t frames_in_flight;
+  // Where the current frame's part of the ring starts and where the next
+  // write goes.
+  VkDeviceSize frame_start;
+  VkDeviceSize ring_head;
+};
+
+// push_descriptor should only be true if the device was created with
+// VK_KHR_push_descriptor. The set layout comes from layouts, so pipelines
+// made with the same bindings share it.
+void create_per_draw_binder(
+  VkPhysicalDevice physical_device,
+  VkDevice device,
+  memory_allocator* allocator,
+  const memory_budget_tracker* budget,
+  layout_cache* layouts,
+  bool push_descriptor,
+  uint32_t frames_in_flight,
+  per_draw_binder* binder
+);
+void destroy_per_draw_binder(per_draw_binder* binder);
+
+// Call at the start of every frame, once the frame's fence says the GPU
+// is done with the last frame that used this index.
+void begin_per_draw_frame(per_draw_binder* binder, uint32_t frame_index);
+
+// Returns the path bind_per_draw_data will take for data of the size.
+// Throws if it's too big for push constants and max_uniform_range.
+per_draw_path choose_per_draw_path(const per_draw_binder* binder, uint32_t size);
+
+// Makes the data visible to the next draws. For the push constant path,
+// the layout must have a push constant range starting at 0 for the
+// stages; otherwise it must have the binder's set_layout at index set.
+void bind_per_draw_data(
+  per_draw_binder* binder,
+  VkCommandBuffer cmd,
+  VkPipelineLayout layout,
+  uint32_t set,
+  VkShaderStageFlags stages,
+  const void* data,
+  uint32_t size
+);
+
+#endif
@@ -0,0 +1,986 @@
+#include "pipeline_manager.h"
+#include "hash.h"
+
+#include <stdexcept>
+#include <fstream>
+#include <algorithm>
+#include <cstring>
+
+using namespace std;
+
+// We don't need more compile threads than this; past a few, the driver's
+// own locking tends to eat the gains.
+const uint32_t MAX_COMPILE_THREADS = 4;
+
+//
+// PIPELINE STATE IMPL.
+//
+
+graphics_pipeline_state default_pipeline_state() {
+  graphics_pipeline_state state{};
+
+  state.topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
+  state.cull_mode = VK_CULL_MODE_BACK_BIT;
+  state.blend = BLEND_OPAQUE;
+  state.depth_test = VK_FALSE;
+  state.depth_write = VK_FALSE;
+  state.depth_compare = VK_COMPARE_OP_LESS;
+  state.depth_format = VK_FORMAT_UNDEFINED;
+  state.samples = VK_SAMPLE_COUNT_1_BIT;
+
+  return state;
+}
+
+uint64_t hash_pipeline_state(const graphics_pipeline_state& state) {
+  uint64_t hash;
+  const VkVertexInputAttributeDescription* attribute;
+
+  hash = HASH_SEED;
+
+  hash_value(&hash, state.vertex_shader);
+  hash_value(&hash, state.fragment_shader);
+
+  hash_value(&hash, state.num_specialization_constants);
+  for (uint32_t i = 0; i < state.num_specialization_constants; i++) {
+    hash_value(&hash, state.specialization_ids[i]);
+    hash_value(&hash, state.specialization_values[i]);
+  }
+
+  hash_value(&hash, state.vertex_stride);
+  hash_value(&hash, state.num_vertex_attributes);
+  for (uint32_t i = 0; i < state.num_vertex_attributes; i++) {
+    attribute = &state.vertex_attributes[i];
+    hash_value(&hash, attribute->location);
+    hash_value(&hash, attribute->binding);
+    hash_value(&hash, attribute->format);
+    hash_value(&hash, attribute->offset);
+  }
+
+  hash_value(&hash, state.topology);
+  hash_value(&hash, state.cull_mode);
+  hash_value(&hash, state.blend);
+  hash_value(&hash, state.depth_test);
+  hash_value(&hash, state.depth_write);
+  hash_value(&hash, state.depth_compare);
+
+  hash_value(&hash, state.num_color_formats);
+  for (uint32_t i = 0; i < state.num_color_formats; i++) {
+    hash_value(&hash, state.color_formats[i]);
+  }
+  hash_value(&hash, state.depth_format);
+  hash_value(&hash, state.samples);
+
+  hash_value(&hash, state.render_pass);
+  hash_value(&hash, state.subpass);
+  hash_value(&hash, state.layout);
+
+  return hash;
+}
+
+bool pipeline_states_equal(
+  const graphics_pipeline_state& a,
+  const graphics_pipeline_state& b
+) {
+  if (a.vertex_shader != b.vertex_shader ||
+      a.fragment_shader != b.fragment_shader ||
+      a.num_specialization_constants != b.num_specialization_constants ||
+      a.vertex_stride != b.vertex_stride ||
+      a.num_vertex_attributes != b.num_vertex_attributes ||
+      a.topology != b.topology ||
+      a.cull_mode != b.cull_mode ||
+      a.blend != b.blend ||
+      a.depth_test != b.depth_test ||
+      a.depth_write != b.depth_write ||
+      a.depth_compare != b.depth_compare ||
+      a.num_color_formats != b.num_color_formats ||
+      a.depth_format != b.depth_format ||
+      a.samples != b.samples ||
+      a.render_pass != b.render_pass ||
+      a.subpass != b.subpass ||
+      a.layout != b.layout) {
+    return false;
+  }
+
+  for (uint32_t i = 0; i < a.num_specialization_constants; i++) {
+    if (a.specialization_ids[i] != b.specialization_ids[i] ||
+        a.specialization_values[i] != b.specialization_values[i]) {
+      return false;
+    }
+  }
+
+  for (uint32_t i = 0; i < a.num_vertex_attributes; i++) {
+    if (a.vertex_attributes[i].location != b.vertex_attributes[i].location ||
+        a.vertex_attributes[i].binding != b.vertex_attributes[i].binding ||
+        a.vertex_attributes[i].format != b.vertex_attributes[i].format ||
+        a.vertex_attributes[i].offset != b.vertex_attributes[i].offset) {
+      return false;
+    }
+  }
+
+  for (uint32_t i = 0; i < a.num_color_formats; i++) {
+    if (a.color_formats[i] != b.color_formats[i]) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+static VkPipelineColorBlendAttachmentState blend_attachment_state(blend_mode blend) {
+  VkPipelineColorBlendAttachmentState attachment{};
+
+  attachment.colorWriteMask =
+    VK_COLOR_COMPONENT_R_BIT |
+    VK_COLOR_COMPONENT_G_BIT |
+    VK_COLOR_COMPONENT_B_BIT |
+    VK_COLOR_COMPONENT_A_BIT;
+
+  switch (blend) {
+    case BLEND_OPAQUE:
+      attachment.blendEnable = VK_FALSE;
+      break;
+
+    // color = src.rgb * src.a + dst.rgb * (1 - src.a)
+    case BLEND_ALPHA:
+      attachment.blendEnable = VK_TRUE;
+      attachment.srcColorBlendFactor = VK_BLEND_FACTOR_SRC_ALPHA;
+      attachment.dstColorBlendFactor = VK_BLEND_FACTOR_ONE_MINUS_SRC_ALPHA;
+      attachment.colorBlendOp = VK_BLEND_OP_ADD;
+      attachment.srcAlphaBlendFactor = VK_BLEND_FACTOR_ONE;
+      attachment.dstAlphaBlendFactor = VK_BLEND_FACTOR_ONE_MINUS_SRC_ALPHA;
+      attachment.alphaBlendOp = VK_BLEND_OP_ADD;
+      break;
+
+    // color = src.rgb * src.a + dst.rgb
+    case BLEND_ADDITIVE:
+      attachment.blendEnable = VK_TRUE;
+      attachment.srcColorBlendFactor = VK_BLEND_FACTOR_SRC_ALPHA;
+      attachment.dstColorBlendFactor = VK_BLEND_FACTOR_ONE;
+      attachment.colorBlendOp = VK_BLEND_OP_ADD;
+      attachment.srcAlphaBlendFactor = VK_BLEND_FACTOR_ONE;
+      attachment.dstAlphaBlendFactor = VK_BLEND_FACTOR_ONE;
+      attachment.alphaBlendOp = VK_BLEND_OP_ADD;
+      break;
+  }
+
+  return attachment;
+}
+
+// All the structs that a VkGraphicsPipelineCreateInfo points at, so they
+// can be filled in by one function and used by another.
+struct pipeline_create_storage {
+  VkPipelineShaderStageCreateInfo stages[2];
+  VkSpecializationMapEntry specialization_entries[MAX_SPECIALIZATION_CONSTANTS];
+  VkSpecializationInfo specialization;
+  VkVertexInputBindingDescription binding;
+  VkPipelineVertexInputStateCreateInfo vertex_input;
+  VkPipelineInputAssemblyStateCreateInfo input_assembly;
+  VkPipelineViewportStateCreateInfo viewport_state;
+  VkPipelineRasterizationStateCreateInfo rasterizer;
+  VkPipelineMultisampleStateCreateInfo multisampling;
+  VkPipelineDepthStencilStateCreateInfo depth_stencil;
+  VkPipelineColorBlendAttachmentState blend_attachments[MAX_COLOR_ATTACHMENTS];
+  VkPipelineColorBlendStateCreateInfo color_blending;
+  VkDynamicState dynamic_states[2];
+  VkPipelineDynamicStateCreateInfo dynamic_state;
+  VkGraphicsPipelineCreateInfo info;
+};
+
+static void fill_pipeline_create_info(
+  const graphics_pipeline_state& state,
+  pipeline_create_storage* storage
+) {
+  uint32_t num_stages;
+
+  *storage = {};
+
+  //
+  // Specialization constants. Each map entry says where in the data
+  // blob the value of one constant id is. Our values are all 32 bits and
+  // already packed together, so the blob is just the values array.
+  //
+
+  for (uint32_t i = 0; i < state.num_specialization_constants; i++) {
+    storage->specialization_entries[i].constantID = state.specialization_ids[i];
+    storage->specialization_entries[i].offset = i * sizeof(uint32_t);
+    storage->specialization_entries[i].size = sizeof(uint32_t);
+  }
+
+  storage->specialization.mapEntryCount = state.num_specialization_constants;
+  storage->specialization.pMapEntries = storage->specialization_entries;
+  storage->specialization.dataSize = state.num_specialization_constants * sizeof(uint32_t);
+  storage->specialization.pData = state.specialization_values;
+
+  //
+  // Programmable stages. A pipeline without a fragment shader is allowed
+  // and is what you want for depth only passes.
+  //
+
+  num_stages = 0;
+
+  storage->stages[num_stages].sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+  storage->stages[num_stages].stage = VK_SHADER_STAGE_VERTEX_BIT;
+  storage->stages[num_stages].module = state.vertex_shader;
+  storage->stages[num_stages].pName = "main";
+  if (state.num_specialization_constants > 0) {
+    storage->stages[num_stages].pSpecializationInfo = &storage->specialization;
+  }
+  num_stages++;
+
+  if (state.fragment_shader != VK_NULL_HANDLE) {
+    storage->stages[num_stages].sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+    storage->stages[num_stages].stage = VK_SHADER_STAGE_FRAGMENT_BIT;
+    storage->stages[num_stages].module = state.fragment_shader;
+    storage->stages[num_stages].pName = "main";
+    if (state.num_specialization_constants > 0) {
+      storage->stages[num_stages].pSpecializationInfo = &storage->specialization;
+    }
+    num_stages++;
+  }
+
+  //
+  // Fixed function stages.
+  //
+
+  storage->binding.binding = 0;
+  storage->binding.stride = state.vertex_stride;
+  storage->binding.inputRate = VK_VERTEX_INPUT_RATE_VERTEX;
+
+  storage->vertex_input.sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
+  if (state.vertex_stride > 0) {
+    storage->vertex_input.vertexBindingDescriptionCount = 1;
+    storage->vertex_input.pVertexBindingDescriptions = &storage->binding;
+    storage->vertex_input.vertexAttributeDescriptionCount = state.num_vertex_attributes;
+    storage->vertex_input.pVertexAttributeDescriptions = state.vertex_attributes;
+  }
+
+  storage->input_assembly.sType = VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO;
+  storage->input_assembly.topology = state.topology;
+  storage->input_assembly.primitiveRestartEnable = VK_FALSE;
+
+  // The actual viewport and scissor are set when drawing.
+  storage->viewport_state.sType = VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO;
+  storage->viewport_state.viewportCount = 1;
+  storage->viewport_state.scissorCount = 1;
+
+  storage->rasterizer.sType = VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO;
+  storage->rasterizer.polygonMode = VK_POLYGON_MODE_FILL;
+  storage->rasterizer.cullMode = state.cull_mode;
+  storage->rasterizer.frontFace = VK_FRONT_FACE_CLOCKWISE;
+  storage->rasterizer.lineWidth = 1.0f;
+
+  storage->multisampling.sType = VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO;
+  storage->multisampling.rasterizationSamples = state.samples;
+
+  storage->depth_stencil.sType = VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO;
+  storage->depth_stencil.depthTestEnable = state.depth_test;
+  storage->depth_stencil.depthWriteEnable = state.depth_write;
+  storage->depth_stencil.depthCompareOp = state.depth_compare;
+
+  for (uint32_t i = 0; i < state.num_color_formats; i++) {
+    storage->blend_attachments[i] = blend_attachment_state(state.blend);
+  }
+
+  storage->color_blending.sType = VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO;
+  storage->color_blending.attachmentCount = state.num_color_formats;
+  storage->color_blending.pAttachments = storage->blend_attachments;
+
+  storage->dynamic_states[0] = VK_DYNAMIC_STATE_VIEWPORT;
+  storage->dynamic_states[1] = VK_DYNAMIC_STATE_SCISSOR;
+
+  storage->dynamic_state.sType = VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO;
+  storage->dynamic_state.dynamicStateCount = 2;
+  storage->dynamic_state.pDynamicStates = storage->dynamic_states;
+
+  //
+  // Finally, put it all together.
+  //
+
+  storage->info.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
+  storage->info.stageCount = num_stages;
+  storage->info.pStages = storage->stages;
+  storage->info.pVertexInputState = &storage->vertex_input;
+  storage->info.pInputAssemblyState = &storage->input_assembly;
+  storage->info.pViewportState = &storage->viewport_state;
+  storage->info.pRasterizationState = &storage->rasterizer;
+  storage->info.pMultisampleState = &storage->multisampling;
+  storage->info.pDepthStencilState = &storage->depth_stencil;
+  storage->info.pColorBlendState = &storage->color_blending;
+  storage->info.pDynamicState = &storage->dynamic_state;
+  storage->info.layout = state.layout;
+  storage->info.renderPass = state.render_pass;
+  storage->info.subpass = state.subpass;
+}
+
+VkPipeline create_graphics_pipeline(
+  VkDevice device,
+  VkPipelineCache cache,
+  const graphics_pipeline_state& state
+) {
+  pipeline_create_storage storage;
+  VkPipeline pipeline;
+  VkResult result;
+
+  fill_pipeline_create_info(state, &storage);
+
+  result = vkCreateGraphicsPipelines(device, cache, 1, &storage.info, NULL, &pipeline);
+
+  if (result != VK_SUCCESS) {
+    throw runtime_error("failed to create graphics pipeline!");
+  }
+
+  return pipeline;
+}
+
+//
+// PIPELINE LIBRARY IMPL.
+//
+
+enum library_part {
+  LIBRARY_VERTEX_INPUT,
+  LIBRARY_PRE_RASTERIZATION,
+  LIBRARY_FRAGMENT_SHADER,
+  LIBRARY_FRAGMENT_OUTPUT,
+  NUM_LIBRARY_PARTS,
+};
+
+const VkGraphicsPipelineLibraryFlagsEXT library_part_flags[NUM_LIBRARY_PARTS] = {
+  VK_GRAPHICS_PIPELINE_LIBRARY_VERTEX_INPUT_INTERFACE_BIT_EXT,
+  VK_GRAPHICS_PIPELINE_LIBRARY_PRE_RASTERIZATION_SHADERS_BIT_EXT,
+  VK_GRAPHICS_PIPELINE_LIBRARY_FRAGMENT_SHADER_BIT_EXT,
+  VK_GRAPHICS_PIPELINE_LIBRARY_FRAGMENT_OUTPUT_INTERFACE_BIT_EXT,
+};
+
+static void copy_specialization(
+  const graphics_pipeline_state& from,
+  graphics_pipeline_state* to
+) {
+  to->num_specialization_constants = from.num_specialization_constants;
+  memcpy(to->specialization_ids, from.specialization_ids, sizeof(to->specialization_ids));
+  memcpy(to->specialization_values, from.specialization_values, sizeof(to->specialization_values));
+}
+
+// Returns a copy of the state with everything the library part doesn't
+// depend on zeroed out. Two pipelines that only differ in the zeroed out
+// parts share the library.
+static graphics_pipeline_state library_key_state(
+  library_part part,
+  const graphics_pipeline_state& state
+) {
+  graphics_pipeline_state key{};
+
+  switch (part) {
+    case LIBRARY_VERTEX_INPUT:
+      key.vertex_stride = state.vertex_stride;
+      key.num_vertex_attributes = state.num_vertex_attributes;
+      memcpy(key.vertex_attributes, state.vertex_attributes, sizeof(key.vertex_attributes));
+      key.topology = state.topology;
+      break;
+
+    case LIBRARY_PRE_RASTERIZATION:
+      key.vertex_shader = state.vertex_shader;
+      copy_specialization(state, &key);
+      key.cull_mode = state.cull_mode;
+      key.render_pass = state.render_pass;
+      key.subpass = state.subpass;
+      key.layout = state.layout;
+      break;
+
+    case LIBRARY_FRAGMENT_SHADER:
+      key.fragment_shader = state.fragment_shader;
+      copy_specialization(state, &key);
+      key.depth_test = state.depth_test;
+      key.depth_write = state.depth_write;
+      key.depth_compare = state.depth_compare;
+      key.samples = state.samples;
+      key.render_pass = state.render_pass;
+      key.subpass = state.subpass;
+      key.layout = state.layout;
+      break;
+
+    case LIBRARY_FRAGMENT_OUTPUT:
+      key.blend = state.blend;
+      key.num_color_formats = state.num_color_formats;
+      memcpy(key.color_formats, state.color_formats, sizeof(key.color_formats));
+      key.depth_format = state.depth_format;
+      key.samples = state.samples;
+      key.render_pass = state.render_pass;
+      key.subpass = state.subpass;
+      break;
+
+    default:
+      break;
+  }
+
+  return key;
+}
+
+static VkPipeline create_pipeline_library(
+  VkDevice device,
+  VkPipelineCache cache,
+  library_part part,
+  const graphics_pipeline_state& state
+) {
+  pipeline_create_storage storage;
+  VkGraphicsPipelineLibraryCreateInfoEXT library_info{};
+  VkPipeline pipeline;
+  VkResult result;
+
+  //
+  // We fill in the whole pipeline, and tell Vulkan which part of it this
+  // library is. It ignores the state that belongs to the other parts,
+  // except for the shader stages, which we have to hand it only the ones
+  // for this part of.
+  //
+
+  fill_pipeline_create_info(state, &storage);
+
+  switch (part) {
+    case LIBRARY_PRE_RASTERIZATION:
+      storage.info.stageCount = 1;
+      break;
+
+    case LIBRARY_FRAGMENT_SHADER:
+      storage.info.stageCount = state.fragment_shader != VK_NULL_HANDLE ? 1 : 0;
+      storage.info.pStages = &storage.stages[1];
+      break;
+
+    default:
+      storage.info.stageCount = 0;
+      storage.info.pStages = NULL;
+      break;
+  }
+
+  library_info.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_LIBRARY_CREATE_INFO_EXT;
+  library_info.flags = library_part_flags[part];
+
+  // Retaining the link time optimization info costs a little memory, but
+  // lets the background thread link a properly optimized pipeline later.
+  storage.info.pNext = &library_info;
+  storage.info.flags =
+    VK_PIPELINE_CREATE_LIBRARY_BIT_KHR |
+    VK_PIPELINE_CREATE_RETAIN_LINK_TIME_OPTIMIZATION_INFO_BIT_EXT;
+
+  result = vkCreateGraphicsPipelines(device, cache, 1, &storage.info, NULL, &pipeline);
+
+  if (result != VK_SUCCESS) {
+    throw runtime_error("failed to create graphics pipeline library!");
+  }
+
+  return pipeline;
+}
+
+static VkPipeline link_pipeline_libraries(
+  VkDevice device,
+  VkPipelineCache cache,
+  const VkPipeline libraries[NUM_LIBRARY_PARTS],
+  VkPipelineLayout layout,
+  bool optimize
+) {
+  VkPipelineLibraryCreateInfoKHR linking_info{};
+  VkGraphicsPipelineCreateInfo pipeline_info{};
+  VkPipeline pipeline;
+  VkResult result;
+
+  linking_info.sType = VK_STRUCTURE_TYPE_PIPELINE_LIBRARY_CREATE_INFO_KHR;
+  linking_info.libraryCount = NUM_LIBRARY_PARTS;
+  linking_info.pLibraries = libraries;
+
+  // Without the optimization flag, linking mostly just glues the already
+  // compiled pieces together, which is what makes it fast.
+  pipeline_info.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
+  pipeline_info.pNext = &linking_info;
+  pipeline_info.flags = optimize ? VK_PIPELINE_CREATE_LINK_TIME_OPTIMIZATION_BIT_EXT : 0;
+  pipeline_info.layout = layout;
+
+  result = vkCreateGraphicsPipelines(device, cache, 1, &pipeline_info, NULL, &pipeline);
+
+  if (result != VK_SUCCESS) {
+    throw runtime_error("failed to link graphics pipeline libraries!");
+  }
+
+  return pipeline;
+}
+
+//
+// PIPELINE MANAGER IMPL.
+//
+
+// Returns the entry for the state in entries, adding a pending one if
+// there isn't one yet. The manager's mutex must be held.
+static pipeline_entry* find_or_add_entry(
+  unordered_map<uint64_t, vector<pipeline_entry*>>* entries,
+  const graphics_pipeline_state& state,
+  bool* added
+) {
+  vector<pipeline_entry*>* bucket;
+  pipeline_entry* entry;
+
+  // Different states can have the same hash, so each hash maps to a
+  // (nearly always one element) list we check for an exact match.
+  bucket = &(*entries)[hash_pipeline_state(state)];
+
+  for (pipeline_entry* existing : *bucket) {
+    if (pipeline_states_equal(existing->state, state)) {
+      *added = false;
+      return existing;
+    }
+  }
+
+  entry = new pipeline_entry;
+  entry->state = state;
+  entry->pipeline = VK_NULL_HANDLE;
+  entry->status = PIPELINE_PENDING;
+  entry->optimized = false;
+  bucket->push_back(entry);
+
+  *added = true;
+
+  return entry;
+}
+
+// Returns the library for the given part of the state, creating it on
+// the calling thread if needed. Takes the manager's mutex itself.
+static VkPipeline get_pipeline_library(
+  pipeline_manager* manager,
+  library_part part,
+  const graphics_pipeline_state& state
+) {
+  graphics_pipeline_state key;
+  pipeline_entry* entry;
+  VkPipeline library;
+  bool added;
+
+  key = library_key_state(part, state);
+
+  {
+    lock_guard<mutex> lock(manager->mutex);
+    entry = find_or_add_entry(&manager->libraries, key, &added);
+
+    if (entry->status == PIPELINE_READY) {
+      return entry->pipeline;
+    }
+  }
+
+  // Two threads may end up building the same library at once. That is
+  // wasted work, but it's rare and much simpler than waiting on the other.
+  library = create_pipeline_library(manager->device, manager->cache, part, state);
+
+  {
+    lock_guard<mutex> lock(manager->mutex);
+
+    if (entry->status == PIPELINE_READY) {
+      vkDestroyPipeline(manager->device, library, NULL);
+    } else {
+      entry->pipeline = library;
+      entry->status = PIPELINE_READY;
+      entry->optimized = true;
+    }
+
+    return entry->pipeline;
+  }
+}
+
+// Builds the best version of the pipeline we know how to: a link time
+// optimized link of its libraries, or else a regular full compile.
+// Returns VK_NULL_HANDLE if the driver refused it.
+static VkPipeline try_create_final_pipeline(
+  pipeline_manager* manager,
+  const graphics_pipeline_state& state
+) {
+  VkPipeline libraries[NUM_LIBRARY_PARTS];
+
+  try {
+    if (!manager->use_libraries) {
+      return create_graphics_pipeline(manager->device, manager->cache, state);
+    }
+
+    for (uint32_t part = 0; part < NUM_LIBRARY_PARTS; part++) {
+      libraries[part] = get_pipeline_library(manager, (library_part)part, state);
+    }
+
+    return link_pipeline_libraries(
+      manager->device,
+      manager->cache,
+      libraries,
+      state.layout,
+      true
+    );
+  } catch (const exception&) {
+    return VK_NULL_HANDLE;
+  }
+}
+
+// Quickly links the pipeline's libraries without optimizing. Returns
+// VK_NULL_HANDLE if that didn't work.
+static VkPipeline try_fast_link_pipeline(
+  pipeline_manager* manager,
+  const graphics_pipeline_state& state
+) {
+  VkPipeline libraries[NUM_LIBRARY_PARTS];
+
+  try {
+    for (uint32_t part = 0; part < NUM_LIBRARY_PARTS; part++) {
+      libraries[part] = get_pipeline_library(manager, (library_part)part, state);
+    }
+
+    return link_pipeline_libraries(
+      manager->device,
+      manager->cache,
+      libraries,
+      state.layout,
+      false
+    );
+  } catch (const exception&) {
+    return VK_NULL_HANDLE;
+  }
+}
+
+// Stores a finished pipeline in the entry. An optimized pipeline replaces
+// a quick linked one (which is retired, since it may still be in use). A
+// pipeline that lost a race with an equal or better one is destroyed. The
+// mutex must be held.
+static void finish_entry(
+  pipeline_manager* manager,
+  pipeline_entry* entry,
+  VkPipeline pipeline,
+  bool optimized
+) {
+  bool redundant;
+
+  redundant = entry->optimized || (!optimized && entry->status == PIPELINE_READY);
+
+  if (redundant) {
+    if (pipeline != VK_NULL_HANDLE) {
+      vkDestroyPipeline(manager->device, pipeline, NULL);
+    }
+
+    return;
+  }
+
+  if (pipeline == VK_NULL_HANDLE) {
+    // A failed quick link doesn't mean the full build will fail, but a
+    // failed full build means there is nothing more to try.
+    if (optimized && entry->status == PIPELINE_PENDING) {
+      entry->status = PIPELINE_FAILED;
+    }
+
+    return;
+  }
+
+  if (entry->pipeline != VK_NULL_HANDLE) {
+    manager->retired.push_back(entry->pipeline);
+  }
+
+  entry->pipeline = pipeline;
+  entry->status = PIPELINE_READY;
+  entry->optimized = optimized;
+}
+
+static void compile_worker(pipeline_manager* manager) {
+  unique_lock<mutex> lock(manager->mutex);
+  pipeline_entry* entry;
+  graphics_pipeline_state state;
+  VkPipeline pipeline;
+
+  while (true) {
+    manager->compile_ready.wait(lock, [manager] {
+      return manager->shutting_down || !manager->compile_queue.empty();
+    });
+
+    if (manager->shutting_down) {
+      return;
+    }
+
+    entry = manager->compile_queue.front();
+    manager->compile_queue.pop_front();
+
+    // Someone built the final version on their own thread while it sat
+    // in the queue.
+    if (entry->optimized || entry->status == PIPELINE_FAILED) {
+      continue;
+    }
+
+    state = entry->state;
+
+    lock.unlock();
+    pipeline = try_create_final_pipeline(manager, state);
+    lock.lock();
+
+    finish_entry(manager, entry, pipeline, true);
+  }
+}
+
+static void load_pipeline_cache(pipeline_manager* manager) {
+  ifstream file;
+  vector<uint8_t> data;
+  VkPhysicalDeviceProperties properties;
+  uint32_t header[4];
+  VkPipelineCacheCreateInfo create_info{};
+  VkResult result;
+
+  //
+  // The cache data starts with a header saying which device and driver
+  // made it. Drivers are supposed to ignore data that isn't theirs, but
+  // not all of them are careful about it, so we check ourselves.
+  //
+
+  file.open(PIPELINE_CACHE_PATH, ios::binary | ios::ate);
+
+  if (file.is_open()) {
+    data.resize((size_t)file.tellg());
+    file.seekg(0);
+    file.read((char*)data.data(), data.size());
+
+    vkGetPhysicalDeviceProperties(manager->physical_device, &properties);
+
+    if (data.size() < sizeof(header) + VK_UUID_SIZE) {
+      data.clear();
+    } else {
+      memcpy(header, data.data(), sizeof(header));
+
+      // header = { header size, header version, vendor id, device id }
+      if (header[2] != properties.vendorID ||
+          header[3] != properties.deviceID ||
+          memcmp(&data[sizeof(header)], properties.pipelineCacheUUID, VK_UUID_SIZE) != 0) {
+        data.clear();
+      }
+    }
+  }
+
+  create_info.sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO;
+  create_info.initialDataSize = data.size();
+  create_info.pInitialData = data.empty() ? NULL : data.data();
+
+  result = vkCreatePipelineCache(manager->device, &create_info, NULL, &(manager->cache));
+
+  if (result != VK_SUCCESS) {
+    throw runtime_error("failed to create pipeline cache!");
+  }
+}
+
+static void save_pipeline_cache(pipeline_manager* manager) {
+  size_t size;
+  vector<uint8_t> data;
+  ofstream file;
+
+  vkGetPipelineCacheData(manager->device, manager->cache, &size, NULL);
+  data.resize(size);
+  vkGetPipelineCacheData(manager->device, manager->cache, &size, data.data());
+
+  // Not being able to save the cache only costs us time on the next run,
+  // so it isn't worth failing over.
+  file.open(PIPELINE_CACHE_PATH, ios::binary);
+  if (file.is_open()) {
+    file.write((const char*)data.data(), size);
+  }
+}
+
+static void destroy_entries(
+  pipeline_manager* manager,
+  unordered_map<uint64_t, vector<pipeline_entry*>>* entries
+) {
+  for (auto& bucket : *entries) {
+    for (pipeline_entry* entry : bucket.second) {
+      if (entry->pipeline != VK_NULL_HANDLE) {
+        vkDestroyPipeline(manager->device, entry->pipeline, NULL);
+      }
+
+      delete entry;
+    }
+  }
+
+  entries->clear();
+}
+
+void create_pipeline_manager(
+  VkPhysicalDevice physical_device,
+  VkDevice device,
+  bool use_libraries,
+  pipeline_manager* manager
+) {
+  uint32_t num_threads;
+
+  manager->physical_device = physical_device;
+  manager->device = device;
+  manager->use_libraries = use_libraries;
+  manager->fallback_vertex_shader = VK_NULL_HANDLE;
+  manager->fallback_fragment_shader = VK_NULL_HANDLE;
+  manager->shutting_down = false;
+
+  load_pipeline_cache(manager);
+
+  // Leave one core for the main thread.
+  num_threads = thread::hardware_concurrency();
+  num_threads = num_threads > 1 ? num_threads - 1 : 1;
+  num_threads = min(num_threads, MAX_COMPILE_THREADS);
+
+  for (uint32_t i = 0; i < num_threads; i++) {
+    manager->workers.push_back(thread(compile_worker, manager));
+  }
+}
+
+void destroy_pipeline_manager(pipeline_manager* manager) {
+  {
+    lock_guard<mutex> lock(manager->mutex);
+    manager->shutting_down = true;
+  }
+
+  manager->compile_ready.notify_all();
+
+  for (thread& worker : manager->workers) {
+    worker.join();
+  }
+
+  manager->workers.clear();
+  manager->compile_queue.clear();
+
+  save_pipeline_cache(manager);
+
+  // Linked pipelines don't need their libraries to stay alive, but
+  // destroying the linked ones first is obviously safe.
+  destroy_entries(manager, &manager->pipelines);
+  destroy_entries(manager, &manager->libraries);
+  release_retired_pipelines(manager);
+
+  vkDestroyPipelineCache(manager->device, manager->cache, NULL);
+}
+
+void set_fallback_shaders(
+  pipeline_manager* manager,
+  VkShaderModule vertex_shader,
+  VkShaderModule fragment_shader
+) {
+  lock_guard<mutex> lock(manager->mutex);
+
+  manager->fallback_vertex_shader = vertex_shader;
+  manager->fallback_fragment_shader = fragment_shader;
+}
+
+void precompile_pipelines(
+  pipeline_manager* manager,
+  const vector<graphics_pipeline_state>& states
+) {
+  pipeline_entry* entry;
+  bool added;
+
+  {
+    lock_guard<mutex> lock(manager->mutex);
+
+    for (const graphics_pipeline_state& state : states) {
+      entry = find_or_add_entry(&manager->pipelines, state, &added);
+
+      if (added) {
+        manager->compile_queue.push_back(entry);
+      }
+    }
+  }
+
+  manager->compile_ready.notify_all();
+}
+
+VkPipeline get_pipeline(pipeline_manager* manager, const graphics_pipeline_state& state) {
+  unique_lock<mutex> lock(manager->mutex);
+  pipeline_entry* entry;
+  graphics_pipeline_state fallback_state;
+  VkPipeline pipeline;
+  bool added;
+
+  entry = find_or_add_entry(&manager->pipelines, state, &added);
+
+  if (entry->status == PIPELINE_READY) {
+    return entry->pipeline;
+  }
+
+  if (entry->status == PIPELINE_FAILED) {
+    return VK_NULL_HANDLE;
+  }
+
+  //
+  // It isn't ready, so queue it. With libraries we can use a quick link
+  // in the meantime, so the optimized version can wait its turn.
+  // Otherwise the draw is stuck with the fallback until the compile is
+  // done, so it jumps the queue.
+  //
+
+  if (added) {
+    if (manager->use_libraries) {
+      manager->compile_queue.push_back(entry);
+    } else {
+      manager->compile_queue.push_front(entry);
+    }
+
+    manager->compile_ready.notify_one();
+  }
+
+  if (manager->use_libraries) {
+    lock.unlock();
+    pipeline = try_fast_link_pipeline(manager, state);
+    lock.lock();
+
+    finish_entry(manager, entry, pipeline, false);
+
+    if (entry->status == PIPELINE_READY) {
+      return entry->pipeline;
+    }
+  }
+
+  if (manager->fallback_vertex_shader == VK_NULL_HANDLE) {
+    return VK_NULL_HANDLE;
+  }
+
+  // The fallback vertex shader reads the position from a vertex buffer,
+  // which a state without vertex input (one that fetches its vertices
+  // itself) has no attribute for. There's nothing to stand in for it, so
+  // build it here.
+  if (state.vertex_stride == 0) {
+    lock.unlock();
+    return get_pipeline_blocking(manager, state);
+  }
+
+  fallback_state = state;
+  fallback_state.vertex_shader = manager->fallback_vertex_shader;
+  fallback_state.fragment_shader =
+    state.fragment_shader != VK_NULL_HANDLE ? manager->fallback_fragment_shader : VK_NULL_HANDLE;
+  // The fallback shaders have no permutations, so leaving these in would
+  // only make needless copies of the same fallback pipeline.
+  fallback_state.num_specialization_constants = 0;
+
+  lock.unlock();
+
+  // The fallback is shared by every pipeline with the same layout and
+  // outputs, so this only stalls the first time we see that combination.
+  return get_pipeline_blocking(manager, fallback_state);
+}
+
+VkPipeline get_pipeline_blocking(
+  pipeline_manager* manager,
+  const graphics_pipeline_state& state
+) {
+  unique_lock<mutex> lock(manager->mutex);
+  pipeline_entry* entry;
+  VkPipeline pipeline;
+  bool added;
+
+  entry = find_or_add_entry(&manager->pipelines, state, &added);
+
+  if (entry->status == PIPELINE_PENDING) {
+    lock.unlock();
+    pipeline = try_create_final_pipeline(manager, state);
+    lock.lock();
+
+    finish_entry(manager, entry, pipeline, true);
+  }
+
+  return entry->status == PIPELINE_READY ? entry->pipeline : VK_NULL_HANDLE;
+}
+
+void release_retired_pipelines(pipeline_manager* manager) {
+  lock_guard<mutex> lock(manager->mutex);
+
+  for (VkPipeline pipeline : manager->retired) {
+    vkDestroyPipeline(manager->device, pipeline, NULL);
+  }
+
+  manager->retired.clear();
+}
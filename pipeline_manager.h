@@ -0,0 +1,209 @@
+#ifndef PIPELINE_MANAGER_H
+#define PIPELINE_MANAGER_H
+
+#define GLFW_INCLUDE_VULKAN
+
+#include <GLFW/glfw3.h>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <deque>
+#include <unordered_map>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+//
+// In Vulkan, all of the pipeline state is baked in when the pipeline is
+// created, and creating one means compiling its shaders for the GPU. That
+// can take tens of milliseconds, which is a visible hitch if it happens
+// in the middle of a frame.
+//
+// The pipeline manager hides this in three ways:
+// 1. Every pipeline is identified by a hash of its full state, so asking
+//    for the same state twice gives back the same pipeline.
+// 2. Pipelines we know we'll need are compiled on background threads at
+//    startup, all sharing one VkPipelineCache that is saved to disk, so
+//    later runs mostly skip the compile.
+// 3. If a pipeline isn't ready when a draw needs it, the draw gets a
+//    generic pipeline (same layout and outputs, simpler shaders) and the
+//    real one is queued for a background compile.
+//
+// On devices with VK_EXT_graphics_pipeline_library, step 3 is better: a
+// pipeline is split into four pieces (vertex input, pre-rasterization
+// shaders, fragment shader and fragment output), each compiled once and
+// shared by every pipeline that uses it. Linking the pieces together is
+// fast enough to do at draw time, so a miss gets the real shaders right
+// away. A fully optimized version is then linked in the background and
+// swapped in when it's ready.
+//
+
+const uint32_t MAX_VERTEX_ATTRIBUTES = 8;
+const uint32_t MAX_COLOR_ATTACHMENTS = 4;
+const uint32_t MAX_SPECIALIZATION_CONSTANTS = 8;
+const char* const PIPELINE_CACHE_PATH = "pipeline_cache.bin";
+
+enum blend_mode : uint32_t {
+  BLEND_OPAQUE,
+  BLEND_ALPHA,
+  BLEND_ADDITIVE,
+};
+
+// Everything needed to create a graphics pipeline. Viewport and scissor
+// are dynamic state, so the same pipeline works at any window size.
+struct graphics_pipeline_state {
+  VkShaderModule vertex_shader;
+  VkShaderModule fragment_shader;
+
+  // Values for the shaders' specialization constants (see
+  // shader_permutation.h), given to both stages. A shader just ignores
+  // the ids it doesn't declare.
+  uint32_t num_specialization_constants;
+  uint32_t specialization_ids[MAX_SPECIALIZATION_CONSTANTS];
+  uint32_t specialization_values[MAX_SPECIALIZATION_CONSTANTS];
+
+  // A single interleaved vertex buffer. A stride of 0 means no vertex
+  // input at all (the vertex shader makes up its own positions).
+  uint32_t vertex_stride;
+  uint32_t num_vertex_attributes;
+  VkVertexInputAttributeDescription vertex_attributes[MAX_VERTEX_ATTRIBUTES];
+
+  VkPrimitiveTopology topology;
+  VkCullModeFlags cull_mode;
+  blend_mode blend;
+  VkBool32 depth_test;
+  VkBool32 depth_write;
+  VkCompareOp depth_compare;
+
+  uint32_t num_color_formats;
+  VkFormat color_formats[MAX_COLOR_ATTACHMENTS];
+  VkFormat depth_format;
+  VkSampleCountFlagBits samples;
+
+  VkRenderPass render_pass;
+  uint32_t subpass;
+  VkPipelineLayout layout;
+};
+
+enum pipeline_status {
+  PIPELINE_PENDING,
+  PIPELINE_READY,
+  PIPELINE_FAILED,
+};
+
+struct pipeline_entry {
+  graphics_pipeline_state state;
+  VkPipeline pipeline;
+  pipeline_status status;
+  // False while pipeline is a quick link of libraries that still has an
+  // optimized replacement coming.
+  bool optimized;
+};
+
+struct pipeline_manager {
+  VkPhysicalDevice physical_device;
+  VkDevice device;
+  VkPipelineCache cache;
+  // True if we build pipelines out of graphics pipeline libraries.
+  bool use_libraries;
+
+  // Generic shaders for fallback pipelines. The vertex shader may only
+  // read the position at location 0, since it has to work with every
+  // vertex layout.
+  VkShaderModule fallback_vertex_shader;
+  VkShaderModule fallback_fragment_shader;
+
+  // Guards everything below.
+  std::mutex mutex;
+  std::unordered_map<uint64_t, std::vector<pipeline_entry*>> pipelines;
+  // The library pieces, keyed by a state with everything the piece
+  // doesn't depend on zeroed out.
+  std::unordered_map<uint64_t, std::vector<pipeline_entry*>> libraries;
+  // Quick linked pipelines that were replaced by optimized ones, but may
+  // still be used by command buffers in flight.
+  std::vector<VkPipeline> retired;
+  std::deque<pipeline_entry*> compile_queue;
+  std::condition_variable compile_ready;
+  std::vector<std::thread> workers;
+  bool shutting_down;
+};
+
+//
+// PIPELINE STATE ROUTINES
+//
+
+// Returns a state with sensible defaults: no vertex input, triangle lists,
+// back face culling, opaque, depth test off.
+graphics_pipeline_state default_pipeline_state();
+
+uint64_t hash_pipeline_state(const graphics_pipeline_state& state);
+bool pipeline_states_equal(
+  const graphics_pipeline_state& a,
+  const graphics_pipeline_state& b
+);
+
+// Creates the pipeline right away on the calling thread.
+VkPipeline create_graphics_pipeline(
+  VkDevice device,
+  VkPipelineCache cache,
+  const graphics_pipeline_state& state
+);
+
+//
+// PIPELINE MANAGER ROUTINES
+//
+
+// Loads the pipeline cache from PIPELINE_CACHE_PATH (if it's there and
+// was made by this device and driver) and starts the compile threads.
+// use_libraries should only be true if the device was created with
+// VK_EXT_graphics_pipeline_library.
+void create_pipeline_manager(
+  VkPhysicalDevice physical_device,
+  VkDevice device,
+  bool use_libraries,
+  pipeline_manager* manager
+);
+
+// Stops the compile threads, saves the pipeline cache and destroys every
+// pipeline.
+void destroy_pipeline_manager(pipeline_manager* manager);
+
+void set_fallback_shaders(
+  pipeline_manager* manager,
+  VkShaderModule vertex_shader,
+  VkShaderModule fragment_shader
+);
+
+// Queues the states for compiling in the background. Call at startup with
+// every permutation you know you'll draw with.
+void precompile_pipelines(
+  pipeline_manager* manager,
+  const std::vector<graphics_pipeline_state>& states
+);
+
+// For use at draw time. Never waits on a full compile of the requested
+// state: if it isn't ready, it is queued, and in the meantime we return
+// a quick link of its libraries (if we use them), or else the fallback
+// pipeline for the same layout and outputs. States with no vertex input
+// can't use the fallback, so without libraries they're compiled on the
+// calling thread. Returns VK_NULL_HANDLE only if there is nothing to fall
+// back on, or the pipeline failed to compile.
+//
+// The pipeline may be replaced by a better one later, so look it up every
+// frame rather than keeping it, and call release_retired_pipelines once
+// a frame.
+VkPipeline get_pipeline(pipeline_manager* manager, const graphics_pipeline_state& state);
+
+// Returns the pipeline for the state, compiling it on the calling thread
+// if it isn't ready.
+VkPipeline get_pipeline_blocking(
+  pipeline_manager* manager,
+  const graphics_pipeline_state& state
+);
+
+// Destroys the quick linked pipelines that optimized ones have replaced.
+// Only call it once the GPU is done with every frame that might have used
+// them, i.e. after waiting on the fence of the most recent frame.
+void release_retired_pipelines(pipeline_manager* manager);
+
+#endif
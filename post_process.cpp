@@ -0,0 +1,601 @@
+#include "post_process.h"
+
+#include <stdexcept>
+#include <algorithm>
+
+using namespace std;
+
+// The workgroup sizes in the shaders.
+const uint32_t POST_GROUP_SIZE = 8;
+const uint32_t POST_BLUR_TILE = 128;
+
+enum post_pass {
+  POST_BRIGHT,
+  POST_BLUR_ACROSS,
+  POST_BLUR_DOWN,
+  POST_TONEMAP,
+  POST_ANTIALIAS,
+  NUM_POST_PASSES,
+};
+
+// What every pass gets, matching post_constants in the shaders.
+struct post_push_constants {
+  float inverse_size[2];
+  int32_t direction[2];
+  float exposure;
+  float bloom_threshold;
+  float bloom_intensity;
+  float saturation;
+  float contrast;
+  float sharpness;
+  uint32_t tonemap;
+  uint32_t fxaa;
+  float gain[4];
+  uint32_t display;
+  float paper_white;
+  float max_white;
+};
+
+static void create_layouts(post_process* post, layout_cache* layouts) {
+  VkDescriptorSetLayoutBinding bindings[3]{};
+  VkPushConstantRange push_constants{};
+
+  // Up to two images to sample and one to write. Each pass only uses
+  // the ones it needs.
+  bindings[0].binding = 0;
+  bindings[0].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+  bindings[0].descriptorCount = 1;
+  bindings[0].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+
+  bindings[1].binding = 1;
+  bindings[1].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+  bindings[1].descriptorCount = 1;
+  bindings[1].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+
+  bindings[2].binding = 2;
+  bindings[2].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+  bindings[2].descriptorCount = 1;
+  bindings[2].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+
+  push_constants.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+  push_constants.size = sizeof(post_push_constants);
+
+  post->set_layout = get_descriptor_set_layout(layouts, bindings, 3);
+  post->layout = get_pipeline_layout(layouts, &(post->set_layout), 1, &push_constants);
+}
+
+static VkPipeline create_compute_pipeline(
+  post_process* post,
+  pipeline_manager* pipelines,
+  shader_library* shaders,
+  const char* name
+) {
+  VkComputePipelineCreateInfo pipeline_info{};
+  VkPipeline pipeline;
+
+  pipeline_info.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+  pipeline_info.stage.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+  pipeline_info.stage.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+  pipeline_info.stage.module = get_shader_module(shaders, name);
+  pipeline_info.stage.pName = "main";
+  pipeline_info.layout = post->layout;
+
+  if (vkCreateComputePipelines(post->device, pipelines->cache, 1, &pipeline_info, NULL, &pipeline) != VK_SUCCESS) {
+    throw runtime_error("failed to create post processing pipeline!");
+  }
+
+  return pipeline;
+}
+
+static void create_sampler(post_process* post) {
+  VkSamplerCreateInfo sampler_info{};
+
+  // Linear for the bloom's upsampling and FXAA's taps between texels.
+  sampler_info.sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO;
+  sampler_info.magFilter = VK_FILTER_LINEAR;
+  sampler_info.minFilter = VK_FILTER_LINEAR;
+  sampler_info.mipmapMode = VK_SAMPLER_MIPMAP_MODE_NEAREST;
+  sampler_info.addressModeU = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+  sampler_info.addressModeV = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+  sampler_info.addressModeW = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+
+  if (vkCreateSampler(post->device, &sampler_info, NULL, &(post->sampler)) != VK_SUCCESS) {
+    throw runtime_error("failed to create post processing sampler!");
+  }
+}
+
+static void create_descriptor_sets(post_process* post) {
+  VkDescriptorPoolSize pool_sizes[2]{};
+  VkDescriptorPoolCreateInfo pool_info{};
+  VkDescriptorSetLayout set_layouts[NUM_POST_PASSES];
+  VkDescriptorSetAllocateInfo alloc_info{};
+
+  pool_sizes[0].type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+  pool_sizes[0].descriptorCount = 2 * NUM_POST_PASSES;
+  pool_sizes[1].type = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+  pool_sizes[1].descriptorCount = NUM_POST_PASSES;
+
+  pool_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+  pool_info.maxSets = NUM_POST_PASSES;
+  pool_info.poolSizeCount = 2;
+  pool_info.pPoolSizes = pool_sizes;
+
+  if (vkCreateDescriptorPool(post->device, &pool_info, NULL, &(post->descriptor_pool)) != VK_SUCCESS) {
+    throw runtime_error("failed to create post processing descriptor pool!");
+  }
+
+  fill(set_layouts, set_layouts + NUM_POST_PASSES, post->set_layout);
+
+  alloc_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+  alloc_info.descriptorPool = post->descriptor_pool;
+  alloc_info.descriptorSetCount = NUM_POST_PASSES;
+  alloc_info.pSetLayouts = set_layouts;
+
+  if (vkAllocateDescriptorSets(post->device, &alloc_info, post->descriptor_sets) != VK_SUCCESS) {
+    throw runtime_error("failed to allocate post processing descriptor sets!");
+  }
+}
+
+void create_post_process(
+  VkDevice device,
+  memory_allocator* allocator,
+  layout_cache* layouts,
+  pipeline_manager* pipelines,
+  shader_library* shaders,
+  post_process* post
+) {
+  post->device = device;
+  post->allocator = allocator;
+  post->display = DISPLAY_SDR;
+  post->width = 0;
+  post->height = 0;
+  post->bloom[0] = NULL;
+  post->bloom[1] = NULL;
+  post->graded = NULL;
+
+  create_layouts(post, layouts);
+
+  post->bright_pipeline = create_compute_pipeline(post, pipelines, shaders, "post_bright.comp");
+  post->blur_pipeline = create_compute_pipeline(post, pipelines, shaders, "post_blur.comp");
+  post->tonemap_pipelines[0] = create_compute_pipeline(post, pipelines, shaders, "post_tonemap.comp");
+  post->tonemap_pipelines[1] = create_compute_pipeline(post, pipelines, shaders, "post_tonemap_hdr.comp");
+  post->antialias_pipelines[DISPLAY_SDR] =
+    create_compute_pipeline(post, pipelines, shaders, "post_antialias.comp");
+  post->antialias_pipelines[DISPLAY_HDR10] =
+    create_compute_pipeline(post, pipelines, shaders, "post_antialias_hdr10.comp");
+  post->antialias_pipelines[DISPLAY_SCRGB] =
+    create_compute_pipeline(post, pipelines, shaders, "post_antialias_scrgb.comp");
+  post->antialias_pipelines[DISPLAY_SDR_LINEAR] =
+    create_compute_pipeline(post, pipelines, shaders, "post_antialias_scrgb.comp");
+
+  create_sampler(post);
+  create_descriptor_sets(post);
+}
+
+static void destroy_intermediates(post_process* post) {
+  if (post->graded == NULL) {
+    return;
+  }
+
+  for (uint32_t i = 0; i < 2; i++) {
+    vkDestroyImageView(post->device, post->bloom_views[i], NULL);
+    vkDestroyImage(post->device, post->bloom[i]->image, NULL);
+    free_allocation(post->allocator, post->bloom[i]);
+  }
+
+  vkDestroyImageView(post->device, post->graded_view, NULL);
+  vkDestroyImage(post->device, post->graded->image, NULL);
+  free_allocation(post->allocator, post->graded);
+
+  post->bloom[0] = NULL;
+  post->bloom[1] = NULL;
+  post->graded = NULL;
+}
+
+void destroy_post_process(post_process* post) {
+  // The layouts belong to the layout cache and the shader modules to the
+  // shader library.
+  destroy_intermediates(post);
+
+  vkDestroyDescriptorPool(post->device, post->descriptor_pool, NULL);
+  vkDestroySampler(post->device, post->sampler, NULL);
+  vkDestroyPipeline(post->device, post->bright_pipeline, NULL);
+  vkDestroyPipeline(post->device, post->blur_pipeline, NULL);
+  for (VkPipeline pipeline : post->tonemap_pipelines) {
+    vkDestroyPipeline(post->device, pipeline, NULL);
+  }
+  for (VkPipeline pipeline : post->antialias_pipelines) {
+    vkDestroyPipeline(post->device, pipeline, NULL);
+  }
+}
+
+post_process_settings default_post_process_settings() {
+  post_process_settings settings{};
+
+  settings.exposure = 1.0f;
+  settings.bloom_threshold = 1.0f;
+  settings.bloom_intensity = 0.5f;
+  settings.tonemap = TONEMAP_ACES;
+  settings.gain[0] = 1.0f;
+  settings.gain[1] = 1.0f;
+  settings.gain[2] = 1.0f;
+  settings.saturation = 1.0f;
+  settings.contrast = 1.0f;
+  settings.fxaa = true;
+  settings.sharpness = 0.25f;
+  settings.paper_white = 203.0f;
+  settings.peak_white = 1000.0f;
+
+  return settings;
+}
+
+VkFormat get_post_output_format(display_encoding display) {
+  switch (display) {
+    case DISPLAY_HDR10:
+      return VK_FORMAT_A2B10G10R10_UNORM_PACK32;
+    case DISPLAY_SCRGB:
+    case DISPLAY_SDR_LINEAR:
+      return VK_FORMAT_R16G16B16A16_SFLOAT;
+    default:
+      return VK_FORMAT_R8G8B8A8_UNORM;
+  }
+}
+
+// Both SDR displays are tonemapped and graded the same way, into sRGB.
+static bool is_sdr_display(display_encoding display) {
+  return display == DISPLAY_SDR || display == DISPLAY_SDR_LINEAR;
+}
+
+// The encoded SDR colors fit in 8 bits. PQ's steps are too coarse for
+// that, and scRGB goes past 1.
+static VkFormat graded_format(display_encoding display) {
+  return is_sdr_display(display) ? VK_FORMAT_R8G8B8A8_UNORM : VK_FORMAT_R16G16B16A16_SFLOAT;
+}
+
+//
+// TARGETS
+//
+
+static gpu_allocation* create_intermediate(
+  post_process* post,
+  VkFormat format,
+  uint32_t width,
+  uint32_t height,
+  VkImageView* view
+) {
+  VkImageCreateInfo image_info{};
+  VkImageViewCreateInfo view_info{};
+  VkImage image;
+  gpu_allocation* allocation;
+
+  image_info.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+  image_info.imageType = VK_IMAGE_TYPE_2D;
+  image_info.format = format;
+  image_info.extent = { width, height, 1 };
+  image_info.mipLevels = 1;
+  image_info.arrayLayers = 1;
+  image_info.samples = VK_SAMPLE_COUNT_1_BIT;
+  image_info.tiling = VK_IMAGE_TILING_OPTIMAL;
+  image_info.usage = VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_SAMPLED_BIT;
+  image_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+  image_info.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+
+  if (vkCreateImage(post->device, &image_info, NULL, &image) != VK_SUCCESS) {
+    throw runtime_error("failed to create post processing image!");
+  }
+
+  allocation = allocate_image(
+    post->allocator,
+    image,
+    VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+    MEMORY_RENDER_TARGETS
+  );
+
+  view_info.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+  view_info.image = image;
+  view_info.viewType = VK_IMAGE_VIEW_TYPE_2D;
+  view_info.format = format;
+  view_info.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+  view_info.subresourceRange.levelCount = 1;
+  view_info.subresourceRange.layerCount = 1;
+
+  if (vkCreateImageView(post->device, &view_info, NULL, view) != VK_SUCCESS) {
+    throw runtime_error("failed to create post processing image view!");
+  }
+
+  return allocation;
+}
+
+// Writes a pass's set: what it samples (input and, if there is one,
+// second_input) and what it writes.
+static void write_pass_set(
+  post_process* post,
+  post_pass pass,
+  VkImageView input,
+  VkImageLayout input_layout,
+  VkImageView second_input,
+  VkImageView output
+) {
+  VkDescriptorImageInfo image_infos[3]{};
+  VkWriteDescriptorSet writes[3]{};
+  uint32_t num_writes;
+
+  image_infos[0].sampler = post->sampler;
+  image_infos[0].imageView = input;
+  image_infos[0].imageLayout = input_layout;
+
+  image_infos[1].sampler = post->sampler;
+  image_infos[1].imageView = second_input;
+  image_infos[1].imageLayout = VK_IMAGE_LAYOUT_GENERAL;
+
+  image_infos[2].imageView = output;
+  image_infos[2].imageLayout = VK_IMAGE_LAYOUT_GENERAL;
+
+  num_writes = 0;
+
+  for (uint32_t binding = 0; binding < 3; binding++) {
+    if (binding == 1 && second_input == VK_NULL_HANDLE) {
+      continue;
+    }
+
+    writes[num_writes].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+    writes[num_writes].dstSet = post->descriptor_sets[pass];
+    writes[num_writes].dstBinding = binding;
+    writes[num_writes].descriptorCount = 1;
+    writes[num_writes].descriptorType =
+      binding == 2 ? VK_DESCRIPTOR_TYPE_STORAGE_IMAGE : VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+    writes[num_writes].pImageInfo = &image_infos[binding];
+    num_writes++;
+  }
+
+  vkUpdateDescriptorSets(post->device, num_writes, writes, 0, NULL);
+}
+
+void set_post_process_target(
+  post_process* post,
+  VkImageView hdr,
+  VkImageView output,
+  display_encoding display,
+  uint32_t width,
+  uint32_t height
+) {
+  uint32_t bloom_width;
+  uint32_t bloom_height;
+  bool same_graded_format;
+
+  same_graded_format = graded_format(display) == graded_format(post->display);
+  post->display = display;
+
+  // If only the views changed, the intermediates can stay.
+  if (width != post->width || height != post->height || !same_graded_format || post->graded == NULL) {
+    destroy_intermediates(post);
+
+    post->width = width;
+    post->height = height;
+
+    bloom_width = max(width / 2, 1u);
+    bloom_height = max(height / 2, 1u);
+
+    for (uint32_t i = 0; i < 2; i++) {
+      post->bloom[i] = create_intermediate(
+        post,
+        VK_FORMAT_R16G16B16A16_SFLOAT,
+        bloom_width,
+        bloom_height,
+        &(post->bloom_views[i])
+      );
+    }
+
+    post->graded = create_intermediate(
+      post,
+      graded_format(display),
+      width,
+      height,
+      &(post->graded_view)
+    );
+  }
+
+  // The blur goes from bloom 0 to 1 and back, so the tonemap pass reads
+  // the finished bloom from 0.
+  write_pass_set(post, POST_BRIGHT, hdr, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, VK_NULL_HANDLE, post->bloom_views[0]);
+  write_pass_set(post, POST_BLUR_ACROSS, post->bloom_views[0], VK_IMAGE_LAYOUT_GENERAL, VK_NULL_HANDLE, post->bloom_views[1]);
+  write_pass_set(post, POST_BLUR_DOWN, post->bloom_views[1], VK_IMAGE_LAYOUT_GENERAL, VK_NULL_HANDLE, post->bloom_views[0]);
+  write_pass_set(post, POST_TONEMAP, hdr, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, post->bloom_views[0], post->graded_view);
+  write_pass_set(post, POST_ANTIALIAS, post->graded_view, VK_IMAGE_LAYOUT_GENERAL, VK_NULL_HANDLE, output);
+}
+
+//
+// RECORDING
+//
+
+// Waits for the last dispatch's writes to image before the next one reads
+// it. With discard, the image is about to be overwritten whole, so its
+// contents can go and only earlier reads have to finish.
+static void compute_barrier(
+  VkCommandBuffer cmd,
+  const VkImage* images,
+  uint32_t num_images,
+  bool discard
+) {
+  VkImageMemoryBarrier barriers[3]{};
+
+  for (uint32_t i = 0; i < num_images; i++) {
+    barriers[i].sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+    barriers[i].srcAccessMask = discard ? 0 : VK_ACCESS_SHADER_WRITE_BIT;
+    barriers[i].dstAccessMask = discard ? VK_ACCESS_SHADER_WRITE_BIT : VK_ACCESS_SHADER_READ_BIT;
+    barriers[i].oldLayout = discard ? VK_IMAGE_LAYOUT_UNDEFINED : VK_IMAGE_LAYOUT_GENERAL;
+    barriers[i].newLayout = VK_IMAGE_LAYOUT_GENERAL;
+    barriers[i].srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barriers[i].dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barriers[i].image = images[i];
+    barriers[i].subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+    barriers[i].subresourceRange.levelCount = 1;
+    barriers[i].subresourceRange.layerCount = 1;
+  }
+
+  vkCmdPipelineBarrier(
+    cmd,
+    VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+    VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+    0,
+    0,
+    NULL,
+    0,
+    NULL,
+    num_images,
+    barriers
+  );
+}
+
+static void dispatch(
+  post_process* post,
+  VkCommandBuffer cmd,
+  post_pass pass,
+  VkPipeline pipeline,
+  post_push_constants* constants,
+  uint32_t groups_x,
+  uint32_t groups_y
+) {
+  vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, pipeline);
+  vkCmdBindDescriptorSets(
+    cmd,
+    VK_PIPELINE_BIND_POINT_COMPUTE,
+    post->layout,
+    0,
+    1,
+    &(post->descriptor_sets[pass]),
+    0,
+    NULL
+  );
+  vkCmdPushConstants(cmd, post->layout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(*constants), constants);
+  vkCmdDispatch(cmd, groups_x, groups_y, 1);
+}
+
+static uint32_t groups(uint32_t size, uint32_t group_size) {
+  return (size + group_size - 1) / group_size;
+}
+
+void record_post_process(
+  post_process* post,
+  VkCommandBuffer cmd,
+  const post_process_settings& settings,
+  gpu_profiler* profiler
+) {
+  post_push_constants constants{};
+  uint32_t bloom_width;
+  uint32_t bloom_height;
+  uint32_t scope = 0;
+  VkImage images[3];
+
+  if (post->graded == NULL) {
+    throw runtime_error("post processing has no target!");
+  }
+
+  bloom_width = max(post->width / 2, 1u);
+  bloom_height = max(post->height / 2, 1u);
+
+  constants.exposure = settings.exposure;
+  constants.bloom_threshold = settings.bloom_threshold;
+  constants.bloom_intensity = settings.bloom_intensity;
+  constants.saturation = settings.saturation;
+  constants.contrast = settings.contrast;
+  constants.sharpness = settings.sharpness;
+  constants.tonemap = settings.tonemap;
+  constants.fxaa = settings.fxaa ? 1 : 0;
+  constants.gain[0] = settings.gain[0];
+  constants.gain[1] = settings.gain[1];
+  constants.gain[2] = settings.gain[2];
+  constants.gain[3] = 1.0f;
+  constants.display = post->display;
+  constants.paper_white = settings.paper_white;
+  constants.max_white = settings.peak_white / settings.paper_white;
+
+  // Every intermediate is written whole before it's read, so last frame's
+  // contents can go as soon as last frame's reads are done.
+  images[0] = post->bloom[0]->image;
+  images[1] = post->bloom[1]->image;
+  images[2] = post->graded->image;
+  compute_barrier(cmd, images, 3, true);
+
+  if (profiler != NULL) {
+    scope = begin_profiler_scope(cmd, profiler, "post_bloom");
+  }
+
+  constants.inverse_size[0] = 1.0f / bloom_width;
+  constants.inverse_size[1] = 1.0f / bloom_height;
+  dispatch(
+    post,
+    cmd,
+    POST_BRIGHT,
+    post->bright_pipeline,
+    &constants,
+    groups(bloom_width, POST_GROUP_SIZE),
+    groups(bloom_height, POST_GROUP_SIZE)
+  );
+  compute_barrier(cmd, &(post->bloom[0]->image), 1, false);
+
+  // One workgroup per run of POST_BLUR_TILE texels of a row, then of a
+  // column.
+  constants.direction[0] = 1;
+  constants.direction[1] = 0;
+  dispatch(
+    post,
+    cmd,
+    POST_BLUR_ACROSS,
+    post->blur_pipeline,
+    &constants,
+    groups(bloom_width, POST_BLUR_TILE),
+    bloom_height
+  );
+  compute_barrier(cmd, &(post->bloom[1]->image), 1, false);
+
+  constants.direction[0] = 0;
+  constants.direction[1] = 1;
+  dispatch(
+    post,
+    cmd,
+    POST_BLUR_DOWN,
+    post->blur_pipeline,
+    &constants,
+    groups(bloom_height, POST_BLUR_TILE),
+    bloom_width
+  );
+  compute_barrier(cmd, &(post->bloom[0]->image), 1, false);
+
+  if (profiler != NULL) {
+    end_profiler_scope(cmd, profiler, scope);
+    scope = begin_profiler_scope(cmd, profiler, "post_tonemap");
+  }
+
+  constants.inverse_size[0] = 1.0f / post->width;
+  constants.inverse_size[1] = 1.0f / post->height;
+  dispatch(
+    post,
+    cmd,
+    POST_TONEMAP,
+    post->tonemap_pipelines[is_sdr_display(post->display) ? 0 : 1],
+    &constants,
+    groups(post->width, POST_GROUP_SIZE),
+    groups(post->height, POST_GROUP_SIZE)
+  );
+  compute_barrier(cmd, &(post->graded->image), 1, false);
+
+  if (profiler != NULL) {
+    end_profiler_scope(cmd, profiler, scope);
+    scope = begin_profiler_scope(cmd, profiler, "post_antialias");
+  }
+
+  dispatch(
+    post,
+    cmd,
+    POST_ANTIALIAS,
+    post->antialias_pipelines[post->display],
+    &constants,
+    groups(post->width, POST_GROUP_SIZE),
+    groups(post->height, POST_GROUP_SIZE)
+  );
+
+  if (profiler != NULL) {
+    end_profiler_scope(cmd, profiler, scope);
+  }
+}
@@ -0,0 +1,172 @@
+#ifndef POST_PROCESS_H
+#define POST_PROCESS_H
+
+#define GLFW_INCLUDE_VULKAN
+
+#include <GLFW/glfw3.h>
+#include <cstdint>
+
+#include "memory_allocator.h"
+#include "layout_cache.h"
+#include "pipeline_manager.h"
+#include "shader_library.h"
+#include "gpu_profiler.h"
+#include "swap_chain.h"
+
+//
+// Post processing turns the HDR scene into the picture on screen:
+// bloom, tonemapping, color grading, antialiasing and sharpening. Done
+// the usual way, as a full screen raster pass each, every effect writes a
+// full size image that the next one reads straight back, and most of the
+// frame's post processing time is spent on that traffic rather than on
+// the effects.
+//
+// The chain here runs as compute shaders, and does the per pixel effects
+// together wherever nothing needs a neighbor's result:
+//
+//   1. post_bright.comp: the bright parts of the scene, at half size.
+//   2. post_blur.comp, twice: a separable Gaussian blur of those, across
+//      and then down. Each workgroup reads a run of texels (and the blur's
+//      reach either side) into shared memory once, so the 17 taps per
+//      texel don't each go back to the image.
+//   3. post_tonemap.comp: exposure, adding the upsampled bloom,
+//      tonemapping, color grading and encoding for the display, all in
+//      one pass from the HDR image to one intermediate.
+//   4. post_antialias.comp: FXAA where the pixel is on an edge and
+//      sharpening where it isn't, into the output.
+//
+// That's one full size intermediate in all, where the raster chain would
+// have one per effect. SMAA isn't offered: it needs three passes and
+// lookup textures of its own, which is what this is trying to avoid.
+//
+// Tonemapping follows the display the swap chain settled on (see
+// swap_chain.h). For SDR it's the chosen curve into sRGB, 8 bits in and
+// out; an _SRGB swap chain is graded the same but decoded to linear half
+// floats on output, for the blit to encode again. For HDR10 and scRGB it rolls off towards the display's peak
+// instead of 1, and the intermediate is half float so the encoded colors
+// don't band. The output's format follows the display too (see
+// get_post_output_format), each with a pipeline of its own, since a
+// shader's storage image format is fixed when it's compiled.
+//
+// The bloom, tonemap and antialias steps each get a profiler scope, so
+// their GPU times show up as post_bloom, post_tonemap and
+// post_antialias.
+//
+
+// Matches the constants in shaders/post_tonemap.glsl. Only SDR displays
+// use them; HDR ones get a curve of their own.
+enum post_tonemap_mode : uint32_t {
+  TONEMAP_ACES,
+  TONEMAP_REINHARD,
+};
+
+struct post_process_settings {
+  // Multiplies the scene before anything else.
+  float exposure;
+  // How bright (after exposure) a color has to be to bloom, and how much
+  // of the bloom is added back.
+  float bloom_threshold;
+  float bloom_intensity;
+  post_tonemap_mode tonemap;
+
+  // Grading, after tonemapping: a per channel multiplier, then saturation
+  // and contrast, where 1 changes nothing.
+  float gain[3];
+  float saturation;
+  float contrast;
+
+  bool fxaa;
+  // 0 for none, up to 1.
+  float sharpness;
+
+  // For HDR displays, in nits: what 1 in the scene's (exposed) colors
+  // comes out as, and the brightest the display goes.
+  float paper_white;
+  float peak_white;
+};
+
+struct post_process {
+  VkDevice device;
+  memory_allocator* allocator;
+
+  VkDescriptorSetLayout set_layout;
+  VkPipelineLayout layout;
+  VkPipeline bright_pipeline;
+  VkPipeline blur_pipeline;
+  // By display_encoding. The tonemap pass has one for SDR and one for
+  // both HDR encodings, which share an intermediate format.
+  VkPipeline tonemap_pipelines[2];
+  VkPipeline antialias_pipelines[4];
+  VkSampler sampler;
+
+  // One set per dispatch: bright, blur across, blur down, tonemap and
+  // antialias.
+  VkDescriptorPool descriptor_pool;
+  VkDescriptorSet descriptor_sets[5];
+
+  // Set by set_post_process_target. The bloom images are half size,
+  // RGBA16F; the graded image is full size, RGBA8 for SDR and RGBA16F for
+  // HDR, with luma in alpha. All three stay in GENERAL.
+  display_encoding display;
+  uint32_t width;
+  uint32_t height;
+  gpu_allocation* bloom[2];
+  VkImageView bloom_views[2];
+  gpu_allocation* graded;
+  VkImageView graded_view;
+};
+
+//
+// POST PROCESS ROUTINES
+//
+
+// Builds the compute pipelines, in the pipeline manager's cache. Call
+// set_post_process_target before the first record_post_process.
+void create_post_process(
+  VkDevice device,
+  memory_allocator* allocator,
+  layout_cache* layouts,
+  pipeline_manager* pipelines,
+  shader_library* shaders,
+  post_process* post
+);
+// Nothing the chain recorded may still be in flight.
+void destroy_post_process(post_process* post);
+
+// Neutral grading, ACES, FXAA on and a little sharpening. Paper white
+// is BT.2408's 203 nits, and the peak 1000, which most HDR displays
+// reach or tone map down from.
+post_process_settings default_post_process_settings();
+
+// The format of the output for a display: R8G8B8A8_UNORM for SDR,
+// A2B10G10R10_UNORM_PACK32 for HDR10 and R16G16B16A16_SFLOAT for scRGB
+// and SDR_LINEAR.
+// Each blits to any swap chain format of its display's.
+VkFormat get_post_output_format(display_encoding display);
+
+// Points the chain at its input and output, and makes the intermediates
+// for their size and display. Call again when any of them change, once
+// nothing the chain recorded is in flight. hdr is sampled in
+// SHADER_READ_ONLY_OPTIMAL; output is a storage image of
+// get_post_output_format(display), written in GENERAL, which gets colors
+// encoded for the display.
+void set_post_process_target(
+  post_process* post,
+  VkImageView hdr,
+  VkImageView output,
+  display_encoding display,
+  uint32_t width,
+  uint32_t height
+);
+
+// Records the chain. The caller makes the scene's writes to hdr visible
+// to compute shaders before, and waits on the compute shader's writes to
+// output after. profiler may be NULL.
+void record_post_process(
+  post_process* post,
+  VkCommandBuffer cmd,
+  const post_process_settings& settings,
+  gpu_profiler* profiler
+);
+
+#endif
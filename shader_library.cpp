@@ -0,0 +1,122 @@
+#include "shader_library.h"
+#include "generated/embedded_shaders.h"
+
+#include <stdexcept>
+#include <fstream>
+#include <vector>
+#include <cstring>
+#include <cstdlib>
+
+using namespace std;
+
+static VkShaderModule create_module(
+  VkDevice device,
+  const uint32_t* code,
+  size_t size
+) {
+  VkShaderModuleCreateInfo create_info{};
+  VkShaderModule module;
+  VkResult result;
+
+  create_info.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
+  create_info.codeSize = size;
+  create_info.pCode = code;
+
+  result = vkCreateShaderModule(device, &create_info, NULL, &module);
+
+  if (result != VK_SUCCESS) {
+    throw runtime_error("failed to create shader module!");
+  }
+
+  return module;
+}
+
+// Reads <override_dir>/<name>.spv into code. Returns false if there's no
+// such file.
+static bool read_override(
+  const string& override_dir,
+  const char* name,
+  vector<uint32_t>* code
+) {
+  ifstream file;
+  size_t size;
+
+  file.open(override_dir + "/" + name + ".spv", ios::binary | ios::ate);
+
+  if (!file.is_open()) {
+    return false;
+  }
+
+  size = (size_t)file.tellg();
+
+  if (size % sizeof(uint32_t) != 0) {
+    throw runtime_error("override shader " + string(name) + " is not valid SPIR-V!");
+  }
+
+  // Read into uint32_t's so the code is aligned the way Vulkan wants.
+  code->resize(size / sizeof(uint32_t));
+  file.seekg(0);
+  file.read((char*)code->data(), size);
+
+  return true;
+}
+
+void create_shader_library(VkDevice device, shader_library* library) {
+  const char* override_dir;
+
+  library->device = device;
+
+  override_dir = getenv(SHADER_OVERRIDE_ENV);
+  library->override_dir = override_dir != NULL ? override_dir : "";
+}
+
+void destroy_shader_library(shader_library* library) {
+  for (auto& module : library->modules) {
+    vkDestroyShaderModule(library->device, module.second, NULL);
+  }
+
+  library->modules.clear();
+}
+
+const embedded_shader* find_embedded_shader(const char* name) {
+  for (size_t i = 0; i < NUM_EMBEDDED_SHADERS; i++) {
+    if (strcmp(EMBEDDED_SHADERS[i].name, name) == 0) {
+      return &EMBEDDED_SHADERS[i];
+    }
+  }
+
+  return NULL;
+}
+
+VkShaderModule get_shader_module(shader_library* library, const char* name) {
+  vector<uint32_t> override_code;
+  const embedded_shader* shader;
+  VkShaderModule module;
+
+  auto existing = library->modules.find(name);
+
+  if (existing != library->modules.end()) {
+    return existing->second;
+  }
+
+  if (!library->override_dir.empty() &&
+      read_override(library->override_dir, name, &override_code)) {
+    module = create_module(
+      library->device,
+      override_code.data(),
+      override_code.size() * sizeof(uint32_t)
+    );
+  } else {
+    shader = find_embedded_shader(name);
+
+    if (shader == NULL) {
+      throw runtime_error("no shader named " + string(name) + "!");
+    }
+
+    module = create_module(library->device, shader->code, shader->size);
+  }
+
+  library->modules[name] = module;
+
+  return module;
+}
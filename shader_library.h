@@ -0,0 +1,54 @@
+#ifndef SHADER_LIBRARY_H
+#define SHADER_LIBRARY_H
+
+#define GLFW_INCLUDE_VULKAN
+
+#include <GLFW/glfw3.h>
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <unordered_map>
+
+//
+// Shaders are compiled to SPIR-V at build time and embedded in the
+// binary by embed_shaders.py, so creating a shader module never touches
+// the disk. That matters on installs that live on a network drive, where
+// every file read at startup is a round trip.
+//
+// For development, setting the SHADER_OVERRIDE_DIR environment variable
+// makes the library look for <dir>/<name>.spv first, so shaders can be
+// recompiled and picked up without rebuilding the program.
+//
+
+const char* const SHADER_OVERRIDE_ENV = "SHADER_OVERRIDE_DIR";
+
+// One entry in the generated registry. name is the shader's file name in
+// shaders/, e.g. "triangle.vert".
+struct embedded_shader {
+  const char* name;
+  const uint32_t* code;
+  // In bytes.
+  size_t size;
+};
+
+struct shader_library {
+  VkDevice device;
+  // Empty if overriding is off.
+  std::string override_dir;
+  // Every module created so far, by name.
+  std::unordered_map<std::string, VkShaderModule> modules;
+};
+
+void create_shader_library(VkDevice device, shader_library* library);
+// Destroys every module the library created. Pipelines made from them
+// are unaffected.
+void destroy_shader_library(shader_library* library);
+
+// Returns the embedded shader with the name, or NULL if there isn't one.
+const embedded_shader* find_embedded_shader(const char* name);
+
+// Returns the module for the named shader, creating it the first time.
+// Throws if there's no shader with the name.
+VkShaderModule get_shader_module(shader_library* library, const char* name);
+
+#endif
@@ -0,0 +1,54 @@
+#include "shader_permutation.h"
+
+#include <stdexcept>
+#include <cstring>
+
+using namespace std;
+
+void apply_permutation(
+  const permutation_space& space,
+  const shader_permutation& permutation,
+  graphics_pipeline_state* state
+) {
+  if (!is_valid_permutation(space, permutation)) {
+    throw runtime_error("shader permutation is not in its permutation space!");
+  }
+
+  state->num_specialization_constants = space.num_constants;
+
+  for (uint32_t i = 0; i < space.num_constants; i++) {
+    state->specialization_ids[i] = space.constants[i].id;
+    state->specialization_values[i] = permutation.values[i];
+  }
+}
+
+vector<graphics_pipeline_state> permutation_pipeline_states(
+  const permutation_space& space,
+  const shader_permutation* permutations,
+  uint32_t num_permutations,
+  const graphics_pipeline_state& base
+) {
+  vector<graphics_pipeline_state> states;
+
+  states.resize(num_permutations, base);
+
+  for (uint32_t i = 0; i < num_permutations; i++) {
+    apply_permutation(space, permutations[i], &states[i]);
+  }
+
+  return states;
+}
+
+uint32_t permutation_value(
+  const permutation_space& space,
+  const shader_permutation& permutation,
+  const char* name
+) {
+  for (uint32_t i = 0; i < space.num_constants; i++) {
+    if (strcmp(space.constants[i].name, name) == 0) {
+      return permutation.values[i];
+    }
+  }
+
+  throw runtime_error("no specialization constant named " + string(name) + "!");
+}
@@ -0,0 +1,211 @@
+#ifndef SHADER_PERMUTATION_H
+#define SHADER_PERMUTATION_H
+
+#include "pipeline_manager.h"
+
+#include <array>
+#include <cstdint>
+#include <stdexcept>
+#include <vector>
+
+//
+// An uber-shader that branches on feature toggles and loops up to a light
+// count it reads from a uniform pays for that flexibility on every pixel:
+// the compiler can't drop the dead code, unroll the loops or keep the
+// register count down. Specialization constants fix this. The shader
+// declares them like
+//
+//   layout(constant_id = 0) const bool USE_NORMAL_MAP = false;
+//   layout(constant_id = 1) const uint NUM_LIGHTS = 1;
+//
+// and their values are handed over when the pipeline is created, so the
+// driver compiles them in as if they were literals. Each combination of
+// values is a "permutation" and gets its own pipeline.
+//
+// The catch is that permutations multiply, so the set of valid ones is
+// described in C++ at compile time and anything outside it is never built:
+//
+//   constexpr bool lit_is_valid(const shader_permutation& p) {
+//     // Normal maps are only worth it with at least one light.
+//     return p.values[1] > 0 || p.values[0] == 0;
+//   }
+//
+//   constexpr permutation_space LIT_SHADER = {
+//     2,
+//     {
+//       { 0, "USE_NORMAL_MAP", 0, 1 },
+//       { 1, "NUM_LIGHTS", 0, 4 },
+//     },
+//     lit_is_valid,
+//   };
+//
+//   // 9 permutations, worked out by the compiler.
+//   constexpr auto LIT_PERMUTATIONS = valid_permutations<LIT_SHADER>();
+//
+
+// The largest number of combinations we are willing to walk through at
+// compile time. A space bigger than this is almost certainly a mistake.
+const uint64_t MAX_PERMUTATION_COMBINATIONS = 1 << 16;
+
+// One specialization constant and the range of values it can take. Bools
+// are constants with a range of 0 to 1.
+struct specialization_constant {
+  // The constant_id in the shader.
+  uint32_t id;
+  const char* name;
+  uint32_t min_value;
+  uint32_t max_value;
+};
+
+// One value per constant, in the same order as the space's constants.
+struct shader_permutation {
+  uint32_t values[MAX_SPECIALIZATION_CONSTANTS];
+};
+
+struct permutation_space {
+  uint32_t num_constants;
+  specialization_constant constants[MAX_SPECIALIZATION_CONSTANTS];
+  // Returns false for combinations we never draw with. It must be
+  // constexpr so the valid permutations can be counted at compile time.
+  // NULL means every combination is valid.
+  bool (*is_valid)(const shader_permutation& permutation);
+};
+
+//
+// COMPILE TIME ROUTINES
+//
+// These throw on a malformed space. Throwing isn't allowed in a constant
+// expression, so when they run at compile time (as they do for
+// valid_permutations) a bad space is a compile error pointing at the throw.
+//
+
+// The number of values the constant can take. Done in 64 bits, since a
+// range of 0 to UINT32_MAX has 2^32 values.
+constexpr uint64_t specialization_range(const specialization_constant& constant) {
+  if (constant.min_value > constant.max_value) {
+    throw std::runtime_error("specialization constant's min_value is above its max_value!");
+  }
+
+  return (uint64_t)constant.max_value - constant.min_value + 1;
+}
+
+// Stops counting once the count goes past MAX_PERMUTATION_COMBINATIONS, so
+// the result can't overflow; anything that big is rejected anyway.
+constexpr uint64_t num_permutation_combinations(const permutation_space& space) {
+  uint64_t count = 1;
+
+  if (space.num_constants > MAX_SPECIALIZATION_CONSTANTS) {
+    throw std::runtime_error("permutation space has too many constants!");
+  }
+
+  for (uint32_t i = 0; i < space.num_constants; i++) {
+    count *= specialization_range(space.constants[i]);
+
+    if (count > MAX_PERMUTATION_COMBINATIONS) {
+      return count;
+    }
+  }
+
+  return count;
+}
+
+// Returns the index'th combination, counting like an odometer where the
+// first constant is the fastest moving digit.
+constexpr shader_permutation permutation_at(const permutation_space& space, uint64_t index) {
+  shader_permutation permutation{};
+  uint64_t range = 0;
+
+  for (uint32_t i = 0; i < space.num_constants; i++) {
+    range = specialization_range(space.constants[i]);
+    permutation.values[i] = space.constants[i].min_value + (uint32_t)(index % range);
+    index /= range;
+  }
+
+  return permutation;
+}
+
+constexpr bool is_valid_permutation(
+  const permutation_space& space,
+  const shader_permutation& permutation
+) {
+  for (uint32_t i = 0; i < space.num_constants; i++) {
+    if (permutation.values[i] < space.constants[i].min_value ||
+        permutation.values[i] > space.constants[i].max_value) {
+      return false;
+    }
+  }
+
+  return space.is_valid == nullptr || space.is_valid(permutation);
+}
+
+constexpr uint32_t num_valid_permutations(const permutation_space& space) {
+  uint32_t count = 0;
+
+  // Checked here as well as in valid_permutations, since this runs first
+  // (it sizes the array) and would otherwise try to walk the whole space.
+  if (num_permutation_combinations(space) > MAX_PERMUTATION_COMBINATIONS) {
+    throw std::runtime_error("permutation space is too big!");
+  }
+
+  for (uint64_t i = 0; i < num_permutation_combinations(space); i++) {
+    if (is_valid_permutation(space, permutation_at(space, i))) {
+      count++;
+    }
+  }
+
+  return count;
+}
+
+// Every valid permutation of the space, as a constant array sized by the
+// compiler.
+template <const permutation_space& space>
+constexpr std::array<shader_permutation, num_valid_permutations(space)> valid_permutations() {
+  static_assert(space.num_constants <= MAX_SPECIALIZATION_CONSTANTS, "too many constants");
+  static_assert(
+    num_permutation_combinations(space) <= MAX_PERMUTATION_COMBINATIONS,
+    "permutation space is too big"
+  );
+
+  std::array<shader_permutation, num_valid_permutations(space)> permutations{};
+  uint32_t count = 0;
+
+  for (uint64_t i = 0; i < num_permutation_combinations(space); i++) {
+    if (is_valid_permutation(space, permutation_at(space, i))) {
+      permutations[count++] = permutation_at(space, i);
+    }
+  }
+
+  return permutations;
+}
+
+//
+// RUNTIME ROUTINES
+//
+
+// Sets the specialization constants of the pipeline state to the
+// permutation. Throws if the permutation isn't valid, so a permutation we
+// didn't plan for is caught instead of quietly compiled at draw time.
+void apply_permutation(
+  const permutation_space& space,
+  const shader_permutation& permutation,
+  graphics_pipeline_state* state
+);
+
+// Returns a copy of the base state for every permutation, ready to be
+// handed to precompile_pipelines.
+std::vector<graphics_pipeline_state> permutation_pipeline_states(
+  const permutation_space& space,
+  const shader_permutation* permutations,
+  uint32_t num_permutations,
+  const graphics_pipeline_state& base
+);
+
+// Returns the value of the named constant in the permutation. Throws if
+// the space has no constant by that name.
+uint32_t permutation_value(
+  const permutation_space& space,
+  const shader_permutation& permutation,
+  const char* name
+);
+
+#endif
@@ -0,0 +1,9 @@
+#version 450
+
+// A flat gray, so a missing pipeline is visible without being jarring.
+
+layout(location = 0) out vec4 out_color;
+
+void main() {
+  out_color = vec4(0.5, 0.5, 0.5, 1.0);
+}
@@ -0,0 +1,11 @@
+#version 450
+
+// Stands in for any vertex shader while its real pipeline compiles (see
+// pipeline_manager.h), so it may only read the position, which every
+// vertex layout has at location 0.
+
+layout(location = 0) in vec3 in_position;
+
+void main() {
+  gl_Position = vec4(in_position, 1.0);
+}
@@ -0,0 +1,130 @@
+// The last pass of the chain (see post_process.h): FXAA on edges, and
+// contrast adaptive sharpening everywhere else. The two want opposite
+// things from the same pixels, so rather than one pass after the other,
+// each pixel gets whichever its neighborhood calls for. Reads luma from
+// alpha, as the tonemap pass left it.
+//
+// One .comp per display defines OUTPUT_FORMAT, the output's format, and
+// includes this: post_antialias.comp, post_antialias_hdr10.comp and
+// post_antialias_scrgb.comp, which also defines LINEAR_OUTPUT. The last
+// serves _SRGB swap chains (DISPLAY_SDR_LINEAR) as well as scRGB.
+
+layout(local_size_x = 8, local_size_y = 8) in;
+
+// FXAA's tuning (Timothy Lottes' defaults).
+const float FXAA_EDGE_THRESHOLD = 1.0 / 8.0;
+const float FXAA_EDGE_THRESHOLD_MIN = 1.0 / 24.0;
+const float FXAA_REDUCE_MUL = 1.0 / 8.0;
+const float FXAA_REDUCE_MIN = 1.0 / 128.0;
+const float FXAA_SPAN_MAX = 8.0;
+
+layout(set = 0, binding = 0) uniform sampler2D graded;
+layout(set = 0, binding = 2, OUTPUT_FORMAT) uniform writeonly image2D result;
+
+#include "post_common.glsl"
+
+// The tonemap pass left both linear outputs sRGB encoded. scRGB is in
+// units of paper white, and its 1 is 80 nits; an _SRGB swap chain's 1 is
+// just white.
+vec3 to_output(vec3 color) {
+#ifdef LINEAR_OUTPUT
+  color = decode_srgb(color);
+
+  if (post.display == DISPLAY_SCRGB) {
+    color *= post.paper_white / 80.0;
+  }
+
+  return color;
+#else
+  return color;
+#endif
+}
+
+vec4 fetch(vec2 uv) {
+  return textureLod(graded, uv, 0.0);
+}
+
+// Clamped at the edges, like the sampler.
+vec3 neighbor(ivec2 texel, ivec2 offset) {
+  return texelFetch(graded, clamp(texel + offset, ivec2(0), imageSize(result) - 1), 0).rgb;
+}
+
+// Pushes the pixel away from the average of its four neighbors, less
+// where the neighborhood already has contrast, and never past its
+// brightest or darkest neighbor, so edges don't ring.
+vec3 sharpen(ivec2 texel, vec3 center) {
+  vec3 n;
+  vec3 s;
+  vec3 e;
+  vec3 w;
+  vec3 lowest;
+  vec3 highest;
+  vec3 amount;
+
+  n = neighbor(texel, ivec2(0, -1));
+  s = neighbor(texel, ivec2(0, 1));
+  e = neighbor(texel, ivec2(1, 0));
+  w = neighbor(texel, ivec2(-1, 0));
+
+  lowest = min(center, min(min(n, s), min(e, w)));
+  highest = max(center, max(max(n, s), max(e, w)));
+  amount = post.sharpness * max(1.0 - (highest - lowest), 0.0);
+
+  return clamp(center + amount * (4.0 * center - n - s - e - w) * 0.25, lowest, highest);
+}
+
+void main() {
+  ivec2 texel;
+  vec2 uv;
+  vec4 center;
+  float luma_nw;
+  float luma_ne;
+  float luma_sw;
+  float luma_se;
+  float luma_min;
+  float luma_max;
+  vec2 dir;
+  float dir_reduce;
+  vec3 rgb_a;
+  vec3 rgb_b;
+  float luma_b;
+
+  texel = ivec2(gl_GlobalInvocationID.xy);
+
+  if (any(greaterThanEqual(texel, imageSize(result)))) {
+    return;
+  }
+
+  uv = (vec2(texel) + 0.5) * post.inverse_size;
+  center = texelFetch(graded, texel, 0);
+
+  luma_nw = fetch(uv + vec2(-1.0, -1.0) * post.inverse_size).a;
+  luma_ne = fetch(uv + vec2(1.0, -1.0) * post.inverse_size).a;
+  luma_sw = fetch(uv + vec2(-1.0, 1.0) * post.inverse_size).a;
+  luma_se = fetch(uv + vec2(1.0, 1.0) * post.inverse_size).a;
+
+  luma_min = min(center.a, min(min(luma_nw, luma_ne), min(luma_sw, luma_se)));
+  luma_max = max(center.a, max(max(luma_nw, luma_ne), max(luma_sw, luma_se)));
+
+  if (post.fxaa == 0 || luma_max - luma_min < max(FXAA_EDGE_THRESHOLD_MIN, luma_max * FXAA_EDGE_THRESHOLD)) {
+    imageStore(result, texel, vec4(to_output(sharpen(texel, center.rgb)), 1.0));
+    return;
+  }
+
+  // Blur along the edge, which runs across the luma gradient.
+  dir = vec2(-((luma_nw + luma_ne) - (luma_sw + luma_se)), (luma_nw + luma_sw) - (luma_ne + luma_se));
+  dir_reduce = max((luma_nw + luma_ne + luma_sw + luma_se) * 0.25 * FXAA_REDUCE_MUL, FXAA_REDUCE_MIN);
+  dir /= min(abs(dir.x), abs(dir.y)) + dir_reduce;
+  dir = clamp(dir, -FXAA_SPAN_MAX, FXAA_SPAN_MAX) * post.inverse_size;
+
+  rgb_a = 0.5 * (fetch(uv + dir * (1.0 / 3.0 - 0.5)).rgb + fetch(uv + dir * (2.0 / 3.0 - 0.5)).rgb);
+  rgb_b = rgb_a * 0.5 + 0.25 * (fetch(uv - dir * 0.5).rgb + fetch(uv + dir * 0.5).rgb);
+  luma_b = dot(rgb_b, vec3(0.299, 0.587, 0.114));
+
+  // The wider blur went past the edge, so the narrow one it is.
+  if (luma_b < luma_min || luma_b > luma_max) {
+    imageStore(result, texel, vec4(to_output(rgb_a), 1.0));
+  } else {
+    imageStore(result, texel, vec4(to_output(rgb_b), 1.0));
+  }
+}
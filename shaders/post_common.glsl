@@ -0,0 +1,50 @@
+// Included by every pass of the post processing chain (see
+// post_process.h). Not a shader of its own: embed_shaders.py only
+// compiles the stages, and glslc resolves the includes.
+
+// Matches display_encoding in swap_chain.h.
+const uint DISPLAY_SDR = 0;
+const uint DISPLAY_HDR10 = 1;
+const uint DISPLAY_SCRGB = 2;
+const uint DISPLAY_SDR_LINEAR = 3;
+
+// Shared by every pass of the chain; matches post_push_constants in
+// post_process.cpp.
+layout(push_constant) uniform post_constants {
+  // 1 / the size of the image this pass writes.
+  vec2 inverse_size;
+  // The blur's direction, (1, 0) or (0, 1).
+  ivec2 direction;
+  float exposure;
+  float bloom_threshold;
+  float bloom_intensity;
+  float saturation;
+  float contrast;
+  float sharpness;
+  uint tonemap;
+  uint fxaa;
+  // Multiplies the graded color.
+  vec4 gain;
+  // What the swap chain expects, and for HDR displays, how bright white
+  // paper is in nits and how many times brighter the display's peak is.
+  uint display;
+  float paper_white;
+  float max_white;
+} post;
+
+// Both extend to values past 1 the way the curve would, for scRGB.
+vec3 encode_srgb(vec3 linear) {
+  return mix(
+    linear * 12.92,
+    1.055 * pow(linear, vec3(1.0 / 2.4)) - 0.055,
+    greaterThan(linear, vec3(0.0031308))
+  );
+}
+
+vec3 decode_srgb(vec3 encoded) {
+  return mix(
+    encoded / 12.92,
+    pow((encoded + 0.055) / 1.055, vec3(2.4)),
+    greaterThan(encoded, vec3(0.04045))
+  );
+}
@@ -0,0 +1,119 @@
+// Everything the chain does per pixel before antialiasing, in one pass
+// (see post_process.h): exposure, adding the bloom, tonemapping, color
+// grading and encoding for the display. Writes the pixel's luma into
+// alpha for the antialiasing pass.
+//
+// post_tonemap.comp and post_tonemap_hdr.comp define GRADED_FORMAT, the
+// intermediate's format, and include this. Encoded SDR fits in 8 bits;
+// PQ would band in 8 bits, and scRGB goes past 1.
+
+layout(local_size_x = 8, local_size_y = 8) in;
+
+// Matches post_tonemap_mode in post_process.h.
+const uint TONEMAP_ACES = 0;
+const uint TONEMAP_REINHARD = 1;
+
+// Luminance of linear Rec. 709.
+const vec3 LUMINANCE = vec3(0.2126, 0.7152, 0.0722);
+
+// Linear Rec. 709 to linear Rec. 2020, the primaries HDR10 is in.
+const mat3 REC709_TO_REC2020 = mat3(
+  0.6274, 0.0691, 0.0164,
+  0.3293, 0.9195, 0.0880,
+  0.0433, 0.0114, 0.8956
+);
+
+layout(set = 0, binding = 0) uniform sampler2D hdr;
+layout(set = 0, binding = 1) uniform sampler2D bloom;
+layout(set = 0, binding = 2, GRADED_FORMAT) uniform writeonly image2D graded;
+
+#include "post_common.glsl"
+
+// Krzysztof Narkowicz's fit of the ACES filmic curve.
+vec3 tonemap_aces(vec3 x) {
+  return clamp((x * (2.51 * x + 0.03)) / (x * (2.43 * x + 0.59) + 0.14), 0.0, 1.0);
+}
+
+vec3 tonemap_reinhard(vec3 x) {
+  return x / (1.0 + x);
+}
+
+// The SDR curves end at 1, which on an HDR display is only paper white.
+// This one leaves the darks and middle alone and rolls the highlights off
+// towards the display's peak, on luminance so hues don't shift.
+vec3 tonemap_hdr(vec3 x) {
+  float luminance;
+  float mapped;
+
+  luminance = dot(x, LUMINANCE);
+  mapped = luminance / (1.0 + luminance / post.max_white);
+
+  return min(x * (mapped / max(luminance, 1e-4)), vec3(post.max_white));
+}
+
+// SMPTE ST 2084, from nits to the 0 to 1 signal.
+vec3 encode_pq(vec3 nits) {
+  const float m1 = 0.1593017578125;
+  const float m2 = 78.84375;
+  const float c1 = 0.8359375;
+  const float c2 = 18.8515625;
+  const float c3 = 18.6875;
+  vec3 y;
+
+  y = pow(clamp(nits / 10000.0, 0.0, 1.0), vec3(m1));
+
+  return pow((c1 + c2 * y) / (1.0 + c3 * y), vec3(m2));
+}
+
+void main() {
+  ivec2 texel;
+  vec2 uv;
+  vec3 color;
+  float luma;
+
+  texel = ivec2(gl_GlobalInvocationID.xy);
+
+  if (any(greaterThanEqual(texel, imageSize(graded)))) {
+    return;
+  }
+
+  uv = (vec2(texel) + 0.5) * post.inverse_size;
+
+  // The bloom is half size; the sampler upsamples it.
+  color = texelFetch(hdr, texel, 0).rgb * post.exposure;
+  color += textureLod(bloom, uv, 0.0).rgb * post.bloom_intensity;
+
+  // SDR_LINEAR is graded the same, and decoded again on output.
+  if (post.display == DISPLAY_SDR || post.display == DISPLAY_SDR_LINEAR) {
+    if (post.tonemap == TONEMAP_REINHARD) {
+      color = tonemap_reinhard(color);
+    } else {
+      color = tonemap_aces(color);
+    }
+
+    // Graded in sRGB, where contrast around the middle looks even.
+    color = encode_srgb(color * post.gain.rgb);
+    luma = dot(color, vec3(0.299, 0.587, 0.114));
+    color = mix(vec3(luma), color, post.saturation);
+    color = clamp((color - 0.5) * post.contrast + 0.5, 0.0, 1.0);
+  } else {
+    // Graded linear, in units of paper white: there's no middle to an
+    // encoding with no top, so contrast pivots on middle gray instead.
+    color = tonemap_hdr(color) * post.gain.rgb;
+    color = max(mix(vec3(dot(color, LUMINANCE)), color, post.saturation), 0.0);
+    color = 0.18 * pow(color / 0.18, vec3(post.contrast));
+
+    if (post.display == DISPLAY_HDR10) {
+      color = encode_pq(REC709_TO_REC2020 * color * post.paper_white);
+    } else {
+      // scRGB is linear, but antialiasing and sharpening want even
+      // steps, so it's sRGB encoded until post_antialias_scrgb.comp
+      // undoes it.
+      color = encode_srgb(color);
+    }
+  }
+
+  luma = dot(color, vec3(0.299, 0.587, 0.114));
+
+  imageStore(graded, texel, vec4(color, luma));
+}
@@ -0,0 +1,23 @@
+#version 450
+
+layout(set = 0, binding = 1) uniform sampler2DArray atlas;
+
+layout(location = 0) in vec3 frag_uv;
+layout(location = 1) in vec4 frag_color;
+layout(location = 2) flat in uint frag_sdf;
+
+layout(location = 0) out vec4 out_color;
+
+void main() {
+  vec4 texel = texture(atlas, frag_uv);
+
+  // A distance field is inside above 0.5. The edge is blended over about
+  // a pixel whatever the scale, by how fast the distance changes on
+  // screen.
+  if (frag_sdf != 0u) {
+    float width = max(fwidth(texel.a) * 0.7, 1e-4);
+    texel = vec4(1.0, 1.0, 1.0, smoothstep(0.5 - width, 0.5 + width, texel.a));
+  }
+
+  out_color = texel * frag_color;
+}
@@ -0,0 +1,50 @@
+#version 450
+
+// Draws the sprites of a sprite batch (see sprite_batch.h). There is no
+// vertex input: each sprite is six vertices, two triangles, and the
+// vertex index says which sprite and which corner.
+
+struct sprite_instance {
+  // x, y, width and height in pixels, y down.
+  vec4 rect;
+  // u0, v0 and u1, v1, each packed as two 16 bit UNORMs.
+  uvec2 uv;
+  // RGBA, 8 bits a channel.
+  uint color;
+  // The atlas layer, with the top bit set for distance fields.
+  uint page;
+};
+
+layout(std430, set = 0, binding = 0) readonly buffer sprite_buffer {
+  sprite_instance sprites[];
+};
+
+layout(push_constant) uniform sprite_view {
+  // 2 / the target's size.
+  vec2 scale;
+} view;
+
+layout(location = 0) out vec3 frag_uv;
+layout(location = 1) out vec4 frag_color;
+layout(location = 2) flat out uint frag_sdf;
+
+const vec2 corners[6] = vec2[](
+  vec2(0.0, 0.0),
+  vec2(1.0, 0.0),
+  vec2(0.0, 1.0),
+  vec2(0.0, 1.0),
+  vec2(1.0, 0.0),
+  vec2(1.0, 1.0)
+);
+
+void main() {
+  sprite_instance s = sprites[gl_VertexIndex / 6];
+  vec2 corner = corners[gl_VertexIndex % 6];
+  vec2 uv0 = unpackUnorm2x16(s.uv.x);
+  vec2 uv1 = unpackUnorm2x16(s.uv.y);
+
+  gl_Position = vec4((s.rect.xy + corner * s.rect.zw) * view.scale - 1.0, 0.0, 1.0);
+  frag_uv = vec3(mix(uv0, uv1, corner), float(s.page & 0xffffu));
+  frag_color = unpackUnorm4x8(s.color);
+  frag_sdf = s.page >> 31;
+}
@@ -0,0 +1,23 @@
+#version 450
+
+// Positions and colors are baked into the shader for now, so drawing the
+// triangle needs no vertex buffer.
+
+layout(location = 0) out vec3 frag_color;
+
+vec2 positions[3] = vec2[](
+  vec2(0.0, -0.5),
+  vec2(0.5, 0.5),
+  vec2(-0.5, 0.5)
+);
+
+vec3 colors[3] = vec3[](
+  vec3(1.0, 0.0, 0.0),
+  vec3(0.0, 1.0, 0.0),
+  vec3(0.0, 0.0, 1.0)
+);
+
+void main() {
+  gl_Position = vec4(positions[gl_VertexIndex], 0.0, 1.0);
+  frag_color = colors[gl_VertexIndex];
+}
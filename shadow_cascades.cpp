@@ -0,0 +1,602 @@
+#include "shadow_cascades.h"
+
+#include <stdexcept>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+using namespace std;
+
+static float dot3(const float* a, const float* b) {
+  return a[0] * b[0] + a[1] * b[1] + a[2] * b[2];
+}
+
+static void cross3(const float* a, const float* b, float* result) {
+  result[0] = a[1] * b[2] - a[2] * b[1];
+  result[1] = a[2] * b[0] - a[0] * b[2];
+  result[2] = a[0] * b[1] - a[1] * b[0];
+}
+
+static void normalize3(float* v) {
+  float length;
+
+  length = sqrtf(dot3(v, v));
+
+  v[0] /= length;
+  v[1] /= length;
+  v[2] /= length;
+}
+
+//
+// RESOURCES
+//
+
+static VkImage create_depth_image(shadow_cascades* shadows, VkImageUsageFlags usage) {
+  VkImageCreateInfo image_info{};
+  VkImage image;
+
+  image_info.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+  image_info.imageType = VK_IMAGE_TYPE_2D;
+  image_info.format = SHADOW_DEPTH_FORMAT;
+  image_info.extent = { shadows->map_size, shadows->map_size, 1 };
+  image_info.mipLevels = 1;
+  image_info.arrayLayers = shadows->num_cascades;
+  image_info.samples = VK_SAMPLE_COUNT_1_BIT;
+  image_info.tiling = VK_IMAGE_TILING_OPTIMAL;
+  image_info.usage = VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT | usage;
+  image_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+  image_info.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+
+  if (vkCreateImage(shadows->device, &image_info, NULL, &image) != VK_SUCCESS) {
+    throw runtime_error("failed to create shadow map!");
+  }
+
+  return image;
+}
+
+static VkImageView create_depth_view(
+  shadow_cascades* shadows,
+  VkImage image,
+  VkImageViewType type,
+  uint32_t first_layer,
+  uint32_t num_layers
+) {
+  VkImageViewCreateInfo view_info{};
+  VkImageView view;
+
+  view_info.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+  view_info.image = image;
+  view_info.viewType = type;
+  view_info.format = SHADOW_DEPTH_FORMAT;
+  view_info.subresourceRange.aspectMask = VK_IMAGE_ASPECT_DEPTH_BIT;
+  view_info.subresourceRange.levelCount = 1;
+  view_info.subresourceRange.baseArrayLayer = first_layer;
+  view_info.subresourceRange.layerCount = num_layers;
+
+  if (vkCreateImageView(shadows->device, &view_info, NULL, &view) != VK_SUCCESS) {
+    throw runtime_error("failed to create shadow map view!");
+  }
+
+  return view;
+}
+
+static void create_images(shadow_cascades* shadows) {
+  VkSamplerCreateInfo sampler_info{};
+  VkImage image;
+
+  image = create_depth_image(shadows, VK_IMAGE_USAGE_TRANSFER_SRC_BIT);
+  shadows->static_depth = allocate_image(
+    shadows->allocator,
+    image,
+    VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+    MEMORY_RENDER_TARGETS
+  );
+
+  image = create_depth_image(shadows, VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT);
+  shadows->shadow_depth = allocate_image(
+    shadows->allocator,
+    image,
+    VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+    MEMORY_RENDER_TARGETS
+  );
+
+  shadows->shadow_array_view = create_depth_view(
+    shadows,
+    shadows->shadow_depth->image,
+    VK_IMAGE_VIEW_TYPE_2D_ARRAY,
+    0,
+    shadows->num_cascades
+  );
+
+  // Compares in the sampler, so a linear filter gives 2x2 PCF for free.
+  // Past the edge of a cascade there's nothing to shadow.
+  sampler_info.sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO;
+  sampler_info.magFilter = VK_FILTER_LINEAR;
+  sampler_info.minFilter = VK_FILTER_LINEAR;
+  sampler_info.mipmapMode = VK_SAMPLER_MIPMAP_MODE_NEAREST;
+  sampler_info.addressModeU = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_BORDER;
+  sampler_info.addressModeV = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_BORDER;
+  sampler_info.addressModeW = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_BORDER;
+  sampler_info.borderColor = VK_BORDER_COLOR_FLOAT_OPAQUE_WHITE;
+  sampler_info.compareEnable = VK_TRUE;
+  sampler_info.compareOp = VK_COMPARE_OP_LESS_OR_EQUAL;
+
+  if (vkCreateSampler(shadows->device, &sampler_info, NULL, &(shadows->sampler)) != VK_SUCCESS) {
+    throw runtime_error("failed to create shadow sampler!");
+  }
+}
+
+// The two passes differ only in what they start from and hand on to.
+static VkRenderPass create_pass(
+  shadow_cascades* shadows,
+  VkAttachmentLoadOp load_op,
+  VkImageLayout initial_layout,
+  VkImageLayout final_layout,
+  const VkSubpassDependency* dependencies
+) {
+  VkAttachmentDescription attachment{};
+  VkAttachmentReference depth_ref{};
+  VkSubpassDescription subpass{};
+  VkRenderPassCreateInfo render_pass_info{};
+  VkRenderPass render_pass;
+
+  attachment.format = SHADOW_DEPTH_FORMAT;
+  attachment.samples = VK_SAMPLE_COUNT_1_BIT;
+  attachment.loadOp = load_op;
+  attachment.storeOp = VK_ATTACHMENT_STORE_OP_STORE;
+  attachment.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+  attachment.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+  attachment.initialLayout = initial_layout;
+  attachment.finalLayout = final_layout;
+
+  depth_ref.attachment = 0;
+  depth_ref.layout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+
+  subpass.pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS;
+  subpass.pDepthStencilAttachment = &depth_ref;
+
+  render_pass_info.sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO;
+  render_pass_info.attachmentCount = 1;
+  render_pass_info.pAttachments = &attachment;
+  render_pass_info.subpassCount = 1;
+  render_pass_info.pSubpasses = &subpass;
+  render_pass_info.dependencyCount = 2;
+  render_pass_info.pDependencies = dependencies;
+
+  if (vkCreateRenderPass(shadows->device, &render_pass_info, NULL, &render_pass) != VK_SUCCESS) {
+    throw runtime_error("failed to create shadow render pass!");
+  }
+
+  return render_pass;
+}
+
+static void create_passes(shadow_cascades* shadows) {
+  VkSubpassDependency dependencies[2]{};
+  const VkPipelineStageFlags depth_stages =
+    VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT;
+
+  // The static depth: the last copy out of it has to be done before we
+  // clear it, and the drawing before the next copy.
+  dependencies[0].srcSubpass = VK_SUBPASS_EXTERNAL;
+  dependencies[0].dstSubpass = 0;
+  dependencies[0].srcStageMask = VK_PIPELINE_STAGE_TRANSFER_BIT;
+  dependencies[0].dstStageMask = depth_stages;
+  dependencies[0].srcAccessMask = 0;
+  dependencies[0].dstAccessMask = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+
+  dependencies[1].srcSubpass = 0;
+  dependencies[1].dstSubpass = VK_SUBPASS_EXTERNAL;
+  dependencies[1].srcStageMask = VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT;
+  dependencies[1].dstStageMask = VK_PIPELINE_STAGE_TRANSFER_BIT;
+  dependencies[1].srcAccessMask = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+  dependencies[1].dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+
+  shadows->static_pass = create_pass(
+    shadows,
+    VK_ATTACHMENT_LOAD_OP_CLEAR,
+    VK_IMAGE_LAYOUT_UNDEFINED,
+    VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+    dependencies
+  );
+
+  // The shadow depth: drawn over the copy, then sampled.
+  dependencies[0].srcStageMask = VK_PIPELINE_STAGE_TRANSFER_BIT;
+  dependencies[0].dstStageMask = depth_stages;
+  dependencies[0].srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+  dependencies[0].dstAccessMask =
+    VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+
+  dependencies[1].srcStageMask = VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT;
+  dependencies[1].dstStageMask = VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT;
+  dependencies[1].srcAccessMask = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+  dependencies[1].dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+
+  shadows->dynamic_pass = create_pass(
+    shadows,
+    VK_ATTACHMENT_LOAD_OP_LOAD,
+    VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+    VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+    dependencies
+  );
+}
+
+static VkFramebuffer create_framebuffer(
+  shadow_cascades* shadows,
+  VkRenderPass render_pass,
+  VkImageView view
+) {
+  VkFramebufferCreateInfo framebuffer_info{};
+  VkFramebuffer framebuffer;
+
+  framebuffer_info.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
+  framebuffer_info.renderPass = render_pass;
+  framebuffer_info.attachmentCount = 1;
+  framebuffer_info.pAttachments = &view;
+  framebuffer_info.width = shadows->map_size;
+  framebuffer_info.height = shadows->map_size;
+  framebuffer_info.layers = 1;
+
+  if (vkCreateFramebuffer(shadows->device, &framebuffer_info, NULL, &framebuffer) != VK_SUCCESS) {
+    throw runtime_error("failed to create shadow framebuffer!");
+  }
+
+  return framebuffer;
+}
+
+void create_shadow_cascades(
+  VkDevice device,
+  memory_allocator* allocator,
+  uint32_t map_size,
+  uint32_t num_cascades,
+  float caster_distance,
+  shadow_cascades* shadows
+) {
+  shadow_cascade* cascade;
+
+  if (num_cascades == 0 || num_cascades > MAX_SHADOW_CASCADES) {
+    throw runtime_error("shadow cascade count out of range!");
+  }
+
+  if (map_size <= 2 * SHADOW_SNAP_TEXELS) {
+    throw runtime_error("shadow map too small for its snapping!");
+  }
+
+  shadows->device = device;
+  shadows->allocator = allocator;
+  shadows->map_size = map_size;
+  shadows->num_cascades = num_cascades;
+  shadows->caster_distance = caster_distance;
+  shadows->num_static_draws = 0;
+  shadows->num_dynamic_draws = 0;
+
+  create_images(shadows);
+  create_passes(shadows);
+
+  for (uint32_t i = 0; i < num_cascades; i++) {
+    cascade = &(shadows->cascades[i]);
+    *cascade = {};
+
+    cascade->static_view = create_depth_view(
+      shadows,
+      shadows->static_depth->image,
+      VK_IMAGE_VIEW_TYPE_2D,
+      i,
+      1
+    );
+    cascade->shadow_view = create_depth_view(
+      shadows,
+      shadows->shadow_depth->image,
+      VK_IMAGE_VIEW_TYPE_2D,
+      i,
+      1
+    );
+    cascade->static_framebuffer = create_framebuffer(shadows, shadows->static_pass, cascade->static_view);
+    cascade->dynamic_framebuffer = create_framebuffer(shadows, shadows->dynamic_pass, cascade->shadow_view);
+  }
+}
+
+void destroy_shadow_cascades(shadow_cascades* shadows) {
+  shadow_cascade* cascade;
+
+  for (uint32_t i = 0; i < shadows->num_cascades; i++) {
+    cascade = &(shadows->cascades[i]);
+
+    vkDestroyFramebuffer(shadows->device, cascade->static_framebuffer, NULL);
+    vkDestroyFramebuffer(shadows->device, cascade->dynamic_framebuffer, NULL);
+    vkDestroyImageView(shadows->device, cascade->static_view, NULL);
+    vkDestroyImageView(shadows->device, cascade->shadow_view, NULL);
+  }
+
+  vkDestroyRenderPass(shadows->device, shadows->static_pass, NULL);
+  vkDestroyRenderPass(shadows->device, shadows->dynamic_pass, NULL);
+  vkDestroySampler(shadows->device, shadows->sampler, NULL);
+  vkDestroyImageView(shadows->device, shadows->shadow_array_view, NULL);
+
+  vkDestroyImage(shadows->device, shadows->static_depth->image, NULL);
+  free_allocation(shadows->allocator, shadows->static_depth);
+  vkDestroyImage(shadows->device, shadows->shadow_depth->image, NULL);
+  free_allocation(shadows->allocator, shadows->shadow_depth);
+}
+
+//
+// FITTING
+//
+
+// Where the slice of the view from near to far ends, blending even and
+// logarithmic splits.
+static float split_distance(float near_plane, float far_plane, uint32_t i, uint32_t n) {
+  float fraction;
+  float even;
+  float logarithmic;
+
+  fraction = (float)i / n;
+  even = near_plane + (far_plane - near_plane) * fraction;
+  logarithmic = near_plane * powf(far_plane / near_plane, fraction);
+
+  return SHADOW_SPLIT_LAMBDA * logarithmic + (1.0f - SHADOW_SPLIT_LAMBDA) * even;
+}
+
+// Fits the smallest sphere around the slice of the view between near and
+// far, with its center at *center along the view direction. It only
+// depends on the distances and the field of view, so it stays the same
+// size as the camera turns. diagonal is the half diagonal of the slice at
+// a distance of 1.
+static float slice_sphere(float near_plane, float far_plane, float diagonal, float* center) {
+  float k2;
+
+  k2 = diagonal * diagonal;
+
+  // Equally far from a near corner and a far corner, unless that's past
+  // the far plane, in which case the far corners are the furthest.
+  *center = 0.5f * (far_plane + near_plane) * (1.0f + k2);
+  *center = min(*center, far_plane);
+
+  return sqrtf((far_plane - *center) * (far_plane - *center) + far_plane * far_plane * k2);
+}
+
+void update_shadow_cascades(
+  shadow_cascades* shadows,
+  const shadow_camera& camera,
+  const float light_dir[3],
+  uint64_t static_generation
+) {
+  float forward[3];
+  float axes[3][3];
+  float reference[3];
+  float diagonal;
+  float tan_y;
+  float near_split;
+  float distance;
+  float center[3];
+  float origin[3];
+  float step;
+  float near_z;
+  float depth;
+  float* m;
+  shadow_cascade* cascade;
+
+  forward[0] = camera.forward[0];
+  forward[1] = camera.forward[1];
+  forward[2] = camera.forward[2];
+  normalize3(forward);
+
+  // The light's axes: x and y across the shadow map, z along the light.
+  // Without a translation, a snap in light space is a snap of the map.
+  axes[2][0] = light_dir[0];
+  axes[2][1] = light_dir[1];
+  axes[2][2] = light_dir[2];
+
+  reference[0] = 0.0f;
+  reference[1] = 1.0f;
+  reference[2] = 0.0f;
+
+  if (fabsf(light_dir[1]) > 0.99f) {
+    reference[0] = 1.0f;
+    reference[1] = 0.0f;
+  }
+
+  cross3(reference, axes[2], axes[0]);
+  normalize3(axes[0]);
+  cross3(axes[2], axes[0], axes[1]);
+
+  tan_y = tanf(camera.fov_y * 0.5f);
+  diagonal = tan_y * sqrtf(1.0f + camera.aspect * camera.aspect);
+  near_split = camera.near_plane;
+
+  for (uint32_t i = 0; i < shadows->num_cascades; i++) {
+    cascade = &(shadows->cascades[i]);
+
+    cascade->split = split_distance(camera.near_plane, camera.far_plane, i + 1, shadows->num_cascades);
+    cascade->radius = slice_sphere(near_split, cascade->split, diagonal, &distance);
+    near_split = cascade->split;
+
+    // Big enough for the sphere wherever in a grid step its center is:
+    // extent = radius + SHADOW_SNAP_TEXELS texels.
+    cascade->extent = cascade->radius / (1.0f - 2.0f * SHADOW_SNAP_TEXELS / shadows->map_size);
+    cascade->texel_size = 2.0f * cascade->extent / shadows->map_size;
+    step = SHADOW_SNAP_TEXELS * cascade->texel_size;
+
+    for (uint32_t j = 0; j < 3; j++) {
+      center[j] = camera.position[j] + forward[j] * distance;
+    }
+
+    for (uint32_t j = 0; j < 3; j++) {
+      origin[j] = roundf(dot3(center, axes[j]) / step) * step;
+    }
+
+    near_z = origin[2] - cascade->extent - shadows->caster_distance;
+    depth = origin[2] + cascade->extent - near_z;
+
+    // An orthographic projection of the box around the snapped center,
+    // straight from world space.
+    m = cascade->view_proj;
+    memset(m, 0, sizeof(cascade->view_proj));
+
+    for (uint32_t j = 0; j < 3; j++) {
+      m[j * 4 + 0] = axes[0][j] / cascade->extent;
+      m[j * 4 + 1] = axes[1][j] / cascade->extent;
+      m[j * 4 + 2] = axes[2][j] / depth;
+    }
+
+    m[12] = -origin[0] / cascade->extent;
+    m[13] = -origin[1] / cascade->extent;
+    m[14] = -near_z / depth;
+    m[15] = 1.0f;
+
+    cascade->static_stale =
+      !cascade->static_valid ||
+      cascade->static_generation != static_generation ||
+      memcmp(cascade->static_view_proj, m, sizeof(cascade->view_proj)) != 0;
+
+    // Valid again once render_shadow_cascades has drawn them.
+    if (cascade->static_stale) {
+      memcpy(cascade->static_view_proj, m, sizeof(cascade->view_proj));
+      cascade->static_generation = static_generation;
+      cascade->static_valid = false;
+    }
+  }
+}
+
+//
+// RENDERING
+//
+
+static void draw_cascade(
+  shadow_cascades* shadows,
+  VkCommandBuffer cmd,
+  uint32_t i,
+  bool static_casters,
+  draw_shadow_casters_callback draw_casters,
+  void* user_data
+) {
+  VkRenderPassBeginInfo begin_info{};
+  VkClearValue clear{};
+  VkViewport viewport{};
+  VkRect2D scissor{};
+  shadow_cascade* cascade;
+
+  cascade = &(shadows->cascades[i]);
+
+  clear.depthStencil.depth = 1.0f;
+
+  begin_info.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
+  begin_info.renderPass = static_casters ? shadows->static_pass : shadows->dynamic_pass;
+  begin_info.framebuffer = static_casters ? cascade->static_framebuffer : cascade->dynamic_framebuffer;
+  begin_info.renderArea.extent = { shadows->map_size, shadows->map_size };
+  begin_info.clearValueCount = static_casters ? 1 : 0;
+  begin_info.pClearValues = static_casters ? &clear : NULL;
+
+  vkCmdBeginRenderPass(cmd, &begin_info, VK_SUBPASS_CONTENTS_INLINE);
+
+  viewport.width = (float)shadows->map_size;
+  viewport.height = (float)shadows->map_size;
+  viewport.maxDepth = 1.0f;
+  scissor.extent = { shadows->map_size, shadows->map_size };
+
+  vkCmdSetViewport(cmd, 0, 1, &viewport);
+  vkCmdSetScissor(cmd, 0, 1, &scissor);
+
+  draw_casters(cmd, i, cascade->view_proj, static_casters, user_data);
+
+  vkCmdEndRenderPass(cmd);
+}
+
+void render_shadow_cascades(
+  shadow_cascades* shadows,
+  VkCommandBuffer cmd,
+  draw_shadow_casters_callback draw_casters,
+  void* user_data
+) {
+  VkImageMemoryBarrier barrier{};
+  VkImageCopy regions[MAX_SHADOW_CASCADES]{};
+  shadow_cascade* cascade;
+
+  for (uint32_t i = 0; i < shadows->num_cascades; i++) {
+    cascade = &(shadows->cascades[i]);
+
+    if (cascade->static_stale) {
+      draw_cascade(shadows, cmd, i, true, draw_casters, user_data);
+      cascade->static_valid = true;
+      cascade->static_stale = false;
+      shadows->num_static_draws++;
+    }
+  }
+
+  // Every cascade's shadow map is about to be overwritten, so what was in
+  // it can go; only last frame's sampling has to be done.
+  barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+  barrier.srcAccessMask = 0;
+  barrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+  barrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+  barrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+  barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+  barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+  barrier.image = shadows->shadow_depth->image;
+  barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_DEPTH_BIT;
+  barrier.subresourceRange.levelCount = 1;
+  barrier.subresourceRange.layerCount = shadows->num_cascades;
+
+  vkCmdPipelineBarrier(
+    cmd,
+    VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT,
+    VK_PIPELINE_STAGE_TRANSFER_BIT,
+    0,
+    0,
+    NULL,
+    0,
+    NULL,
+    1,
+    &barrier
+  );
+
+  // One copy for every cascade; the layers line up.
+  for (uint32_t i = 0; i < shadows->num_cascades; i++) {
+    regions[i].srcSubresource.aspectMask = VK_IMAGE_ASPECT_DEPTH_BIT;
+    regions[i].srcSubresource.baseArrayLayer = i;
+    regions[i].srcSubresource.layerCount = 1;
+    regions[i].dstSubresource = regions[i].srcSubresource;
+    regions[i].extent = { shadows->map_size, shadows->map_size, 1 };
+  }
+
+  vkCmdCopyImage(
+    cmd,
+    shadows->static_depth->image,
+    VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+    shadows->shadow_depth->image,
+    VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+    shadows->num_cascades,
+    regions
+  );
+
+  for (uint32_t i = 0; i < shadows->num_cascades; i++) {
+    draw_cascade(shadows, cmd, i, false, draw_casters, user_data);
+    shadows->num_dynamic_draws++;
+  }
+}
+
+void get_shadow_uniforms(const shadow_cascades* shadows, shadow_uniforms* uniforms) {
+  *uniforms = {};
+
+  for (uint32_t i = 0; i < shadows->num_cascades; i++) {
+    memcpy(uniforms->view_proj[i], shadows->cascades[i].view_proj, sizeof(uniforms->view_proj[i]));
+    uniforms->splits[i] = shadows->cascades[i].split;
+    uniforms->texel_sizes[i] = shadows->cascades[i].texel_size;
+  }
+
+  uniforms->num_cascades = shadows->num_cascades;
+}
+
+void invalidate_shadow_cascades(shadow_cascades* shadows) {
+  for (uint32_t i = 0; i < shadows->num_cascades; i++) {
+    shadows->cascades[i].static_valid = false;
+    shadows->cascades[i].static_stale = true;
+  }
+}
+
+void publish_shadow_stats(shadow_cascades* shadows, gpu_profiler* profiler) {
+  set_profiler_counter(profiler, "shadow_static_cascades_drawn", shadows->num_static_draws);
+  set_profiler_counter(profiler, "shadow_dynamic_cascades_drawn", shadows->num_dynamic_draws);
+
+  shadows->num_static_draws = 0;
+  shadows->num_dynamic_draws = 0;
+}
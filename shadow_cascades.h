@@ -0,0 +1,200 @@
+#ifndef SHADOW_CASCADES_H
+#define SHADOW_CASCADES_H
+
+#define GLFW_INCLUDE_VULKAN
+
+#include <GLFW/glfw3.h>
+#include <cstdint>
+#include <vector>
+
+#include "memory_allocator.h"
+#include "gpu_profiler.h"
+
+//
+// A directional light's shadows cover everything from the camera's feet
+// to the horizon. One shadow map over all of that is blurry up close, so
+// the view is cut into slices by distance (cascades), each with its own
+// shadow map: the near slice is small and sharp, the far ones big and
+// coarse.
+//
+// Drawing every caster into every cascade every frame is a lot of
+// geometry, and most of it (terrain, buildings) never moves. So each
+// cascade keeps the static casters' depth in a layer of its own, and only
+// draws them again when something they depend on changes: the light's
+// direction, the static geometry (a generation counter its owner bumps,
+// as with static_commands.h), or where the cascade is. Every frame, the
+// static depth is copied into the shadow map the lights sample, and only
+// the dynamic casters are drawn on top of it. A copy of a depth layer is
+// far cheaper than the geometry it holds.
+//
+// For the cached depth to stay usable, a cascade must not move with every
+// step of the camera. Each cascade is fit to a bounding sphere of its
+// slice of the view, which is the same size however the camera turns, so
+// its texels stay the same size and shadow edges don't shimmer. The
+// sphere's center is then snapped to a grid of SHADOW_SNAP_TEXELS texels
+// in light space, and the cascade made that much bigger than the sphere
+// so the slice always fits. The cascade only moves (and its static
+// casters are only drawn again) when the camera crosses a grid line: for
+// the far cascades, rarely.
+//
+// Matrices are column major, and map to Vulkan clip space, depth 0 to 1
+// from the light outwards; shadows sample with a LESS_OR_EQUAL compare.
+// The pipeline state has no depth bias, so receivers should offset their
+// position along the normal by a texel or so (see
+// shadow_uniforms::texel_sizes) before looking up the shadow map.
+//
+
+const uint32_t MAX_SHADOW_CASCADES = 4;
+const VkFormat SHADOW_DEPTH_FORMAT = VK_FORMAT_D32_SFLOAT;
+// The cascades move in steps of this many texels.
+const uint32_t SHADOW_SNAP_TEXELS = 64;
+// Blends logarithmic splits (1) with even ones (0). Logarithmic gives the
+// most even texels per pixel, but near cascades too small to be useful.
+const float SHADOW_SPLIT_LAMBDA = 0.75f;
+
+// Where the camera is and what it sees. The cascades don't depend on
+// which way is up, and forward needn't be normalized.
+struct shadow_camera {
+  float position[3];
+  float forward[3];
+  // Vertical, in radians.
+  float fov_y;
+  float aspect;
+  float near_plane;
+  // Where the shadows end, which can be well short of the camera's far
+  // plane.
+  float far_plane;
+};
+
+struct shadow_cascade {
+  // The far end of the cascade's slice, as a distance along the view
+  // direction.
+  float split;
+  float radius;
+  // Half the width of the cascade, in world units, and of a texel.
+  float extent;
+  float texel_size;
+
+  // World to clip space, for drawing the casters and for looking up the
+  // shadow map.
+  float view_proj[16];
+
+  // What the static depth is drawn with. It's good for as long as the
+  // matrix (which only changes with the light, or when the snapped center
+  // moves) and the static generation stay the same.
+  float static_view_proj[16];
+  uint64_t static_generation;
+  // False until the static casters have been drawn with those.
+  bool static_valid;
+  // Set by update_shadow_cascades when the static casters have to be
+  // drawn again.
+  bool static_stale;
+
+  VkImageView static_view;
+  VkImageView shadow_view;
+  VkFramebuffer static_framebuffer;
+  VkFramebuffer dynamic_framebuffer;
+};
+
+// What shaders that receive shadows need, laid out for std140, where
+// splits and texel_sizes are each a vec4.
+struct shadow_uniforms {
+  float view_proj[MAX_SHADOW_CASCADES][16];
+  // The far end of each cascade, to pick one by view distance.
+  float splits[MAX_SHADOW_CASCADES];
+  float texel_sizes[MAX_SHADOW_CASCADES];
+  uint32_t num_cascades;
+  uint32_t padding[3];
+};
+
+// Draws the static or dynamic shadow casters for a cascade, with a
+// pipeline made for the cascades' render pass. The render pass is begun
+// and the viewport and scissor set. view_proj is the cascade's matrix;
+// casters entirely outside of it can be culled.
+typedef void (*draw_shadow_casters_callback)(
+  VkCommandBuffer cmd,
+  uint32_t cascade,
+  const float* view_proj,
+  bool static_casters,
+  void* user_data
+);
+
+struct shadow_cascades {
+  VkDevice device;
+  memory_allocator* allocator;
+  uint32_t map_size;
+  uint32_t num_cascades;
+  // How far behind a cascade, towards the light, casters can be and still
+  // shadow it.
+  float caster_distance;
+
+  // One layer per cascade of each. The static depth only ever leaves the
+  // render pass for copies, so it stays in TRANSFER_SRC_OPTIMAL. The
+  // shadow depth is left in SHADER_READ_ONLY_OPTIMAL.
+  gpu_allocation* static_depth;
+  gpu_allocation* shadow_depth;
+  // Every cascade of the shadow depth, for sampling, and a sampler that
+  // compares.
+  VkImageView shadow_array_view;
+  VkSampler sampler;
+
+  // static_pass clears, dynamic_pass loads what the copy left. They're
+  // compatible, so pipelines made for either work in both.
+  VkRenderPass static_pass;
+  VkRenderPass dynamic_pass;
+
+  shadow_cascade cascades[MAX_SHADOW_CASCADES];
+
+  // Reset by whoever reads them.
+  uint32_t num_static_draws;
+  uint32_t num_dynamic_draws;
+};
+
+//
+// SHADOW CASCADE ROUTINES
+//
+
+// map_size is the width and height of each cascade's shadow map.
+void create_shadow_cascades(
+  VkDevice device,
+  memory_allocator* allocator,
+  uint32_t map_size,
+  uint32_t num_cascades,
+  float caster_distance,
+  shadow_cascades* shadows
+);
+// Nothing the cascades recorded may still be in flight.
+void destroy_shadow_cascades(shadow_cascades* shadows);
+
+// Fits the cascades to the camera, for a light shining along light_dir
+// (towards the scene, normalized). static_generation is bumped by the
+// static casters' owner whenever one of them moves, appears or goes.
+void update_shadow_cascades(
+  shadow_cascades* shadows,
+  const shadow_camera& camera,
+  const float light_dir[3],
+  uint64_t static_generation
+);
+
+// Draws the static casters of the cascades that need them, then the
+// dynamic casters of every cascade over a copy of the static depth. Must
+// be outside of a render pass. Afterwards the shadow maps are ready to be
+// sampled in fragment shaders.
+void render_shadow_cascades(
+  shadow_cascades* shadows,
+  VkCommandBuffer cmd,
+  draw_shadow_casters_callback draw_casters,
+  void* user_data
+);
+
+void get_shadow_uniforms(const shadow_cascades* shadows, shadow_uniforms* uniforms);
+
+// Makes every cascade draw its static casters again on the next render,
+// for when the caller knows better than the generation.
+void invalidate_shadow_cascades(shadow_cascades* shadows);
+
+// Sets profiler counters with the cascades whose static and dynamic
+// casters were drawn since the last call, and resets them.
+void publish_shadow_stats(shadow_cascades* shadows, gpu_profiler* profiler);
+
+#endif
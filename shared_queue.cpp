@@ -0,0 +1,356 @@
+#include "shared_queue.h"
+
+#include <stdexcept>
+#include <thread>
+#include <algorithm>
+
+using namespace std;
+
+void create_shared_queue(
+  VkDevice device,
+  VkQueue queue,
+  bool synchronization2,
+  shared_queue* shared
+) {
+  shared->queue = queue;
+  shared->synchronization2 = synchronization2;
+  shared->queue_submit2 = NULL;
+  shared->num_submissions = 0;
+  shared->num_submit_calls = 0;
+  shared->peers = NULL;
+  shared->num_peers = 0;
+
+  if (synchronization2) {
+    shared->queue_submit2 = (PFN_vkQueueSubmit2KHR)vkGetDeviceProcAddr(device, "vkQueueSubmit2KHR");
+
+    if (shared->queue_submit2 == NULL) {
+      throw runtime_error("failed to load vkQueueSubmit2KHR!");
+    }
+  }
+
+  create_mpsc_queue(SHARED_QUEUE_CAPACITY, &(shared->pending));
+  shared->batch.reserve(SHARED_QUEUE_CAPACITY);
+}
+
+void link_shared_queues(shared_queue* queues, uint32_t num_queues) {
+  for (uint32_t i = 0; i < num_queues; i++) {
+    queues[i].peers = queues;
+    queues[i].num_peers = num_queues;
+  }
+}
+
+// Flushes the other queues with unflushed signals of any of the
+// semaphores. None of their locks may be held.
+static void flush_signalling_peers(
+  shared_queue* shared,
+  const VkSemaphore* semaphores,
+  uint32_t num_semaphores
+) {
+  shared_queue* peer;
+  bool signals;
+
+  for (uint32_t i = 0; i < shared->num_peers; i++) {
+    peer = &(shared->peers[i]);
+
+    if (peer == shared) {
+      continue;
+    }
+
+    {
+      lock_guard<mutex> lock(peer->signal_mutex);
+
+      signals = false;
+      for (uint32_t j = 0; j < num_semaphores && !signals; j++) {
+        signals = find(
+          peer->pending_signals.begin(),
+          peer->pending_signals.end(),
+          semaphores[j]
+        ) != peer->pending_signals.end();
+      }
+    }
+
+    if (signals) {
+      flush_queue(peer);
+    }
+  }
+}
+
+// Moves what's waiting into batch. The mutex must be held.
+static void drain_pending(shared_queue* shared) {
+  queue_submission submission;
+
+  shared->batch.clear();
+
+  // Everything submitted before the flush started is at most a queue's
+  // worth, so stopping there still gets the caller's own submissions out
+  // without chasing threads that keep submitting.
+  while (shared->batch.size() < SHARED_QUEUE_CAPACITY) {
+    if (mpsc_pop(&(shared->pending), &submission)) {
+      shared->batch.push_back(submission);
+    } else if (mpsc_empty(&(shared->pending))) {
+      break;
+    } else {
+      // Another thread claimed the next cell but hasn't filled it in.
+      this_thread::yield();
+    }
+  }
+}
+
+// Submits batch[first, last) in one call. The mutex must be held.
+static void submit_range(shared_queue* shared, size_t first, size_t last, VkFence fence) {
+  VkResult result;
+
+  if (shared->synchronization2) {
+    result = shared->queue_submit2(
+      shared->queue,
+      (uint32_t)(last - first),
+      shared->submit_infos.data() + first,
+      fence
+    );
+  } else {
+    result = vkQueueSubmit(
+      shared->queue,
+      (uint32_t)(last - first),
+      shared->legacy_submit_infos.data() + first,
+      fence
+    );
+  }
+
+  if (result != VK_SUCCESS) {
+    throw runtime_error("failed to submit to queue!");
+  }
+
+  lock_guard<mutex> lock(shared->stats_mutex);
+  shared->num_submit_calls++;
+}
+
+// Fills in the sync2 submit infos for batch.
+static void build_submit_infos(shared_queue* shared) {
+  size_t num_command_buffers;
+  size_t num_semaphores;
+  size_t command_buffer;
+  size_t semaphore;
+  VkSubmitInfo2* info;
+
+  num_command_buffers = 0;
+  num_semaphores = 0;
+
+  for (const queue_submission& submission : shared->batch) {
+    num_command_buffers += submission.num_command_buffers;
+    num_semaphores += submission.num_wait_semaphores + submission.num_signal_semaphores;
+  }
+
+  // Sized up front, so the pointers into them stay put.
+  shared->submit_infos.resize(shared->batch.size());
+  shared->command_buffer_infos.resize(num_command_buffers);
+  shared->semaphore_infos.resize(num_semaphores);
+
+  command_buffer = 0;
+  semaphore = 0;
+
+  for (size_t i = 0; i < shared->batch.size(); i++) {
+    const queue_submission& submission = shared->batch[i];
+
+    info = &(shared->submit_infos[i]);
+    *info = {};
+    info->sType = VK_STRUCTURE_TYPE_SUBMIT_INFO_2;
+
+    info->pWaitSemaphoreInfos = shared->semaphore_infos.data() + semaphore;
+    info->waitSemaphoreInfoCount = submission.num_wait_semaphores;
+    for (uint32_t j = 0; j < submission.num_wait_semaphores; j++) {
+      shared->semaphore_infos[semaphore] = {};
+      shared->semaphore_infos[semaphore].sType = VK_STRUCTURE_TYPE_SEMAPHORE_SUBMIT_INFO;
+      shared->semaphore_infos[semaphore].semaphore = submission.wait_semaphores[j];
+      shared->semaphore_infos[semaphore].stageMask = submission.wait_stages[j];
+      semaphore++;
+    }
+
+    info->pCommandBufferInfos = shared->command_buffer_infos.data() + command_buffer;
+    info->commandBufferInfoCount = submission.num_command_buffers;
+    for (uint32_t j = 0; j < submission.num_command_buffers; j++) {
+      shared->command_buffer_infos[command_buffer] = {};
+      shared->command_buffer_infos[command_buffer].sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_SUBMIT_INFO;
+      shared->command_buffer_infos[command_buffer].commandBuffer = submission.command_buffers[j];
+      command_buffer++;
+    }
+
+    info->pSignalSemaphoreInfos = shared->semaphore_infos.data() + semaphore;
+    info->signalSemaphoreInfoCount = submission.num_signal_semaphores;
+    for (uint32_t j = 0; j < submission.num_signal_semaphores; j++) {
+      shared->semaphore_infos[semaphore] = {};
+      shared->semaphore_infos[semaphore].sType = VK_STRUCTURE_TYPE_SEMAPHORE_SUBMIT_INFO;
+      shared->semaphore_infos[semaphore].semaphore = submission.signal_semaphores[j];
+      shared->semaphore_infos[semaphore].stageMask = submission.signal_stages[j];
+      semaphore++;
+    }
+  }
+}
+
+// Fills in the Vulkan 1.0 submit infos for batch. The command buffers and
+// semaphores can be pointed at where they are in batch; only the wait
+// stages need converting.
+static void build_legacy_submit_infos(shared_queue* shared) {
+  size_t num_wait_stages;
+  size_t wait_stage;
+  VkSubmitInfo* info;
+
+  num_wait_stages = 0;
+  for (const queue_submission& submission : shared->batch) {
+    num_wait_stages += submission.num_wait_semaphores;
+  }
+
+  shared->legacy_submit_infos.resize(shared->batch.size());
+  shared->legacy_wait_stages.resize(num_wait_stages);
+
+  wait_stage = 0;
+
+  for (size_t i = 0; i < shared->batch.size(); i++) {
+    const queue_submission& submission = shared->batch[i];
+
+    info = &(shared->legacy_submit_infos[i]);
+    *info = {};
+    info->sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+
+    // The original stage bits all fit in 32 bits, with the same values.
+    info->pWaitDstStageMask = shared->legacy_wait_stages.data() + wait_stage;
+    for (uint32_t j = 0; j < submission.num_wait_semaphores; j++) {
+      shared->legacy_wait_stages[wait_stage] = (VkPipelineStageFlags)submission.wait_stages[j];
+      wait_stage++;
+    }
+
+    info->waitSemaphoreCount = submission.num_wait_semaphores;
+    info->pWaitSemaphores = submission.wait_semaphores;
+    info->commandBufferCount = submission.num_command_buffers;
+    info->pCommandBuffers = submission.command_buffers;
+    info->signalSemaphoreCount = submission.num_signal_semaphores;
+    info->pSignalSemaphores = submission.signal_semaphores;
+  }
+}
+
+// The batch's signals are on their way, so nothing has to flush for them
+// any more. The mutex must be held.
+static void clear_pending_signals(shared_queue* shared) {
+  lock_guard<mutex> lock(shared->signal_mutex);
+  vector<VkSemaphore>::iterator found;
+
+  for (const queue_submission& submission : shared->batch) {
+    for (uint32_t i = 0; i < submission.num_signal_semaphores; i++) {
+      found = find(
+        shared->pending_signals.begin(),
+        shared->pending_signals.end(),
+        submission.signal_semaphores[i]
+      );
+
+      if (found != shared->pending_signals.end()) {
+        shared->pending_signals.erase(found);
+      }
+    }
+  }
+}
+
+// The mutex must be held.
+static void flush_locked(shared_queue* shared) {
+  size_t first;
+
+  drain_pending(shared);
+
+  if (shared->batch.empty()) {
+    return;
+  }
+
+  if (shared->synchronization2) {
+    build_submit_infos(shared);
+  } else {
+    build_legacy_submit_infos(shared);
+  }
+
+  // One call, unless there are fences to signal along the way.
+  first = 0;
+  for (size_t i = 0; i < shared->batch.size(); i++) {
+    if (shared->batch[i].fence != VK_NULL_HANDLE) {
+      submit_range(shared, first, i + 1, shared->batch[i].fence);
+      first = i + 1;
+    }
+  }
+
+  if (first < shared->batch.size()) {
+    submit_range(shared, first, shared->batch.size(), VK_NULL_HANDLE);
+  }
+
+  clear_pending_signals(shared);
+
+  lock_guard<mutex> lock(shared->stats_mutex);
+  shared->num_submissions += shared->batch.size();
+}
+
+void submit_to_queue(shared_queue* shared, const queue_submission& submission) {
+  if (submission.num_command_buffers > MAX_SUBMISSION_COMMAND_BUFFERS ||
+      submission.num_wait_semaphores > MAX_SUBMISSION_SEMAPHORES ||
+      submission.num_signal_semaphores > MAX_SUBMISSION_SEMAPHORES) {
+    throw runtime_error("submission too big for the shared queue!");
+  }
+
+  flush_signalling_peers(shared, submission.wait_semaphores, submission.num_wait_semaphores);
+
+  // Before it's in pending, so whoever might wait on it finds it.
+  if (submission.num_signal_semaphores > 0) {
+    lock_guard<mutex> lock(shared->signal_mutex);
+
+    shared->pending_signals.insert(
+      shared->pending_signals.end(),
+      submission.signal_semaphores,
+      submission.signal_semaphores + submission.num_signal_semaphores
+    );
+  }
+
+  // Full, so make room. Other threads may be filling it as fast as we
+  // empty it, hence the loop.
+  while (!mpsc_push(&(shared->pending), submission)) {
+    flush_queue(shared);
+  }
+}
+
+void flush_queue(shared_queue* shared) {
+  lock_guard<mutex> lock(shared->mutex);
+
+  flush_locked(shared);
+}
+
+VkResult present_on_queue(shared_queue* shared, const VkPresentInfoKHR* present_info) {
+  flush_signalling_peers(shared, present_info->pWaitSemaphores, present_info->waitSemaphoreCount);
+
+  lock_guard<mutex> lock(shared->mutex);
+
+  // The rendering being presented may still be waiting for a flush.
+  flush_locked(shared);
+
+  return vkQueuePresentKHR(shared->queue, present_info);
+}
+
+void bind_sparse_on_queue(shared_queue* shared, const VkBindSparseInfo* bind_info, VkFence fence) {
+  flush_signalling_peers(shared, bind_info->pWaitSemaphores, bind_info->waitSemaphoreCount);
+
+  lock_guard<mutex> lock(shared->mutex);
+
+  flush_locked(shared);
+
+  if (vkQueueBindSparse(shared->queue, 1, bind_info, fence) != VK_SUCCESS) {
+    throw runtime_error("failed to bind sparse memory!");
+  }
+}
+
+void wait_shared_queue_idle(shared_queue* shared) {
+  lock_guard<mutex> lock(shared->mutex);
+
+  flush_locked(shared);
+  vkQueueWaitIdle(shared->queue);
+}
+
+void take_queue_stats(shared_queue* shared, uint64_t* num_submissions, uint64_t* num_submit_calls) {
+  lock_guard<mutex> lock(shared->stats_mutex);
+
+  *num_submissions = shared->num_submissions;
+  *num_submit_calls = shared->num_submit_calls;
+  shared->num_submissions = 0;
+  shared->num_submit_calls = 0;
+}
@@ -0,0 +1,147 @@
+#ifndef SHARED_QUEUE_H
+#define SHARED_QUEUE_H
+
+#define GLFW_INCLUDE_VULKAN
+
+#include <GLFW/glfw3.h>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+#include "work_queue.h"
+
+//
+// A VkQueue can only be used by one thread at a time, and the queues we
+// ask for aren't always different queues: if the graphics family can
+// present, graphics_queue and present_queue are the same VkQueue, and
+// without a dedicated transfer family so is transfer_queue. So the
+// submission thread, the defragmenter and the virtual textures can all
+// end up submitting to one queue from different threads.
+//
+// A shared queue is the one place a VkQueue gets used. Any thread can
+// hand it a submission, which just goes into a lock-free queue. Whoever
+// owns the frame then flushes it, which takes the queue's lock and sends
+// everything waiting in one vkQueueSubmit2 call. vkQueueSubmit is one of
+// the most expensive calls in the API, so a few batches in one call costs
+// much less than a call each.
+//
+// A vkQueueSubmit2 call only takes one fence, which is signaled once all
+// of its batches are done. So a flush ends its call after each
+// submission with a fence, and the submissions after it go in another
+// call. Submissions without fences never cause an extra call.
+//
+// Holding submissions back has one catch. A submission that waits on a
+// binary semaphore must not reach the GPU before the one that signals it,
+// and if that one went to another shared queue it may still be waiting
+// for a flush. So each shared queue keeps the semaphores its unflushed
+// submissions signal, and a submission that waits on one of them, or a
+// present or sparse bind that does, first flushes the queue it's on. For
+// that, the shared queues have to know about each other; see
+// link_shared_queues.
+//
+// Without VK_KHR_synchronization2 it falls back to vkQueueSubmit, which
+// batches the same way but can only take the stage bits Vulkan 1.0 has.
+//
+
+// How many submissions can wait for a flush. Submitting to a full queue
+// flushes it.
+const uint32_t SHARED_QUEUE_CAPACITY = 256;
+// The most command buffers and semaphores in one submission.
+const uint32_t MAX_SUBMISSION_COMMAND_BUFFERS = 8;
+const uint32_t MAX_SUBMISSION_SEMAPHORES = 4;
+
+struct queue_submission {
+  VkCommandBuffer command_buffers[MAX_SUBMISSION_COMMAND_BUFFERS];
+  uint32_t num_command_buffers;
+
+  VkSemaphore wait_semaphores[MAX_SUBMISSION_SEMAPHORES];
+  VkPipelineStageFlags2 wait_stages[MAX_SUBMISSION_SEMAPHORES];
+  uint32_t num_wait_semaphores;
+
+  VkSemaphore signal_semaphores[MAX_SUBMISSION_SEMAPHORES];
+  VkPipelineStageFlags2 signal_stages[MAX_SUBMISSION_SEMAPHORES];
+  uint32_t num_signal_semaphores;
+
+  // Optional. Signaled once this and everything flushed before it is done.
+  VkFence fence;
+};
+
+struct shared_queue {
+  VkQueue queue;
+  bool synchronization2;
+  PFN_vkQueueSubmit2KHR queue_submit2;
+
+  mpsc_queue<queue_submission> pending;
+
+  // Held whenever the VkQueue is used, and while draining pending, since
+  // only one thread may pop from it at a time.
+  std::mutex mutex;
+
+  // The other shared queues on the device (see link_shared_queues), and
+  // the semaphores signaled by submissions still in pending, which a
+  // submission to one of them may be waiting on.
+  shared_queue* peers;
+  uint32_t num_peers;
+  std::mutex signal_mutex;
+  std::vector<VkSemaphore> pending_signals;
+
+  // Scratch space for building the submit calls, kept between flushes so
+  // they don't allocate. Only used with the mutex held.
+  std::vector<queue_submission> batch;
+  std::vector<VkSubmitInfo2> submit_infos;
+  std::vector<VkCommandBufferSubmitInfo> command_buffer_infos;
+  std::vector<VkSemaphoreSubmitInfo> semaphore_infos;
+  std::vector<VkSubmitInfo> legacy_submit_infos;
+  std::vector<VkPipelineStageFlags> legacy_wait_stages;
+
+  // For the profiler: how many submissions went out in how many calls
+  // since the last take_queue_stats. They have a lock of their own, so
+  // reading them never waits on a flush or a present.
+  std::mutex stats_mutex;
+  uint64_t num_submissions;
+  uint64_t num_submit_calls;
+};
+
+//
+// SHARED QUEUE ROUTINES
+//
+
+// synchronization2 says whether VK_KHR_synchronization2 was enabled on
+// the device.
+void create_shared_queue(
+  VkDevice device,
+  VkQueue queue,
+  bool synchronization2,
+  shared_queue* shared
+);
+
+// Tells each of the queues about the rest, so submissions that wait on a
+// semaphore another one signals go out in the right order. Call once
+// they're all created, before any submissions.
+void link_shared_queues(shared_queue* queues, uint32_t num_queues);
+
+// Any thread. Queues the submission for the next flush, without taking
+// the lock unless the queue is full, or the submission waits on a
+// semaphore another queue has yet to flush the signal for.
+void submit_to_queue(shared_queue* shared, const queue_submission& submission);
+
+// Any thread. Sends everything submitted so far to the GPU, in order.
+void flush_queue(shared_queue* shared);
+
+// Any thread. Flushes, then presents with the lock held, since the
+// VkQueue can't be used by another thread while it presents. That can
+// block for a while under FIFO, so leave presenting to the submission
+// thread. Returns what vkQueuePresentKHR did.
+VkResult present_on_queue(shared_queue* shared, const VkPresentInfoKHR* present_info);
+
+// Any thread. Flushes, then binds with the lock held.
+void bind_sparse_on_queue(shared_queue* shared, const VkBindSparseInfo* bind_info, VkFence fence);
+
+// Flushes and waits for the queue to go idle.
+void wait_shared_queue_idle(shared_queue* shared);
+
+// Any thread. Returns how many submissions went out in how many calls
+// since the last call, and starts counting again.
+void take_queue_stats(shared_queue* shared, uint64_t* num_submissions, uint64_t* num_submit_calls);
+
+#endif
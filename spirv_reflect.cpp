@@ -0,0 +1,727 @@
+#include "spirv_reflect.h"
+
+#include <stdexcept>
+#include <algorithm>
+#include <string>
+
+using namespace std;
+
+const uint32_t SPIRV_MAGIC = 0x07230203;
+const uint32_t SPIRV_HEADER_WORDS = 5;
+
+//
+// The few parts of the SPIR-V spec we need. The numbers come straight
+// from the spec's tables.
+//
+
+enum spirv_opcode : uint32_t {
+  OP_ENTRY_POINT = 15,
+  OP_TYPE_BOOL = 20,
+  OP_TYPE_INT = 21,
+  OP_TYPE_FLOAT = 22,
+  OP_TYPE_VECTOR = 23,
+  OP_TYPE_MATRIX = 24,
+  OP_TYPE_IMAGE = 25,
+  OP_TYPE_SAMPLER = 26,
+  OP_TYPE_SAMPLED_IMAGE = 27,
+  OP_TYPE_ARRAY = 28,
+  OP_TYPE_RUNTIME_ARRAY = 29,
+  OP_TYPE_STRUCT = 30,
+  OP_TYPE_POINTER = 32,
+  OP_CONSTANT = 43,
+  OP_SPEC_CONSTANT_TRUE = 48,
+  OP_SPEC_CONSTANT_FALSE = 49,
+  OP_SPEC_CONSTANT = 50,
+  OP_SPEC_CONSTANT_COMPOSITE = 51,
+  OP_SPEC_CONSTANT_OP = 52,
+  OP_VARIABLE = 59,
+  OP_DECORATE = 71,
+  OP_MEMBER_DECORATE = 72,
+};
+
+enum spirv_decoration : uint32_t {
+  DECORATION_BLOCK = 2,
+  DECORATION_BUFFER_BLOCK = 3,
+  DECORATION_ARRAY_STRIDE = 6,
+  DECORATION_MATRIX_STRIDE = 7,
+  DECORATION_BUILT_IN = 11,
+  DECORATION_LOCATION = 30,
+  DECORATION_BINDING = 33,
+  DECORATION_DESCRIPTOR_SET = 34,
+  DECORATION_OFFSET = 35,
+};
+
+enum spirv_storage_class : uint32_t {
+  STORAGE_UNIFORM_CONSTANT = 0,
+  STORAGE_INPUT = 1,
+  STORAGE_UNIFORM = 2,
+  STORAGE_PUSH_CONSTANT = 9,
+  STORAGE_STORAGE_BUFFER = 12,
+};
+
+enum spirv_execution_model : uint32_t {
+  EXECUTION_VERTEX = 0,
+  EXECUTION_TESSELLATION_CONTROL = 1,
+  EXECUTION_TESSELLATION_EVALUATION = 2,
+  EXECUTION_GEOMETRY = 3,
+  EXECUTION_FRAGMENT = 4,
+  EXECUTION_GL_COMPUTE = 5,
+};
+
+const uint32_t IMAGE_DIM_BUFFER = 5;
+const uint32_t IMAGE_DIM_SUBPASS_DATA = 6;
+// An image with Sampled = 2 is only read and written without a sampler,
+// i.e. it's a storage image.
+const uint32_t IMAGE_SAMPLED_STORAGE = 2;
+
+const uint32_t NO_DECORATION = ~0u;
+
+// Everything we learned about one id. Which fields mean anything depends
+// on the opcode that made it.
+struct spirv_id {
+  uint32_t opcode;
+
+  // The element type of arrays, vectors, matrices and pointers, and the
+  // pointer type of variables.
+  uint32_t type_id;
+  // Pointers and variables.
+  uint32_t storage_class;
+  // The width of ints and floats, the component count of vectors, the
+  // column count of matrices and the length id of arrays.
+  uint32_t count;
+  uint32_t is_signed;
+  uint32_t image_dim;
+  uint32_t image_sampled;
+  // The low word of constants, and the default of specialization
+  // constants.
+  uint32_t value;
+  // Set for specialization constants and anything computed from them,
+  // whose value may change when the pipeline is made.
+  bool specialized;
+
+  std::vector<uint32_t> members;
+  std::vector<uint32_t> member_offsets;
+  std::vector<uint32_t> member_matrix_strides;
+
+  uint32_t array_stride;
+  bool block;
+  bool buffer_block;
+  bool built_in;
+  uint32_t set;
+  uint32_t binding;
+  uint32_t location;
+};
+
+static spirv_id* get_id(vector<spirv_id>& ids, uint32_t id) {
+  if (id >= ids.size()) {
+    throw runtime_error("SPIR-V id out of range!");
+  }
+
+  return &ids[id];
+}
+
+static void set_member_decoration(
+  vector<uint32_t>* decorations,
+  uint32_t member,
+  uint32_t value
+) {
+  if (decorations->size() <= member) {
+    decorations->resize(member + 1, NO_DECORATION);
+  }
+
+  (*decorations)[member] = value;
+}
+
+// Returns the length of an array type. Layouts are made before pipelines
+// are specialized, so a length a specialization constant could change
+// can't be trusted even though its default is known.
+static uint32_t array_length(vector<spirv_id>& ids, const spirv_id& array) {
+  spirv_id* length;
+
+  length = get_id(ids, array.count);
+
+  if (length->specialized) {
+    throw runtime_error("arrays sized by specialization constants aren't supported by reflection!");
+  }
+
+  if (length->opcode != OP_CONSTANT) {
+    throw runtime_error("SPIR-V array length isn't a constant!");
+  }
+
+  return length->value;
+}
+
+// Returns the size in bytes of a type as laid out in a buffer. The matrix
+// stride comes from the struct member holding the matrix.
+static uint32_t type_size(vector<spirv_id>& ids, uint32_t type_id, uint32_t matrix_stride) {
+  spirv_id* type;
+  uint32_t size;
+  uint32_t member_size;
+
+  type = get_id(ids, type_id);
+
+  switch (type->opcode) {
+    case OP_TYPE_BOOL:
+      return 4;
+
+    case OP_TYPE_INT:
+    case OP_TYPE_FLOAT:
+      return type->count / 8;
+
+    case OP_TYPE_VECTOR:
+      return type->count * type_size(ids, type->type_id, NO_DECORATION);
+
+    case OP_TYPE_MATRIX:
+      if (matrix_stride != NO_DECORATION) {
+        return type->count * matrix_stride;
+      }
+
+      return type->count * type_size(ids, type->type_id, NO_DECORATION);
+
+    case OP_TYPE_ARRAY:
+      if (type->array_stride != NO_DECORATION) {
+        return array_length(ids, *type) * type->array_stride;
+      }
+
+      return array_length(ids, *type) * type_size(ids, type->type_id, matrix_stride);
+
+    case OP_TYPE_STRUCT:
+      // Members aren't required to be in offset order, so the size is
+      // where the furthest one ends.
+      size = 0;
+
+      for (uint32_t i = 0; i < type->members.size(); i++) {
+        member_size = type_size(
+          ids,
+          type->members[i],
+          i < type->member_matrix_strides.size() ? type->member_matrix_strides[i] : NO_DECORATION
+        );
+
+        if (i < type->member_offsets.size() && type->member_offsets[i] != NO_DECORATION) {
+          size = max(size, type->member_offsets[i] + member_size);
+        } else {
+          size += member_size;
+        }
+      }
+
+      return size;
+
+    default:
+      throw runtime_error("SPIR-V type has no size!");
+  }
+}
+
+static VkShaderStageFlags execution_model_stage(uint32_t model) {
+  switch (model) {
+    case EXECUTION_VERTEX:
+      return VK_SHADER_STAGE_VERTEX_BIT;
+    case EXECUTION_TESSELLATION_CONTROL:
+      return VK_SHADER_STAGE_TESSELLATION_CONTROL_BIT;
+    case EXECUTION_TESSELLATION_EVALUATION:
+      return VK_SHADER_STAGE_TESSELLATION_EVALUATION_BIT;
+    case EXECUTION_GEOMETRY:
+      return VK_SHADER_STAGE_GEOMETRY_BIT;
+    case EXECUTION_FRAGMENT:
+      return VK_SHADER_STAGE_FRAGMENT_BIT;
+    case EXECUTION_GL_COMPUTE:
+      return VK_SHADER_STAGE_COMPUTE_BIT;
+    default:
+      throw runtime_error("unsupported SPIR-V execution model!");
+  }
+}
+
+static VkDescriptorType descriptor_type(
+  const spirv_id& type,
+  uint32_t storage_class
+) {
+  switch (type.opcode) {
+    case OP_TYPE_SAMPLER:
+      return VK_DESCRIPTOR_TYPE_SAMPLER;
+
+    case OP_TYPE_SAMPLED_IMAGE:
+      return VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+
+    case OP_TYPE_IMAGE:
+      if (type.image_dim == IMAGE_DIM_SUBPASS_DATA) {
+        return VK_DESCRIPTOR_TYPE_INPUT_ATTACHMENT;
+      }
+
+      if (type.image_dim == IMAGE_DIM_BUFFER) {
+        return type.image_sampled == IMAGE_SAMPLED_STORAGE ?
+          VK_DESCRIPTOR_TYPE_STORAGE_TEXEL_BUFFER :
+          VK_DESCRIPTOR_TYPE_UNIFORM_TEXEL_BUFFER;
+      }
+
+      return type.image_sampled == IMAGE_SAMPLED_STORAGE ?
+        VK_DESCRIPTOR_TYPE_STORAGE_IMAGE :
+        VK_DESCRIPTOR_TYPE_SAMPLED_IMAGE;
+
+    case OP_TYPE_STRUCT:
+      // Older compilers mark storage buffers as BufferBlock in the
+      // Uniform storage class, newer ones use the StorageBuffer class.
+      if (storage_class == STORAGE_STORAGE_BUFFER || type.buffer_block) {
+        return VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+      }
+
+      return VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+
+    default:
+      throw runtime_error("unsupported SPIR-V descriptor type!");
+  }
+}
+
+static VkFormat vertex_input_format(vector<spirv_id>& ids, uint32_t type_id) {
+  const VkFormat float_formats[4] = {
+    VK_FORMAT_R32_SFLOAT,
+    VK_FORMAT_R32G32_SFLOAT,
+    VK_FORMAT_R32G32B32_SFLOAT,
+    VK_FORMAT_R32G32B32A32_SFLOAT,
+  };
+  const VkFormat sint_formats[4] = {
+    VK_FORMAT_R32_SINT,
+    VK_FORMAT_R32G32_SINT,
+    VK_FORMAT_R32G32B32_SINT,
+    VK_FORMAT_R32G32B32A32_SINT,
+  };
+  const VkFormat uint_formats[4] = {
+    VK_FORMAT_R32_UINT,
+    VK_FORMAT_R32G32_UINT,
+    VK_FORMAT_R32G32B32_UINT,
+    VK_FORMAT_R32G32B32A32_UINT,
+  };
+  spirv_id* type;
+  spirv_id* component;
+  uint32_t num_components;
+
+  type = get_id(ids, type_id);
+
+  if (type->opcode == OP_TYPE_VECTOR) {
+    component = get_id(ids, type->type_id);
+    num_components = type->count;
+  } else {
+    component = type;
+    num_components = 1;
+  }
+
+  if (component->count != 32 || num_components < 1 || num_components > 4) {
+    throw runtime_error("unsupported vertex input type!");
+  }
+
+  if (component->opcode == OP_TYPE_FLOAT) {
+    return float_formats[num_components - 1];
+  }
+
+  if (component->opcode == OP_TYPE_INT) {
+    return component->is_signed ?
+      sint_formats[num_components - 1] :
+      uint_formats[num_components - 1];
+  }
+
+  throw runtime_error("unsupported vertex input type!");
+}
+
+shader_reflection reflect_spirv(const uint32_t* code, size_t code_size) {
+  shader_reflection reflection{};
+  vector<spirv_id> ids;
+  size_t num_words;
+  size_t word;
+  uint32_t opcode;
+  uint32_t length;
+  const uint32_t* args;
+  spirv_id* id;
+  spirv_id* pointer;
+  spirv_id* type;
+  reflected_binding binding;
+  reflected_vertex_input input;
+  uint32_t push_constant_end;
+  uint32_t member_size;
+
+  num_words = code_size / sizeof(uint32_t);
+
+  if (num_words < SPIRV_HEADER_WORDS || code[0] != SPIRV_MAGIC) {
+    throw runtime_error("not a SPIR-V module!");
+  }
+
+  // header = { magic, version, generator, id bound, reserved }
+  ids.resize(code[3]);
+
+  for (spirv_id& blank : ids) {
+    blank.array_stride = NO_DECORATION;
+    blank.set = NO_DECORATION;
+    blank.binding = NO_DECORATION;
+    blank.location = NO_DECORATION;
+  }
+
+  //
+  // First pass: record what every id is and how it's decorated.
+  //
+
+  word = SPIRV_HEADER_WORDS;
+
+  while (word < num_words) {
+    opcode = code[word] & 0xffff;
+    length = code[word] >> 16;
+    args = &code[word + 1];
+
+    if (length == 0 || word + length > num_words) {
+      throw runtime_error("malformed SPIR-V instruction!");
+    }
+
+    switch (opcode) {
+      case OP_ENTRY_POINT:
+        // { execution model, id, name, interface... }. We assume one
+        // entry point per module, which is what glslc gives us.
+        if (reflection.stage == 0) {
+          reflection.stage = execution_model_stage(args[0]);
+        }
+        break;
+
+      case OP_TYPE_BOOL:
+      case OP_TYPE_SAMPLER:
+        get_id(ids, args[0])->opcode = opcode;
+        break;
+
+      case OP_TYPE_INT:
+        id = get_id(ids, args[0]);
+        id->opcode = opcode;
+        id->count = args[1];
+        id->is_signed = args[2];
+        break;
+
+      case OP_TYPE_FLOAT:
+        id = get_id(ids, args[0]);
+        id->opcode = opcode;
+        id->count = args[1];
+        break;
+
+      case OP_TYPE_VECTOR:
+      case OP_TYPE_MATRIX:
+      case OP_TYPE_ARRAY:
+        id = get_id(ids, args[0]);
+        id->opcode = opcode;
+        id->type_id = args[1];
+        id->count = args[2];
+        break;
+
+      case OP_TYPE_RUNTIME_ARRAY:
+      case OP_TYPE_SAMPLED_IMAGE:
+        id = get_id(ids, args[0]);
+        id->opcode = opcode;
+        id->type_id = args[1];
+        break;
+
+      case OP_TYPE_IMAGE:
+        // { result, sampled type, dim, depth, arrayed, ms, sampled, format }
+        id = get_id(ids, args[0]);
+        id->opcode = opcode;
+        id->type_id = args[1];
+        id->image_dim = args[2];
+        id->image_sampled = args[6];
+        break;
+
+      case OP_TYPE_STRUCT:
+        id = get_id(ids, args[0]);
+        id->opcode = opcode;
+        id->members.assign(args + 1, args + length - 1);
+        break;
+
+      case OP_TYPE_POINTER:
+        id = get_id(ids, args[0]);
+        id->opcode = opcode;
+        id->storage_class = args[1];
+        id->type_id = args[2];
+        break;
+
+      case OP_CONSTANT:
+        // { result type, result, value... }
+        id = get_id(ids, args[1]);
+        id->opcode = opcode;
+        id->value = args[2];
+        break;
+
+      case OP_SPEC_CONSTANT:
+        // { result type, result, default value... }
+        id = get_id(ids, args[1]);
+        id->opcode = opcode;
+        id->value = args[2];
+        id->specialized = true;
+        break;
+
+      case OP_SPEC_CONSTANT_TRUE:
+      case OP_SPEC_CONSTANT_FALSE:
+      case OP_SPEC_CONSTANT_COMPOSITE:
+      case OP_SPEC_CONSTANT_OP:
+        // { result type, result, ... }. Their values only matter as array
+        // lengths, which array_length refuses for anything specialized.
+        id = get_id(ids, args[1]);
+        id->opcode = opcode;
+        id->specialized = true;
+        break;
+
+      case OP_VARIABLE:
+        // { result type, result, storage class, initializer? }
+        id = get_id(ids, args[1]);
+        id->opcode = opcode;
+        id->type_id = args[0];
+        id->storage_class = args[2];
+        break;
+
+      case OP_DECORATE:
+        // { target, decoration, value? }
+        id = get_id(ids, args[0]);
+
+        switch (args[1]) {
+          case DECORATION_BLOCK:
+            id->block = true;
+            break;
+          case DECORATION_BUFFER_BLOCK:
+            id->buffer_block = true;
+            break;
+          case DECORATION_ARRAY_STRIDE:
+            id->array_stride = args[2];
+            break;
+          case DECORATION_BUILT_IN:
+            id->built_in = true;
+            break;
+          case DECORATION_LOCATION:
+            id->location = args[2];
+            break;
+          case DECORATION_BINDING:
+            id->binding = args[2];
+            break;
+          case DECORATION_DESCRIPTOR_SET:
+            id->set = args[2];
+            break;
+        }
+        break;
+
+      case OP_MEMBER_DECORATE:
+        // { struct, member, decoration, value? }
+        id = get_id(ids, args[0]);
+
+        switch (args[2]) {
+          case DECORATION_OFFSET:
+            set_member_decoration(&id->member_offsets, args[1], args[3]);
+            break;
+          case DECORATION_MATRIX_STRIDE:
+            set_member_decoration(&id->member_matrix_strides, args[1], args[3]);
+            break;
+          case DECORATION_BUILT_IN:
+            id->built_in = true;
+            break;
+        }
+        break;
+    }
+
+    word += length;
+  }
+
+  if (reflection.stage == 0) {
+    throw runtime_error("SPIR-V module has no entry point!");
+  }
+
+  //
+  // Second pass: now that every type is known, go through the global
+  // variables and turn them into bindings, push constants and inputs.
+  //
+
+  push_constant_end = 0;
+  reflection.push_constant_offset = ~0u;
+
+  for (spirv_id& variable : ids) {
+    if (variable.opcode != OP_VARIABLE) {
+      continue;
+    }
+
+    pointer = get_id(ids, variable.type_id);
+    type = get_id(ids, pointer->type_id);
+
+    switch (variable.storage_class) {
+      case STORAGE_UNIFORM_CONSTANT:
+      case STORAGE_UNIFORM:
+      case STORAGE_STORAGE_BUFFER:
+        if (variable.set == NO_DECORATION || variable.binding == NO_DECORATION) {
+          throw runtime_error("SPIR-V resource has no set or binding!");
+        }
+
+        binding.set = variable.set;
+        binding.binding = variable.binding;
+        binding.count = 1;
+        binding.stages = reflection.stage;
+
+        // Arrays of arrays are flattened into one descriptor array.
+        while (type->opcode == OP_TYPE_ARRAY || type->opcode == OP_TYPE_RUNTIME_ARRAY) {
+          if (type->opcode == OP_TYPE_RUNTIME_ARRAY) {
+            throw runtime_error("unsized descriptor arrays aren't supported by reflection!");
+          }
+
+          binding.count *= array_length(ids, *type);
+          type = get_id(ids, type->type_id);
+        }
+
+        binding.type = descriptor_type(*type, variable.storage_class);
+        reflection.bindings.push_back(binding);
+        break;
+
+      case STORAGE_PUSH_CONSTANT:
+        for (uint32_t i = 0; i < type->members.size(); i++) {
+          if (i >= type->member_offsets.size() || type->member_offsets[i] == NO_DECORATION) {
+            throw runtime_error("push constant member has no offset!");
+          }
+
+          member_size = type_size(
+            ids,
+            type->members[i],
+            i < type->member_matrix_strides.size() ? type->member_matrix_strides[i] : NO_DECORATION
+          );
+
+          reflection.push_constant_offset = min(reflection.push_constant_offset, type->member_offsets[i]);
+          push_constant_end = max(push_constant_end, type->member_offsets[i] + member_size);
+        }
+        break;
+
+      case STORAGE_INPUT:
+        // Built ins like gl_VertexIndex aren't vertex attributes.
+        if (reflection.stage != VK_SHADER_STAGE_VERTEX_BIT ||
+            variable.built_in ||
+            type->built_in ||
+            variable.location == NO_DECORATION) {
+          break;
+        }
+
+        input.location = variable.location;
+        input.format = vertex_input_format(ids, pointer->type_id);
+        input.size = type_size(ids, pointer->type_id, NO_DECORATION);
+        reflection.vertex_inputs.push_back(input);
+        break;
+    }
+  }
+
+  if (push_constant_end == 0) {
+    reflection.push_constant_offset = 0;
+    reflection.push_constant_size = 0;
+  } else {
+    reflection.push_constant_size = push_constant_end - reflection.push_constant_offset;
+  }
+
+  sort(
+    reflection.bindings.begin(),
+    reflection.bindings.end(),
+    [](const reflected_binding& a, const reflected_binding& b) {
+      return a.set != b.set ? a.set < b.set : a.binding < b.binding;
+    }
+  );
+
+  sort(
+    reflection.vertex_inputs.begin(),
+    reflection.vertex_inputs.end(),
+    [](const reflected_vertex_input& a, const reflected_vertex_input& b) {
+      return a.location < b.location;
+    }
+  );
+
+  return reflection;
+}
+
+shader_reflection merge_reflections(
+  const shader_reflection* reflections,
+  uint32_t num_reflections
+) {
+  shader_reflection merged{};
+  uint32_t push_constant_end;
+  reflected_binding* existing;
+
+  push_constant_end = 0;
+
+  for (uint32_t r = 0; r < num_reflections; r++) {
+    const shader_reflection& reflection = reflections[r];
+
+    merged.stage |= reflection.stage;
+
+    for (const reflected_binding& binding : reflection.bindings) {
+      existing = NULL;
+
+      for (reflected_binding& other : merged.bindings) {
+        if (other.set == binding.set && other.binding == binding.binding) {
+          existing = &other;
+          break;
+        }
+      }
+
+      if (existing == NULL) {
+        merged.bindings.push_back(binding);
+        continue;
+      }
+
+      if (existing->type != binding.type || existing->count != binding.count) {
+        throw runtime_error(
+          "shader stages disagree about set " + to_string(binding.set) +
+          " binding " + to_string(binding.binding) + "!"
+        );
+      }
+
+      existing->stages |= binding.stages;
+    }
+
+    // One range covering what every stage uses. That's a little more than
+    // some stages need, but keeps it to one vkCmdPushConstants call.
+    if (reflection.push_constant_size > 0) {
+      if (push_constant_end == 0) {
+        merged.push_constant_offset = reflection.push_constant_offset;
+      } else {
+        merged.push_constant_offset = min(merged.push_constant_offset, reflection.push_constant_offset);
+      }
+
+      push_constant_end = max(
+        push_constant_end,
+        reflection.push_constant_offset + reflection.push_constant_size
+      );
+    }
+
+    if (reflection.stage == VK_SHADER_STAGE_VERTEX_BIT) {
+      merged.vertex_inputs = reflection.vertex_inputs;
+    }
+  }
+
+  if (push_constant_end > 0) {
+    merged.push_constant_size = push_constant_end - merged.push_constant_offset;
+  }
+
+  sort(
+    merged.bindings.begin(),
+    merged.bindings.end(),
+    [](const reflected_binding& a, const reflected_binding& b) {
+      return a.set != b.set ? a.set < b.set : a.binding < b.binding;
+    }
+  );
+
+  return merged;
+}
+
+void reflected_vertex_layout(
+  const shader_reflection& reflection,
+  uint32_t* vertex_stride,
+  uint32_t* num_attributes,
+  VkVertexInputAttributeDescription* attributes,
+  uint32_t max_attributes
+) {
+  uint32_t offset;
+
+  if (reflection.vertex_inputs.size() > max_attributes) {
+    throw runtime_error("vertex shader has too many inputs!");
+  }
+
+  offset = 0;
+
+  for (uint32_t i = 0; i < reflection.vertex_inputs.size(); i++) {
+    attributes[i].location = reflection.vertex_inputs[i].location;
+    attributes[i].binding = 0;
+    attributes[i].format = reflection.vertex_inputs[i].format;
+    attributes[i].offset = offset;
+
+    offset += reflection.vertex_inputs[i].size;
+  }
+
+  *vertex_stride = offset;
+  *num_attributes = (uint32_t)reflection.vertex_inputs.size();
+}
@@ -0,0 +1,81 @@
+#ifndef SPIRV_REFLECT_H
+#define SPIRV_REFLECT_H
+
+#define GLFW_INCLUDE_VULKAN
+
+#include <GLFW/glfw3.h>
+#include <cstdint>
+#include <vector>
+
+//
+// A pipeline layout has to match the shaders exactly: every descriptor
+// binding, its type and count, which stages see it, and the size of the
+// push constants. Writing those out by hand means keeping two copies of
+// the same information in sync, and they drift.
+//
+// SPIR-V already has all of it, since the shader compiler writes out the
+// set, binding and type of every resource. So we read the binary
+// ourselves. A SPIR-V module is a 5 word header followed by a flat list
+// of instructions. Every instruction starts with a word holding its
+// length (high 16 bits) and opcode (low 16 bits), and the results of
+// instructions are referred to by id. We only need to look at the type
+// declarations, the decorations and the global variables, so one pass
+// over the instructions collects everything.
+//
+
+struct reflected_binding {
+  uint32_t set;
+  uint32_t binding;
+  VkDescriptorType type;
+  // The array size, or 1 if it's not an array.
+  uint32_t count;
+  VkShaderStageFlags stages;
+};
+
+struct reflected_vertex_input {
+  uint32_t location;
+  VkFormat format;
+  // In bytes.
+  uint32_t size;
+};
+
+struct shader_reflection {
+  VkShaderStageFlags stage;
+  std::vector<reflected_binding> bindings;
+
+  // The push constant block, if the shader has one (size is 0 if not).
+  // The offset is the offset of the first member the shader uses, which
+  // lets stages share one block while each only declaring their part.
+  uint32_t push_constant_offset;
+  uint32_t push_constant_size;
+
+  // Only filled in for vertex shaders. Sorted by location.
+  std::vector<reflected_vertex_input> vertex_inputs;
+};
+
+// Reads a SPIR-V module. Throws if it isn't valid SPIR-V or uses a kind
+// of resource we don't know how to make a layout for (like unsized
+// descriptor arrays, or descriptor and push constant arrays sized by a
+// specialization constant).
+shader_reflection reflect_spirv(const uint32_t* code, size_t code_size);
+
+// Combines the reflections of every stage of a pipeline. Bindings used by
+// several stages are merged, and their stage flags combined. Throws if
+// two stages disagree about a binding.
+shader_reflection merge_reflections(
+  const shader_reflection* reflections,
+  uint32_t num_reflections
+);
+
+// Fills in the vertex input of a pipeline state (see pipeline_manager.h)
+// from a vertex shader's reflection, assuming a single interleaved vertex
+// buffer with the attributes packed in location order.
+void reflected_vertex_layout(
+  const shader_reflection& reflection,
+  uint32_t* vertex_stride,
+  uint32_t* num_attributes,
+  VkVertexInputAttributeDescription* attributes,
+  uint32_t max_attributes
+);
+
+#endif
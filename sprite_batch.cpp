@@ -0,0 +1,548 @@
+#include "sprite_batch.h"
+
+#include <stdexcept>
+#include <algorithm>
+#include <cmath>
+
+using namespace std;
+
+// What the vertex shader gets: 2 / the target's size, to turn pixels into
+// clip space.
+struct sprite_push_constants {
+  float scale[2];
+};
+
+static void create_atlas(sprite_batch* batch) {
+  VkImageCreateInfo image_info{};
+  VkImageViewCreateInfo view_info{};
+  VkSamplerCreateInfo sampler_info{};
+  VkImage image;
+
+  image_info.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+  image_info.imageType = VK_IMAGE_TYPE_2D;
+  image_info.format = SPRITE_ATLAS_FORMAT;
+  image_info.extent = { SPRITE_ATLAS_SIZE, SPRITE_ATLAS_SIZE, 1 };
+  image_info.mipLevels = 1;
+  image_info.arrayLayers = batch->num_pages;
+  image_info.samples = VK_SAMPLE_COUNT_1_BIT;
+  image_info.tiling = VK_IMAGE_TILING_OPTIMAL;
+  image_info.usage = VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT;
+  image_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+  image_info.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+
+  if (vkCreateImage(batch->device, &image_info, NULL, &image) != VK_SUCCESS) {
+    throw runtime_error("failed to create sprite atlas!");
+  }
+
+  batch->atlas = allocate_image(
+    batch->allocator,
+    image,
+    VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+    MEMORY_TEXTURES
+  );
+
+  view_info.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+  view_info.image = image;
+  view_info.viewType = VK_IMAGE_VIEW_TYPE_2D_ARRAY;
+  view_info.format = SPRITE_ATLAS_FORMAT;
+  view_info.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+  view_info.subresourceRange.levelCount = 1;
+  view_info.subresourceRange.layerCount = batch->num_pages;
+
+  if (vkCreateImageView(batch->device, &view_info, NULL, &(batch->atlas_view)) != VK_SUCCESS) {
+    throw runtime_error("failed to create sprite atlas view!");
+  }
+
+  // The atlas only needs stages and accesses Vulkan 1.0 has, so the
+  // batch doesn't need synchronization2.
+  create_barrier_batch(batch->device, false, &(batch->barriers));
+  track_image(&(batch->barriers), image, view_info.subresourceRange, VK_IMAGE_LAYOUT_UNDEFINED);
+
+  // Clamped, so filtering at the edge of a picture doesn't wrap around to
+  // the other side of the page.
+  sampler_info.sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO;
+  sampler_info.magFilter = VK_FILTER_LINEAR;
+  sampler_info.minFilter = VK_FILTER_LINEAR;
+  sampler_info.mipmapMode = VK_SAMPLER_MIPMAP_MODE_NEAREST;
+  sampler_info.addressModeU = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+  sampler_info.addressModeV = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+  sampler_info.addressModeW = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+
+  if (vkCreateSampler(batch->device, &sampler_info, NULL, &(batch->sampler)) != VK_SUCCESS) {
+    throw runtime_error("failed to create sprite sampler!");
+  }
+}
+
+static void create_layouts(sprite_batch* batch, layout_cache* layouts) {
+  VkDescriptorSetLayoutBinding bindings[2]{};
+  VkPushConstantRange push_constants{};
+
+  // The sprites, at this frame's offset into the ring.
+  bindings[0].binding = 0;
+  bindings[0].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC;
+  bindings[0].descriptorCount = 1;
+  bindings[0].stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
+
+  bindings[1].binding = 1;
+  bindings[1].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+  bindings[1].descriptorCount = 1;
+  bindings[1].stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT;
+
+  push_constants.stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
+  push_constants.size = sizeof(sprite_push_constants);
+
+  batch->set_layout = get_descriptor_set_layout(layouts, bindings, 2);
+  batch->layout = get_pipeline_layout(layouts, &(batch->set_layout), 1, &push_constants);
+}
+
+static void create_descriptor_set(sprite_batch* batch) {
+  VkDescriptorPoolSize pool_sizes[2]{};
+  VkDescriptorPoolCreateInfo pool_info{};
+  VkDescriptorSetAllocateInfo alloc_info{};
+  VkDescriptorBufferInfo buffer_info{};
+  VkDescriptorImageInfo image_info{};
+  VkWriteDescriptorSet writes[2]{};
+
+  pool_sizes[0].type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC;
+  pool_sizes[0].descriptorCount = 1;
+  pool_sizes[1].type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+  pool_sizes[1].descriptorCount = 1;
+
+  pool_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+  pool_info.maxSets = 1;
+  pool_info.poolSizeCount = 2;
+  pool_info.pPoolSizes = pool_sizes;
+
+  if (vkCreateDescriptorPool(batch->device, &pool_info, NULL, &(batch->descriptor_pool)) != VK_SUCCESS) {
+    throw runtime_error("failed to create sprite descriptor pool!");
+  }
+
+  alloc_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+  alloc_info.descriptorPool = batch->descriptor_pool;
+  alloc_info.descriptorSetCount = 1;
+  alloc_info.pSetLayouts = &(batch->set_layout);
+
+  if (vkAllocateDescriptorSets(batch->device, &alloc_info, &(batch->descriptor_set)) != VK_SUCCESS) {
+    throw runtime_error("failed to allocate sprite descriptor set!");
+  }
+
+  // One frame's slice; the dynamic offset picks which.
+  buffer_info.buffer = batch->ring.device->buffer;
+  buffer_info.offset = batch->ring.device->offset;
+  buffer_info.range = batch->ring.frame_size;
+
+  image_info.sampler = batch->sampler;
+  image_info.imageView = batch->atlas_view;
+  image_info.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+
+  writes[0].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+  writes[0].dstSet = batch->descriptor_set;
+  writes[0].dstBinding = 0;
+  writes[0].descriptorCount = 1;
+  writes[0].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC;
+  writes[0].pBufferInfo = &buffer_info;
+
+  writes[1].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+  writes[1].dstSet = batch->descriptor_set;
+  writes[1].dstBinding = 1;
+  writes[1].descriptorCount = 1;
+  writes[1].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+  writes[1].pImageInfo = &image_info;
+
+  vkUpdateDescriptorSets(batch->device, 2, writes, 0, NULL);
+}
+
+static void create_pipelines(
+  sprite_batch* batch,
+  pipeline_manager* pipelines,
+  VkShaderModule vertex_shader,
+  VkShaderModule fragment_shader,
+  const graphics_pipeline_state& target
+) {
+  graphics_pipeline_state state;
+
+  state = default_pipeline_state();
+  state.vertex_shader = vertex_shader;
+  state.fragment_shader = fragment_shader;
+  // Quads are made up in the shader, facing either way.
+  state.cull_mode = VK_CULL_MODE_NONE;
+  state.num_color_formats = target.num_color_formats;
+  copy(target.color_formats, target.color_formats + MAX_COLOR_ATTACHMENTS, state.color_formats);
+  state.depth_format = target.depth_format;
+  state.samples = target.samples;
+  state.render_pass = target.render_pass;
+  state.subpass = target.subpass;
+  state.layout = batch->layout;
+
+  batch->pipelines = pipelines;
+
+  for (blend_mode blend : { BLEND_OPAQUE, BLEND_ALPHA, BLEND_ADDITIVE }) {
+    state.blend = blend;
+    batch->pipeline_states[blend] = state;
+  }
+
+  precompile_pipelines(
+    pipelines,
+    vector<graphics_pipeline_state>(batch->pipeline_states, batch->pipeline_states + 3)
+  );
+}
+
+void create_sprite_batch(
+  VkDevice device,
+  memory_allocator* allocator,
+  const memory_budget_tracker* budget,
+  layout_cache* layouts,
+  pipeline_manager* pipelines,
+  VkShaderModule vertex_shader,
+  VkShaderModule fragment_shader,
+  const graphics_pipeline_state& target,
+  uint32_t capacity,
+  uint32_t num_pages,
+  uint32_t frames_in_flight,
+  sprite_batch* batch
+) {
+  if (num_pages == 0 || num_pages > MAX_SPRITE_ATLAS_PAGES) {
+    throw runtime_error("sprite atlas page count out of range!");
+  }
+
+  batch->device = device;
+  batch->allocator = allocator;
+  batch->capacity = capacity;
+  batch->num_pages = num_pages;
+  batch->mapped = NULL;
+  batch->num_sprites = 0;
+  batch->num_draws = 0;
+
+  batch->instances.reserve(capacity);
+  batch->keys.reserve(capacity);
+  batch->sort_scratch.reserve(capacity);
+
+  create_dynamic_buffer(
+    allocator,
+    budget,
+    (VkDeviceSize)capacity * sizeof(sprite_instance),
+    frames_in_flight,
+    MEMORY_OTHER,
+    &(batch->ring)
+  );
+
+  create_atlas(batch);
+  create_layouts(batch, layouts);
+  create_descriptor_set(batch);
+  create_pipelines(batch, pipelines, vertex_shader, fragment_shader, target);
+}
+
+void destroy_sprite_batch(sprite_batch* batch) {
+  // The layouts belong to the layout cache and the pipelines to the
+  // pipeline manager.
+  vkDestroyDescriptorPool(batch->device, batch->descriptor_pool, NULL);
+  vkDestroySampler(batch->device, batch->sampler, NULL);
+  vkDestroyImageView(batch->device, batch->atlas_view, NULL);
+  vkDestroyImage(batch->device, batch->atlas->image, NULL);
+  free_allocation(batch->allocator, batch->atlas);
+  destroy_dynamic_buffer(&(batch->ring));
+}
+
+void write_sprite_atlas(
+  sprite_batch* batch,
+  VkCommandBuffer cmd,
+  VkBuffer src,
+  const vector<VkBufferImageCopy>& regions
+) {
+  if (regions.empty()) {
+    return;
+  }
+
+  for (const VkBufferImageCopy& region : regions) {
+    if (region.imageSubresource.baseArrayLayer + region.imageSubresource.layerCount > batch->num_pages) {
+      throw runtime_error("sprite atlas write past the last page!");
+    }
+  }
+
+  // All of the pages at once, so any number of regions costs one barrier
+  // here. The one before sampling waits for prepare_sprite_batch, so
+  // several writes in a frame share it.
+  use_image(
+    &(batch->barriers),
+    batch->atlas->image,
+    VK_PIPELINE_STAGE_2_TRANSFER_BIT,
+    VK_ACCESS_2_TRANSFER_WRITE_BIT,
+    VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL
+  );
+  flush_barriers(&(batch->barriers), cmd);
+
+  vkCmdCopyBufferToImage(
+    cmd,
+    src,
+    batch->atlas->image,
+    VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+    (uint32_t)regions.size(),
+    regions.data()
+  );
+}
+
+void clear_sprite_atlas(
+  sprite_batch* batch,
+  VkCommandBuffer cmd,
+  uint32_t first_page,
+  uint32_t num_pages,
+  const VkClearColorValue& color
+) {
+  VkImageSubresourceRange range{};
+
+  if (first_page + num_pages > batch->num_pages) {
+    throw runtime_error("sprite atlas clear past the last page!");
+  }
+
+  use_image(
+    &(batch->barriers),
+    batch->atlas->image,
+    VK_PIPELINE_STAGE_2_TRANSFER_BIT,
+    VK_ACCESS_2_TRANSFER_WRITE_BIT,
+    VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL
+  );
+  flush_barriers(&(batch->barriers), cmd);
+
+  range.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+  range.levelCount = 1;
+  range.baseArrayLayer = first_page;
+  range.layerCount = num_pages;
+
+  vkCmdClearColorImage(
+    cmd,
+    batch->atlas->image,
+    VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+    &color,
+    1,
+    &range
+  );
+}
+
+void begin_sprite_batch(sprite_batch* batch, uint32_t frame_index) {
+  batch->mapped = (sprite_instance*)begin_dynamic_buffer_frame(&(batch->ring), frame_index);
+  batch->instances.clear();
+  batch->keys.clear();
+  batch->draws.clear();
+}
+
+// Packs two values from 0 to 1 as 16 bit UNORMs, the way unpackUnorm2x16
+// reads them.
+static uint32_t pack_unorm2x16(float a, float b) {
+  uint32_t low;
+  uint32_t high;
+
+  low = (uint32_t)lroundf(min(max(a, 0.0f), 1.0f) * 65535.0f);
+  high = (uint32_t)lroundf(min(max(b, 0.0f), 1.0f) * 65535.0f);
+
+  return low | (high << 16);
+}
+
+void draw_sprite(sprite_batch* batch, const sprite& s) {
+  sprite_instance instance;
+  uint32_t index;
+
+  if (batch->instances.size() == batch->capacity) {
+    throw runtime_error("sprite batch is full!");
+  }
+
+  if (s.page >= batch->num_pages) {
+    throw runtime_error("sprite page is past the end of the atlas!");
+  }
+
+  instance.rect[0] = s.x;
+  instance.rect[1] = s.y;
+  instance.rect[2] = s.width;
+  instance.rect[3] = s.height;
+  instance.uv[0] = pack_unorm2x16(s.u0, s.v0);
+  instance.uv[1] = pack_unorm2x16(s.u1, s.v1);
+  instance.color = s.color;
+  instance.page = s.page | (s.sdf ? SPRITE_SDF_BIT : 0);
+
+  index = (uint32_t)batch->instances.size();
+  batch->instances.push_back(instance);
+
+  // Layer, then blend mode, then page, then the order they came in, so
+  // the sort never reorders sprites that compare equal.
+  batch->keys.push_back(
+    ((uint64_t)s.layer << 56) |
+    ((uint64_t)(s.blend & 0xff) << 48) |
+    ((uint64_t)(s.page & 0xffff) << 32) |
+    index
+  );
+}
+
+// Sorts the keys by their top 32 bits, a byte at a time, least
+// significant first. Each pass keeps the order of keys whose byte is the
+// same, so equal keys stay in the order they were added. Bytes that are
+// the same for every sprite (one layer, one blend mode...) skip their
+// pass, so the usual frame does one or two passes over the keys instead
+// of a full comparison sort.
+static void sort_sprite_keys(sprite_batch* batch) {
+  vector<uint64_t>& keys = batch->keys;
+  vector<uint64_t>& scratch = batch->sort_scratch;
+  uint32_t counts[256];
+  uint32_t offset;
+  uint32_t shift;
+  uint8_t digit;
+
+  scratch.resize(keys.size());
+
+  for (shift = 32; shift < 64; shift += 8) {
+    fill(counts, counts + 256, 0);
+
+    for (uint64_t key : keys) {
+      counts[(key >> shift) & 0xff]++;
+    }
+
+    digit = (uint8_t)(keys[0] >> shift);
+    if (counts[digit] == keys.size()) {
+      continue;
+    }
+
+    offset = 0;
+    for (uint32_t i = 0; i < 256; i++) {
+      uint32_t count = counts[i];
+      counts[i] = offset;
+      offset += count;
+    }
+
+    for (uint64_t key : keys) {
+      scratch[counts[(key >> shift) & 0xff]++] = key;
+    }
+
+    keys.swap(scratch);
+  }
+}
+
+void prepare_sprite_batch(sprite_batch* batch, VkCommandBuffer cmd) {
+  uint32_t num_sprites;
+  sprite_draw draw;
+  blend_mode blend;
+
+  num_sprites = (uint32_t)batch->keys.size();
+  batch->draws.clear();
+
+  // Makes this frame's atlas writes visible to the fragment shader. With
+  // none since the last frame, the batch drops it. The first frame also
+  // needs it even if nothing was written, since sampling a layout the
+  // atlas was never put in isn't allowed.
+  use_image(
+    &(batch->barriers),
+    batch->atlas->image,
+    VK_PIPELINE_STAGE_2_FRAGMENT_SHADER_BIT,
+    VK_ACCESS_2_SHADER_SAMPLED_READ_BIT,
+    VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL
+  );
+  flush_barriers(&(batch->barriers), cmd);
+
+  if (num_sprites == 0) {
+    return;
+  }
+
+  if (!is_sorted(batch->keys.begin(), batch->keys.end())) {
+    sort_sprite_keys(batch);
+  }
+
+  // Written front to back, which is what write combined memory wants.
+  // Each run of the same blend mode is one draw.
+  draw.blend = (blend_mode)((batch->keys[0] >> 48) & 0xff);
+  draw.first = 0;
+  draw.count = 0;
+
+  for (uint32_t i = 0; i < num_sprites; i++) {
+    blend = (blend_mode)((batch->keys[i] >> 48) & 0xff);
+
+    if (blend != draw.blend) {
+      batch->draws.push_back(draw);
+      draw.blend = blend;
+      draw.first = i;
+      draw.count = 0;
+    }
+
+    batch->mapped[i] = batch->instances[(uint32_t)batch->keys[i]];
+    draw.count++;
+  }
+
+  batch->draws.push_back(draw);
+
+  flush_dynamic_buffer(
+    &(batch->ring),
+    cmd,
+    (VkDeviceSize)num_sprites * sizeof(sprite_instance),
+    VK_PIPELINE_STAGE_VERTEX_SHADER_BIT,
+    VK_ACCESS_SHADER_READ_BIT
+  );
+}
+
+void render_sprite_batch(
+  sprite_batch* batch,
+  VkCommandBuffer cmd,
+  uint32_t width,
+  uint32_t height
+) {
+  VkViewport viewport{};
+  VkRect2D scissor{};
+  sprite_push_constants push_constants;
+  uint32_t dynamic_offset;
+  VkPipeline pipeline;
+
+  if (batch->draws.empty()) {
+    return;
+  }
+
+  viewport.width = (float)width;
+  viewport.height = (float)height;
+  viewport.maxDepth = 1.0f;
+  scissor.extent = { width, height };
+
+  vkCmdSetViewport(cmd, 0, 1, &viewport);
+  vkCmdSetScissor(cmd, 0, 1, &scissor);
+
+  push_constants.scale[0] = 2.0f / (float)width;
+  push_constants.scale[1] = 2.0f / (float)height;
+
+  dynamic_offset = (uint32_t)(dynamic_buffer_offset(&(batch->ring)) - batch->ring.device->offset);
+
+  vkCmdBindDescriptorSets(
+    cmd,
+    VK_PIPELINE_BIND_POINT_GRAPHICS,
+    batch->layout,
+    0,
+    1,
+    &(batch->descriptor_set),
+    1,
+    &dynamic_offset
+  );
+  vkCmdPushConstants(
+    cmd,
+    batch->layout,
+    VK_SHADER_STAGE_VERTEX_BIT,
+    0,
+    sizeof(push_constants),
+    &push_constants
+  );
+
+  // Six vertices a sprite, and the shader finds its sprite from the
+  // vertex index, which starts at firstVertex.
+  for (const sprite_draw& draw : batch->draws) {
+    pipeline = get_pipeline(batch->pipelines, batch->pipeline_states[draw.blend]);
+
+    if (pipeline == VK_NULL_HANDLE) {
+      throw runtime_error("failed to create sprite pipeline!");
+    }
+
+    vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline);
+    vkCmdDraw(cmd, draw.count * 6, 1, draw.first * 6, 0);
+  }
+
+  batch->num_sprites += (uint32_t)batch->keys.size();
+  batch->num_draws += (uint32_t)batch->draws.size();
+}
+
+void publish_sprite_stats(sprite_batch* batch, gpu_profiler* profiler) {
+  set_profiler_counter(profiler, "sprites", batch->num_sprites);
+  set_profiler_counter(profiler, "sprite_draws", batch->num_draws);
+
+  batch->num_sprites = 0;
+  batch->num_draws = 0;
+}
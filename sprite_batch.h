@@ -0,0 +1,220 @@
+#ifndef SPRITE_BATCH_H
+#define SPRITE_BATCH_H
+
+#define GLFW_INCLUDE_VULKAN
+
+#include <GLFW/glfw3.h>
+#include <cstdint>
+#include <vector>
+
+#include "memory_allocator.h"
+#include "memory_budget.h"
+#include "dynamic_upload.h"
+#include "layout_cache.h"
+#include "pipeline_manager.h"
+#include "barrier_batch.h"
+#include "gpu_profiler.h"
+
+//
+// HUDs and overlays are tens of thousands of small textured quads. Drawn
+// one at a time, the CPU cost of the draw calls (and of switching
+// textures and blend state between them) is far more than the GPU cost of
+// the quads, so a sprite batch collects them over the frame and draws
+// them all at the end with as few calls as it can.
+//
+// Every texture a sprite can use lives in one atlas: a 2D array image,
+// each layer a page of SPRITE_ATLAS_SIZE squared texels with many
+// pictures packed into it. A sprite names its page, and since the page is
+// just the array layer to sample, sprites on different pages can share a
+// draw. Nothing is bound per sprite at all.
+//
+// Sprites are written into a per frame slice of a persistently mapped
+// ring (see dynamic_upload.h), 32 bytes each, and the vertex shader reads
+// them straight from it as a storage buffer, making up the six corners of
+// each quad from gl_VertexIndex. There is no vertex or index buffer to
+// fill.
+//
+// Before they're written, sprites are sorted by layer, then blend mode,
+// then page. Layers are drawn back to front in the order given; within a
+// layer, sprites are assumed not to care about each other's order, so
+// those with the same blend mode end up next to each other. Only a change
+// of blend mode needs a new pipeline, so a frame takes one draw per run
+// of the same blend mode, and a frame that only blends one way takes one
+// draw. Within a run, sprites stay in the order they were added.
+//
+
+// The width and height of an atlas page, in texels.
+const uint32_t SPRITE_ATLAS_SIZE = 2048;
+// Sprites are sampled as they're stored, so the atlas should match the
+// render target: UNORM here, for UNORM targets.
+const VkFormat SPRITE_ATLAS_FORMAT = VK_FORMAT_R8G8B8A8_UNORM;
+// The most pages an atlas can have.
+const uint32_t MAX_SPRITE_ATLAS_PAGES = 256;
+// Set in sprite_instance::page for sprites whose picture is a distance
+// field.
+const uint32_t SPRITE_SDF_BIT = 0x80000000;
+
+// One quad, as the caller describes it.
+struct sprite {
+  // The top left corner and size, in pixels of the render target, with y
+  // pointing down.
+  float x;
+  float y;
+  float width;
+  float height;
+
+  // The part of the page to show, from 0 to 1.
+  float u0;
+  float v0;
+  float u1;
+  float v1;
+
+  // Multiplies the texels. See pack_sprite_color.
+  uint32_t color;
+  uint32_t page;
+  blend_mode blend;
+  // Sprites on lower layers are drawn first.
+  uint8_t layer;
+  // The picture's alpha is a signed distance field (see text_renderer.h),
+  // to be cut at 0.5 with a smooth edge, rather than coverage.
+  bool sdf;
+};
+
+// A sprite the way the shader reads it, matching sprite_instance in
+// shaders/sprite.vert.
+struct sprite_instance {
+  float rect[4];
+  // u0, v0 and u1, v1, each pair packed as two 16 bit UNORMs.
+  uint32_t uv[2];
+  uint32_t color;
+  // With SPRITE_SDF_BIT for distance fields.
+  uint32_t page;
+};
+
+// A run of sorted sprites drawn with one call.
+struct sprite_draw {
+  blend_mode blend;
+  uint32_t first;
+  uint32_t count;
+};
+
+struct sprite_batch {
+  VkDevice device;
+  memory_allocator* allocator;
+  // The most sprites a frame can have.
+  uint32_t capacity;
+
+  // Where the sprites go for the GPU, capacity of them per frame in
+  // flight, and the part of it this frame writes into.
+  dynamic_buffer ring;
+  sprite_instance* mapped;
+
+  // This frame's sprites in the order they were added, and a sort key for
+  // each with its index in the low 32 bits.
+  std::vector<sprite_instance> instances;
+  std::vector<uint64_t> keys;
+  std::vector<uint64_t> sort_scratch;
+  // Built by prepare_sprite_batch for render_sprite_batch.
+  std::vector<sprite_draw> draws;
+
+  gpu_allocation* atlas;
+  VkImageView atlas_view;
+  VkSampler sampler;
+  uint32_t num_pages;
+  // Knows what the atlas was last used for, so the barriers before a
+  // write or the frame's sampling are only as big as they need to be,
+  // and frames that don't touch the atlas get none.
+  barrier_batch barriers;
+
+  VkDescriptorSetLayout set_layout;
+  VkPipelineLayout layout;
+  VkDescriptorPool descriptor_pool;
+  VkDescriptorSet descriptor_set;
+  // Indexed by blend_mode. The pipelines are looked up every frame, since
+  // the manager swaps quick linked ones for optimized ones as they finish.
+  pipeline_manager* pipelines;
+  graphics_pipeline_state pipeline_states[3];
+
+  // Reset by whoever reads them.
+  uint32_t num_sprites;
+  uint32_t num_draws;
+};
+
+//
+// SPRITE BATCH ROUTINES
+//
+
+// Packs a color the way sprites take it, 8 bits a channel.
+inline uint32_t pack_sprite_color(uint8_t r, uint8_t g, uint8_t b, uint8_t a) {
+  return (uint32_t)r | ((uint32_t)g << 8) | ((uint32_t)b << 16) | ((uint32_t)a << 24);
+}
+
+// target gives the render pass, subpass, color format and sample count
+// the sprites will be drawn in; the rest of it is ignored. vertex_shader
+// and fragment_shader are sprite.vert and sprite.frag. The pipelines are
+// queued for compiling here; a frame drawn before they're done gets quick
+// linked ones, or without libraries waits for them.
+void create_sprite_batch(
+  VkDevice device,
+  memory_allocator* allocator,
+  const memory_budget_tracker* budget,
+  layout_cache* layouts,
+  pipeline_manager* pipelines,
+  VkShaderModule vertex_shader,
+  VkShaderModule fragment_shader,
+  const graphics_pipeline_state& target,
+  uint32_t capacity,
+  uint32_t num_pages,
+  uint32_t frames_in_flight,
+  sprite_batch* batch
+);
+// Nothing the batch recorded may still be in flight.
+void destroy_sprite_batch(sprite_batch* batch);
+
+// Copies regions of src into the atlas, each into the page given by its
+// imageSubresource.baseArrayLayer. Must be outside of a render pass. The
+// sprites see it from the next prepare_sprite_batch on.
+void write_sprite_atlas(
+  sprite_batch* batch,
+  VkCommandBuffer cmd,
+  VkBuffer src,
+  const std::vector<VkBufferImageCopy>& regions
+);
+
+// Clears num_pages pages from first_page to color, for texels no write
+// will cover. Must be outside of a render pass.
+void clear_sprite_atlas(
+  sprite_batch* batch,
+  VkCommandBuffer cmd,
+  uint32_t first_page,
+  uint32_t num_pages,
+  const VkClearColorValue& color
+);
+
+// Starts collecting a frame's sprites. Call once the frame's fence says
+// the GPU is done with the last frame that used this index.
+void begin_sprite_batch(sprite_batch* batch, uint32_t frame_index);
+
+// Adds a sprite to the frame. Throws if the batch is full.
+void draw_sprite(sprite_batch* batch, const sprite& s);
+
+// Sorts the frame's sprites, writes them for the GPU and works out the
+// draws. Must be outside of a render pass, since on the staged upload
+// path it records a copy.
+void prepare_sprite_batch(sprite_batch* batch, VkCommandBuffer cmd);
+
+// Draws the prepared sprites, inside the render pass the batch was made
+// for, into a target of the given size. Sets the viewport and scissor to
+// cover all of it.
+void render_sprite_batch(
+  sprite_batch* batch,
+  VkCommandBuffer cmd,
+  uint32_t width,
+  uint32_t height
+);
+
+// Sets profiler counters with the sprites and draws since the last call,
+// and resets them.
+void publish_sprite_stats(sprite_batch* batch, gpu_profiler* profiler);
+
+#endif
@@ -0,0 +1,191 @@
+#include "static_commands.h"
+
+#include <stdexcept>
+#include <algorithm>
+
+using namespace std;
+
+void create_command_cache(
+  VkDevice device,
+  uint32_t queue_family,
+  uint32_t frames_in_flight,
+  command_cache* cache
+) {
+  VkCommandPoolCreateInfo pool_info{};
+
+  cache->device = device;
+  cache->frames_in_flight = frames_in_flight;
+  cache->entries.clear();
+  cache->num_recorded = 0;
+  cache->num_reused = 0;
+
+  // Each command buffer is reset on its own when it's rerecorded.
+  pool_info.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+  pool_info.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
+  pool_info.queueFamilyIndex = queue_family;
+
+  if (vkCreateCommandPool(device, &pool_info, NULL, &(cache->command_pool)) != VK_SUCCESS) {
+    throw runtime_error("failed to create command cache pool!");
+  }
+}
+
+void destroy_command_cache(command_cache* cache) {
+  while (!cache->entries.empty()) {
+    destroy_static_commands(cache, cache->entries.back());
+  }
+
+  vkDestroyCommandPool(cache->device, cache->command_pool, NULL);
+}
+
+static_commands* create_static_commands(
+  command_cache* cache,
+  VkCommandBufferLevel level,
+  record_commands_callback record,
+  void* user_data,
+  const vector<const uint64_t*>& inputs,
+  const VkCommandBufferInheritanceInfo* inheritance
+) {
+  static_commands* commands;
+  VkCommandBufferAllocateInfo alloc_info{};
+  vector<VkCommandBuffer> buffers(cache->frames_in_flight);
+
+  if (inputs.size() > MAX_STATIC_COMMAND_INPUTS) {
+    throw runtime_error("too many inputs for static commands!");
+  }
+
+  if (level == VK_COMMAND_BUFFER_LEVEL_SECONDARY && inheritance == NULL) {
+    throw runtime_error("secondary static commands need inheritance info!");
+  }
+
+  alloc_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+  alloc_info.commandPool = cache->command_pool;
+  alloc_info.level = level;
+  alloc_info.commandBufferCount = cache->frames_in_flight;
+
+  if (vkAllocateCommandBuffers(cache->device, &alloc_info, buffers.data()) != VK_SUCCESS) {
+    throw runtime_error("failed to allocate static command buffers!");
+  }
+
+  commands = new static_commands{};
+  commands->level = level;
+  commands->record = record;
+  commands->user_data = user_data;
+  commands->num_inputs = (uint32_t)inputs.size();
+  commands->inheritance = {};
+
+  for (uint32_t i = 0; i < commands->num_inputs; i++) {
+    commands->inputs[i] = inputs[i];
+  }
+
+  if (level == VK_COMMAND_BUFFER_LEVEL_SECONDARY) {
+    set_static_commands_inheritance(commands, inheritance);
+  }
+
+  commands->copies.resize(cache->frames_in_flight);
+  for (uint32_t i = 0; i < cache->frames_in_flight; i++) {
+    commands->copies[i] = {};
+    commands->copies[i].cmd = buffers[i];
+  }
+
+  cache->entries.push_back(commands);
+
+  return commands;
+}
+
+void destroy_static_commands(command_cache* cache, static_commands* commands) {
+  for (static_command_copy& copy : commands->copies) {
+    vkFreeCommandBuffers(cache->device, cache->command_pool, 1, &(copy.cmd));
+  }
+
+  cache->entries.erase(find(cache->entries.begin(), cache->entries.end(), commands));
+  delete commands;
+}
+
+void set_static_commands_inheritance(
+  static_commands* commands,
+  const VkCommandBufferInheritanceInfo* inheritance
+) {
+  // Extension structs aren't copied, so they can't come along.
+  commands->inheritance = *inheritance;
+  commands->inheritance.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_INFO;
+  commands->inheritance.pNext = NULL;
+
+  invalidate_static_commands(commands);
+}
+
+void invalidate_static_commands(static_commands* commands) {
+  for (static_command_copy& copy : commands->copies) {
+    copy.recorded = false;
+  }
+}
+
+// Returns true if copy was recorded against the inputs as they are now.
+static bool is_current(const static_commands* commands, const static_command_copy* copy) {
+  if (!copy->recorded) {
+    return false;
+  }
+
+  for (uint32_t i = 0; i < commands->num_inputs; i++) {
+    if (copy->generations[i] != *(commands->inputs[i])) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+VkCommandBuffer get_static_commands(
+  command_cache* cache,
+  static_commands* commands,
+  uint32_t frame_index
+) {
+  static_command_copy* copy;
+  VkCommandBufferBeginInfo begin_info{};
+
+  copy = &(commands->copies[frame_index % cache->frames_in_flight]);
+
+  if (is_current(commands, copy)) {
+    cache->num_reused++;
+    return copy->cmd;
+  }
+
+  vkResetCommandBuffer(copy->cmd, 0);
+
+  // No ONE_TIME_SUBMIT: the point is to submit it again and again.
+  begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+
+  if (commands->level == VK_COMMAND_BUFFER_LEVEL_SECONDARY) {
+    begin_info.pInheritanceInfo = &(commands->inheritance);
+
+    if (commands->inheritance.renderPass != VK_NULL_HANDLE) {
+      begin_info.flags |= VK_COMMAND_BUFFER_USAGE_RENDER_PASS_CONTINUE_BIT;
+    }
+  }
+
+  if (vkBeginCommandBuffer(copy->cmd, &begin_info) != VK_SUCCESS) {
+    throw runtime_error("failed to begin static command buffer!");
+  }
+
+  commands->record(copy->cmd, commands->user_data);
+
+  if (vkEndCommandBuffer(copy->cmd) != VK_SUCCESS) {
+    throw runtime_error("failed to record static command buffer!");
+  }
+
+  for (uint32_t i = 0; i < commands->num_inputs; i++) {
+    copy->generations[i] = *(commands->inputs[i]);
+  }
+  copy->recorded = true;
+
+  cache->num_recorded++;
+
+  return copy->cmd;
+}
+
+void publish_command_cache_stats(command_cache* cache, gpu_profiler* profiler) {
+  set_profiler_counter(profiler, "static_commands_recorded", cache->num_recorded);
+  set_profiler_counter(profiler, "static_commands_reused", cache->num_reused);
+
+  cache->num_recorded = 0;
+  cache->num_reused = 0;
+}
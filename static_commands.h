@@ -0,0 +1,132 @@
+#ifndef STATIC_COMMANDS_H
+#define STATIC_COMMANDS_H
+
+#define GLFW_INCLUDE_VULKAN
+
+#include <GLFW/glfw3.h>
+#include <cstdint>
+#include <vector>
+
+#include "gpu_profiler.h"
+
+//
+// Some work is the same every frame: a UI that hasn't changed, a pass
+// over static geometry, a kiosk screen that only changes when someone
+// touches it. Recording it again every frame costs CPU for nothing, since
+// a command buffer can be submitted (or executed from another) as many
+// times as we like.
+//
+// A static command buffer is recorded by a callback, and depends on some
+// inputs, each with a generation counter that its owner bumps whenever it
+// changes (a new vertex buffer, a new UI layout, a recreated
+// framebuffer...). When asked for the command buffer, we compare the
+// counters with the ones it was recorded against, and only call the
+// callback again if one moved.
+//
+// A command buffer can't be rerecorded while a frame that uses it is
+// still running, so each static command buffer keeps a copy per frame in
+// flight, and a change is recorded into each copy when its frame comes
+// around. Secondary command buffers are executed from the frame's primary
+// with vkCmdExecuteCommands; primaries are submitted as they are.
+//
+// A command cache isn't thread safe. Threads that record should each have
+// their own.
+//
+
+// Records the commands into cmd, which is already begun and is ended
+// afterwards.
+typedef void (*record_commands_callback)(VkCommandBuffer cmd, void* user_data);
+
+// The most inputs a static command buffer can depend on.
+const uint32_t MAX_STATIC_COMMAND_INPUTS = 8;
+
+struct static_command_copy {
+  VkCommandBuffer cmd;
+  // The inputs' generations when cmd was recorded.
+  uint64_t generations[MAX_STATIC_COMMAND_INPUTS];
+  bool recorded;
+};
+
+struct static_commands {
+  VkCommandBufferLevel level;
+  record_commands_callback record;
+  void* user_data;
+
+  const uint64_t* inputs[MAX_STATIC_COMMAND_INPUTS];
+  uint32_t num_inputs;
+
+  // Only for secondaries. The render pass and framebuffer they're
+  // executed in; a change of either needs set_static_commands_inheritance.
+  VkCommandBufferInheritanceInfo inheritance;
+
+  std::vector<static_command_copy> copies;
+};
+
+struct command_cache {
+  VkDevice device;
+  VkCommandPool command_pool;
+  uint32_t frames_in_flight;
+
+  std::vector<static_commands*> entries;
+
+  // Reset by whoever reads them.
+  uint32_t num_recorded;
+  uint32_t num_reused;
+};
+
+//
+// COMMAND CACHE ROUTINES
+//
+
+// queue_family is the family the command buffers will be submitted to.
+void create_command_cache(
+  VkDevice device,
+  uint32_t queue_family,
+  uint32_t frames_in_flight,
+  command_cache* cache
+);
+// None of the command buffers may be in flight.
+void destroy_command_cache(command_cache* cache);
+
+// inputs are the generation counters the commands depend on, which must
+// outlive them. inheritance is required for secondaries and ignored for
+// primaries. Nothing is recorded until the first get_static_commands.
+static_commands* create_static_commands(
+  command_cache* cache,
+  VkCommandBufferLevel level,
+  record_commands_callback record,
+  void* user_data,
+  const std::vector<const uint64_t*>& inputs,
+  const VkCommandBufferInheritanceInfo* inheritance
+);
+// None of its command buffers may be in flight.
+void destroy_static_commands(command_cache* cache, static_commands* commands);
+
+// Marks an input as changed.
+inline void bump_generation(uint64_t* generation) {
+  (*generation)++;
+}
+
+// For secondaries, when the render pass or framebuffer they're executed
+// in changes. Rerecords every copy.
+void set_static_commands_inheritance(
+  static_commands* commands,
+  const VkCommandBufferInheritanceInfo* inheritance
+);
+// Rerecords every copy, whatever the inputs say.
+void invalidate_static_commands(static_commands* commands);
+
+// Returns the command buffer for this frame, rerecording it first if any
+// input changed since it was recorded. The frame's previous submission
+// must be done.
+VkCommandBuffer get_static_commands(
+  command_cache* cache,
+  static_commands* commands,
+  uint32_t frame_index
+);
+
+// Sets profiler counters with the recorded and reused counts, and resets
+// them.
+void publish_command_cache_stats(command_cache* cache, gpu_profiler* profiler);
+
+#endif
@@ -0,0 +1,228 @@
+#include "submission_thread.h"
+
+#include <stdexcept>
+
+using namespace std;
+
+// Keeps the worse of the stored result and this one: out of date, then
+// suboptimal, then success.
+static void record_present_result(submission_thread* submission, VkResult result) {
+  int32_t current;
+
+  current = submission->present_result.load();
+
+  while (current != VK_ERROR_OUT_OF_DATE_KHR &&
+         (result == VK_ERROR_OUT_OF_DATE_KHR || current == VK_SUCCESS)) {
+    if (submission->present_result.compare_exchange_weak(current, result)) {
+      break;
+    }
+  }
+}
+
+static void submit_frame(submission_thread* submission, const recorded_frame& frame) {
+  queue_submission queued{};
+  VkPresentInfoKHR present_info{};
+  VkResult result;
+
+  for (uint32_t i = 0; i < frame.num_command_buffers; i++) {
+    queued.command_buffers[i] = frame.command_buffers[i];
+  }
+  queued.num_command_buffers = frame.num_command_buffers;
+
+  if (frame.wait_semaphore != VK_NULL_HANDLE) {
+    queued.wait_semaphores[0] = frame.wait_semaphore;
+    queued.wait_stages[0] = frame.wait_stage;
+    queued.num_wait_semaphores = 1;
+  }
+
+  if (frame.signal_semaphore != VK_NULL_HANDLE) {
+    queued.signal_semaphores[0] = frame.signal_semaphore;
+    queued.signal_stages[0] = VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT;
+    queued.num_signal_semaphores = 1;
+  }
+
+  queued.fence = frame.fence;
+
+  // The other queues go first, so the frame can wait on their work.
+  for (uint32_t i = 0; i < submission->num_queues; i++) {
+    if (submission->queues[i] != submission->graphics_queue) {
+      flush_queue(submission->queues[i]);
+    }
+  }
+
+  if (queued.num_command_buffers > 0 ||
+      queued.num_wait_semaphores > 0 ||
+      queued.num_signal_semaphores > 0 ||
+      queued.fence != VK_NULL_HANDLE) {
+    submit_to_queue(submission->graphics_queue, queued);
+  }
+
+  flush_queue(submission->graphics_queue);
+
+  if (frame.swapchain == VK_NULL_HANDLE) {
+    return;
+  }
+
+  present_info.sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR;
+  present_info.swapchainCount = 1;
+  present_info.pSwapchains = &(frame.swapchain);
+  present_info.pImageIndices = &(frame.image_index);
+
+  if (frame.signal_semaphore != VK_NULL_HANDLE) {
+    present_info.waitSemaphoreCount = 1;
+    present_info.pWaitSemaphores = &(frame.signal_semaphore);
+  }
+
+  // This is the call that can block.
+  result = present_on_queue(submission->present_queue, &present_info);
+
+  if (result != VK_SUCCESS && result != VK_SUBOPTIMAL_KHR && result != VK_ERROR_OUT_OF_DATE_KHR) {
+    throw runtime_error("failed to present frame!");
+  }
+
+  record_present_result(submission, result);
+  submission->num_presented++;
+}
+
+static void submission_thread_main(submission_thread* submission) {
+  recorded_frame frame;
+
+  for (;;) {
+    {
+      unique_lock<mutex> lock(submission->mutex);
+
+      submission->frame_queued.wait(lock, [submission] {
+        return submission->pending > 0 || submission->quit;
+      });
+
+      // Only quit once everything queued is out.
+      if (submission->pending == 0) {
+        return;
+      }
+    }
+
+    spsc_pop(&(submission->frames), &frame);
+
+    // Once a submit has failed, the frames after it are dropped; the
+    // main thread will find out the next time it queues one.
+    if (!submission->error) {
+      try {
+        submit_frame(submission, frame);
+      } catch (...) {
+        lock_guard<mutex> lock(submission->mutex);
+        submission->error = current_exception();
+      }
+    }
+
+    {
+      lock_guard<mutex> lock(submission->mutex);
+      submission->pending--;
+    }
+
+    submission->frame_done.notify_all();
+  }
+}
+
+void create_submission_thread(
+  shared_queue* graphics_queue,
+  shared_queue* present_queue,
+  shared_queue* queues,
+  uint32_t num_queues,
+  uint32_t depth,
+  submission_thread* submission
+) {
+  size_t capacity;
+
+  if (depth == 0 || depth > MAX_SUBMISSION_DEPTH) {
+    throw runtime_error("submission queue depth out of range!");
+  }
+
+  if (num_queues > MAX_SUBMISSION_QUEUES) {
+    throw runtime_error("too many queues for the submission thread!");
+  }
+
+  submission->graphics_queue = graphics_queue;
+  submission->present_queue = present_queue;
+  submission->num_queues = num_queues;
+
+  for (uint32_t i = 0; i < num_queues; i++) {
+    submission->queues[i] = &(queues[i]);
+  }
+
+  submission->depth = depth;
+  submission->pending = 0;
+  submission->quit = false;
+  submission->error = nullptr;
+  submission->present_result = VK_SUCCESS;
+  submission->num_presented = 0;
+
+  // The ring needs a power of two; pending is what holds it to depth.
+  capacity = 1;
+  while (capacity < depth) {
+    capacity *= 2;
+  }
+
+  create_spsc_queue(capacity, &(submission->frames));
+
+  submission->thread = thread(submission_thread_main, submission);
+}
+
+void destroy_submission_thread(submission_thread* submission) {
+  {
+    lock_guard<mutex> lock(submission->mutex);
+    submission->quit = true;
+  }
+
+  submission->frame_queued.notify_one();
+  submission->thread.join();
+}
+
+void queue_frame(submission_thread* submission, const recorded_frame& frame) {
+  if (frame.num_command_buffers > MAX_FRAME_COMMAND_BUFFERS) {
+    throw runtime_error("too many command buffers in frame!");
+  }
+
+  {
+    unique_lock<mutex> lock(submission->mutex);
+
+    submission->frame_done.wait(lock, [submission] {
+      return submission->pending < submission->depth || submission->error;
+    });
+
+    if (submission->error) {
+      rethrow_exception(submission->error);
+    }
+  }
+
+  // There's room, and only this thread pushes, so this can't fail.
+  spsc_push(&(submission->frames), frame);
+
+  {
+    lock_guard<mutex> lock(submission->mutex);
+    submission->pending++;
+  }
+
+  submission->frame_queued.notify_one();
+}
+
+void queue_flush(submission_thread* submission) {
+  recorded_frame frame{};
+
+  queue_frame(submission, frame);
+}
+
+void wait_submission_idle(submission_thread* submission) {
+  unique_lock<mutex> lock(submission->mutex);
+
+  submission->frame_done.wait(lock, [submission] {
+    return submission->pending == 0;
+  });
+
+  if (submission->error) {
+    rethrow_exception(submission->error);
+  }
+}
+
+VkResult take_present_result(submission_thread* submission) {
+  return (VkResult)submission->present_result.exchange(VK_SUCCESS);
+}
@@ -0,0 +1,132 @@
+#ifndef SUBMISSION_THREAD_H
+#define SUBMISSION_THREAD_H
+
+#define GLFW_INCLUDE_VULKAN
+
+#include <GLFW/glfw3.h>
+#include <cstdint>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+
+#include "work_queue.h"
+#include "shared_queue.h"
+
+//
+// vkQueueSubmit can take a while, and vkQueuePresentKHR can block for
+// however long the driver likes (waiting for vblank, for a free image, for
+// the compositor...). If the thread running the simulation makes those
+// calls, every stall in them is a stall in the simulation.
+//
+// So once a frame is recorded, the main thread hands it to the submission
+// thread and gets on with the next one. The submission thread submits and
+// presents frames in order, so frame N goes to the GPU while frame N + 1
+// is simulated and recorded.
+//
+// The queue between them is bounded. A deeper queue keeps the GPU fed
+// through uneven frames, but every queued frame is a frame of latency
+// between input and the screen, so the depth is up to the caller. When
+// the queue is full, queueing a frame waits for the submission thread.
+//
+// The frame's submission goes through the graphics shared queue, and the
+// submission thread is what flushes it, so anything other threads have
+// submitted to it goes out in the same call. It flushes every other
+// shared queue along with each frame too, first, so the frame can wait
+// on what was submitted to them. Nothing else needs to flush, and the
+// main thread never takes a queue's lock.
+//
+
+// The most frames that can be waiting on the submission thread.
+const uint32_t MAX_SUBMISSION_DEPTH = 8;
+// The most command buffers in one frame.
+const uint32_t MAX_FRAME_COMMAND_BUFFERS = 8;
+
+// The most shared queues the thread flushes.
+const uint32_t MAX_SUBMISSION_QUEUES = 4;
+
+// Everything needed to submit and present one recorded frame. One with
+// nothing in it just flushes the queues.
+struct recorded_frame {
+  VkCommandBuffer command_buffers[MAX_FRAME_COMMAND_BUFFERS];
+  uint32_t num_command_buffers;
+
+  // Optional. Usually the swapchain image's acquire semaphore.
+  VkSemaphore wait_semaphore;
+  VkPipelineStageFlags2 wait_stage;
+  // Optional, but needed to present. Signaled when rendering is done.
+  VkSemaphore signal_semaphore;
+  // Optional. Signaled when the command buffers are done.
+  VkFence fence;
+
+  // The image to present once rendering is done. The frame isn't
+  // presented if swapchain is VK_NULL_HANDLE.
+  VkSwapchainKHR swapchain;
+  uint32_t image_index;
+};
+
+struct submission_thread {
+  shared_queue* graphics_queue;
+  shared_queue* present_queue;
+  // Every shared queue, graphics and present included.
+  shared_queue* queues[MAX_SUBMISSION_QUEUES];
+  uint32_t num_queues;
+  uint32_t depth;
+
+  spsc_queue<recorded_frame> frames;
+  std::thread thread;
+
+  // Only for sleeping and waking; the frames themselves go through the
+  // queue. pending counts frames queued but not yet submitted and
+  // presented.
+  std::mutex mutex;
+  std::condition_variable frame_queued;
+  std::condition_variable frame_done;
+  uint32_t pending;
+  bool quit;
+
+  // Set if a submit failed. Rethrown on the main thread.
+  std::exception_ptr error;
+  // The worst present result since the last take_present_result.
+  std::atomic<int32_t> present_result;
+  std::atomic<uint64_t> num_presented;
+};
+
+//
+// SUBMISSION THREAD ROUTINES
+//
+
+// graphics_queue and present_queue may be the same queue. queues is
+// every shared queue, graphics_queue and present_queue among them. depth
+// is how many frames can be queued at once, between 1 and
+// MAX_SUBMISSION_DEPTH.
+void create_submission_thread(
+  shared_queue* graphics_queue,
+  shared_queue* present_queue,
+  shared_queue* queues,
+  uint32_t num_queues,
+  uint32_t depth,
+  submission_thread* submission
+);
+// Submits and presents whatever is still queued, then stops the thread.
+void destroy_submission_thread(submission_thread* submission);
+
+// Hands a frame to the submission thread, waiting if the queue is full.
+// Rethrows the error if an earlier submit failed.
+void queue_frame(submission_thread* submission, const recorded_frame& frame);
+
+// Queues a frame with nothing in it, so whatever has been submitted to
+// the shared queues goes out, for frames that don't render.
+void queue_flush(submission_thread* submission);
+
+// Waits until every queued frame has been submitted and presented, for
+// example before recreating the swapchain.
+void wait_submission_idle(submission_thread* submission);
+
+// Returns the worst vkQueuePresentKHR result since the last call:
+// VK_ERROR_OUT_OF_DATE_KHR or VK_SUBOPTIMAL_KHR mean the swapchain
+// should be recreated. Resets it to VK_SUCCESS.
+VkResult take_present_result(submission_thread* submission);
+
+#endif
@@ -0,0 +1,323 @@
+#include "swap_chain.h"
+
+#include <stdexcept>
+#include <algorithm>
+#include <limits>
+
+using namespace std;
+
+// A format and color space pair worth asking for, and what it means.
+struct surface_format_candidate {
+  VkFormat format;
+  VkColorSpaceKHR color_space;
+  display_encoding encoding;
+};
+
+// In order of preference. The first two are the packed 10:10:10:2
+// formats, in either channel order.
+const surface_format_candidate HDR_CANDIDATES[] = {
+  { VK_FORMAT_A2B10G10R10_UNORM_PACK32, VK_COLOR_SPACE_HDR10_ST2084_EXT, DISPLAY_HDR10 },
+  { VK_FORMAT_A2R10G10B10_UNORM_PACK32, VK_COLOR_SPACE_HDR10_ST2084_EXT, DISPLAY_HDR10 },
+  { VK_FORMAT_R16G16B16A16_SFLOAT, VK_COLOR_SPACE_EXTENDED_SRGB_LINEAR_EXT, DISPLAY_SCRGB },
+};
+
+// Every UNORM one first, since the chain encodes those itself. The _SRGB
+// ones come last and need linear output.
+const surface_format_candidate SDR_CANDIDATES[] = {
+  { VK_FORMAT_B8G8R8A8_UNORM, VK_COLOR_SPACE_SRGB_NONLINEAR_KHR, DISPLAY_SDR },
+  { VK_FORMAT_R8G8B8A8_UNORM, VK_COLOR_SPACE_SRGB_NONLINEAR_KHR, DISPLAY_SDR },
+  { VK_FORMAT_A8B8G8R8_UNORM_PACK32, VK_COLOR_SPACE_SRGB_NONLINEAR_KHR, DISPLAY_SDR },
+  { VK_FORMAT_A2B10G10R10_UNORM_PACK32, VK_COLOR_SPACE_SRGB_NONLINEAR_KHR, DISPLAY_SDR },
+  { VK_FORMAT_A2R10G10B10_UNORM_PACK32, VK_COLOR_SPACE_SRGB_NONLINEAR_KHR, DISPLAY_SDR },
+  { VK_FORMAT_B8G8R8A8_SRGB, VK_COLOR_SPACE_SRGB_NONLINEAR_KHR, DISPLAY_SDR_LINEAR },
+  { VK_FORMAT_R8G8B8A8_SRGB, VK_COLOR_SPACE_SRGB_NONLINEAR_KHR, DISPLAY_SDR_LINEAR },
+  { VK_FORMAT_A8B8G8R8_SRGB_PACK32, VK_COLOR_SPACE_SRGB_NONLINEAR_KHR, DISPLAY_SDR_LINEAR },
+};
+
+const uint32_t NUM_HDR_CANDIDATES = sizeof(HDR_CANDIDATES) / sizeof(HDR_CANDIDATES[0]);
+const uint32_t NUM_SDR_CANDIDATES = sizeof(SDR_CANDIDATES) / sizeof(SDR_CANDIDATES[0]);
+
+static bool find_candidate(
+  const vector<VkSurfaceFormatKHR>& formats,
+  const surface_format_candidate* candidates,
+  uint32_t num_candidates,
+  VkSurfaceFormatKHR* chosen,
+  display_encoding* encoding
+) {
+  for (uint32_t i = 0; i < num_candidates; i++) {
+    for (const VkSurfaceFormatKHR& format : formats) {
+      if (format.format == candidates[i].format && format.colorSpace == candidates[i].color_space) {
+        *chosen = format;
+        *encoding = candidates[i].encoding;
+        return true;
+      }
+    }
+  }
+
+  return false;
+}
+
+VkSurfaceFormatKHR choose_surface_format(
+  const vector<VkSurfaceFormatKHR>& formats,
+  bool allow_hdr,
+  display_encoding* encoding
+) {
+  VkSurfaceFormatKHR chosen{};
+
+  if (formats.empty()) {
+    throw runtime_error("surface has no formats!");
+  }
+
+  *encoding = DISPLAY_SDR;
+
+  // Early drivers said "anything you like" with a single UNDEFINED.
+  if (formats.size() == 1 && formats[0].format == VK_FORMAT_UNDEFINED) {
+    chosen.format = VK_FORMAT_B8G8R8A8_UNORM;
+    chosen.colorSpace = VK_COLOR_SPACE_SRGB_NONLINEAR_KHR;
+    return chosen;
+  }
+
+  if (allow_hdr && find_candidate(formats, HDR_CANDIDATES, NUM_HDR_CANDIDATES, &chosen, encoding)) {
+    return chosen;
+  }
+
+  if (find_candidate(formats, SDR_CANDIDATES, NUM_SDR_CANDIDATES, &chosen, encoding)) {
+    return chosen;
+  }
+
+  // Nothing we know. The candidates cover every _SRGB format a surface
+  // offers in practice, so this is almost certainly a UNORM one.
+  return formats[0];
+}
+
+static VkExtent2D choose_extent(
+  const VkSurfaceCapabilitiesKHR& capabilities,
+  uint32_t width,
+  uint32_t height
+) {
+  VkExtent2D extent;
+
+  // Otherwise the surface is the window's size, and that's that.
+  if (capabilities.currentExtent.width != numeric_limits<uint32_t>::max()) {
+    return capabilities.currentExtent;
+  }
+
+  extent.width = clamp(width, capabilities.minImageExtent.width, capabilities.maxImageExtent.width);
+  extent.height = clamp(height, capabilities.minImageExtent.height, capabilities.maxImageExtent.height);
+
+  return extent;
+}
+
+static void create_views(swap_chain* chain) {
+  VkImageViewCreateInfo view_info{};
+  uint32_t num_images;
+
+  num_images = 0;
+  vkGetSwapchainImagesKHR(chain->device, chain->swapchain, &num_images, NULL);
+
+  chain->images.resize(num_images);
+  vkGetSwapchainImagesKHR(chain->device, chain->swapchain, &num_images, chain->images.data());
+
+  chain->views.resize(num_images);
+
+  view_info.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+  view_info.viewType = VK_IMAGE_VIEW_TYPE_2D;
+  view_info.format = chain->surface_format.format;
+  view_info.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+  view_info.subresourceRange.levelCount = 1;
+  view_info.subresourceRange.layerCount = 1;
+
+  for (uint32_t i = 0; i < num_images; i++) {
+    view_info.image = chain->images[i];
+
+    if (vkCreateImageView(chain->device, &view_info, NULL, &(chain->views[i])) != VK_SUCCESS) {
+      throw runtime_error("failed to create swap chain image view!");
+    }
+  }
+}
+
+static void destroy_views(swap_chain* chain) {
+  for (VkImageView view : chain->views) {
+    vkDestroyImageView(chain->device, view, NULL);
+  }
+
+  chain->views.clear();
+  chain->images.clear();
+}
+
+// Builds the swap chain for the surface as it is now, handing the old one
+// (if any) to the driver so it can reuse what it can.
+static void build_swap_chain(swap_chain* chain, uint32_t width, uint32_t height) {
+  VkSurfaceCapabilitiesKHR capabilities;
+  vector<VkSurfaceFormatKHR> formats;
+  uint32_t num_formats;
+  VkSwapchainCreateInfoKHR create_info{};
+  VkSwapchainKHR old_swapchain;
+
+  vkGetPhysicalDeviceSurfaceCapabilitiesKHR(chain->physical_device, chain->surface, &capabilities);
+
+  num_formats = 0;
+  vkGetPhysicalDeviceSurfaceFormatsKHR(chain->physical_device, chain->surface, &num_formats, NULL);
+  formats.resize(num_formats);
+  vkGetPhysicalDeviceSurfaceFormatsKHR(chain->physical_device, chain->surface, &num_formats, formats.data());
+
+  chain->surface_format = choose_surface_format(formats, chain->allow_hdr, &(chain->encoding));
+  chain->extent = choose_extent(capabilities, width, height);
+
+  create_info.sType = VK_STRUCTURE_TYPE_SWAPCHAIN_CREATE_INFO_KHR;
+  create_info.surface = chain->surface;
+  // One more than the least, so we never wait on the driver to give one
+  // back; maxImageCount is 0 when there's no limit.
+  create_info.minImageCount = capabilities.minImageCount + 1;
+  if (capabilities.maxImageCount != 0) {
+    create_info.minImageCount = min(create_info.minImageCount, capabilities.maxImageCount);
+  }
+  create_info.imageFormat = chain->surface_format.format;
+  create_info.imageColorSpace = chain->surface_format.colorSpace;
+  create_info.imageExtent = chain->extent;
+  create_info.imageArrayLayers = 1;
+  // Transfers for blit_to_swap_chain. Every desktop and mobile driver
+  // allows them, though the spec only promises color attachments.
+  if (!(capabilities.supportedUsageFlags & VK_IMAGE_USAGE_TRANSFER_DST_BIT)) {
+    throw runtime_error("swap chain images can't be blitted to!");
+  }
+  create_info.imageUsage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT;
+
+  if (chain->queue_families[0] != chain->queue_families[1]) {
+    create_info.imageSharingMode = VK_SHARING_MODE_CONCURRENT;
+    create_info.queueFamilyIndexCount = 2;
+    create_info.pQueueFamilyIndices = chain->queue_families;
+  } else {
+    create_info.imageSharingMode = VK_SHARING_MODE_EXCLUSIVE;
+  }
+
+  create_info.preTransform = capabilities.currentTransform;
+  create_info.compositeAlpha = VK_COMPOSITE_ALPHA_OPAQUE_BIT_KHR;
+  // The only mode every surface has, and it never tears.
+  create_info.presentMode = VK_PRESENT_MODE_FIFO_KHR;
+  create_info.clipped = VK_TRUE;
+  create_info.oldSwapchain = chain->swapchain;
+
+  old_swapchain = chain->swapchain;
+
+  if (vkCreateSwapchainKHR(chain->device, &create_info, NULL, &(chain->swapchain)) != VK_SUCCESS) {
+    throw runtime_error("failed to create swap chain!");
+  }
+
+  if (old_swapchain != VK_NULL_HANDLE) {
+    vkDestroySwapchainKHR(chain->device, old_swapchain, NULL);
+  }
+
+  create_views(chain);
+}
+
+void create_swap_chain(
+  VkPhysicalDevice physical_device,
+  VkDevice device,
+  VkSurfaceKHR surface,
+  uint32_t graphics_family,
+  uint32_t present_family,
+  bool allow_hdr,
+  uint32_t width,
+  uint32_t height,
+  swap_chain* chain
+) {
+  chain->physical_device = physical_device;
+  chain->device = device;
+  chain->surface = surface;
+  chain->queue_families[0] = graphics_family;
+  chain->queue_families[1] = present_family;
+  chain->allow_hdr = allow_hdr;
+  chain->swapchain = VK_NULL_HANDLE;
+
+  build_swap_chain(chain, width, height);
+}
+
+void destroy_swap_chain(swap_chain* chain) {
+  destroy_views(chain);
+  vkDestroySwapchainKHR(chain->device, chain->swapchain, NULL);
+  chain->swapchain = VK_NULL_HANDLE;
+}
+
+void recreate_swap_chain(swap_chain* chain, uint32_t width, uint32_t height) {
+  destroy_views(chain);
+  build_swap_chain(chain, width, height);
+}
+
+void blit_to_swap_chain(
+  swap_chain* chain,
+  VkCommandBuffer cmd,
+  uint32_t image_index,
+  VkImage source,
+  VkImageLayout source_layout,
+  uint32_t width,
+  uint32_t height
+) {
+  VkImageMemoryBarrier barrier{};
+  VkImageBlit region{};
+
+  // Whatever the image held before can go.
+  barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+  barrier.srcAccessMask = 0;
+  barrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+  barrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+  barrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+  barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+  barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+  barrier.image = chain->images[image_index];
+  barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+  barrier.subresourceRange.levelCount = 1;
+  barrier.subresourceRange.layerCount = 1;
+
+  vkCmdPipelineBarrier(
+    cmd,
+    VK_PIPELINE_STAGE_TRANSFER_BIT,
+    VK_PIPELINE_STAGE_TRANSFER_BIT,
+    0,
+    0,
+    NULL,
+    0,
+    NULL,
+    1,
+    &barrier
+  );
+
+  region.srcSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+  region.srcSubresource.layerCount = 1;
+  region.srcOffsets[1] = { (int32_t)width, (int32_t)height, 1 };
+  region.dstSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+  region.dstSubresource.layerCount = 1;
+  region.dstOffsets[1] = { (int32_t)chain->extent.width, (int32_t)chain->extent.height, 1 };
+
+  // Same size is a straight copy; linear only matters when scaling.
+  vkCmdBlitImage(
+    cmd,
+    source,
+    source_layout,
+    chain->images[image_index],
+    VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+    1,
+    &region,
+    VK_FILTER_LINEAR
+  );
+
+  // Presentation waits on a semaphore, which makes the write visible; the
+  // barrier only has to change the layout.
+  barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+  barrier.dstAccessMask = 0;
+  barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+  barrier.newLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
+
+  vkCmdPipelineBarrier(
+    cmd,
+    VK_PIPELINE_STAGE_TRANSFER_BIT,
+    VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
+    0,
+    0,
+    NULL,
+    0,
+    NULL,
+    1,
+    &barrier
+  );
+}
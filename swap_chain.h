@@ -0,0 +1,116 @@
+#ifndef SWAP_CHAIN_H
+#define SWAP_CHAIN_H
+
+#define GLFW_INCLUDE_VULKAN
+
+#include <GLFW/glfw3.h>
+#include <cstdint>
+#include <vector>
+
+//
+// The swap chain is the set of images the surface shows, and its format
+// and color space decide what the display gets: 8 bit sRGB, which every
+// display takes, or HDR. The surface lists the pairs it accepts, and the
+// HDR ones only show up when the instance has VK_EXT_swapchain_colorspace
+// (see get_required_extensions in application.cpp).
+//
+// choose_surface_format takes the first of these the surface offers:
+//
+//   1. HDR10: 10:10:10:2 in Rec. 2020, PQ encoded. HDR in 32 bits a
+//      pixel, the same as 8 bit sRGB, so scanout and composition cost no
+//      more bandwidth than SDR.
+//   2. scRGB: half floats, linear Rec. 709 that goes past 1 for HDR. Twice
+//      the bandwidth of HDR10, so only when HDR10 isn't offered.
+//   3. UNORM, sRGB nonlinear: 8 bit, then 10 bit. UNORM rather than
+//      _SRGB because the post processing chain encodes sRGB itself (see
+//      post_process.h).
+//   4. 8 bit _SRGB, sRGB nonlinear, for surfaces with no UNORM format.
+//      The hardware encodes on write, so the chain has to output linear
+//      colors instead (DISPLAY_SDR_LINEAR), or they'd be encoded twice.
+//
+// The encoding it picks is what the post processing chain tonemaps for.
+// The chain writes an image of its own, since swap chain images aren't
+// guaranteed to allow storage and their channel order varies, and
+// blit_to_swap_chain copies it in, swizzling as it goes.
+//
+
+// How the colors in a swap chain image are encoded. Matches the
+// DISPLAY_ constants in shaders/post_common.glsl.
+enum display_encoding : uint32_t {
+  // sRGB nonlinear, 0 to 1.
+  DISPLAY_SDR,
+  // PQ encoded nits in Rec. 2020 primaries (SMPTE ST 2084).
+  DISPLAY_HDR10,
+  // Linear Rec. 709, with 1 being 80 nits.
+  DISPLAY_SCRGB,
+  // sRGB nonlinear through an _SRGB format, which encodes on write, so
+  // linear 0 to 1.
+  DISPLAY_SDR_LINEAR,
+};
+
+struct swap_chain {
+  VkPhysicalDevice physical_device;
+  VkDevice device;
+  VkSurfaceKHR surface;
+  // The graphics and present queue families, which may be the same.
+  uint32_t queue_families[2];
+  // False to keep to SDR even on surfaces that offer HDR.
+  bool allow_hdr;
+
+  VkSwapchainKHR swapchain;
+  VkSurfaceFormatKHR surface_format;
+  display_encoding encoding;
+  VkExtent2D extent;
+  // One view per image, for rendering into it directly.
+  std::vector<VkImage> images;
+  std::vector<VkImageView> views;
+};
+
+//
+// SWAP CHAIN ROUTINES
+//
+
+// Picks from the formats the surface offers, in the order above, and
+// says how the one it picked is encoded. Falls back to the first one
+// offered, as SDR, if it knows none of them.
+VkSurfaceFormatKHR choose_surface_format(
+  const std::vector<VkSurfaceFormatKHR>& formats,
+  bool allow_hdr,
+  display_encoding* encoding
+);
+
+// width and height are only used when the surface leaves the size to us.
+void create_swap_chain(
+  VkPhysicalDevice physical_device,
+  VkDevice device,
+  VkSurfaceKHR surface,
+  uint32_t graphics_family,
+  uint32_t present_family,
+  bool allow_hdr,
+  uint32_t width,
+  uint32_t height,
+  swap_chain* chain
+);
+// Nothing may still be using the images.
+void destroy_swap_chain(swap_chain* chain);
+
+// For when presenting says the swap chain is out of date, as when the
+// window is resized or moved to a display with different formats. The
+// encoding may change with it. Nothing may still be using the images.
+void recreate_swap_chain(swap_chain* chain, uint32_t width, uint32_t height);
+
+// Records a blit of source (width by height, in source_layout, its writes
+// already visible to transfers) into the swap chain image, scaled to fit,
+// and leaves the image ready to present. The frame has to wait on the
+// image's acquire semaphore at VK_PIPELINE_STAGE_TRANSFER_BIT or earlier.
+void blit_to_swap_chain(
+  swap_chain* chain,
+  VkCommandBuffer cmd,
+  uint32_t image_index,
+  VkImage source,
+  VkImageLayout source_layout,
+  uint32_t width,
+  uint32_t height
+);
+
+#endif
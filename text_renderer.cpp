@@ -0,0 +1,661 @@
+#include "text_renderer.h"
+#include "hash.h"
+
+#include <stdexcept>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+using namespace std;
+
+// Stands in for "no seed anywhere near" in the distance transform.
+const float DISTANCE_INFINITY = 1e20f;
+// Laid out strings are swept for old ones this often, in frames.
+const uint64_t TEXT_RUN_SWEEP_INTERVAL = 60;
+// Left between glyphs in the atlas, so filtering never reads a neighbor.
+const uint32_t GLYPH_GAP = 1;
+
+//
+// DISTANCE FIELDS
+//
+
+// The exact squared distance transform of one row or column (Felzenszwalb
+// and Huttenlocher): d[q] = min over p of (q - p)^2 + f[p]. It's the lower
+// envelope of a parabola rooted at every p, found in linear time. v and z
+// are scratch, n and n + 1 long.
+static void distance_transform_1d(const float* f, float* d, uint32_t n, uint32_t* v, float* z) {
+  uint32_t k;
+  float s;
+
+  k = 0;
+  v[0] = 0;
+  z[0] = -DISTANCE_INFINITY;
+  z[1] = DISTANCE_INFINITY;
+
+  for (uint32_t q = 1; q < n; q++) {
+    for (;;) {
+      s = ((f[q] + (float)(q * q)) - (f[v[k]] + (float)(v[k] * v[k]))) / (2.0f * q - 2.0f * v[k]);
+
+      if (s > z[k] || k == 0) {
+        break;
+      }
+
+      k--;
+    }
+
+    // The first parabola can't be hidden, so when s is below z[0] it
+    // still goes after it.
+    if (s <= z[k]) {
+      v[k] = q;
+      z[k + 1] = DISTANCE_INFINITY;
+      continue;
+    }
+
+    k++;
+    v[k] = q;
+    z[k] = s;
+    z[k + 1] = DISTANCE_INFINITY;
+  }
+
+  k = 0;
+  for (uint32_t q = 0; q < n; q++) {
+    while (z[k + 1] < (float)q) {
+      k++;
+    }
+
+    d[q] = (float)((q - v[k]) * (q - v[k])) + f[v[k]];
+  }
+}
+
+// Turns a grid that is 0 at the seeds and DISTANCE_INFINITY elsewhere into
+// the squared distance to the nearest seed, a column and then a row at a
+// time.
+static void distance_transform(vector<float>* grid, uint32_t width, uint32_t height) {
+  uint32_t n;
+  vector<float> f;
+  vector<float> d;
+  vector<uint32_t> v;
+  vector<float> z;
+
+  n = max(width, height);
+  f.resize(n);
+  d.resize(n);
+  v.resize(n);
+  z.resize(n + 1);
+
+  for (uint32_t x = 0; x < width; x++) {
+    for (uint32_t y = 0; y < height; y++) {
+      f[y] = (*grid)[y * width + x];
+    }
+
+    distance_transform_1d(f.data(), d.data(), height, v.data(), z.data());
+
+    for (uint32_t y = 0; y < height; y++) {
+      (*grid)[y * width + x] = d[y];
+    }
+  }
+
+  for (uint32_t y = 0; y < height; y++) {
+    distance_transform_1d(&(*grid)[y * width], d.data(), width, v.data(), z.data());
+    copy(d.begin(), d.begin() + width, grid->begin() + y * width);
+  }
+}
+
+// Makes the glyph's padded distance field: the distance from each texel
+// to the nearest texel on the other side of the edge, signed so inside is
+// positive, scaled so TEXT_SDF_SPREAD either way covers the whole range.
+static void build_distance_field(const glyph_bitmap& bitmap, glyph_field* field) {
+  uint32_t width;
+  uint32_t height;
+  uint32_t src;
+  vector<bool> inside;
+  vector<float> to_inside;
+  vector<float> to_outside;
+  float distance;
+  float value;
+
+  width = bitmap.width + 2 * TEXT_SDF_SPREAD;
+  height = bitmap.height + 2 * TEXT_SDF_SPREAD;
+
+  inside.assign(width * height, false);
+
+  for (uint32_t y = 0; y < bitmap.height; y++) {
+    for (uint32_t x = 0; x < bitmap.width; x++) {
+      src = y * bitmap.width + x;
+      inside[(y + TEXT_SDF_SPREAD) * width + x + TEXT_SDF_SPREAD] = bitmap.coverage[src] >= 128;
+    }
+  }
+
+  to_inside.resize(width * height);
+  to_outside.resize(width * height);
+
+  for (uint32_t i = 0; i < width * height; i++) {
+    to_inside[i] = inside[i] ? 0.0f : DISTANCE_INFINITY;
+    to_outside[i] = inside[i] ? DISTANCE_INFINITY : 0.0f;
+  }
+
+  distance_transform(&to_inside, width, height);
+  distance_transform(&to_outside, width, height);
+
+  field->width = width;
+  field->height = height;
+  field->x = bitmap.bearing_x - (float)TEXT_SDF_SPREAD;
+  field->y = -bitmap.bearing_y - (float)TEXT_SDF_SPREAD;
+  field->distances.resize(width * height);
+
+  // The edge lies halfway between an inside texel's center and its
+  // outside neighbor's.
+  for (uint32_t i = 0; i < width * height; i++) {
+    if (inside[i]) {
+      distance = sqrtf(to_outside[i]) - 0.5f;
+    } else {
+      distance = 0.5f - sqrtf(to_inside[i]);
+    }
+
+    value = 0.5f + distance / (2.0f * TEXT_SDF_SPREAD);
+    field->distances[i] = (uint8_t)lroundf(min(max(value, 0.0f), 1.0f) * 255.0f);
+  }
+}
+
+//
+// WORKERS
+//
+
+static void make_glyph_field(text_renderer* text, uint32_t codepoint, glyph_field* field) {
+  glyph_bitmap bitmap{};
+
+  field->codepoint = codepoint;
+  field->found = text->rasterize(codepoint, TEXT_GLYPH_SIZE, &bitmap, text->rasterizer_user_data);
+  field->width = 0;
+  field->height = 0;
+
+  if (!field->found) {
+    field->advance = TEXT_GLYPH_SIZE / 2.0f;
+    return;
+  }
+
+  field->advance = bitmap.advance;
+
+  // Spaces and the like have nothing to draw.
+  if (bitmap.width > 0 && bitmap.height > 0) {
+    build_distance_field(bitmap, field);
+  }
+}
+
+static void glyph_worker(text_renderer* text) {
+  unique_lock<mutex> lock(text->mutex);
+  glyph_field field;
+  uint32_t codepoint;
+
+  while (true) {
+    text->request_ready.wait(lock, [text] {
+      return text->shutting_down || !text->requests.empty();
+    });
+
+    if (text->shutting_down) {
+      return;
+    }
+
+    codepoint = text->requests.front();
+    text->requests.pop_front();
+
+    lock.unlock();
+    field = glyph_field();
+    make_glyph_field(text, codepoint, &field);
+    lock.lock();
+
+    text->finished.push_back(move(field));
+  }
+}
+
+void create_text_renderer(
+  sprite_batch* batch,
+  memory_allocator* allocator,
+  uint32_t first_page,
+  uint32_t num_pages,
+  uint32_t frames_in_flight,
+  glyph_rasterizer rasterize,
+  void* rasterizer_user_data,
+  text_renderer* text
+) {
+  uint32_t num_threads;
+
+  if (num_pages == 0 || first_page + num_pages > batch->num_pages) {
+    throw runtime_error("text pages are outside of the sprite atlas!");
+  }
+
+  text->batch = batch;
+  text->allocator = allocator;
+  text->first_page = first_page;
+  text->num_pages = num_pages;
+  text->pack_page = 0;
+  text->pack_x = 0;
+  text->pack_y = 0;
+  text->row_height = 0;
+  text->pages_cleared = false;
+  text->rasterize = rasterize;
+  text->rasterizer_user_data = rasterizer_user_data;
+  text->frame = 0;
+  text->frames_in_flight = frames_in_flight;
+  text->shutting_down = false;
+  text->num_run_hits = 0;
+  text->num_run_misses = 0;
+  text->num_glyphs_added = 0;
+
+  text->staging = allocate_buffer(
+    allocator,
+    TEXT_STAGING_SIZE * frames_in_flight,
+    VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+    MEMORY_STAGING
+  );
+
+  // Leave one core for the main thread.
+  num_threads = thread::hardware_concurrency();
+  num_threads = num_threads > 1 ? num_threads - 1 : 1;
+  num_threads = min(num_threads, MAX_TEXT_THREADS);
+
+  for (uint32_t i = 0; i < num_threads; i++) {
+    text->workers.push_back(thread(glyph_worker, text));
+  }
+}
+
+void destroy_text_renderer(text_renderer* text) {
+  {
+    lock_guard<mutex> lock(text->mutex);
+    text->shutting_down = true;
+  }
+
+  text->request_ready.notify_all();
+
+  for (thread& worker : text->workers) {
+    worker.join();
+  }
+
+  text->workers.clear();
+  text->requests.clear();
+  text->finished.clear();
+
+  free_allocation(text->allocator, text->staging);
+}
+
+//
+// LAYOUT
+//
+
+// Decodes the UTF-8 character at *s and moves past it. Malformed bytes
+// come out as U+FFFD, one at a time.
+static uint32_t next_codepoint(const char** s) {
+  const uint8_t* bytes;
+  uint32_t codepoint;
+  uint32_t length;
+
+  bytes = (const uint8_t*)*s;
+
+  if (bytes[0] < 0x80) {
+    codepoint = bytes[0];
+    length = 1;
+  } else if ((bytes[0] & 0xe0) == 0xc0) {
+    codepoint = bytes[0] & 0x1f;
+    length = 2;
+  } else if ((bytes[0] & 0xf0) == 0xe0) {
+    codepoint = bytes[0] & 0x0f;
+    length = 3;
+  } else if ((bytes[0] & 0xf8) == 0xf0) {
+    codepoint = bytes[0] & 0x07;
+    length = 4;
+  } else {
+    (*s)++;
+    return 0xfffd;
+  }
+
+  for (uint32_t i = 1; i < length; i++) {
+    if ((bytes[i] & 0xc0) != 0x80) {
+      *s += i;
+      return 0xfffd;
+    }
+
+    codepoint = (codepoint << 6) | (bytes[i] & 0x3f);
+  }
+
+  *s += length;
+
+  return codepoint;
+}
+
+// Looks the glyph up, queueing it for the workers the first time it's
+// seen.
+static text_glyph* find_glyph(text_renderer* text, uint32_t codepoint, vector<uint32_t>* requests) {
+  auto found = text->glyphs.find(codepoint);
+
+  if (found != text->glyphs.end()) {
+    return &(found->second);
+  }
+
+  text_glyph& glyph = text->glyphs[codepoint];
+  glyph = {};
+  glyph.status = GLYPH_LOADING;
+  glyph.advance = TEXT_GLYPH_SIZE / 2.0f;
+
+  requests->push_back(codepoint);
+
+  return &glyph;
+}
+
+static void queue_requests(text_renderer* text, const vector<uint32_t>& requests) {
+  if (requests.empty()) {
+    return;
+  }
+
+  {
+    lock_guard<mutex> lock(text->mutex);
+    text->requests.insert(text->requests.end(), requests.begin(), requests.end());
+  }
+
+  text->request_ready.notify_all();
+}
+
+// Places the string's glyphs. Returns false if any of them are still
+// loading, in which case they're left out and the run shouldn't be kept.
+static bool lay_out_run(text_renderer* text, const char* utf8, text_run* run) {
+  vector<uint32_t> requests;
+  text_glyph* glyph;
+  text_quad quad;
+  uint32_t codepoint;
+  float pen_x;
+  float pen_y;
+  bool complete;
+
+  run->text = utf8;
+  run->quads.clear();
+  run->width = 0.0f;
+
+  pen_x = 0.0f;
+  pen_y = 0.0f;
+  complete = true;
+
+  while (*utf8 != '\0') {
+    codepoint = next_codepoint(&utf8);
+
+    if (codepoint == '\n') {
+      pen_x = 0.0f;
+      pen_y += TEXT_LINE_HEIGHT * TEXT_GLYPH_SIZE;
+      continue;
+    }
+
+    glyph = find_glyph(text, codepoint, &requests);
+
+    if (glyph->status == GLYPH_LOADING) {
+      complete = false;
+    } else if (glyph->visible) {
+      quad = glyph->quad;
+      quad.x += pen_x;
+      quad.y += pen_y;
+      run->quads.push_back(quad);
+    }
+
+    pen_x += glyph->advance;
+    run->width = max(run->width, pen_x);
+  }
+
+  queue_requests(text, requests);
+
+  return complete;
+}
+
+void request_glyphs(text_renderer* text, const char* utf8) {
+  vector<uint32_t> requests;
+
+  while (*utf8 != '\0') {
+    find_glyph(text, next_codepoint(&utf8), &requests);
+  }
+
+  queue_requests(text, requests);
+}
+
+static uint64_t hash_string(const char* s) {
+  uint64_t hash;
+
+  hash = HASH_SEED;
+
+  for (; *s != '\0'; s++) {
+    hash_value(&hash, *s);
+  }
+
+  return hash;
+}
+
+float draw_text(
+  text_renderer* text,
+  const char* utf8,
+  float x,
+  float y,
+  float size,
+  uint32_t color,
+  uint8_t layer
+) {
+  uint64_t hash;
+  text_run new_run;
+  const text_run* run;
+  sprite s{};
+  float scale;
+
+  hash = hash_string(utf8);
+  auto found = text->runs.find(hash);
+
+  // Two strings can share a hash, so it's only a hit if the text matches.
+  if (found != text->runs.end() && found->second.text == utf8) {
+    found->second.last_used = text->frame;
+    run = &(found->second);
+    text->num_run_hits++;
+  } else {
+    text->num_run_misses++;
+
+    if (lay_out_run(text, utf8, &new_run)) {
+      new_run.last_used = text->frame;
+      text_run& stored = text->runs[hash];
+      stored = move(new_run);
+      run = &stored;
+    } else {
+      run = &new_run;
+    }
+  }
+
+  scale = size / TEXT_GLYPH_SIZE;
+
+  s.color = color;
+  s.blend = BLEND_ALPHA;
+  s.layer = layer;
+  s.sdf = true;
+
+  for (const text_quad& quad : run->quads) {
+    s.x = x + quad.x * scale;
+    s.y = y + quad.y * scale;
+    s.width = quad.width * scale;
+    s.height = quad.height * scale;
+    s.u0 = quad.u0;
+    s.v0 = quad.v0;
+    s.u1 = quad.u1;
+    s.v1 = quad.v1;
+    s.page = quad.page;
+
+    draw_sprite(text->batch, s);
+  }
+
+  return run->width * scale;
+}
+
+//
+// ATLAS
+//
+
+// Finds room for a width by height field. Returns false once every page
+// is full; glyphs are never evicted, so the pages given to the renderer
+// have to hold every glyph it will see.
+static bool pack_glyph(
+  text_renderer* text,
+  uint32_t width,
+  uint32_t height,
+  uint32_t* page,
+  uint32_t* x,
+  uint32_t* y
+) {
+  width += GLYPH_GAP;
+  height += GLYPH_GAP;
+
+  if (width > SPRITE_ATLAS_SIZE || height > SPRITE_ATLAS_SIZE) {
+    return false;
+  }
+
+  while (text->pack_page < text->num_pages) {
+    if (text->pack_x + width > SPRITE_ATLAS_SIZE) {
+      text->pack_x = 0;
+      text->pack_y += text->row_height;
+      text->row_height = 0;
+    }
+
+    if (text->pack_y + height > SPRITE_ATLAS_SIZE) {
+      text->pack_page++;
+      text->pack_x = 0;
+      text->pack_y = 0;
+      text->row_height = 0;
+      continue;
+    }
+
+    *page = text->first_page + text->pack_page;
+    *x = text->pack_x;
+    *y = text->pack_y;
+
+    text->pack_x += width;
+    text->row_height = max(text->row_height, height);
+
+    return true;
+  }
+
+  return false;
+}
+
+// Writes the field into staging as white with the distance in alpha.
+static void write_glyph_texels(const glyph_field& field, uint8_t* dst) {
+  for (uint32_t i = 0; i < field.width * field.height; i++) {
+    dst[i * 4 + 0] = 255;
+    dst[i * 4 + 1] = 255;
+    dst[i * 4 + 2] = 255;
+    dst[i * 4 + 3] = field.distances[i];
+  }
+}
+
+void update_text_renderer(text_renderer* text, VkCommandBuffer cmd, uint32_t frame_index) {
+  uint8_t* staging;
+  VkDeviceSize staging_offset;
+  VkDeviceSize used;
+  VkDeviceSize bytes;
+  vector<VkBufferImageCopy> regions;
+  VkBufferImageCopy region{};
+  uint32_t num_done;
+  uint32_t page;
+  uint32_t x;
+  uint32_t y;
+
+  {
+    lock_guard<mutex> lock(text->mutex);
+
+    for (glyph_field& field : text->finished) {
+      text->ready.push_back(move(field));
+    }
+
+    text->finished.clear();
+  }
+
+  // Before the first glyph goes in: filtering at a glyph's edge reads
+  // into the gap around it, which should be as far outside as can be.
+  if (!text->pages_cleared) {
+    clear_sprite_atlas(text->batch, cmd, text->first_page, text->num_pages, { { 1.0f, 1.0f, 1.0f, 0.0f } });
+    text->pages_cleared = true;
+  }
+
+  staging_offset = (frame_index % text->frames_in_flight) * TEXT_STAGING_SIZE;
+  staging = text->staging->mapped + staging_offset;
+  used = 0;
+  num_done = 0;
+
+  region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+  region.imageSubresource.layerCount = 1;
+
+  for (const glyph_field& field : text->ready) {
+    text_glyph& glyph = text->glyphs[field.codepoint];
+    bytes = (VkDeviceSize)field.width * field.height * 4;
+
+    // Wait for the next frame's staging, unless it can never fit.
+    if (used + bytes > TEXT_STAGING_SIZE && bytes <= TEXT_STAGING_SIZE) {
+      break;
+    }
+
+    num_done++;
+    glyph.advance = field.advance;
+    glyph.visible = false;
+
+    if (!field.found || bytes > TEXT_STAGING_SIZE) {
+      glyph.status = GLYPH_MISSING;
+      continue;
+    }
+
+    glyph.status = GLYPH_READY;
+
+    if (bytes == 0) {
+      continue;
+    }
+
+    if (!pack_glyph(text, field.width, field.height, &page, &x, &y)) {
+      glyph.status = GLYPH_MISSING;
+      continue;
+    }
+
+    write_glyph_texels(field, staging + used);
+
+    region.bufferOffset = text->staging->offset + staging_offset + used;
+    region.imageSubresource.baseArrayLayer = page;
+    region.imageOffset = { (int32_t)x, (int32_t)y, 0 };
+    region.imageExtent = { field.width, field.height, 1 };
+    regions.push_back(region);
+
+    glyph.visible = true;
+    glyph.quad.x = field.x;
+    glyph.quad.y = field.y;
+    glyph.quad.width = (float)field.width;
+    glyph.quad.height = (float)field.height;
+    glyph.quad.u0 = (float)x / SPRITE_ATLAS_SIZE;
+    glyph.quad.v0 = (float)y / SPRITE_ATLAS_SIZE;
+    glyph.quad.u1 = (float)(x + field.width) / SPRITE_ATLAS_SIZE;
+    glyph.quad.v1 = (float)(y + field.height) / SPRITE_ATLAS_SIZE;
+    glyph.quad.page = page;
+
+    used += bytes;
+    text->num_glyphs_added++;
+  }
+
+  text->ready.erase(text->ready.begin(), text->ready.begin() + num_done);
+
+  write_sprite_atlas(text->batch, cmd, text->staging->buffer, regions);
+
+  if (text->frame % TEXT_RUN_SWEEP_INTERVAL == 0) {
+    for (auto it = text->runs.begin(); it != text->runs.end();) {
+      if (it->second.last_used + TEXT_RUN_LIFETIME < text->frame) {
+        it = text->runs.erase(it);
+      } else {
+        it++;
+      }
+    }
+  }
+
+  text->frame++;
+}
+
+void publish_text_stats(text_renderer* text, gpu_profiler* profiler) {
+  set_profiler_counter(profiler, "text_runs_cached", text->num_run_hits);
+  set_profiler_counter(profiler, "text_runs_laid_out", text->num_run_misses);
+  set_profiler_counter(profiler, "glyphs_added", text->num_glyphs_added);
+
+  text->num_run_hits = 0;
+  text->num_run_misses = 0;
+  text->num_glyphs_added = 0;
+}
@@ -0,0 +1,235 @@
+#ifndef TEXT_RENDERER_H
+#define TEXT_RENDERER_H
+
+#define GLFW_INCLUDE_VULKAN
+
+#include <GLFW/glfw3.h>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <deque>
+#include <unordered_map>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#include "memory_allocator.h"
+#include "sprite_batch.h"
+#include "gpu_profiler.h"
+
+//
+// Labels are the bulk of what an overlay draws, and most of the cost of a
+// label is on the CPU: turning a glyph outline into pixels, and working
+// out where each glyph of a string goes. The text renderer keeps both out
+// of the frame.
+//
+// Each glyph is rasterized once, at TEXT_GLYPH_SIZE pixels, and turned
+// into a signed distance field: every texel holds how far it is from the
+// glyph's edge, 0.5 on the edge and more inside. The sprite shader cuts
+// the field at 0.5 with an edge a pixel wide, so one copy of a glyph
+// stays sharp from small print up to several times its rasterized size.
+// Rasterizing and building the field happen on worker threads; a glyph
+// that isn't ready yet is left out of the text until it is, usually for a
+// frame or two.
+//
+// The fields are packed into a range of pages of a sprite batch's atlas,
+// and the text is drawn as sprites through the batch, so all of it (and
+// the other sprites blended the same way) takes one draw, whichever pages
+// its glyphs are on.
+//
+// Laying out a string (decoding it, looking up each glyph, placing the
+// quads) is cached by the string's hash, so a label that doesn't change
+// only costs a lookup and a copy of its quads into the batch. Strings not
+// drawn for TEXT_RUN_LIFETIME frames are forgotten.
+//
+// Glyphs come from a rasterizer callback, so the renderer works with any
+// font library. The fields are made from coverage bitmaps, not outlines,
+// so they are single channel; corners round off a little when a glyph is
+// drawn much bigger than TEXT_GLYPH_SIZE.
+//
+// A text renderer isn't thread safe, apart from its workers. Only one
+// thread should draw with it.
+//
+
+// The size glyphs are rasterized at, in pixels per em.
+const uint32_t TEXT_GLYPH_SIZE = 32;
+// How far from the edge the distance field reaches, in pixels at
+// TEXT_GLYPH_SIZE. The field is padded this much on every side.
+const uint32_t TEXT_SDF_SPREAD = 4;
+// The distance between baselines, in ems.
+const float TEXT_LINE_HEIGHT = 1.25f;
+// How many frames a laid out string is kept without being drawn.
+const uint64_t TEXT_RUN_LIFETIME = 120;
+// Staging for new glyphs, per frame in flight. Glyphs that don't fit wait
+// for the next frame.
+const VkDeviceSize TEXT_STAGING_SIZE = 1024 * 1024;
+const uint32_t MAX_TEXT_THREADS = 4;
+
+// What a rasterizer gives back for a glyph, in pixels, with y down.
+struct glyph_bitmap {
+  uint32_t width;
+  uint32_t height;
+  // From the pen position on the baseline to the bitmap's top left
+  // corner; bearing_y is positive going up.
+  float bearing_x;
+  float bearing_y;
+  // How far the pen moves after the glyph.
+  float advance;
+  // width * height bytes, 255 for fully covered.
+  std::vector<uint8_t> coverage;
+};
+
+// Rasterizes a glyph at size pixels per em. Returns false if the font has
+// no such glyph. Called from the worker threads, so it must be thread
+// safe.
+typedef bool (*glyph_rasterizer)(
+  uint32_t codepoint,
+  uint32_t size,
+  glyph_bitmap* bitmap,
+  void* user_data
+);
+
+enum glyph_status {
+  GLYPH_LOADING,
+  GLYPH_READY,
+  // Not in the font, or no room left in the atlas. Takes up space but
+  // isn't drawn.
+  GLYPH_MISSING,
+};
+
+// A quad of a glyph's distance field, placed relative to the pen position
+// on the baseline, in pixels at TEXT_GLYPH_SIZE.
+struct text_quad {
+  float x;
+  float y;
+  float width;
+  float height;
+  float u0;
+  float v0;
+  float u1;
+  float v1;
+  uint32_t page;
+};
+
+struct text_glyph {
+  glyph_status status;
+  float advance;
+  // Only for GLYPH_READY glyphs with something to draw.
+  bool visible;
+  text_quad quad;
+};
+
+// A glyph's distance field, made by a worker.
+struct glyph_field {
+  uint32_t codepoint;
+  bool found;
+  float advance;
+  uint32_t width;
+  uint32_t height;
+  float x;
+  float y;
+  // width * height bytes, 128 on the edge.
+  std::vector<uint8_t> distances;
+};
+
+// A laid out string, relative to the start of its first baseline.
+struct text_run {
+  std::string text;
+  std::vector<text_quad> quads;
+  float width;
+  uint64_t last_used;
+};
+
+struct text_renderer {
+  sprite_batch* batch;
+  memory_allocator* allocator;
+
+  // The atlas pages the glyphs go in, and where the next one goes: glyphs
+  // are packed left to right in rows as tall as their tallest glyph.
+  uint32_t first_page;
+  uint32_t num_pages;
+  uint32_t pack_page;
+  uint32_t pack_x;
+  uint32_t pack_y;
+  uint32_t row_height;
+  // Whether the pages have been cleared yet. The gaps between glyphs are
+  // never written, so they have to start out empty.
+  bool pages_cleared;
+
+  glyph_rasterizer rasterize;
+  void* rasterizer_user_data;
+
+  std::unordered_map<uint32_t, text_glyph> glyphs;
+  std::unordered_map<uint64_t, text_run> runs;
+  // Finished fields taken from the workers, waiting for staging room.
+  std::vector<glyph_field> ready;
+  uint64_t frame;
+
+  // Host visible, TEXT_STAGING_SIZE per frame in flight.
+  gpu_allocation* staging;
+  uint32_t frames_in_flight;
+
+  // Guards everything below.
+  std::mutex mutex;
+  std::deque<uint32_t> requests;
+  std::condition_variable request_ready;
+  std::vector<glyph_field> finished;
+  std::vector<std::thread> workers;
+  bool shutting_down;
+
+  // Reset by whoever reads them.
+  uint32_t num_run_hits;
+  uint32_t num_run_misses;
+  uint32_t num_glyphs_added;
+};
+
+//
+// TEXT RENDERER ROUTINES
+//
+
+// The glyphs go in pages first_page to first_page + num_pages - 1 of the
+// batch's atlas, which nothing else should use. Starts the workers.
+void create_text_renderer(
+  sprite_batch* batch,
+  memory_allocator* allocator,
+  uint32_t first_page,
+  uint32_t num_pages,
+  uint32_t frames_in_flight,
+  glyph_rasterizer rasterize,
+  void* rasterizer_user_data,
+  text_renderer* text
+);
+// Stops the workers. Nothing the renderer recorded may still be in
+// flight.
+void destroy_text_renderer(text_renderer* text);
+
+// Starts rasterizing every glyph in the UTF-8 string that hasn't been,
+// so it's ready by the time it's drawn. Good for the digits and the
+// alphabet at startup.
+void request_glyphs(text_renderer* text, const char* utf8);
+
+// Call once a frame, outside of a render pass and before the frame's
+// text is drawn, once the frame's fence says the GPU is done with the
+// last frame that used this index. Copies the glyphs the workers have
+// finished into the atlas, and forgets strings that haven't been drawn
+// in a while.
+void update_text_renderer(text_renderer* text, VkCommandBuffer cmd, uint32_t frame_index);
+
+// Adds a UTF-8 string to the batch, starting at (x, y) on the first line's
+// baseline, size pixels per em. '\n' starts a new line. Returns the width
+// of the widest line, in pixels.
+float draw_text(
+  text_renderer* text,
+  const char* utf8,
+  float x,
+  float y,
+  float size,
+  uint32_t color,
+  uint8_t layer
+);
+
+// Sets profiler counters with the cached and laid out strings and the
+// glyphs added since the last call, and resets them.
+void publish_text_stats(text_renderer* text, gpu_profiler* profiler);
+
+#endif
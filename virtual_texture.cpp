@@ -0,0 +1,837 @@
+#include "virtual_texture.h"
+
+#include <stdexcept>
+#include <algorithm>
+#include <cstring>
+
+using namespace std;
+
+const VkImageUsageFlags VT_IMAGE_USAGE =
+  VK_IMAGE_USAGE_SAMPLED_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT;
+
+bool supports_virtual_texture(VkPhysicalDevice physical_device, VkFormat format) {
+  VkPhysicalDeviceFeatures features;
+  uint32_t num_properties;
+
+  vkGetPhysicalDeviceFeatures(physical_device, &features);
+
+  if (!features.sparseBinding || !features.sparseResidencyImage2D) {
+    return false;
+  }
+
+  // No properties means the format can't be sparse.
+  num_properties = 0;
+  vkGetPhysicalDeviceSparseImageFormatProperties(
+    physical_device,
+    format,
+    VK_IMAGE_TYPE_2D,
+    VK_SAMPLE_COUNT_1_BIT,
+    VT_IMAGE_USAGE,
+    VK_IMAGE_TILING_OPTIMAL,
+    &num_properties,
+    NULL
+  );
+
+  return num_properties > 0;
+}
+
+static void create_image(virtual_texture* vt, uint32_t width, uint32_t height) {
+  VkImageCreateInfo create_info{};
+
+  create_info.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+  create_info.flags = VK_IMAGE_CREATE_SPARSE_BINDING_BIT | VK_IMAGE_CREATE_SPARSE_RESIDENCY_BIT;
+  create_info.imageType = VK_IMAGE_TYPE_2D;
+  create_info.format = vt->format;
+  create_info.extent = { width, height, 1 };
+  create_info.mipLevels = vt->mip_levels;
+  create_info.arrayLayers = 1;
+  create_info.samples = VK_SAMPLE_COUNT_1_BIT;
+  create_info.tiling = VK_IMAGE_TILING_OPTIMAL;
+  create_info.usage = VT_IMAGE_USAGE;
+  create_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+  create_info.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+
+  if (vkCreateImage(vt->device, &create_info, NULL, &(vt->image)) != VK_SUCCESS) {
+    throw runtime_error("failed to create virtual texture image!");
+  }
+}
+
+static void create_sync_objects(virtual_texture* vt, uint32_t graphics_family) {
+  VkCommandPoolCreateInfo pool_info{};
+  VkCommandBufferAllocateInfo alloc_info{};
+  VkSemaphoreCreateInfo semaphore_info{};
+  VkFenceCreateInfo fence_info{};
+
+  pool_info.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+  pool_info.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
+  pool_info.queueFamilyIndex = graphics_family;
+
+  if (vkCreateCommandPool(vt->device, &pool_info, NULL, &(vt->command_pool)) != VK_SUCCESS) {
+    throw runtime_error("failed to create virtual texture command pool!");
+  }
+
+  alloc_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+  alloc_info.commandPool = vt->command_pool;
+  alloc_info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+  alloc_info.commandBufferCount = 1;
+
+  if (vkAllocateCommandBuffers(vt->device, &alloc_info, &(vt->cmd)) != VK_SUCCESS) {
+    throw runtime_error("failed to allocate virtual texture command buffer!");
+  }
+
+  semaphore_info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+
+  if (vkCreateSemaphore(vt->device, &semaphore_info, NULL, &(vt->bind_semaphore)) != VK_SUCCESS) {
+    throw runtime_error("failed to create virtual texture semaphore!");
+  }
+
+  fence_info.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+
+  if (vkCreateFence(vt->device, &fence_info, NULL, &(vt->fence)) != VK_SUCCESS) {
+    throw runtime_error("failed to create virtual texture fence!");
+  }
+}
+
+static VkExtent3D mip_extent(uint32_t width, uint32_t height, uint32_t mip) {
+  return { max(width >> mip, 1u), max(height >> mip, 1u), 1 };
+}
+
+// Allocates and binds the mip tails, which stay resident. Returns the
+// opaque binds, which have to be submitted before the tail is loaded.
+static vector<VkSparseMemoryBind> bind_mip_tails(
+  virtual_texture* vt,
+  const vector<VkSparseImageMemoryRequirements>& sparse_requirements
+) {
+  vector<VkSparseMemoryBind> binds;
+  VkMemoryRequirements requirements;
+  VkSparseMemoryBind bind;
+  gpu_allocation* memory;
+
+  for (const VkSparseImageMemoryRequirements& sparse : sparse_requirements) {
+    if (sparse.imageMipTailFirstLod >= vt->mip_levels || sparse.imageMipTailSize == 0) {
+      continue;
+    }
+
+    requirements = vt->page_requirements;
+    requirements.size = sparse.imageMipTailSize;
+
+    memory = allocate_image_memory(
+      vt->allocator,
+      requirements,
+      VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+      MEMORY_TEXTURES
+    );
+    vt->mip_tail_memory.push_back(memory);
+
+    bind = {};
+    bind.resourceOffset = sparse.imageMipTailOffset;
+    bind.size = sparse.imageMipTailSize;
+    bind.memory = memory->block->memory;
+    bind.memoryOffset = memory->offset;
+
+    // Some formats need memory for metadata (compression and such) as
+    // well as the texels. It has no pages, so it's all tail.
+    if (sparse.formatProperties.aspectMask & VK_IMAGE_ASPECT_METADATA_BIT) {
+      bind.flags = VK_SPARSE_MEMORY_BIND_METADATA_BIT;
+    }
+
+    binds.push_back(bind);
+  }
+
+  return binds;
+}
+
+// Recomputes the current residency map from the page table. The frames'
+// copies pick it up as they come round (see write_residency_map).
+static void update_residency_map(virtual_texture* vt) {
+  uint32_t pages_x;
+  uint32_t pages_y;
+  uint32_t page_x;
+  uint32_t page_y;
+  const vt_page* page;
+  uint8_t lod;
+
+  if (vt->mips.empty()) {
+    vt->residency_map[0] = (uint8_t)vt->mip_tail_first_lod;
+    return;
+  }
+
+  pages_x = vt->mips[0].pages_x;
+  pages_y = vt->mips[0].pages_y;
+
+  for (uint32_t y = 0; y < pages_y; y++) {
+    for (uint32_t x = 0; x < pages_x; x++) {
+      lod = (uint8_t)vt->mip_tail_first_lod;
+
+      // Each mip down covers twice as much of mip 0 per page.
+      for (uint32_t mip = 0; mip < vt->mips.size(); mip++) {
+        page_x = min(x >> mip, vt->mips[mip].pages_x - 1);
+        page_y = min(y >> mip, vt->mips[mip].pages_y - 1);
+        page = &vt->mips[mip].pages[page_y * vt->mips[mip].pages_x + page_x];
+
+        if (page->memory != NULL && !page->loading) {
+          lod = (uint8_t)mip;
+          break;
+        }
+      }
+
+      vt->residency_map[y * pages_x + x] = lod;
+    }
+  }
+}
+
+// Moves the image to GENERAL and loads the mip tail, waiting for it all.
+static void load_mip_tail(virtual_texture* vt, uint32_t width, uint32_t height) {
+  VkCommandBufferBeginInfo begin_info{};
+  VkImageMemoryBarrier barrier{};
+  vector<VkBufferImageCopy> regions;
+  VkBufferImageCopy region;
+  VkExtent3D extent;
+  VkDeviceSize offset;
+  queue_submission submission{};
+
+  begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+  begin_info.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+  vkBeginCommandBuffer(vt->cmd, &begin_info);
+
+  barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+  barrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+  barrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+  barrier.newLayout = VK_IMAGE_LAYOUT_GENERAL;
+  barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+  barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+  barrier.image = vt->image;
+  barrier.subresourceRange = { VK_IMAGE_ASPECT_COLOR_BIT, 0, vt->mip_levels, 0, 1 };
+
+  vkCmdPipelineBarrier(
+    vt->cmd,
+    VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+    VK_PIPELINE_STAGE_TRANSFER_BIT,
+    0,
+    0, NULL,
+    0, NULL,
+    1, &barrier
+  );
+
+  offset = 0;
+
+  for (uint32_t mip = vt->mip_tail_first_lod; mip < vt->mip_levels; mip++) {
+    extent = mip_extent(width, height, mip);
+
+    if (offset + extent.width * extent.height * vt->bytes_per_texel > vt->staging->size) {
+      throw runtime_error("virtual texture mip tail doesn't fit in staging!");
+    }
+
+    vt->loader(mip, 0, 0, extent.width, extent.height, vt->staging->mapped + offset, vt->loader_user_data);
+
+    region = {};
+    region.bufferOffset = vt->staging->offset + offset;
+    region.imageSubresource = { VK_IMAGE_ASPECT_COLOR_BIT, mip, 0, 1 };
+    region.imageExtent = extent;
+    regions.push_back(region);
+
+    offset += extent.width * extent.height * vt->bytes_per_texel;
+  }
+
+  if (!regions.empty()) {
+    vkCmdCopyBufferToImage(
+      vt->cmd,
+      vt->staging->buffer,
+      vt->image,
+      VK_IMAGE_LAYOUT_GENERAL,
+      (uint32_t)regions.size(),
+      regions.data()
+    );
+  }
+
+  vkEndCommandBuffer(vt->cmd);
+
+  submission.wait_semaphores[0] = vt->bind_semaphore;
+  submission.wait_stages[0] = VK_PIPELINE_STAGE_2_TRANSFER_BIT;
+  submission.num_wait_semaphores = 1;
+  submission.command_buffers[0] = vt->cmd;
+  submission.num_command_buffers = 1;
+  submission.fence = vt->fence;
+
+  // Waited on right away, so it can't wait for the frame's flush.
+  submit_to_queue(vt->graphics_queue, submission);
+  flush_queue(vt->graphics_queue);
+
+  vkWaitForFences(vt->device, 1, &(vt->fence), VK_TRUE, UINT64_MAX);
+  vkResetFences(vt->device, 1, &(vt->fence));
+}
+
+// The budget tracker's eviction callback. Lowers the page limit by enough
+// pages to cover bytes_wanted, if the pages are in heap. The pages
+// themselves go in the next updates, once no frame in flight can sample
+// them.
+static VkDeviceSize evict_virtual_texture_pages(
+  uint32_t heap,
+  VkDeviceSize bytes_wanted,
+  void* user_data
+) {
+  virtual_texture* vt;
+  const gpu_allocation* memory;
+  uint32_t page_heap;
+  uint32_t num_pages;
+
+  vt = (virtual_texture*)user_data;
+  memory = NULL;
+
+  for (const vt_mip& mip : vt->mips) {
+    for (const vt_page& page : mip.pages) {
+      if (page.memory != NULL) {
+        memory = page.memory;
+        break;
+      }
+    }
+
+    if (memory != NULL) {
+      break;
+    }
+  }
+
+  // With no pages resident there's nothing to give back.
+  if (memory == NULL) {
+    return 0;
+  }
+
+  page_heap = vt->allocator->memory_properties.memoryTypes[memory->block->memory_type].heapIndex;
+
+  if (page_heap != heap) {
+    return 0;
+  }
+
+  num_pages = (uint32_t)min(
+    (bytes_wanted + vt->page_requirements.size - 1) / vt->page_requirements.size,
+    (VkDeviceSize)vt->page_limit
+  );
+  vt->page_limit -= num_pages;
+
+  return num_pages * vt->page_requirements.size;
+}
+
+void create_virtual_texture(
+  VkPhysicalDevice physical_device,
+  VkDevice device,
+  memory_allocator* allocator,
+  memory_budget_tracker* budget,
+  shared_queue* sparse_queue,
+  shared_queue* graphics_queue,
+  uint32_t graphics_family,
+  uint32_t frames_in_flight,
+  VkFormat format,
+  uint32_t bytes_per_texel,
+  uint32_t width,
+  uint32_t height,
+  uint32_t mip_levels,
+  uint32_t max_resident_pages,
+  vt_page_loader loader,
+  void* loader_user_data,
+  virtual_texture* vt
+) {
+  uint32_t num_sparse_requirements;
+  vector<VkSparseImageMemoryRequirements> sparse_requirements;
+  const VkSparseImageMemoryRequirements* color;
+  vector<VkSparseMemoryBind> tail_binds;
+  VkSparseImageOpaqueMemoryBindInfo opaque_info{};
+  VkBindSparseInfo bind_info{};
+  VkDeviceSize tail_bytes;
+  VkExtent3D extent;
+  vt_mip mip;
+
+  if (!supports_virtual_texture(physical_device, format)) {
+    throw runtime_error("device doesn't support sparse residency for the format!");
+  }
+
+  *vt = {};
+  vt->device = device;
+  vt->allocator = allocator;
+  vt->budget = budget;
+  vt->sparse_queue = sparse_queue;
+  vt->graphics_queue = graphics_queue;
+  vt->frames_in_flight = frames_in_flight;
+  vt->format = format;
+  vt->bytes_per_texel = bytes_per_texel;
+  vt->mip_levels = mip_levels;
+  vt->max_resident_pages = max_resident_pages;
+  vt->page_limit = max_resident_pages;
+  vt->loader = loader;
+  vt->loader_user_data = loader_user_data;
+
+  create_image(vt, width, height);
+
+  //
+  // The image's memory requirements give the page size (as the alignment)
+  // and the memory types; its sparse requirements give the page extent in
+  // texels and where the mip tail starts.
+  //
+
+  vkGetImageMemoryRequirements(device, vt->image, &(vt->page_requirements));
+  vt->page_requirements.size = vt->page_requirements.alignment;
+
+  vkGetImageSparseMemoryRequirements(device, vt->image, &num_sparse_requirements, NULL);
+  sparse_requirements.resize(num_sparse_requirements);
+  vkGetImageSparseMemoryRequirements(
+    device,
+    vt->image,
+    &num_sparse_requirements,
+    sparse_requirements.data()
+  );
+
+  color = NULL;
+  for (const VkSparseImageMemoryRequirements& sparse : sparse_requirements) {
+    if (sparse.formatProperties.aspectMask & VK_IMAGE_ASPECT_COLOR_BIT) {
+      color = &sparse;
+    }
+  }
+
+  if (color == NULL) {
+    throw runtime_error("virtual texture has no color sparse requirements!");
+  }
+
+  vt->page_extent = color->formatProperties.imageGranularity;
+  vt->mip_tail_first_lod = min(color->imageMipTailFirstLod, mip_levels);
+  vt->page_bytes = (VkDeviceSize)vt->page_extent.width * vt->page_extent.height * bytes_per_texel;
+
+  //
+  // Set up the page table for the mips before the tail.
+  //
+
+  for (uint32_t level = 0; level < vt->mip_tail_first_lod; level++) {
+    extent = mip_extent(width, height, level);
+
+    mip = {};
+    mip.width = extent.width;
+    mip.height = extent.height;
+    mip.pages_x = (extent.width + vt->page_extent.width - 1) / vt->page_extent.width;
+    mip.pages_y = (extent.height + vt->page_extent.height - 1) / vt->page_extent.height;
+    mip.pages.resize(mip.pages_x * mip.pages_y);
+
+    vt->mips.push_back(mip);
+  }
+
+  //
+  // Staging has to hold a full update's pages, or the whole mip tail,
+  // whichever is bigger.
+  //
+
+  tail_bytes = 0;
+  for (uint32_t level = vt->mip_tail_first_lod; level < mip_levels; level++) {
+    extent = mip_extent(width, height, level);
+    tail_bytes += (VkDeviceSize)extent.width * extent.height * bytes_per_texel;
+  }
+
+  vt->staging = allocate_buffer(
+    allocator,
+    max(vt->page_bytes * VT_MAX_PAGES_PER_UPDATE, tail_bytes),
+    VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+    MEMORY_STAGING
+  );
+
+  vt->residency_map.resize(vt->mips.empty() ? 1 : vt->mips[0].pages_x * vt->mips[0].pages_y);
+  update_residency_map(vt);
+
+  for (uint32_t i = 0; i < frames_in_flight; i++) {
+    vt->residency.push_back(allocate_buffer(
+      allocator,
+      vt->residency_map.size(),
+      VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+      MEMORY_TEXTURES
+    ));
+    memcpy(vt->residency[i]->mapped, vt->residency_map.data(), vt->residency_map.size());
+  }
+
+  create_sync_objects(vt, graphics_family);
+
+  //
+  // Bind the mip tail, then load it once the bind is done.
+  //
+
+  tail_binds = bind_mip_tails(vt, sparse_requirements);
+
+  opaque_info.image = vt->image;
+  opaque_info.bindCount = (uint32_t)tail_binds.size();
+  opaque_info.pBinds = tail_binds.data();
+
+  bind_info.sType = VK_STRUCTURE_TYPE_BIND_SPARSE_INFO;
+  bind_info.imageOpaqueBindCount = tail_binds.empty() ? 0 : 1;
+  bind_info.pImageOpaqueBinds = &opaque_info;
+  bind_info.signalSemaphoreCount = 1;
+  bind_info.pSignalSemaphores = &(vt->bind_semaphore);
+
+  bind_sparse_on_queue(sparse_queue, &bind_info, VK_NULL_HANDLE);
+
+  load_mip_tail(vt, width, height);
+
+  add_eviction_handler(budget, MEMORY_TEXTURES, evict_virtual_texture_pages, vt);
+}
+
+void destroy_virtual_texture(virtual_texture* vt) {
+  remove_eviction_handler(vt->budget, evict_virtual_texture_pages, vt);
+
+  if (vt->updating) {
+    flush_queue(vt->graphics_queue);
+    vkWaitForFences(vt->device, 1, &(vt->fence), VK_TRUE, UINT64_MAX);
+  }
+
+  for (gpu_allocation* memory : vt->evicted) {
+    free_allocation(vt->allocator, memory);
+  }
+
+  // The image goes with its binds, so these needn't be unbound first.
+  for (const vt_unbind& unbind : vt->unbinds) {
+    free_allocation(vt->allocator, unbind.memory);
+  }
+
+  for (vt_mip& mip : vt->mips) {
+    for (vt_page& page : mip.pages) {
+      if (page.memory != NULL) {
+        free_allocation(vt->allocator, page.memory);
+      }
+    }
+  }
+
+  for (gpu_allocation* memory : vt->mip_tail_memory) {
+    free_allocation(vt->allocator, memory);
+  }
+
+  for (gpu_allocation* residency : vt->residency) {
+    free_allocation(vt->allocator, residency);
+  }
+  free_allocation(vt->allocator, vt->staging);
+
+  vkDestroyImage(vt->device, vt->image, NULL);
+  vkDestroyFence(vt->device, vt->fence, NULL);
+  vkDestroySemaphore(vt->device, vt->bind_semaphore, NULL);
+  vkDestroyCommandPool(vt->device, vt->command_pool, NULL);
+}
+
+void request_virtual_texture_page(
+  virtual_texture* vt,
+  uint32_t mip,
+  uint32_t x,
+  uint32_t y,
+  uint64_t frame
+) {
+  vt_mip* level;
+  vt_page* page;
+
+  // The mip tail is always resident.
+  if (mip >= vt->mips.size()) {
+    return;
+  }
+
+  level = &vt->mips[mip];
+  page = &level->pages[
+    min(y / vt->page_extent.height, level->pages_y - 1) * level->pages_x +
+    min(x / vt->page_extent.width, level->pages_x - 1)
+  ];
+
+  page->last_used = frame;
+  page->requested = true;
+}
+
+// The image bind for a page, with memory or, to unbind it, without.
+static VkSparseImageMemoryBind page_bind(
+  const virtual_texture* vt,
+  uint32_t mip,
+  uint32_t index,
+  const gpu_allocation* memory
+) {
+  const vt_mip& level = vt->mips[mip];
+  VkSparseImageMemoryBind bind{};
+  uint32_t x;
+  uint32_t y;
+
+  x = (index % level.pages_x) * vt->page_extent.width;
+  y = (index / level.pages_x) * vt->page_extent.height;
+
+  bind.subresource = { VK_IMAGE_ASPECT_COLOR_BIT, mip, 0 };
+  bind.offset = { (int32_t)x, (int32_t)y, 0 };
+  // Pages on the right and bottom edges may hang off the image.
+  bind.extent = {
+    min(vt->page_extent.width, level.width - x),
+    min(vt->page_extent.height, level.height - y),
+    1
+  };
+
+  if (memory != NULL) {
+    bind.memory = memory->block->memory;
+    bind.memoryOffset = memory->offset;
+  }
+
+  return bind;
+}
+
+struct page_ref {
+  uint32_t mip;
+  uint32_t index;
+  vt_page* page;
+};
+
+// The binds and copies are done, so the loaded pages can be used and the
+// unbound memory reused.
+static void finish_update(virtual_texture* vt) {
+  for (vt_page* page : vt->loading) {
+    page->loading = false;
+  }
+
+  for (gpu_allocation* memory : vt->evicted) {
+    free_allocation(vt->allocator, memory);
+  }
+
+  vt->loading.clear();
+  vt->evicted.clear();
+  vt->updating = false;
+  vkResetFences(vt->device, 1, &(vt->fence));
+
+  update_residency_map(vt);
+}
+
+// Copies the current residency map into the frame's. The last frame to
+// read that copy was frames_in_flight frames ago, and it's done by now.
+static void write_residency_map(virtual_texture* vt, uint64_t frame) {
+  memcpy(
+    vt->residency[frame % vt->frames_in_flight]->mapped,
+    vt->residency_map.data(),
+    vt->residency_map.size()
+  );
+}
+
+gpu_allocation* get_virtual_texture_residency(const virtual_texture* vt, uint64_t frame) {
+  return vt->residency[frame % vt->frames_in_flight];
+}
+
+void update_virtual_texture(virtual_texture* vt, uint64_t frame) {
+  vector<page_ref> wanted;
+  vector<page_ref> unused;
+  vector<VkSparseImageMemoryBind> binds;
+  vector<VkBufferImageCopy> regions;
+  VkBufferImageCopy region;
+  VkSparseImageMemoryBindInfo image_info{};
+  VkBindSparseInfo bind_info{};
+  VkCommandBufferBeginInfo begin_info{};
+  VkImageMemoryBarrier barrier{};
+  queue_submission submission{};
+  size_t num_unbind;
+  size_t num_evict;
+  size_t num_load;
+  size_t room;
+  size_t short_by;
+  size_t over_limit;
+  VkSparseImageMemoryBind bind;
+
+  write_residency_map(vt, frame);
+
+  // Never wait on the last update; if it isn't done, try next frame.
+  if (vt->updating) {
+    if (vkGetFenceStatus(vt->device, vt->fence) != VK_SUCCESS) {
+      return;
+    }
+
+    finish_update(vt);
+  }
+
+  //
+  // Find the pages that were asked for lately and aren't resident, and
+  // the resident ones no frame in flight has asked for. Pages still
+  // waiting to be unbound are left out of both; they can be loaded again
+  // once they are.
+  //
+
+  for (uint32_t mip = 0; mip < vt->mips.size(); mip++) {
+    for (uint32_t i = 0; i < vt->mips[mip].pages.size(); i++) {
+      vt_page* page = &vt->mips[mip].pages[i];
+
+      if (page->unbinding) {
+        continue;
+      }
+
+      if (page->memory == NULL && page->requested && page->last_used + vt->frames_in_flight >= frame) {
+        wanted.push_back({ mip, i, page });
+      } else if (page->memory != NULL && page->last_used + vt->frames_in_flight < frame) {
+        unused.push_back({ mip, i, page });
+      }
+    }
+  }
+
+  //
+  // Unbind the pages evicted frames_in_flight frames ago. Every frame that
+  // could have seen them in its residency map is done with them now. Their
+  // memory is freed once the bind is done.
+  //
+
+  num_unbind = 0;
+  for (const vt_unbind& unbind : vt->unbinds) {
+    if (unbind.frame > frame) {
+      break;
+    }
+
+    binds.push_back(page_bind(vt, unbind.mip, unbind.index, NULL));
+    vt->evicted.push_back(unbind.memory);
+    vt->mips[unbind.mip].pages[unbind.index].unbinding = false;
+    vt->num_resident_pages--;
+    num_unbind++;
+  }
+  vt->unbinds.erase(vt->unbinds.begin(), vt->unbinds.begin() + num_unbind);
+
+  // Coarse mips first: they cover more of the screen, and a fine page is
+  // no use until the one above it can be fallen back to.
+  sort(wanted.begin(), wanted.end(), [](const page_ref& a, const page_ref& b) {
+    return a.mip != b.mip ? a.mip > b.mip : a.page->last_used > b.page->last_used;
+  });
+  sort(unused.begin(), unused.end(), [](const page_ref& a, const page_ref& b) {
+    return a.page->last_used < b.page->last_used;
+  });
+
+  // The limit recovers a page at a time after memory pressure cut it.
+  if (vt->page_limit < vt->max_resident_pages) {
+    vt->page_limit++;
+  }
+
+  // Load what fits in the limit now; evicted pages keep their memory
+  // until they're unbound, so they still count against it. If that's
+  // fewer than we want, evict the least recently used pages to make room
+  // for later updates, less whatever's already on its way out. Pages over
+  // the limit go too, though only ones no frame in flight asked for.
+  room = vt->page_limit - min(vt->num_resident_pages, vt->page_limit);
+  num_load = min(wanted.size(), (size_t)VT_MAX_PAGES_PER_UPDATE);
+  short_by = num_load - min(num_load, room);
+  num_load -= short_by;
+  over_limit = vt->num_resident_pages - min((size_t)vt->num_resident_pages, vt->page_limit + vt->unbinds.size());
+  num_evict = min(max(short_by - min(short_by, vt->unbinds.size()), over_limit), unused.size());
+
+  // Evicted pages leave the map right away, so frames from the next on
+  // don't sample them.
+  for (size_t i = 0; i < num_evict; i++) {
+    vt->unbinds.push_back({
+      unused[i].mip,
+      unused[i].index,
+      unused[i].page->memory,
+      frame + vt->frames_in_flight
+    });
+    unused[i].page->memory = NULL;
+    unused[i].page->unbinding = true;
+  }
+
+  if (num_evict > 0) {
+    update_residency_map(vt);
+  }
+
+  if (num_load == 0 && binds.empty()) {
+    return;
+  }
+
+  //
+  // Bind memory for the new pages and fill them in.
+  //
+
+  for (size_t i = 0; i < num_load; i++) {
+    vt_page* page = wanted[i].page;
+
+    page->memory = allocate_image_memory(
+      vt->allocator,
+      vt->page_requirements,
+      VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+      MEMORY_TEXTURES
+    );
+    page->loading = true;
+    vt->loading.push_back(page);
+    vt->num_resident_pages++;
+
+    bind = page_bind(vt, wanted[i].mip, wanted[i].index, page->memory);
+    binds.push_back(bind);
+
+    vt->loader(
+      wanted[i].mip,
+      (uint32_t)bind.offset.x,
+      (uint32_t)bind.offset.y,
+      bind.extent.width,
+      bind.extent.height,
+      vt->staging->mapped + i * vt->page_bytes,
+      vt->loader_user_data
+    );
+
+    region = {};
+    region.bufferOffset = vt->staging->offset + i * vt->page_bytes;
+    region.imageSubresource = { VK_IMAGE_ASPECT_COLOR_BIT, wanted[i].mip, 0, 1 };
+    region.imageOffset = bind.offset;
+    region.imageExtent = bind.extent;
+    regions.push_back(region);
+  }
+
+  image_info.image = vt->image;
+  image_info.bindCount = (uint32_t)binds.size();
+  image_info.pBinds = binds.data();
+
+  bind_info.sType = VK_STRUCTURE_TYPE_BIND_SPARSE_INFO;
+  bind_info.imageBindCount = 1;
+  bind_info.pImageBinds = &image_info;
+
+  // With nothing to copy, the bind signals the fence itself.
+  if (regions.empty()) {
+    bind_sparse_on_queue(vt->sparse_queue, &bind_info, vt->fence);
+    vt->updating = true;
+    return;
+  }
+
+  bind_info.signalSemaphoreCount = 1;
+  bind_info.pSignalSemaphores = &(vt->bind_semaphore);
+
+  bind_sparse_on_queue(vt->sparse_queue, &bind_info, VK_NULL_HANDLE);
+
+  //
+  // Copy the pages in once they're bound, and make the copies visible to
+  // the shaders of later frames.
+  //
+
+  vkResetCommandBuffer(vt->cmd, 0);
+
+  begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+  begin_info.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+  vkBeginCommandBuffer(vt->cmd, &begin_info);
+
+  vkCmdCopyBufferToImage(
+    vt->cmd,
+    vt->staging->buffer,
+    vt->image,
+    VK_IMAGE_LAYOUT_GENERAL,
+    (uint32_t)regions.size(),
+    regions.data()
+  );
+
+  barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+  barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+  barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+  barrier.oldLayout = VK_IMAGE_LAYOUT_GENERAL;
+  barrier.newLayout = VK_IMAGE_LAYOUT_GENERAL;
+  barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+  barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+  barrier.image = vt->image;
+  barrier.subresourceRange = { VK_IMAGE_ASPECT_COLOR_BIT, 0, vt->mip_levels, 0, 1 };
+
+  vkCmdPipelineBarrier(
+    vt->cmd,
+    VK_PIPELINE_STAGE_TRANSFER_BIT,
+    VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT,
+    0,
+    0, NULL,
+    0, NULL,
+    1, &barrier
+  );
+
+  vkEndCommandBuffer(vt->cmd);
+
+  submission.wait_semaphores[0] = vt->bind_semaphore;
+  submission.wait_stages[0] = VK_PIPELINE_STAGE_2_TRANSFER_BIT;
+  submission.num_wait_semaphores = 1;
+  submission.command_buffers[0] = vt->cmd;
+  submission.num_command_buffers = 1;
+  submission.fence = vt->fence;
+
+  // Goes out with the frame's flush.
+  submit_to_queue(vt->graphics_queue, submission);
+
+  vt->updating = true;
+}
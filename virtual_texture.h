@@ -0,0 +1,201 @@
+#ifndef VIRTUAL_TEXTURE_H
+#define VIRTUAL_TEXTURE_H
+
+#define GLFW_INCLUDE_VULKAN
+
+#include <GLFW/glfw3.h>
+#include <cstdint>
+#include <vector>
+
+#include "memory_allocator.h"
+#include "memory_budget.h"
+#include "shared_queue.h"
+
+//
+// A 32k x 32k terrain or satellite texture takes 4 GiB at full detail, but
+// only the few pages the camera can see are ever needed at once. With
+// sparse residency (sparseResidencyImage2D), an image can be created
+// without memory, and memory can be bound to it a page (usually 64 KiB) at
+// a time, through vkQueueBindSparse on a queue with sparse binding.
+//
+// The virtual texture keeps a page table of which pages of which mip
+// levels have memory. The renderer requests the pages it needs (usually
+// from a feedback pass that writes out which pages were sampled), and
+// each update binds memory for a handful of them, fills them in from the
+// page loader, and unbinds the ones that haven't been used for the
+// longest once we're over budget.
+//
+// The smallest mips (the mip tail) can't be split into pages, so they're
+// bound and loaded up front and always resident. Shaders sampling a page
+// that isn't resident would read zeros, so they clamp their level of
+// detail with the residency map: one byte per page of mip 0, holding the
+// finest resident mip covering that page.
+//
+// Frames in flight may still be sampling a page when it's evicted, so
+// there's a residency map per frame in flight, each written only when its
+// frame comes round again. An evicted page leaves the map at once, but
+// its memory is only unbound frames_in_flight frames later, once every
+// frame that could have seen it in the map is done.
+//
+// The image stays in VK_IMAGE_LAYOUT_GENERAL, so pages can be copied into
+// while others are being sampled.
+//
+// The pages are the first thing to give up when their heap runs short
+// (see memory_budget.h): the budget tracker can lower the page limit, and
+// the next updates evict the least recently used pages down to it. The
+// limit creeps back up a page per update, so it settles just under what
+// the heap can spare.
+//
+
+// The most pages loaded in one update. Loading costs a copy and a bind per
+// page, so this keeps one update from taking too long.
+const uint32_t VT_MAX_PAGES_PER_UPDATE = 32;
+
+// Fills in a page. mip is the mip level, and x and y are its texel offset
+// in that level. dst is tightly packed, width * height texels.
+typedef void (*vt_page_loader)(
+  uint32_t mip,
+  uint32_t x,
+  uint32_t y,
+  uint32_t width,
+  uint32_t height,
+  uint8_t* dst,
+  void* user_data
+);
+
+struct vt_page {
+  // NULL if the page isn't resident.
+  gpu_allocation* memory;
+  // The last frame the page was requested, if it ever was.
+  uint64_t last_used;
+  bool requested;
+  // Set while the page's data is on its way in.
+  bool loading;
+  // Set from eviction until the memory is unbound. The page can't be
+  // loaded again until then.
+  bool unbinding;
+};
+
+// An evicted page's memory, waiting for the frames that might sample it.
+struct vt_unbind {
+  uint32_t mip;
+  uint32_t index;
+  gpu_allocation* memory;
+  // The first frame it can be unbound in.
+  uint64_t frame;
+};
+
+struct vt_mip {
+  uint32_t width;
+  uint32_t height;
+  // The number of pages across and down, and their page table entries.
+  uint32_t pages_x;
+  uint32_t pages_y;
+  std::vector<vt_page> pages;
+};
+
+struct virtual_texture {
+  VkDevice device;
+  memory_allocator* allocator;
+  memory_budget_tracker* budget;
+  shared_queue* sparse_queue;
+  shared_queue* graphics_queue;
+  uint32_t frames_in_flight;
+
+  VkImage image;
+  VkFormat format;
+  uint32_t bytes_per_texel;
+  uint32_t mip_levels;
+
+  // The size of a page in texels and in bytes of memory.
+  VkExtent3D page_extent;
+  VkMemoryRequirements page_requirements;
+  uint32_t max_resident_pages;
+  uint32_t num_resident_pages;
+  // What max_resident_pages is cut down to under memory pressure.
+  uint32_t page_limit;
+
+  // Mips from mip_tail_first_lod on are the mip tail.
+  uint32_t mip_tail_first_lod;
+  std::vector<vt_mip> mips;
+  std::vector<gpu_allocation*> mip_tail_memory;
+
+  // One byte per page of mip 0, see above. residency_map is the current
+  // one, and residency holds a copy per frame in flight, host visible, for
+  // binding as a storage or uniform texel buffer.
+  std::vector<uint8_t> residency_map;
+  std::vector<gpu_allocation*> residency;
+
+  vt_page_loader loader;
+  void* loader_user_data;
+
+  // Pages are written into staging, then copied into the image.
+  gpu_allocation* staging;
+  VkCommandPool command_pool;
+  VkCommandBuffer cmd;
+  // Signaled by the bind, waited on by the copy.
+  VkSemaphore bind_semaphore;
+  // Signaled when the copy is done.
+  VkFence fence;
+  bool updating;
+  // The pages being loaded and the memory being unbound by the update in
+  // flight.
+  std::vector<vt_page*> loading;
+  std::vector<gpu_allocation*> evicted;
+  // Evicted pages not unbound yet, oldest first.
+  std::vector<vt_unbind> unbinds;
+  // The size of a page's data in staging.
+  VkDeviceSize page_bytes;
+};
+
+// Returns true if the device can make sparse residency images of the
+// format.
+bool supports_virtual_texture(VkPhysicalDevice physical_device, VkFormat format);
+
+// graphics_family is the family graphics_queue belongs to. max_resident_pages
+// is how many pages may have memory at once, not counting the mip tail.
+// Only uncompressed formats are handled, with bytes_per_texel per texel.
+// Throws if the device can't make the image. The pages are registered
+// with budget as evictable textures, so update_memory_budget must be
+// called on the thread that updates the texture.
+void create_virtual_texture(
+  VkPhysicalDevice physical_device,
+  VkDevice device,
+  memory_allocator* allocator,
+  memory_budget_tracker* budget,
+  shared_queue* sparse_queue,
+  shared_queue* graphics_queue,
+  uint32_t graphics_family,
+  uint32_t frames_in_flight,
+  VkFormat format,
+  uint32_t bytes_per_texel,
+  uint32_t width,
+  uint32_t height,
+  uint32_t mip_levels,
+  uint32_t max_resident_pages,
+  vt_page_loader loader,
+  void* loader_user_data,
+  virtual_texture* vt
+);
+void destroy_virtual_texture(virtual_texture* vt);
+
+// Marks the page containing texel (x, y) of the mip as needed this frame.
+void request_virtual_texture_page(
+  virtual_texture* vt,
+  uint32_t mip,
+  uint32_t x,
+  uint32_t y,
+  uint64_t frame
+);
+
+// Call once a frame, after waiting for the frame frames_in_flight ago to
+// finish and before recording this one. Writes this frame's residency
+// map, finishes the last update if it's done, then unbinds the pages
+// evicted frames_in_flight frames ago and starts loading the most recently
+// requested pages that aren't resident.
+void update_virtual_texture(virtual_texture* vt, uint64_t frame);
+
+// The residency map buffer for the frame's shaders to read.
+gpu_allocation* get_virtual_texture_residency(const virtual_texture* vt, uint64_t frame);
+
+#endif
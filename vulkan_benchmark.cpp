@@ -0,0 +1,1304 @@
+/*
+  A headless benchmark and regression test. It renders a handful of canned
+  scenes into an offscreen image, reads them back through a host visible
+  buffer, checks them against golden images, and writes CPU and GPU frame
+  times to a JSON file. compare_benchmarks.py then flags regressions
+  between two of those files.
+
+  There is no window or surface, so this runs fine on machines without a
+  GPU by pointing the loader at a software ICD such as lavapipe:
+
+    VK_DRIVER_FILES=/usr/share/vulkan/icd.d/lvp_icd.x86_64.json ./benchmark.out
+
+  Usage:
+    benchmark.out [--frames N] [--output results.json]
+                  [--golden-dir dir] [--update-golden] [--gpu]
+                  [--capture file]
+
+  A scene fails if its image is off from its golden image, or has no
+  golden image; --update-golden writes them all instead of checking.
+
+  --capture records the last frame of every scene into a capture file,
+  which vulkan_replay can run again on any device. Scenes that draw can't
+  be captured yet, so they're left out of it.
+*/
+
+#define GLFW_INCLUDE_VULKAN
+#include <GLFW/glfw3.h>
+
+#include "headless.h"
+#include "gpu_profiler.h"
+#include "command_capture.h"
+#include "memory_allocator.h"
+#include "memory_budget.h"
+#include "dynamic_upload.h"
+#include "shader_library.h"
+#include "layout_cache.h"
+#include "pipeline_manager.h"
+#include "sprite_batch.h"
+
+#include <stdexcept>
+#include <vector>
+#include <string>
+#include <iostream>
+#include <fstream>
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <cstdlib>
+#include <cmath>
+
+using namespace std;
+
+const uint32_t TARGET_W = 256;
+const uint32_t TARGET_H = 256;
+const uint32_t DEFAULT_FRAMES = 100;
+// Every scene is run this many times before we start timing, so that
+// one-off costs (first use of memory, shader caches, etc.) don't count.
+const uint32_t WARMUP_FRAMES = 5;
+// How much the upload scenes write every frame, about what a busy frame
+// of per draw data, particles and skinning would.
+const VkDeviceSize DYNAMIC_UPLOAD_SIZE = 16 * 1024 * 1024;
+// How many sprites the sprite scene draws every frame, about what a busy
+// HUD with a few overlays on top would.
+const uint32_t BENCHMARK_SPRITES = 20000;
+const uint32_t BENCHMARK_SPRITE_PAGES = 2;
+
+struct benchmark_context {
+  headless_context headless;
+  VkCommandBuffer cmd;
+  VkFence fence;
+
+  // The image every scene renders into.
+  VkImage target;
+  VkDeviceMemory target_memory;
+
+  // For the scenes that draw: a render pass that clears the target and
+  // leaves it ready to copy from.
+  VkImageView target_view;
+  VkRenderPass render_pass;
+  VkFramebuffer framebuffer;
+
+  // A small image the scenes can use as a source for blits.
+  VkImage source;
+  VkDeviceMemory source_memory;
+
+  // Host visible buffers for uploading scene data and reading the
+  // target back.
+  VkBuffer upload;
+  VkDeviceMemory upload_memory;
+  uint8_t* upload_mapped;
+  VkBuffer readback;
+  VkDeviceMemory readback_memory;
+  uint8_t* readback_mapped;
+
+  gpu_profiler profiler;
+
+  // What the sprite batch and the upload scenes need from the renderer.
+  memory_allocator allocator;
+  memory_budget_tracker budget;
+  shader_library shaders;
+  layout_cache layouts;
+  pipeline_manager pipelines;
+
+  // For comparing the two ways of getting per frame data to the GPU,
+  // through the renderer's own dynamic buffers (see dynamic_upload.h),
+  // each forced down one path. If the device has no device local host
+  // visible memory, dynamic_direct ends up staged too.
+  dynamic_buffer dynamic_staged;
+  dynamic_buffer dynamic_direct;
+
+  sprite_batch sprites;
+
+  // Every resource is registered with capture when it's made. Commands
+  // are only recorded into it while active_capture points at it.
+  command_capture capture;
+  command_capture* active_capture;
+};
+
+struct benchmark_scene {
+  const char* name;
+  // Records the scene into cmd. On return the target must be in
+  // VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL.
+  void (*record)(benchmark_context* ctx, VkCommandBuffer cmd);
+  // How far (per channel) a pixel may be from the golden image. Scenes
+  // that filter need some slack since implementations round differently.
+  uint32_t tolerance;
+  // False for scenes that record commands command_capture doesn't know.
+  bool capturable;
+};
+
+struct scene_result {
+  string name;
+  vector<double> cpu_ms;
+  vector<double> gpu_ms;
+  // One of "pass", "fail", "updated" or "missing".
+  string golden;
+  uint32_t max_difference;
+  // For the sprite scene, what the batch drew in the last frame.
+  uint32_t sprites_per_frame;
+  uint32_t sprite_draws_per_frame;
+};
+
+//
+// VULKAN SETUP
+//
+
+static void create_image(
+  benchmark_context* ctx,
+  uint32_t width,
+  uint32_t height,
+  VkImage* image,
+  VkDeviceMemory* memory
+) {
+  VkImageCreateInfo create_info{};
+  VkMemoryRequirements requirements;
+  VkMemoryAllocateInfo allocate_info{};
+
+  create_info.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+  create_info.imageType = VK_IMAGE_TYPE_2D;
+  create_info.format = VK_FORMAT_R8G8B8A8_UNORM;
+  create_info.extent = { width, height, 1 };
+  create_info.mipLevels = 1;
+  create_info.arrayLayers = 1;
+  create_info.samples = VK_SAMPLE_COUNT_1_BIT;
+  create_info.tiling = VK_IMAGE_TILING_OPTIMAL;
+  create_info.usage =
+    VK_IMAGE_USAGE_TRANSFER_SRC_BIT |
+    VK_IMAGE_USAGE_TRANSFER_DST_BIT |
+    VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT;
+  create_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+  create_info.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+
+  if (vkCreateImage(ctx->headless.device, &create_info, NULL, image) != VK_SUCCESS) {
+    throw runtime_error("failed to create image!");
+  }
+
+  vkGetImageMemoryRequirements(ctx->headless.device, *image, &requirements);
+
+  allocate_info.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+  allocate_info.allocationSize = requirements.size;
+  allocate_info.memoryTypeIndex = find_memory_type(
+    ctx->headless.physical_device,
+    requirements.memoryTypeBits,
+    VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT
+  );
+
+  if (vkAllocateMemory(ctx->headless.device, &allocate_info, NULL, memory) != VK_SUCCESS) {
+    throw runtime_error("failed to allocate image memory!");
+  }
+
+  vkBindImageMemory(ctx->headless.device, *image, *memory, 0);
+
+  capture_image(&(ctx->capture), *image, create_info);
+}
+
+// Makes a buffer in memory with the properties. If mapped isn't NULL,
+// the memory is mapped there for the buffer's lifetime.
+static void create_buffer(
+  benchmark_context* ctx,
+  VkDeviceSize size,
+  VkBufferUsageFlags usage,
+  VkMemoryPropertyFlags properties,
+  VkBuffer* buffer,
+  VkDeviceMemory* memory,
+  uint8_t** mapped
+) {
+  VkBufferCreateInfo create_info{};
+  VkMemoryRequirements requirements;
+  VkMemoryAllocateInfo allocate_info{};
+
+  create_info.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+  create_info.size = size;
+  create_info.usage = usage;
+  create_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+
+  if (vkCreateBuffer(ctx->headless.device, &create_info, NULL, buffer) != VK_SUCCESS) {
+    throw runtime_error("failed to create buffer!");
+  }
+
+  vkGetBufferMemoryRequirements(ctx->headless.device, *buffer, &requirements);
+
+  allocate_info.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+  allocate_info.allocationSize = requirements.size;
+  allocate_info.memoryTypeIndex = find_memory_type(
+    ctx->headless.physical_device,
+    requirements.memoryTypeBits,
+    properties
+  );
+
+  if (vkAllocateMemory(ctx->headless.device, &allocate_info, NULL, memory) != VK_SUCCESS) {
+    throw runtime_error("failed to allocate buffer memory!");
+  }
+
+  vkBindBufferMemory(ctx->headless.device, *buffer, *memory, 0);
+
+  if (mapped != NULL) {
+    vkMapMemory(ctx->headless.device, *memory, 0, size, 0, (void**)mapped);
+  }
+
+  capture_buffer(&(ctx->capture), *buffer, create_info, mapped != NULL ? *mapped : NULL);
+}
+
+static void create_host_buffer(
+  benchmark_context* ctx,
+  VkDeviceSize size,
+  VkBufferUsageFlags usage,
+  VkBuffer* buffer,
+  VkDeviceMemory* memory,
+  uint8_t** mapped
+) {
+  // HOST_COHERENT means we don't have to flush or invalidate by hand.
+  create_buffer(
+    ctx,
+    size,
+    usage,
+    VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+    buffer,
+    memory,
+    mapped
+  );
+}
+
+static void create_dynamic_buffers(benchmark_context* ctx) {
+  // Every frame waits for the last, so one frame in flight is enough.
+  create_dynamic_buffer_on_path(
+    &(ctx->allocator),
+    DYNAMIC_UPLOAD_SIZE,
+    1,
+    UPLOAD_STAGED,
+    MEMORY_OTHER,
+    &(ctx->dynamic_staged)
+  );
+  create_dynamic_buffer_on_path(
+    &(ctx->allocator),
+    DYNAMIC_UPLOAD_SIZE,
+    1,
+    UPLOAD_DIRECT,
+    MEMORY_OTHER,
+    &(ctx->dynamic_direct)
+  );
+
+  if (ctx->dynamic_direct.path != UPLOAD_DIRECT) {
+    cout << "no device local host visible memory, "
+         << "upload_direct will stage like upload_staged" << endl;
+  }
+}
+
+static void destroy_dynamic_buffers(benchmark_context* ctx) {
+  destroy_dynamic_buffer(&(ctx->dynamic_direct));
+  destroy_dynamic_buffer(&(ctx->dynamic_staged));
+}
+
+// A render pass that clears the target, draws into it and leaves it in
+// VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, like every scene has to.
+static void create_render_target(benchmark_context* ctx) {
+  VkImageViewCreateInfo view_info{};
+  VkAttachmentDescription attachment{};
+  VkAttachmentReference color_ref{};
+  VkSubpassDescription subpass{};
+  VkSubpassDependency dependencies[2]{};
+  VkRenderPassCreateInfo render_pass_info{};
+  VkFramebufferCreateInfo framebuffer_info{};
+
+  view_info.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+  view_info.image = ctx->target;
+  view_info.viewType = VK_IMAGE_VIEW_TYPE_2D;
+  view_info.format = VK_FORMAT_R8G8B8A8_UNORM;
+  view_info.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+  view_info.subresourceRange.levelCount = 1;
+  view_info.subresourceRange.layerCount = 1;
+
+  if (vkCreateImageView(ctx->headless.device, &view_info, NULL, &(ctx->target_view)) != VK_SUCCESS) {
+    throw runtime_error("failed to create target view!");
+  }
+
+  attachment.format = VK_FORMAT_R8G8B8A8_UNORM;
+  attachment.samples = VK_SAMPLE_COUNT_1_BIT;
+  attachment.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
+  attachment.storeOp = VK_ATTACHMENT_STORE_OP_STORE;
+  attachment.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+  attachment.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+  attachment.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+  attachment.finalLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+
+  color_ref.attachment = 0;
+  color_ref.layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+
+  subpass.pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS;
+  subpass.colorAttachmentCount = 1;
+  subpass.pColorAttachments = &color_ref;
+
+  // The last frame's readback copy has to be done before we clear, and
+  // the drawing before this frame's.
+  dependencies[0].srcSubpass = VK_SUBPASS_EXTERNAL;
+  dependencies[0].dstSubpass = 0;
+  dependencies[0].srcStageMask = VK_PIPELINE_STAGE_TRANSFER_BIT;
+  dependencies[0].dstStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+  dependencies[0].srcAccessMask = 0;
+  dependencies[0].dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+
+  dependencies[1].srcSubpass = 0;
+  dependencies[1].dstSubpass = VK_SUBPASS_EXTERNAL;
+  dependencies[1].srcStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+  dependencies[1].dstStageMask = VK_PIPELINE_STAGE_TRANSFER_BIT;
+  dependencies[1].srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+  dependencies[1].dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+
+  render_pass_info.sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO;
+  render_pass_info.attachmentCount = 1;
+  render_pass_info.pAttachments = &attachment;
+  render_pass_info.subpassCount = 1;
+  render_pass_info.pSubpasses = &subpass;
+  render_pass_info.dependencyCount = 2;
+  render_pass_info.pDependencies = dependencies;
+
+  if (vkCreateRenderPass(ctx->headless.device, &render_pass_info, NULL, &(ctx->render_pass)) != VK_SUCCESS) {
+    throw runtime_error("failed to create render pass!");
+  }
+
+  framebuffer_info.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
+  framebuffer_info.renderPass = ctx->render_pass;
+  framebuffer_info.attachmentCount = 1;
+  framebuffer_info.pAttachments = &(ctx->target_view);
+  framebuffer_info.width = TARGET_W;
+  framebuffer_info.height = TARGET_H;
+  framebuffer_info.layers = 1;
+
+  if (vkCreateFramebuffer(ctx->headless.device, &framebuffer_info, NULL, &(ctx->framebuffer)) != VK_SUCCESS) {
+    throw runtime_error("failed to create framebuffer!");
+  }
+}
+
+// Fills the first TARGET_W by TARGET_H texels of an atlas page from the
+// upload buffer: a soft white disc on page 0, a checkerboard on the rest.
+static void write_sprite_page(benchmark_context* ctx, uint32_t page) {
+  VkCommandBufferBeginInfo begin_info{};
+  VkSubmitInfo submit_info{};
+  VkBufferImageCopy region{};
+  uint8_t* texel;
+  float dx;
+  float dy;
+  float alpha;
+
+  for (uint32_t y = 0; y < TARGET_H; y++) {
+    for (uint32_t x = 0; x < TARGET_W; x++) {
+      texel = &(ctx->upload_mapped[(y * TARGET_W + x) * 4]);
+
+      if (page == 0) {
+        dx = (float)x - TARGET_W / 2.0f;
+        dy = (float)y - TARGET_H / 2.0f;
+        alpha = max(0.0f, 1.0f - sqrtf(dx * dx + dy * dy) / (TARGET_W / 2.0f));
+
+        texel[0] = 255;
+        texel[1] = 255;
+        texel[2] = 255;
+        texel[3] = (uint8_t)(alpha * 255.0f);
+      } else {
+        texel[0] = ((x / 32 + y / 32) % 2) ? 255 : 64;
+        texel[1] = texel[0];
+        texel[2] = texel[0];
+        texel[3] = 255;
+      }
+    }
+  }
+
+  region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+  region.imageSubresource.baseArrayLayer = page;
+  region.imageSubresource.layerCount = 1;
+  region.imageExtent = { TARGET_W, TARGET_H, 1 };
+
+  begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+  begin_info.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+
+  vkResetCommandBuffer(ctx->cmd, 0);
+  vkBeginCommandBuffer(ctx->cmd, &begin_info);
+  write_sprite_atlas(&(ctx->sprites), ctx->cmd, ctx->upload, { region });
+  vkEndCommandBuffer(ctx->cmd);
+
+  submit_info.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+  submit_info.commandBufferCount = 1;
+  submit_info.pCommandBuffers = &(ctx->cmd);
+
+  if (vkQueueSubmit(ctx->headless.queue, 1, &submit_info, ctx->fence) != VK_SUCCESS) {
+    throw runtime_error("failed to submit sprite atlas upload!");
+  }
+
+  vkWaitForFences(ctx->headless.device, 1, &(ctx->fence), VK_TRUE, UINT64_MAX);
+  vkResetFences(ctx->headless.device, 1, &(ctx->fence));
+}
+
+// The parts of the renderer the scenes share.
+static void create_renderer_state(benchmark_context* ctx) {
+  create_memory_allocator(
+    ctx->headless.physical_device,
+    ctx->headless.device,
+    false,
+    { ctx->headless.queue_family },
+    &(ctx->allocator)
+  );
+  create_memory_budget_tracker(ctx->headless.physical_device, false, &(ctx->budget));
+  update_memory_budget(&(ctx->budget), &(ctx->allocator));
+  create_shader_library(ctx->headless.device, &(ctx->shaders));
+  create_layout_cache(ctx->headless.device, &(ctx->layouts));
+  create_pipeline_manager(
+    ctx->headless.physical_device,
+    ctx->headless.device,
+    false,
+    &(ctx->pipelines)
+  );
+}
+
+static void destroy_renderer_state(benchmark_context* ctx) {
+  destroy_pipeline_manager(&(ctx->pipelines));
+  destroy_layout_cache(&(ctx->layouts));
+  destroy_shader_library(&(ctx->shaders));
+  destroy_memory_allocator(&(ctx->allocator));
+}
+
+static void create_sprite_scene(benchmark_context* ctx) {
+  graphics_pipeline_state target;
+
+  target = default_pipeline_state();
+  target.num_color_formats = 1;
+  target.color_formats[0] = VK_FORMAT_R8G8B8A8_UNORM;
+  target.render_pass = ctx->render_pass;
+
+  // Every frame waits for the last, so one frame in flight is enough.
+  create_sprite_batch(
+    ctx->headless.device,
+    &(ctx->allocator),
+    &(ctx->budget),
+    &(ctx->layouts),
+    &(ctx->pipelines),
+    get_shader_module(&(ctx->shaders), "sprite.vert"),
+    get_shader_module(&(ctx->shaders), "sprite.frag"),
+    target,
+    BENCHMARK_SPRITES,
+    BENCHMARK_SPRITE_PAGES,
+    1,
+    &(ctx->sprites)
+  );
+
+  for (uint32_t page = 0; page < BENCHMARK_SPRITE_PAGES; page++) {
+    write_sprite_page(ctx, page);
+  }
+}
+
+static void destroy_sprite_scene(benchmark_context* ctx) {
+  destroy_sprite_batch(&(ctx->sprites));
+}
+
+static void init_benchmark(benchmark_context* ctx, bool allow_gpu) {
+  VkCommandBufferAllocateInfo alloc_info{};
+  VkFenceCreateInfo fence_info{};
+
+  create_headless_context("Vulkan Benchmark", allow_gpu, &(ctx->headless));
+
+  init_command_capture(&(ctx->capture));
+  ctx->active_capture = NULL;
+
+  alloc_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+  alloc_info.commandPool = ctx->headless.command_pool;
+  alloc_info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+  alloc_info.commandBufferCount = 1;
+
+  if (vkAllocateCommandBuffers(ctx->headless.device, &alloc_info, &(ctx->cmd)) != VK_SUCCESS) {
+    throw runtime_error("failed to allocate command buffer!");
+  }
+
+  fence_info.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+
+  if (vkCreateFence(ctx->headless.device, &fence_info, NULL, &(ctx->fence)) != VK_SUCCESS) {
+    throw runtime_error("failed to create fence!");
+  }
+
+  create_image(ctx, TARGET_W, TARGET_H, &(ctx->target), &(ctx->target_memory));
+  create_image(ctx, 2, 2, &(ctx->source), &(ctx->source_memory));
+
+  create_host_buffer(
+    ctx,
+    TARGET_W * TARGET_H * 4,
+    VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+    &(ctx->upload),
+    &(ctx->upload_memory),
+    &(ctx->upload_mapped)
+  );
+
+  create_host_buffer(
+    ctx,
+    TARGET_W * TARGET_H * 4,
+    VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+    &(ctx->readback),
+    &(ctx->readback_memory),
+    &(ctx->readback_mapped)
+  );
+
+  create_gpu_profiler(
+    ctx->headless.physical_device,
+    ctx->headless.device,
+    ctx->headless.queue_family,
+    &(ctx->profiler)
+  );
+
+  create_render_target(ctx);
+  create_renderer_state(ctx);
+  create_dynamic_buffers(ctx);
+  create_sprite_scene(ctx);
+}
+
+static void cleanup_benchmark(benchmark_context* ctx) {
+  destroy_sprite_scene(ctx);
+  destroy_dynamic_buffers(ctx);
+  destroy_renderer_state(ctx);
+  destroy_gpu_profiler(ctx->headless.device, &(ctx->profiler));
+
+  vkDestroyFramebuffer(ctx->headless.device, ctx->framebuffer, NULL);
+  vkDestroyRenderPass(ctx->headless.device, ctx->render_pass, NULL);
+  vkDestroyImageView(ctx->headless.device, ctx->target_view, NULL);
+
+  vkDestroyBuffer(ctx->headless.device, ctx->readback, NULL);
+  vkFreeMemory(ctx->headless.device, ctx->readback_memory, NULL);
+  vkDestroyBuffer(ctx->headless.device, ctx->upload, NULL);
+  vkFreeMemory(ctx->headless.device, ctx->upload_memory, NULL);
+  vkDestroyImage(ctx->headless.device, ctx->source, NULL);
+  vkFreeMemory(ctx->headless.device, ctx->source_memory, NULL);
+  vkDestroyImage(ctx->headless.device, ctx->target, NULL);
+  vkFreeMemory(ctx->headless.device, ctx->target_memory, NULL);
+
+  vkDestroyFence(ctx->headless.device, ctx->fence, NULL);
+  destroy_headless_context(&(ctx->headless));
+}
+
+static void transition_image(
+  benchmark_context* ctx,
+  VkCommandBuffer cmd,
+  VkImage image,
+  VkImageLayout old_layout,
+  VkImageLayout new_layout,
+  VkAccessFlags src_access,
+  VkAccessFlags dst_access
+) {
+  VkImageMemoryBarrier barrier{};
+
+  barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+  barrier.srcAccessMask = src_access;
+  barrier.dstAccessMask = dst_access;
+  barrier.oldLayout = old_layout;
+  barrier.newLayout = new_layout;
+  barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+  barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+  barrier.image = image;
+  barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+  barrier.subresourceRange.levelCount = 1;
+  barrier.subresourceRange.layerCount = 1;
+
+  // Everything in a scene is a transfer, so that is the only stage we
+  // ever need to wait on.
+  capture_cmd_pipeline_barrier(
+    ctx->active_capture,
+    cmd,
+    VK_PIPELINE_STAGE_TRANSFER_BIT,
+    VK_PIPELINE_STAGE_TRANSFER_BIT,
+    0, NULL,
+    1, &barrier
+  );
+}
+
+//
+// SCENES
+//
+// Most scenes exercise the transfer and blit paths; the sprite scene at
+// the end is the only one that draws. They're chosen so the expected
+// output is easy to reason about when a golden image goes stale.
+//
+
+static void record_clear_scene(benchmark_context* ctx, VkCommandBuffer cmd) {
+  VkClearColorValue color;
+  VkImageSubresourceRange range{};
+
+  range.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+  range.levelCount = 1;
+  range.layerCount = 1;
+
+  transition_image(
+    ctx,
+    cmd,
+    ctx->target,
+    VK_IMAGE_LAYOUT_UNDEFINED,
+    VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+    0,
+    VK_ACCESS_TRANSFER_WRITE_BIT
+  );
+
+  // A few hundred full screen clears gives the GPU enough to do that the
+  // timing isn't all noise.
+  for (uint32_t i = 0; i < 256; i++) {
+    color.float32[0] = (float)i / 255.0f;
+    color.float32[1] = 0.5f;
+    color.float32[2] = 1.0f - (float)i / 255.0f;
+    color.float32[3] = 1.0f;
+
+    capture_cmd_clear_color_image(
+      ctx->active_capture,
+      cmd,
+      ctx->target,
+      VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+      &color,
+      1,
+      &range
+    );
+
+    transition_image(
+      ctx,
+      cmd,
+      ctx->target,
+      VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+      VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+      VK_ACCESS_TRANSFER_WRITE_BIT,
+      VK_ACCESS_TRANSFER_WRITE_BIT
+    );
+  }
+
+  transition_image(
+    ctx,
+    cmd,
+    ctx->target,
+    VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+    VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+    VK_ACCESS_TRANSFER_WRITE_BIT,
+    VK_ACCESS_TRANSFER_READ_BIT
+  );
+}
+
+static void record_checkerboard_scene(benchmark_context* ctx, VkCommandBuffer cmd) {
+  const uint32_t tile = 32;
+  vector<VkBufferImageCopy> regions;
+  VkBufferImageCopy region{};
+  uint32_t* pixels;
+
+  //
+  // The upload buffer holds two solid tiles one after the other. Every
+  // square of the board is a copy from one of them.
+  //
+
+  pixels = (uint32_t*)ctx->upload_mapped;
+  for (uint32_t i = 0; i < tile * tile; i++) {
+    pixels[i] = 0xff202020;
+    pixels[tile * tile + i] = 0xffe0e0e0;
+  }
+
+  region.bufferRowLength = tile;
+  region.bufferImageHeight = tile;
+  region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+  region.imageSubresource.layerCount = 1;
+  region.imageExtent = { tile, tile, 1 };
+
+  for (uint32_t y = 0; y < TARGET_H / tile; y++) {
+    for (uint32_t x = 0; x < TARGET_W / tile; x++) {
+      region.bufferOffset = ((x + y) % 2) * tile * tile * 4;
+      region.imageOffset = { (int32_t)(x * tile), (int32_t)(y * tile), 0 };
+      regions.push_back(region);
+    }
+  }
+
+  transition_image(
+    ctx,
+    cmd,
+    ctx->target,
+    VK_IMAGE_LAYOUT_UNDEFINED,
+    VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+    0,
+    VK_ACCESS_TRANSFER_WRITE_BIT
+  );
+
+  capture_cmd_copy_buffer_to_image(
+    ctx->active_capture,
+    cmd,
+    ctx->upload,
+    ctx->target,
+    VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+    (uint32_t)regions.size(),
+    regions.data()
+  );
+
+  transition_image(
+    ctx,
+    cmd,
+    ctx->target,
+    VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+    VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+    VK_ACCESS_TRANSFER_WRITE_BIT,
+    VK_ACCESS_TRANSFER_READ_BIT
+  );
+}
+
+static void record_gradient_scene(benchmark_context* ctx, VkCommandBuffer cmd) {
+  const uint32_t corners[4] = { 0xff0000ff, 0xff00ff00, 0xffff0000, 0xffffffff };
+  VkBufferImageCopy upload{};
+  VkImageBlit blit{};
+
+  //
+  // Stretch a 2x2 image over the whole target with linear filtering,
+  // which gives a smooth gradient between the four corner colors.
+  //
+
+  memcpy(ctx->upload_mapped, corners, sizeof(corners));
+
+  upload.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+  upload.imageSubresource.layerCount = 1;
+  upload.imageExtent = { 2, 2, 1 };
+
+  transition_image(
+    ctx,
+    cmd,
+    ctx->source,
+    VK_IMAGE_LAYOUT_UNDEFINED,
+    VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+    0,
+    VK_ACCESS_TRANSFER_WRITE_BIT
+  );
+
+  capture_cmd_copy_buffer_to_image(
+    ctx->active_capture,
+    cmd,
+    ctx->upload,
+    ctx->source,
+    VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+    1,
+    &upload
+  );
+
+  transition_image(
+    ctx,
+    cmd,
+    ctx->source,
+    VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+    VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+    VK_ACCESS_TRANSFER_WRITE_BIT,
+    VK_ACCESS_TRANSFER_READ_BIT
+  );
+
+  transition_image(
+    ctx,
+    cmd,
+    ctx->target,
+    VK_IMAGE_LAYOUT_UNDEFINED,
+    VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+    0,
+    VK_ACCESS_TRANSFER_WRITE_BIT
+  );
+
+  blit.srcSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+  blit.srcSubresource.layerCount = 1;
+  blit.srcOffsets[1] = { 2, 2, 1 };
+  blit.dstSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+  blit.dstSubresource.layerCount = 1;
+  blit.dstOffsets[1] = { (int32_t)TARGET_W, (int32_t)TARGET_H, 1 };
+
+  capture_cmd_blit_image(
+    ctx->active_capture,
+    cmd,
+    ctx->source,
+    VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+    ctx->target,
+    VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+    1,
+    &blit,
+    VK_FILTER_LINEAR
+  );
+
+  transition_image(
+    ctx,
+    cmd,
+    ctx->target,
+    VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+    VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+    VK_ACCESS_TRANSFER_WRITE_BIT,
+    VK_ACCESS_TRANSFER_READ_BIT
+  );
+}
+
+//
+// The upload scenes write DYNAMIC_UPLOAD_SIZE bytes of new data every
+// frame, the way a renderer writes its per frame buffers, and then copy
+// the end of it into the target so there's something to check. The two
+// only differ in how the data gets to device memory, so comparing their
+// times shows what the staging copy costs. Their commands go through
+// dynamic_upload.cpp, which command_capture doesn't see, so they aren't
+// captured.
+//
+
+// Writes the frame's data. It's written front to back in big strides,
+// which is what write combined memory wants.
+static void write_dynamic_data(uint8_t* dst) {
+  uint32_t* words;
+  size_t num_words;
+
+  words = (uint32_t*)dst;
+  num_words = DYNAMIC_UPLOAD_SIZE / sizeof(uint32_t);
+
+  for (size_t i = 0; i < num_words; i++) {
+    words[i] = 0xff000000 | (uint32_t)((i * 0x9e3779b1u) >> 8);
+  }
+}
+
+// Copies the last TARGET_W * TARGET_H pixels of the frame's data into
+// the target, from wherever the GPU reads it.
+static void copy_dynamic_to_target(benchmark_context* ctx, VkCommandBuffer cmd, const dynamic_buffer* buffer) {
+  VkBufferImageCopy region{};
+
+  region.bufferOffset = dynamic_buffer_offset(buffer) + DYNAMIC_UPLOAD_SIZE - TARGET_W * TARGET_H * 4;
+  region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+  region.imageSubresource.layerCount = 1;
+  region.imageExtent = { TARGET_W, TARGET_H, 1 };
+
+  transition_image(
+    ctx,
+    cmd,
+    ctx->target,
+    VK_IMAGE_LAYOUT_UNDEFINED,
+    VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+    0,
+    VK_ACCESS_TRANSFER_WRITE_BIT
+  );
+
+  capture_cmd_copy_buffer_to_image(
+    ctx->active_capture,
+    cmd,
+    buffer->device->buffer,
+    ctx->target,
+    VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+    1,
+    &region
+  );
+
+  transition_image(
+    ctx,
+    cmd,
+    ctx->target,
+    VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+    VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+    VK_ACCESS_TRANSFER_WRITE_BIT,
+    VK_ACCESS_TRANSFER_READ_BIT
+  );
+}
+
+// The same for both scenes; only the path the buffer was made for
+// differs. flush_dynamic_buffer does nothing on the direct path.
+static void record_upload_scene(benchmark_context* ctx, VkCommandBuffer cmd, dynamic_buffer* buffer) {
+  write_dynamic_data(begin_dynamic_buffer_frame(buffer, 0));
+
+  flush_dynamic_buffer(
+    buffer,
+    cmd,
+    DYNAMIC_UPLOAD_SIZE,
+    VK_PIPELINE_STAGE_TRANSFER_BIT,
+    VK_ACCESS_TRANSFER_READ_BIT
+  );
+
+  copy_dynamic_to_target(ctx, cmd, buffer);
+}
+
+static void record_upload_staged_scene(benchmark_context* ctx, VkCommandBuffer cmd) {
+  record_upload_scene(ctx, cmd, &(ctx->dynamic_staged));
+}
+
+static void record_upload_direct_scene(benchmark_context* ctx, VkCommandBuffer cmd) {
+  record_upload_scene(ctx, cmd, &(ctx->dynamic_direct));
+}
+
+//
+// The sprite scene is a HUD's worth of small quads through the sprite
+// batch (see sprite_batch.h): soft discs blended over each other, with a
+// layer of checkered tiles added on top. Positions, sizes and colors come
+// from a hash of the sprite's index, so every frame is the same.
+//
+
+static void record_sprites_scene(benchmark_context* ctx, VkCommandBuffer cmd) {
+  VkRenderPassBeginInfo begin_info{};
+  VkClearValue clear{};
+  sprite s{};
+  uint32_t hash;
+  float size;
+
+  begin_sprite_batch(&(ctx->sprites), 0);
+
+  for (uint32_t i = 0; i < BENCHMARK_SPRITES; i++) {
+    hash = i * 2654435761u;
+    size = 4.0f + (float)(hash % 13);
+
+    s.x = (float)((hash >> 8) % TARGET_W) - size / 2.0f;
+    s.y = (float)((hash >> 16) % TARGET_H) - size / 2.0f;
+    s.width = size;
+    s.height = size;
+    s.u0 = 0.0f;
+    s.v0 = 0.0f;
+    s.u1 = (float)TARGET_W / SPRITE_ATLAS_SIZE;
+    s.v1 = (float)TARGET_H / SPRITE_ATLAS_SIZE;
+    s.color = pack_sprite_color(
+      (uint8_t)(hash >> 3),
+      (uint8_t)(hash >> 11),
+      (uint8_t)(hash >> 19),
+      i % 8 == 7 ? 48 : 192
+    );
+
+    // Added in no particular order, so the batch has to sort them.
+    if (i % 8 == 7) {
+      s.page = 1;
+      s.blend = BLEND_ADDITIVE;
+      s.layer = 1;
+    } else {
+      s.page = 0;
+      s.blend = BLEND_ALPHA;
+      s.layer = 0;
+    }
+
+    draw_sprite(&(ctx->sprites), s);
+  }
+
+  prepare_sprite_batch(&(ctx->sprites), cmd);
+
+  clear.color = { { 0.1f, 0.1f, 0.1f, 1.0f } };
+
+  begin_info.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
+  begin_info.renderPass = ctx->render_pass;
+  begin_info.framebuffer = ctx->framebuffer;
+  begin_info.renderArea.extent = { TARGET_W, TARGET_H };
+  begin_info.clearValueCount = 1;
+  begin_info.pClearValues = &clear;
+
+  vkCmdBeginRenderPass(cmd, &begin_info, VK_SUBPASS_CONTENTS_INLINE);
+  render_sprite_batch(&(ctx->sprites), cmd, TARGET_W, TARGET_H);
+  vkCmdEndRenderPass(cmd);
+}
+
+static const benchmark_scene scenes[] = {
+  { "clear", record_clear_scene, 0, true },
+  { "checkerboard", record_checkerboard_scene, 0, true },
+  { "gradient", record_gradient_scene, 2, true },
+  { "upload_staged", record_upload_staged_scene, 0, false },
+  { "upload_direct", record_upload_direct_scene, 0, false },
+  { "sprites", record_sprites_scene, 2, false },
+};
+
+//
+// FRAME LOOP
+//
+
+// Records, submits and waits on one frame of the scene. Returns the wall
+// clock time from the start of recording until the GPU was done.
+static double run_frame(benchmark_context* ctx, const benchmark_scene& scene) {
+  VkCommandBufferBeginInfo begin_info{};
+  VkBufferImageCopy copy{};
+  VkBufferMemoryBarrier host_barrier{};
+  VkSubmitInfo submit_info{};
+  uint32_t scope;
+  chrono::steady_clock::time_point start;
+
+  start = chrono::steady_clock::now();
+
+  begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+  begin_info.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+
+  vkResetCommandBuffer(ctx->cmd, 0);
+  vkBeginCommandBuffer(ctx->cmd, &begin_info);
+
+  reset_gpu_profiler(ctx->cmd, &(ctx->profiler));
+
+  scope = begin_profiler_scope(ctx->cmd, &(ctx->profiler), scene.name);
+  scene.record(ctx, ctx->cmd);
+  end_profiler_scope(ctx->cmd, &(ctx->profiler), scope);
+
+  //
+  // Copy the result into the readback buffer, and make sure the copy is
+  // visible to the host before we look at it.
+  //
+
+  copy.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+  copy.imageSubresource.layerCount = 1;
+  copy.imageExtent = { TARGET_W, TARGET_H, 1 };
+
+  capture_cmd_copy_image_to_buffer(
+    ctx->active_capture,
+    ctx->cmd,
+    ctx->target,
+    VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+    ctx->readback,
+    1,
+    &copy
+  );
+
+  host_barrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+  host_barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+  host_barrier.dstAccessMask = VK_ACCESS_HOST_READ_BIT;
+  host_barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+  host_barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+  host_barrier.buffer = ctx->readback;
+  host_barrier.size = VK_WHOLE_SIZE;
+
+  capture_cmd_pipeline_barrier(
+    ctx->active_capture,
+    ctx->cmd,
+    VK_PIPELINE_STAGE_TRANSFER_BIT,
+    VK_PIPELINE_STAGE_HOST_BIT,
+    1, &host_barrier,
+    0, NULL
+  );
+
+  vkEndCommandBuffer(ctx->cmd);
+
+  submit_info.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+  submit_info.commandBufferCount = 1;
+  submit_info.pCommandBuffers = &(ctx->cmd);
+
+  if (vkQueueSubmit(ctx->headless.queue, 1, &submit_info, ctx->fence) != VK_SUCCESS) {
+    throw runtime_error("failed to submit benchmark frame!");
+  }
+
+  capture_submit(ctx->active_capture);
+
+  vkWaitForFences(ctx->headless.device, 1, &(ctx->fence), VK_TRUE, UINT64_MAX);
+  vkResetFences(ctx->headless.device, 1, &(ctx->fence));
+
+  // The frame is done, so any quick linked pipeline it used and that has
+  // been replaced since can go.
+  release_retired_pipelines(&(ctx->pipelines));
+
+  return chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+}
+
+//
+// GOLDEN IMAGES
+//
+// Golden images are binary PPMs, so any image viewer can show you what
+// the scene is supposed to look like. Alpha is always 1 in our scenes,
+// so it isn't stored.
+//
+
+static void write_ppm(const string& path, const uint8_t* rgba) {
+  ofstream file;
+
+  file.open(path, ios::binary);
+
+  if (!file.is_open()) {
+    throw runtime_error("failed to write golden image " + path);
+  }
+
+  file << "P6\n" << TARGET_W << " " << TARGET_H << "\n255\n";
+
+  for (uint32_t i = 0; i < TARGET_W * TARGET_H; i++) {
+    file.write((const char*)&rgba[i * 4], 3);
+  }
+}
+
+static bool read_ppm(const string& path, vector<uint8_t>* rgb) {
+  ifstream file;
+  string magic;
+  uint32_t width;
+  uint32_t height;
+  uint32_t max_value;
+
+  file.open(path, ios::binary);
+
+  if (!file.is_open()) {
+    return false;
+  }
+
+  file >> magic >> width >> height >> max_value;
+  file.get();
+
+  if (magic != "P6" || width != TARGET_W || height != TARGET_H || max_value != 255) {
+    throw runtime_error("golden image " + path + " is not a 256x256 P6 PPM!");
+  }
+
+  rgb->resize(TARGET_W * TARGET_H * 3);
+  file.read((char*)rgb->data(), rgb->size());
+
+  return file.good();
+}
+
+static void check_golden(
+  const string& golden_dir,
+  bool update_golden,
+  const benchmark_context* ctx,
+  const benchmark_scene& scene,
+  scene_result* result
+) {
+  string path;
+  vector<uint8_t> golden;
+  int difference;
+
+  path = golden_dir + "/" + scene.name + ".ppm";
+  result->max_difference = 0;
+
+  if (update_golden) {
+    write_ppm(path, ctx->readback_mapped);
+    result->golden = "updated";
+    return;
+  }
+
+  if (!read_ppm(path, &golden)) {
+    result->golden = "missing";
+    return;
+  }
+
+  for (uint32_t i = 0; i < TARGET_W * TARGET_H; i++) {
+    for (uint32_t c = 0; c < 3; c++) {
+      difference = abs((int)ctx->readback_mapped[i * 4 + c] - (int)golden[i * 3 + c]);
+      result->max_difference = max(result->max_difference, (uint32_t)difference);
+    }
+  }
+
+  result->golden = result->max_difference <= scene.tolerance ? "pass" : "fail";
+}
+
+//
+// RESULTS
+//
+
+static void write_json_array(ofstream& file, const vector<double>& values) {
+  file << "[";
+
+  for (size_t i = 0; i < values.size(); i++) {
+    file << (i > 0 ? ", " : "") << values[i];
+  }
+
+  file << "]";
+}
+
+static void write_results(
+  const string& path,
+  const benchmark_context* ctx,
+  const vector<scene_result>& results
+) {
+  ofstream file;
+  VkPhysicalDeviceProperties properties;
+
+  file.open(path);
+
+  if (!file.is_open()) {
+    throw runtime_error("failed to open results file " + path);
+  }
+
+  vkGetPhysicalDeviceProperties(ctx->headless.physical_device, &properties);
+
+  file << "{\n";
+  file << "  \"device\": \"" << properties.deviceName << "\",\n";
+  file << "  \"driver_version\": " << properties.driverVersion << ",\n";
+  file << "  \"direct_upload_device_local\": "
+       << (ctx->dynamic_direct.path == UPLOAD_DIRECT ? "true" : "false") << ",\n";
+  file << "  \"scenes\": [\n";
+
+  for (size_t i = 0; i < results.size(); i++) {
+    file << "    {\n";
+    file << "      \"name\": \"" << results[i].name << "\",\n";
+    file << "      \"golden\": \"" << results[i].golden << "\",\n";
+    file << "      \"max_difference\": " << results[i].max_difference << ",\n";
+    file << "      \"sprites_per_frame\": " << results[i].sprites_per_frame << ",\n";
+    file << "      \"sprite_draws_per_frame\": " << results[i].sprite_draws_per_frame << ",\n";
+    file << "      \"cpu_ms\": ";
+    write_json_array(file, results[i].cpu_ms);
+    file << ",\n";
+    file << "      \"gpu_ms\": ";
+    write_json_array(file, results[i].gpu_ms);
+    file << "\n";
+    file << "    }" << (i + 1 < results.size() ? "," : "") << "\n";
+  }
+
+  file << "  ]\n";
+  file << "}\n";
+}
+
+int main(int argc, char** argv) {
+  benchmark_context ctx{};
+  vector<scene_result> results;
+  scene_result result;
+  uint32_t frames;
+  string output_path;
+  string golden_dir;
+  string capture_path;
+  bool update_golden;
+  bool allow_gpu;
+  bool failed;
+
+  frames = DEFAULT_FRAMES;
+  output_path = "benchmark_results.json";
+  golden_dir = "benchmark_golden";
+  update_golden = false;
+  allow_gpu = false;
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--frames") == 0 && i + 1 < argc) {
+      frames = (uint32_t)atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--output") == 0 && i + 1 < argc) {
+      output_path = argv[++i];
+    } else if (strcmp(argv[i], "--golden-dir") == 0 && i + 1 < argc) {
+      golden_dir = argv[++i];
+    } else if (strcmp(argv[i], "--update-golden") == 0) {
+      update_golden = true;
+    } else if (strcmp(argv[i], "--capture") == 0 && i + 1 < argc) {
+      capture_path = argv[++i];
+    } else if (strcmp(argv[i], "--gpu") == 0) {
+      allow_gpu = true;
+    } else {
+      cerr << "unknown argument: " << argv[i] << endl;
+      return -1;
+    }
+  }
+
+  failed = false;
+
+  try {
+    init_benchmark(&ctx, allow_gpu);
+
+    for (const benchmark_scene& scene : scenes) {
+      result = scene_result();
+      result.name = scene.name;
+
+      for (uint32_t i = 0; i < WARMUP_FRAMES; i++) {
+        run_frame(&ctx, scene);
+      }
+
+      for (uint32_t i = 0; i < frames; i++) {
+        if (!capture_path.empty() && i + 1 == frames && scene.capturable) {
+          ctx.active_capture = &ctx.capture;
+        }
+
+        result.cpu_ms.push_back(run_frame(&ctx, scene));
+        ctx.active_capture = NULL;
+
+        read_profiler_results(ctx.headless.device, &(ctx.profiler));
+        result.gpu_ms.push_back(profiler_scope_ms(&(ctx.profiler), scene.name));
+
+        publish_sprite_stats(&(ctx.sprites), &(ctx.profiler));
+        result.sprites_per_frame = (uint32_t)max(0.0, profiler_counter(&(ctx.profiler), "sprites"));
+        result.sprite_draws_per_frame = (uint32_t)max(0.0, profiler_counter(&(ctx.profiler), "sprite_draws"));
+      }
+
+      // The readback buffer still holds the last frame.
+      check_golden(golden_dir, update_golden, &ctx, scene, &result);
+      // A scene with no golden image checks nothing, so that's a failure
+      // too. --update-golden is how new scenes get theirs.
+      failed = failed || result.golden == "fail" || result.golden == "missing";
+
+      cout << scene.name << ": golden " << result.golden
+           << " (max difference " << result.max_difference << ")" << endl;
+
+      results.push_back(result);
+    }
+
+    write_results(output_path, &ctx, results);
+
+    if (!capture_path.empty()) {
+      write_command_capture(capture_path, &ctx.capture);
+    }
+
+    cleanup_benchmark(&ctx);
+  } catch (const exception& e) {
+    cerr << e.what() << endl;
+    return -1;
+  }
+
+  return failed ? 1 : 0;
+}
@@ -0,0 +1,95 @@
+/*
+  Replays a capture made with the capture layer (command_capture.h) as
+  fast as the device allows, and reports the throughput. Like the
+  benchmark, it needs no window, so captures can be replayed on headless
+  machines and software ICDs.
+
+  Usage:
+    replay.out capture_file [--loops N] [--gpu]
+*/
+
+#include "headless.h"
+#include "command_capture.h"
+
+#include <stdexcept>
+#include <iostream>
+#include <chrono>
+#include <cstring>
+#include <cstdlib>
+
+using namespace std;
+
+int main(int argc, char** argv) {
+  headless_context ctx{};
+  capture_replay replay;
+  const char* capture_path;
+  uint32_t loops;
+  bool allow_gpu;
+  uint64_t num_frames;
+  double total_ms;
+  chrono::steady_clock::time_point start;
+
+  capture_path = NULL;
+  loops = 100;
+  allow_gpu = false;
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--loops") == 0 && i + 1 < argc) {
+      loops = (uint32_t)atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--gpu") == 0) {
+      allow_gpu = true;
+    } else if (capture_path == NULL) {
+      capture_path = argv[i];
+    } else {
+      cerr << "unknown argument: " << argv[i] << endl;
+      return -1;
+    }
+  }
+
+  if (capture_path == NULL) {
+    cerr << "usage: replay.out capture_file [--loops N] [--gpu]" << endl;
+    return -1;
+  }
+
+  try {
+    create_headless_context("Vulkan Replay", allow_gpu, &ctx);
+    prepare_capture_replay(&ctx, capture_path, &replay);
+
+    if (replay.frames.empty()) {
+      throw runtime_error("capture has no frames!");
+    }
+
+    // One untimed pass so first use costs don't skew the numbers.
+    for (uint32_t f = 0; f < replay.frames.size(); f++) {
+      run_replay_frame(&ctx, &replay, f);
+    }
+
+    finish_capture_replay(&ctx, &replay);
+
+    start = chrono::steady_clock::now();
+
+    for (uint32_t loop = 0; loop < loops; loop++) {
+      for (uint32_t f = 0; f < replay.frames.size(); f++) {
+        run_replay_frame(&ctx, &replay, f);
+      }
+    }
+
+    // Frames are still in flight when the loop ends; they count too.
+    finish_capture_replay(&ctx, &replay);
+
+    total_ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+    num_frames = (uint64_t)loops * replay.frames.size();
+
+    cout << "Replayed " << num_frames << " frames in " << total_ms << " ms ("
+         << total_ms / num_frames << " ms/frame, "
+         << num_frames * 1000.0 / total_ms << " frames/s)" << endl;
+
+    destroy_capture_replay(&ctx, &replay);
+    destroy_headless_context(&ctx);
+  } catch (const exception& e) {
+    cerr << e.what() << endl;
+    return -1;
+  }
+
+  return 0;
+}
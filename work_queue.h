@@ -0,0 +1,199 @@
+#ifndef WORK_QUEUE_H
+#define WORK_QUEUE_H
+
+#include <cstdint>
+#include <cstddef>
+#include <atomic>
+#include <vector>
+#include <stdexcept>
+
+//
+// Bounded, lock-free queues for handing work between threads: from the
+// job system to the asset streamer, from the render thread to the
+// submission thread, and so on. A mutex around a std::deque works, but
+// every push and pop would fight over the lock and the deque would
+// allocate as it grows. These allocate once, when they're made, and a
+// push or pop is a couple of atomic operations.
+//
+// spsc_queue: one thread pushes and one thread pops. The cheapest, since
+//   neither side ever has to retry.
+// mpsc_queue: any number of threads push, one thread pops. Pushers claim
+//   a cell with a compare and swap, and each cell has a sequence number
+//   saying whose turn it is, so a pusher that's slow to fill in its cell
+//   just makes the consumer wait for that cell.
+//
+// Both are fixed size. A push to a full queue fails rather than blocking
+// or growing; the caller decides whether to retry, drop or do the work
+// itself.
+//
+
+// Keeps the producer's and consumer's counters on their own cache lines,
+// so they don't slow each other down by sharing one.
+const size_t CACHE_LINE_SIZE = 64;
+
+//
+// SPSC QUEUE
+//
+
+template<typename T>
+struct spsc_queue {
+  std::vector<T> cells;
+  // capacity - 1. The capacity is a power of two, so this wraps indices.
+  size_t mask;
+
+  // Only the consumer writes head and only the producer writes tail.
+  // Both only ever increase; the cell is the index & mask.
+  alignas(CACHE_LINE_SIZE) std::atomic<size_t> head;
+  alignas(CACHE_LINE_SIZE) std::atomic<size_t> tail;
+};
+
+// capacity must be a power of two.
+template<typename T>
+void create_spsc_queue(size_t capacity, spsc_queue<T>* queue) {
+  if (capacity == 0 || (capacity & (capacity - 1)) != 0) {
+    throw std::runtime_error("queue capacity must be a power of two!");
+  }
+
+  queue->cells.resize(capacity);
+  queue->mask = capacity - 1;
+  queue->head = 0;
+  queue->tail = 0;
+}
+
+// Producer only. Returns false if the queue is full.
+template<typename T>
+bool spsc_push(spsc_queue<T>* queue, const T& value) {
+  size_t tail;
+
+  tail = queue->tail.load(std::memory_order_relaxed);
+
+  if (tail - queue->head.load(std::memory_order_acquire) > queue->mask) {
+    return false;
+  }
+
+  queue->cells[tail & queue->mask] = value;
+  // Release, so the consumer sees the value before the new tail.
+  queue->tail.store(tail + 1, std::memory_order_release);
+
+  return true;
+}
+
+// Consumer only. Returns false if the queue is empty.
+template<typename T>
+bool spsc_pop(spsc_queue<T>* queue, T* value) {
+  size_t head;
+
+  head = queue->head.load(std::memory_order_relaxed);
+
+  if (head == queue->tail.load(std::memory_order_acquire)) {
+    return false;
+  }
+
+  *value = queue->cells[head & queue->mask];
+  // Release, so the producer doesn't reuse the cell before we've read it.
+  queue->head.store(head + 1, std::memory_order_release);
+
+  return true;
+}
+
+//
+// MPSC QUEUE
+//
+
+template<typename T>
+struct mpsc_cell {
+  // Equal to the position when the cell is free for a push to that
+  // position, and one past it once the value is in.
+  std::atomic<size_t> sequence;
+  T value;
+};
+
+template<typename T>
+struct mpsc_queue {
+  std::vector<mpsc_cell<T>> cells;
+  size_t mask;
+
+  alignas(CACHE_LINE_SIZE) std::atomic<size_t> head;
+  alignas(CACHE_LINE_SIZE) std::atomic<size_t> tail;
+};
+
+// capacity must be a power of two.
+template<typename T>
+void create_mpsc_queue(size_t capacity, mpsc_queue<T>* queue) {
+  if (capacity == 0 || (capacity & (capacity - 1)) != 0) {
+    throw std::runtime_error("queue capacity must be a power of two!");
+  }
+
+  queue->cells = std::vector<mpsc_cell<T>>(capacity);
+  queue->mask = capacity - 1;
+  queue->head = 0;
+  queue->tail = 0;
+
+  for (size_t i = 0; i < capacity; i++) {
+    queue->cells[i].sequence.store(i, std::memory_order_relaxed);
+  }
+}
+
+// Any thread. Returns false if the queue is full.
+template<typename T>
+bool mpsc_push(mpsc_queue<T>* queue, const T& value) {
+  mpsc_cell<T>* cell;
+  size_t tail;
+  size_t sequence;
+
+  tail = queue->tail.load(std::memory_order_relaxed);
+
+  for (;;) {
+    cell = &queue->cells[tail & queue->mask];
+    sequence = cell->sequence.load(std::memory_order_acquire);
+
+    if (sequence == tail) {
+      // The cell is free. Claim it, unless another producer beat us to
+      // it, in which case tail now holds the new tail and we try again.
+      if (queue->tail.compare_exchange_weak(tail, tail + 1, std::memory_order_relaxed)) {
+        break;
+      }
+    } else if (sequence < tail) {
+      // The consumer hasn't popped the value a lap ago yet: full.
+      return false;
+    } else {
+      tail = queue->tail.load(std::memory_order_relaxed);
+    }
+  }
+
+  cell->value = value;
+  cell->sequence.store(tail + 1, std::memory_order_release);
+
+  return true;
+}
+
+// Consumer only. Returns false if the queue is empty, or the next value
+// is still being pushed.
+template<typename T>
+bool mpsc_pop(mpsc_queue<T>* queue, T* value) {
+  mpsc_cell<T>* cell;
+  size_t head;
+
+  head = queue->head.load(std::memory_order_relaxed);
+  cell = &queue->cells[head & queue->mask];
+
+  if (cell->sequence.load(std::memory_order_acquire) != head + 1) {
+    return false;
+  }
+
+  *value = cell->value;
+  // Free the cell for the push one lap from now.
+  cell->sequence.store(head + queue->mask + 1, std::memory_order_release);
+  queue->head.store(head + 1, std::memory_order_relaxed);
+
+  return true;
+}
+
+// Consumer only. False if a push has claimed a cell past head, even if
+// it hasn't finished writing it, so mpsc_pop will succeed soon.
+template<typename T>
+bool mpsc_empty(mpsc_queue<T>* queue) {
+  return queue->head.load(std::memory_order_relaxed) == queue->tail.load(std::memory_order_acquire);
+}
+
+#endif